@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <type_traits>
 #include <iomanip>
 #include "NES.h"
 #include "util.h"
@@ -14,7 +17,7 @@ void NES_Cpu::log() {
 	printf("\tAccumulator: %d\nX Register: %d\nY Register: %d\n", accumulator, X, Y);
 
 	char bits[8];
-	char proc = proc_status;
+	char proc = get_status();
 	int i = 0;
 	while (i < 8){
 		bits[i] = proc % 2;
@@ -26,6 +29,425 @@ void NES_Cpu::log() {
 	printf("\tN: %d,V: %d,-: %d,B: %d,D: %d,I: %d,Z: %d,C: %d", bits[7], bits[6], bits[5], bits[4], bits[3], bits[2], bits[1], bits[0]);
 }
 
+// Compare the visible machine state with another instance, used to check the cores against each other
+bool NES_Cpu::same_state(const NES_Cpu* other) {
+	return pc == other->pc && sp == other->sp && accumulator == other->accumulator && X == other->X &&
+		Y == other->Y && get_status() == other->get_status() && opcode == other->opcode &&
+		cycle_count == other->cycle_count &&
+		memcmp(ram, other->ram, sizeof(ram)) == 0 &&
+		memcmp(ppu_registers, other->ppu_registers, sizeof(ppu_registers)) == 0 &&
+		memcmp(io_registers, other->io_registers, sizeof(io_registers)) == 0 &&
+		memcmp(button_shift, other->button_shift, sizeof(button_shift)) == 0 &&
+		memcmp(mapper_registers, other->mapper_registers, sizeof(mapper_registers)) == 0 &&
+		memcmp(prg_ram, other->prg_ram, sizeof(prg_ram)) == 0 &&
+		chr_ram == other->chr_ram &&
+		ppu_v == other->ppu_v && ppu_t == other->ppu_t && ppu_x == other->ppu_x && ppu_w == other->ppu_w &&
+		ppu_buffer == other->ppu_buffer && ppu_nmi_pending == other->ppu_nmi_pending &&
+		ppu_scanline == other->ppu_scanline && ppu_line_dot == other->ppu_line_dot &&
+		memcmp(oam, other->oam, sizeof(oam)) == 0 &&
+		memcmp(palette, other->palette, sizeof(palette)) == 0 &&
+		memcmp(vram, other->vram, sizeof(vram)) == 0;
+}
+
+
+// Hash of everything same_state() compares, so runs can be checked against each other without keeping them around
+uint64_t NES_Cpu::state_hash() {
+	uint64_t hash = 0xCBF29CE484222325;
+
+	// The PPU catches up first, so the hash doesn't depend on how far behind it happened to be
+	ppu->sync();
+
+	uint8_t registers[] = {
+		(uint8_t)(pc & 0x00FF), (uint8_t)(pc >> 8), sp, accumulator, X, Y, get_status(), opcode
+	};
+
+	uint8_t ppu_state[] = {
+		(uint8_t)(ppu_v & 0x00FF), (uint8_t)(ppu_v >> 8), (uint8_t)(ppu_t & 0x00FF), (uint8_t)(ppu_t >> 8), ppu_x, ppu_w,
+		ppu_buffer, ppu_nmi_pending, (uint8_t)(ppu_scanline & 0x00FF), (uint8_t)(ppu_scanline >> 8)
+	};
+
+	const uint8_t* parts[] = { registers, ram, ppu_registers, io_registers, button_shift, (const uint8_t*) &cycle_count,
+		mapper_registers, prg_ram, chr_ram.data(), ppu_state, (const uint8_t*) &ppu_line_dot, oam, palette, vram };
+	size_t sizes[] = { sizeof(registers), sizeof(ram), sizeof(ppu_registers), sizeof(io_registers), sizeof(button_shift),
+		sizeof(cycle_count), sizeof(mapper_registers), sizeof(prg_ram), chr_ram.size(), sizeof(ppu_state),
+		sizeof(ppu_line_dot), sizeof(oam), sizeof(palette), sizeof(vram) };
+
+	for (int part = 0; part < 14; part++) {
+		for (size_t i = 0; i < sizes[part]; i++) {
+			hash ^= parts[part][i];
+			hash *= 0x100000001B3;
+		}
+	}
+
+	return hash;
+}
+
+
+/*
+	Save states
+
+	A state is a header followed by tagged sections, all little endian:
+
+		"NESS"	u16 version	u16 section count	u32 total size
+		tag[4]	u32 size	payload
+		...
+
+	CPU  - pc (u16), sp, A, X, Y, status, opcode, target_address (u16), cycle_count (u64)
+	RAM  - internal RAM
+	IO   - PPU registers, APU/IO registers, buttons[2], button_shift[2], button_strobe
+	PRAM - PRG RAM, only written with a cartridge
+	MAPR - Mapper registers, only written with a cartridge
+	CRAM - CHR RAM, only written with a cartridge that has it
+	PPU  - v (u16), t (u16), x, w, read buffer, NMI pending, scanline (u16), line dot (u64), frame (u64), OAM, palette
+	VRAM - Nametable RAM
+
+	Version 1 had CPU, RAM, IO and PRAM, 2 added MAPR, 3 CRAM and 4 PPU and VRAM. Every change to a section or to
+	the sections written bumps STATE_VERSION, and load_state() rejects any other version than its own rather than
+	loading a state into a layout it wasn't written for. Within a version, tags it doesn't know are skipped and
+	whatever has no section is left as it is. Sections are checked before anything is loaded. Nothing is allocated
+	either way, so a state can be taken every frame.
+*/
+#define STATE_HEADER_SIZE	12
+#define STATE_SECTION_SIZE	8
+#define STATE_CPU_SIZE		18
+#define STATE_IO_SIZE		(sizeof(ppu_registers) + sizeof(io_registers) + sizeof(buttons) + sizeof(button_shift) + 1)
+#define STATE_PPU_SIZE		(26 + sizeof(oam) + sizeof(palette))
+
+static uint8_t* put_section(uint8_t* out, const char* tag, uint32_t size) {
+	memcpy(out, tag, 4);
+	return put32(out + 4, size);
+}
+
+size_t NES_Cpu::save_state(uint8_t* buffer, size_t size) {
+	ppu->sync();
+
+	bool has_chr_ram = cartridge != NULL && cartridge->chr_ram;
+	int sections = 5 + (cartridge != NULL ? 2 : 0) + (has_chr_ram ? 1 : 0);
+	size_t total = STATE_HEADER_SIZE + STATE_SECTION_SIZE * sections + STATE_CPU_SIZE + sizeof(ram) + STATE_IO_SIZE +
+		(cartridge != NULL ? sizeof(prg_ram) + sizeof(mapper_registers) : 0) + (has_chr_ram ? chr_ram.size() : 0) +
+		STATE_PPU_SIZE + sizeof(vram);
+
+	if (size < total) {
+		return 0;
+	}
+
+	uint8_t* out = buffer;
+	memcpy(out, "NESS", 4);
+	out = put16(out + 4, STATE_VERSION);
+	out = put16(out, sections);
+	out = put32(out, total);
+
+	out = put_section(out, "CPU ", STATE_CPU_SIZE);
+	out = put16(out, pc);
+	*out++ = sp;
+	*out++ = accumulator;
+	*out++ = X;
+	*out++ = Y;
+	*out++ = get_status();
+	*out++ = opcode;
+	out = put16(out, target_address);
+	out = put64(out, cycle_count);
+
+	out = put_section(out, "RAM ", sizeof(ram));
+	memcpy(out, ram, sizeof(ram));
+	out += sizeof(ram);
+
+	out = put_section(out, "IO  ", STATE_IO_SIZE);
+	memcpy(out, ppu_registers, sizeof(ppu_registers));
+	out += sizeof(ppu_registers);
+	memcpy(out, io_registers, sizeof(io_registers));
+	out += sizeof(io_registers);
+	memcpy(out, buttons, sizeof(buttons));
+	out += sizeof(buttons);
+	memcpy(out, button_shift, sizeof(button_shift));
+	out += sizeof(button_shift);
+	*out++ = button_strobe;
+
+	if (cartridge != NULL) {
+		out = put_section(out, "PRAM", sizeof(prg_ram));
+		memcpy(out, prg_ram, sizeof(prg_ram));
+		out += sizeof(prg_ram);
+
+		out = put_section(out, "MAPR", sizeof(mapper_registers));
+		memcpy(out, mapper_registers, sizeof(mapper_registers));
+		out += sizeof(mapper_registers);
+	}
+
+	if (has_chr_ram) {
+		out = put_section(out, "CRAM", chr_ram.size());
+		memcpy(out, chr_ram.data(), chr_ram.size());
+		out += chr_ram.size();
+	}
+
+	out = put_section(out, "PPU ", STATE_PPU_SIZE);
+	out = put16(out, ppu_v);
+	out = put16(out, ppu_t);
+	*out++ = ppu_x;
+	*out++ = ppu_w;
+	*out++ = ppu_buffer;
+	*out++ = ppu_nmi_pending;
+	out = put16(out, ppu_scanline);
+	out = put64(out, ppu_line_dot);
+	out = put64(out, ppu_frame);
+	memcpy(out, oam, sizeof(oam));
+	out += sizeof(oam);
+	memcpy(out, palette, sizeof(palette));
+	out += sizeof(palette);
+
+	out = put_section(out, "VRAM", sizeof(vram));
+	memcpy(out, vram, sizeof(vram));
+	out += sizeof(vram);
+
+	return out - buffer;
+}
+
+// Copies RAM or PRG RAM in from a state a page at a time, only what is decoded in the pages that differ is dropped
+void NES_Cpu::load_memory(uint8_t* memory, const uint8_t* in, size_t size, uint16_t address) {
+	for (size_t page = 0; page < size; page += 0x100) {
+		if (memcmp(&memory[page], &in[page], 0x100) != 0) {
+			memcpy(&memory[page], &in[page], 0x100);
+			invalidate_range(address + page, address + page + 0xFF);
+		}
+	}
+}
+
+int NES_Cpu::load_state(const uint8_t* buffer, size_t size) {
+	if (size < STATE_HEADER_SIZE || memcmp(buffer, "NESS", 4) != 0 || get16(buffer + 4) != STATE_VERSION) {
+		return 1;
+	}
+
+	size_t total = get32(buffer + 8);
+	int sections = get16(buffer + 6);
+
+	if (total > size) {
+		return 1;
+	}
+
+	// The first pass only checks the sections, the second loads them
+	for (int pass = 0; pass < 2; pass++) {
+		const uint8_t* in = buffer + STATE_HEADER_SIZE;
+
+		for (int section = 0; section < sections; section++) {
+			if ((size_t) (buffer + total - in) < STATE_SECTION_SIZE) {
+				return 1;
+			}
+
+			const uint8_t* tag = in;
+			uint32_t length = get32(in + 4);
+			in += STATE_SECTION_SIZE;
+
+			if ((size_t) (buffer + total - in) < length) {
+				return 1;
+			}
+
+			if (memcmp(tag, "CPU ", 4) == 0) {
+				if (length != STATE_CPU_SIZE) {
+					return 1;
+				}
+
+				if (pass == 1) {
+					pc = get16(in);
+					sp = in[2];
+					accumulator = in[3];
+					X = in[4];
+					Y = in[5];
+					set_status(in[6]);
+					opcode = in[7];
+					target_address = get16(in + 8);
+					cycle_count = get64(in + 10);
+				}
+			}
+			else if (memcmp(tag, "RAM ", 4) == 0) {
+				if (length != sizeof(ram)) {
+					return 1;
+				}
+
+				if (pass == 1) {
+					load_memory(ram, in, sizeof(ram), 0x0000);
+				}
+			}
+			else if (memcmp(tag, "IO  ", 4) == 0) {
+				if (length != STATE_IO_SIZE) {
+					return 1;
+				}
+
+				if (pass == 1) {
+					const uint8_t* field = in;
+					memcpy(ppu_registers, field, sizeof(ppu_registers));
+					field += sizeof(ppu_registers);
+					memcpy(io_registers, field, sizeof(io_registers));
+					field += sizeof(io_registers);
+					memcpy(buttons, field, sizeof(buttons));
+					field += sizeof(buttons);
+					memcpy(button_shift, field, sizeof(button_shift));
+					field += sizeof(button_shift);
+					button_strobe = *field;
+				}
+			}
+			else if (memcmp(tag, "PRAM", 4) == 0) {
+				if (cartridge == NULL || length != sizeof(prg_ram)) {
+					return 1;
+				}
+
+				if (pass == 1) {
+					load_memory(prg_ram, in, sizeof(prg_ram), 0x6000);
+				}
+			}
+			else if (memcmp(tag, "MAPR", 4) == 0) {
+				if (cartridge == NULL || length != sizeof(mapper_registers)) {
+					return 1;
+				}
+
+				if (pass == 1) {
+					memcpy(mapper_registers, in, sizeof(mapper_registers));
+				}
+			}
+			else if (memcmp(tag, "CRAM", 4) == 0) {
+				if (cartridge == NULL || !cartridge->chr_ram || length != chr_ram.size()) {
+					return 1;
+				}
+
+				if (pass == 1) {
+					memcpy(chr_ram.data(), in, chr_ram.size());
+				}
+			}
+			else if (memcmp(tag, "PPU ", 4) == 0) {
+				if (length != STATE_PPU_SIZE || get16(in + 8) >= PPU_SCANLINES) {
+					return 1;
+				}
+
+				if (pass == 1) {
+					ppu_v = get16(in);
+					ppu_t = get16(in + 2);
+					ppu_x = in[4];
+					ppu_w = in[5];
+					ppu_buffer = in[6];
+					ppu_nmi_pending = in[7];
+					ppu_scanline = get16(in + 8);
+					ppu_line_dot = get64(in + 10);
+					ppu_frame = get64(in + 18);
+					memcpy(oam, in + 26, sizeof(oam));
+					memcpy(palette, in + 26 + sizeof(oam), sizeof(palette));
+
+					ppu_deadline = (ppu_line_dot + 2) / 3;
+				}
+			}
+			else if (memcmp(tag, "VRAM", 4) == 0) {
+				if (length != sizeof(vram)) {
+					return 1;
+				}
+
+				if (pass == 1) {
+					memcpy(vram, in, sizeof(vram));
+				}
+			}
+
+			in += length;
+		}
+	}
+
+	// The banks may have switched
+	remap();
+
+	return 0;
+}
+
+
+/*
+	Instruction tracing
+
+	Records are filled before the instruction runs, with the program counter still on the opcode the core fetched.
+	They keep the operand bytes themselves so self-modifying code prints what actually ran. The bytes are peeked, a
+	trace must not read a device register the instruction itself doesn't, so code on a device page shows 0s.
+*/
+void NES_Cpu::fill_trace_record(trace_record* record) {
+	record->cycle = cycle_count;
+	record->pc = pc;
+	record->opcode = opcode;
+	record->operand[0] = peek(pc + 1);
+	record->operand[1] = peek(pc + 2);
+	record->accumulator = accumulator;
+	record->X = X;
+	record->Y = Y;
+	record->sp = sp;
+	record->status = get_status();
+}
+
+void NES_Cpu::print_trace_record(const trace_record* record) {
+	const instruction_desc* desc = &instruction_set[record->opcode];
+	uint8_t length = operand_length[desc->addr_mode];
+
+	char bytes[9];
+	if (length == 0) {
+		snprintf(bytes, sizeof(bytes), "%02X", record->opcode);
+	}
+	else if (length == 1) {
+		snprintf(bytes, sizeof(bytes), "%02X %02X", record->opcode, record->operand[0]);
+	}
+	else {
+		snprintf(bytes, sizeof(bytes), "%02X %02X %02X", record->opcode, record->operand[0], record->operand[1]);
+	}
+
+	printf("%04X  %-8s  %s  A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n", record->pc, bytes, desc->instr_name,
+		record->accumulator, record->X, record->Y, record->status, record->sp, (unsigned long long) record->cycle);
+}
+
+void NES_Cpu::dump_trace() {
+	uint64_t first = trace_count > trace_buffer.size() ? trace_count - trace_buffer.size() : 0;
+
+	// Oldest record first
+	for (uint64_t i = first; i < trace_count; i++) {
+		print_trace_record(&trace_buffer[i & (TRACE_RING_SIZE - 1)]);
+	}
+}
+
+inline void NES_Trace_None::record(NES_Cpu*) {
+}
+
+inline void NES_Trace_Ring::record(NES_Cpu* cpu) {
+	trace_record* record = &cpu->trace_buffer[cpu->trace_count & (TRACE_RING_SIZE - 1)];
+	cpu->trace_count++;
+
+	cpu->fill_trace_record(record);
+}
+
+inline void NES_Trace_Log::record(NES_Cpu* cpu) {
+	trace_record record;
+
+	cpu->fill_trace_record(&record);
+	NES_Cpu::print_trace_record(&record);
+}
+
+inline void NES_Trace_Profile::record(NES_Cpu* cpu) {
+	cpu->profile->step(cpu->pc, cpu->opcode, cpu->cycle_count);
+}
+
+/*
+	Defined here instead of in Profile.cpp so the cores inline it. The cycles since the last call belong to the
+	instruction before this one, and the call tree only moves once the JSR, RTS, BRK or RTI has run, so both are
+	settled for the last instruction before counting this one.
+*/
+inline void NES_Profile::step(uint16_t pc, uint8_t opcode, uint64_t cycle) {
+	uint64_t cycles = cycle - last_cycle;
+	pc_counters[last_pc].cycles += cycles;
+	nodes[last_node].cycles += cycles;
+
+	if (last_opcode == 0x20 || last_opcode == 0x00) {
+		enter(pc);
+	}
+	else if (last_opcode == 0x60 || last_opcode == 0x40) {
+		leave();
+	}
+
+	pc_counters[pc].instructions++;
+	nodes[node].instructions++;
+
+	last_pc = pc;
+	last_opcode = opcode;
+	last_node = node;
+	last_cycle = cycle;
+}
+
 
 // Initialization
 NES_Cpu::NES_Cpu() {
@@ -36,21 +458,405 @@ NES_Cpu::NES_Cpu() {
 	accumulator = 0x00;
 	X = 0x00;
 	Y = 0x00;
-	proc_status = 0x00;
+	set_status(0x00);
 
 	use_accumulator = 0;
 	target_address = 0x0000;
 
-	memset(memory, 0, 0xFFFF);			// Clear memory
+	core = CORE_TABLE;
+	instruction_count = 0;
+	core_limit = 0;
+	jit = NULL;
+	ppu = new NES_Ppu(this);
+	cycle_count = 0;
+
+	cartridge = NULL;
+	loaded_cartridge = NULL;
+	bus_context = NULL;
+	prg_decoded = NULL;
+	decoding = false;
+
+	profile = NULL;
+
+	// The ring buffer is allocated up front so recording never allocates
+	trace_count = 0;
+	if (TRACE_POLICY == TRACE_RING) {
+		trace_buffer.resize(TRACE_RING_SIZE);
+	}
+
+	memset(ram, 0, sizeof(ram));		// Clear memory
+	memset(code_bitmap, 0, sizeof(code_bitmap));
+	memset(ppu_registers, 0, sizeof(ppu_registers));
+	ppu_v = 0;
+	ppu_t = 0;
+	ppu_x = 0;
+	ppu_w = 0;
+	ppu_buffer = 0;
+	ppu_nmi_pending = 0;
+	ppu_scanline = 0;
+	ppu_line_dot = 0;
+	ppu_deadline = 0;
+	events.clear();
+	events.post(EVENT_PPU, 0);
+	ppu_frame = 0;
+	memset(oam, 0, sizeof(oam));
+	memset(palette, 0, sizeof(palette));
+	memset(io_registers, 0, sizeof(io_registers));
+	memset(buttons, 0, sizeof(buttons));
+	memset(button_shift, 0, sizeof(button_shift));
+	button_strobe = 0;
+
+	memset(prg_ram, 0, sizeof(prg_ram));
+	memset(vram, 0, sizeof(vram));
+	memset(chr_pages, 0, sizeof(chr_pages));
+	memset(nametable_pages, 0, sizeof(nametable_pages));
+	memset(mapper_registers, 0, sizeof(mapper_registers));
+
+	remap();
 }
 
 // Destruction
 NES_Cpu::~NES_Cpu() {
-	
+	delete jit;
+	delete ppu;
+	NES_Cartridge::release(loaded_cartridge);
 }
 
+// The state is plain data, copying it is a memcpy, then the page tables are built over our own copy of it
+void NES_Cpu::clone(const NES_Cpu* source) {
+	const NES_Cartridge* image = source->cartridge;
+	NES_Cartridge::retain(image);
 
-int NES_Cpu::load_cpu(uint8_t* buffer, int size) {
+	*(NES_Cpu_State*) this = *(const NES_Cpu_State*) source;
+	chr_ram = source->chr_ram;
+
+	set_cartridge(image);
+	remap();
+	flush_decode_cache();
+}
+
+
+/*
+	Memory access
+
+	Every access looks up the page of the address. Pages backed by memory are a single load or store through their
+	pointer, pages with a NULL pointer belong to a device and go to its handler. Writes that land on a byte of a
+	decoded instruction drop the stale decode cache entries.
+*/
+inline uint8_t NES_Cpu::read(uint16_t address) {
+	uint8_t* page = read_pages[address >> 8];
+
+	if (page != NULL) {
+		return page[address & 0x00FF];
+	}
+
+	return read_handlers[address >> 8](this, address);
+}
+
+uint8_t NES_Cpu::peek(uint16_t address) {
+	const uint8_t* page = read_pages[address >> 8];
+
+	return page != NULL ? page[address & 0x00FF] : 0;
+}
+
+inline void NES_Cpu::write(uint16_t address, uint8_t data) {
+	uint8_t* page = write_pages[address >> 8];
+
+	if (page == NULL) {
+		write_handlers[address >> 8](this, address, data);
+		return;
+	}
+
+	page[address & 0x00FF] = data;
+
+	if (code_bitmap[address >> 3] & (1 << (address & 0x07))) {
+		invalidate(address);
+	}
+}
+
+uint8_t NES_Cpu::bus_read(NES_Cpu* cpu, uint16_t address) {
+	return cpu->read(address);
+}
+
+void NES_Cpu::bus_write(NES_Cpu* cpu, uint16_t address, uint8_t data) {
+	cpu->write(address, data);
+}
+
+/*
+	Bus setup
+
+	map_memory() points first_page through last_page at base, repeating every size bytes so mirrors share the same
+	memory. Read only ranges get no write pointer and ignore writes. map_io() hands the pages to a device instead.
+*/
+void NES_Cpu::map_memory(uint8_t first_page, uint8_t last_page, uint8_t* base, uint32_t size, bool writable) {
+	for (int page = first_page; page <= last_page; page++) {
+		uint8_t* memory_page = base + (((page - first_page) << 8) % size);
+
+		read_pages[page] = memory_page;
+		write_pages[page] = writable ? memory_page : NULL;
+		read_handlers[page] = NULL;
+		write_handlers[page] = &NES_Cpu::write_ignored;
+	}
+}
+
+void NES_Cpu::map_io(uint8_t first_page, uint8_t last_page, bus_read_handler read, bus_write_handler write) {
+	for (int page = first_page; page <= last_page; page++) {
+		read_pages[page] = NULL;
+		write_pages[page] = NULL;
+		read_handlers[page] = read;
+		write_handlers[page] = write;
+	}
+}
+
+// Internal RAM and its mirrors, the PPU and APU/IO registers, then the cartridge's PRG RAM and the mapper's banks
+void NES_Cpu::remap() {
+	// CHR RAM may have been copied or loaded in, the PPU decodes it again. The registers it predicts from may have too.
+	ppu->invalidate_chr();
+	ppu->schedule();
+
+	map_memory(0x00, 0x1F, ram, sizeof(ram), true);
+	map_io(0x20, 0x3F, &NES_Cpu::read_ppu_register, &NES_Cpu::write_ppu_register);
+	map_io(0x40, 0x40, &NES_Cpu::read_io_register, &NES_Cpu::write_io_register);
+	map_io(0x41, 0x5F, &NES_Cpu::read_open_bus, &NES_Cpu::write_ignored);
+
+	if (cartridge == NULL || cartridge->prg_size == 0) {
+		map_io(0x60, 0xFF, &NES_Cpu::read_open_bus, &NES_Cpu::write_ignored);
+	}
+	else {
+		map_memory(0x60, 0x7F, prg_ram, sizeof(prg_ram), true);
+		cartridge->mapper->map(this);
+	}
+
+	map_decoded(0x00, 0xFF);
+
+	// A state saved right after I was cleared can hold the IRQ line without its event
+	irq_enabled();
+}
+
+// Nothing drives the bus, reads come back as 0
+uint8_t NES_Cpu::read_open_bus(NES_Cpu*, uint16_t) {
+	return 0;
+}
+
+void NES_Cpu::write_ignored(NES_Cpu*, uint16_t, uint8_t) {
+}
+
+// The eight PPU registers, mirrored every 8 bytes. The PPU catches up to the CPU first.
+uint8_t NES_Cpu::read_ppu_register(NES_Cpu* cpu, uint16_t address) {
+	cpu->ppu->sync();
+	return cpu->ppu->read_register(address);
+}
+
+void NES_Cpu::write_ppu_register(NES_Cpu* cpu, uint16_t address, uint8_t data) {
+	cpu->ppu->sync();
+	cpu->ppu->write_register(address, data);
+	cpu->ppu->schedule();
+}
+
+/*
+	APU and IO registers
+
+	$4014 is the OAM DMA and $4016/$4017 are the controllers. There is no sound, so the APU registers only hold what
+	was last written to them. The rest of the page is cartridge expansion space with nothing in it.
+*/
+uint8_t NES_Cpu::read_io_register(NES_Cpu* cpu, uint16_t address) {
+	if (address >= 0x4020) {
+		return read_open_bus(cpu, address);
+	}
+
+	if (address == 0x4016 || address == 0x4017) {
+		int pad = address & 0x0001;
+
+		if (cpu->button_strobe) {
+			return 0x40 | (cpu->buttons[pad] & 0x01);
+		}
+
+		// Shift in 1s so reads past the eighth button return 1
+		uint8_t bit = cpu->button_shift[pad] & 0x01;
+		cpu->button_shift[pad] = (cpu->button_shift[pad] >> 1) | 0x80;
+
+		return 0x40 | bit;
+	}
+
+	return cpu->io_registers[address & 0x001F];
+}
+
+void NES_Cpu::write_io_register(NES_Cpu* cpu, uint16_t address, uint8_t data) {
+	if (address >= 0x4020) {
+		return;
+	}
+
+	if (address == OAM_DMA_ADDRESS) {
+		cpu->oam_dma(data);
+	}
+
+	if (address == 0x4016) {
+		cpu->button_strobe = data & 0x01;
+
+		if (cpu->button_strobe) {
+			cpu->button_shift[0] = cpu->buttons[0];
+			cpu->button_shift[1] = cpu->buttons[1];
+		}
+	}
+
+	cpu->io_registers[address & 0x001F] = data;
+}
+
+/*
+	OAM DMA
+
+	Copies the 256 bytes of a CPU page to OAM through $2004, so the copy starts at OAMADDR and wraps around. A page
+	backed by memory is copied in one go, a device page is read a byte at a time through its handler. Instead of 256
+	read and write cycles the stall is added to cycle_count at once: the CPU halts on the cycle after the write, one
+	more when that's an odd cycle, then copies for 512. Handlers run before the instruction's own cycles are added,
+	so the cycle after the write is cycle_count plus those.
+*/
+void NES_Cpu::oam_dma(uint8_t page) {
+
+	// The lines up to here draw the sprites from before the copy
+	ppu->sync();
+
+	uint8_t start = ppu_registers[3];
+	const uint8_t* source = read_pages[page];
+
+	if (source != NULL) {
+		memcpy(oam + start, source, 0x100 - start);
+		memcpy(oam, source + 0x100 - start, start);
+	}
+	else {
+		for (int i = 0; i < 0x100; i++) {
+			oam[(start + i) & 0xFF] = read((uint16_t)(page << 8 | i));
+		}
+	}
+
+	uint64_t halt = cycle_count + instruction_set[opcode].cycles;
+	cycle_count += OAM_DMA_CYCLES + (halt & 0x01);
+}
+
+// Writes to PRG ROM go to the mapper's registers. Bank switches and IRQ counter writes change what the lines still
+// to run do, so the PPU catches up first. Only a mapper with an IRQ counter can move the PPU's events.
+void NES_Cpu::write_mapper(NES_Cpu* cpu, uint16_t address, uint8_t data) {
+	const NES_Mapper* mapper = cpu->cartridge->mapper;
+
+	cpu->ppu->sync();
+	mapper->write(cpu, address, data);
+
+	if (mapper->has_irq()) {
+		cpu->ppu->schedule();
+	}
+}
+
+void NES_Cpu::set_buttons(int pad, uint8_t pressed) {
+	buttons[pad & 0x01] = pressed;
+}
+
+
+/*
+	Flags
+
+	Instructions hand over the value a flag comes from: a result byte for N (bit 7) and Z (zero), 0 or 1 for the
+	carry and zero/non-zero for the overflow.
+*/
+#if LAZY_FLAGS
+
+inline void NES_Cpu::set_nz(uint8_t result) {
+	flag_n = result;
+	flag_z = result;
+}
+
+inline void NES_Cpu::set_negative(uint8_t result) {
+	flag_n = result;
+}
+
+inline void NES_Cpu::set_zero(uint8_t result) {
+	flag_z = result;
+}
+
+inline void NES_Cpu::set_carry(uint8_t carry) {
+	flag_c = carry;
+}
+
+inline void NES_Cpu::set_overflow(uint8_t overflow) {
+	flag_v = overflow;
+}
+
+inline uint8_t NES_Cpu::get_carry() {
+	return flag_c;
+}
+
+inline bool NES_Cpu::flag(uint8_t mask) {
+	switch (mask) {
+		case NEGATIVE_FLAG: return flag_n & 0x80;
+		case ZERO_FLAG: return flag_z == 0;
+		case CARRY_FLAG: return flag_c;
+		case OVERFLOW_FLAG: return flag_v != 0;
+	}
+
+	return proc_status & mask;
+}
+
+uint8_t NES_Cpu::get_status() const {
+	uint8_t status = proc_status & ~(NEGATIVE_FLAG | ZERO_FLAG | CARRY_FLAG | OVERFLOW_FLAG);
+
+	status |= flag_n & NEGATIVE_FLAG;
+	status |= flag_z == 0 ? ZERO_FLAG : 0;
+	status |= flag_c ? CARRY_FLAG : 0;
+	status |= flag_v ? OVERFLOW_FLAG : 0;
+
+	return status;
+}
+
+void NES_Cpu::set_status(uint8_t status) {
+	proc_status = status;
+
+	flag_n = status;
+	flag_z = (status & ZERO_FLAG) ? 0 : 1;
+	flag_c = (status & CARRY_FLAG) ? 1 : 0;
+	flag_v = status & OVERFLOW_FLAG;
+}
+
+#else
+
+inline void NES_Cpu::set_nz(uint8_t result) {
+	proc_status = (proc_status & ~(NEGATIVE_FLAG | ZERO_FLAG)) | (result & NEGATIVE_FLAG) | (result == 0 ? ZERO_FLAG : 0);
+}
+
+inline void NES_Cpu::set_negative(uint8_t result) {
+	proc_status = (proc_status & ~NEGATIVE_FLAG) | (result & NEGATIVE_FLAG);
+}
+
+inline void NES_Cpu::set_zero(uint8_t result) {
+	proc_status = (proc_status & ~ZERO_FLAG) | (result == 0 ? ZERO_FLAG : 0);
+}
+
+inline void NES_Cpu::set_carry(uint8_t carry) {
+	proc_status = (proc_status & ~CARRY_FLAG) | (carry ? CARRY_FLAG : 0);
+}
+
+inline void NES_Cpu::set_overflow(uint8_t overflow) {
+	proc_status = (proc_status & ~OVERFLOW_FLAG) | (overflow ? OVERFLOW_FLAG : 0);
+}
+
+inline uint8_t NES_Cpu::get_carry() {
+	return proc_status & CARRY_FLAG;
+}
+
+inline bool NES_Cpu::flag(uint8_t mask) {
+	return proc_status & mask;
+}
+
+uint8_t NES_Cpu::get_status() const {
+	return proc_status;
+}
+
+void NES_Cpu::set_status(uint8_t status) {
+	proc_status = status;
+}
+
+#endif
+
+
+int NES_Cpu::load_image(uint8_t* buffer, int size, NES_Rom_File* file) {
 	/*
 		0-3: Constant $4E $45 $53 $1A ("NES" followed by MS-DOS end-of-file)
 		4: Size of PRG ROM in 16 KB units
@@ -112,9 +918,9 @@ int NES_Cpu::load_cpu(uint8_t* buffer, int size) {
 
 	
 	/*
-		TODO: Lower nybble of mapper number
+		Lower nybble of mapper number
 	*/
-	uint8_t lower_nybble = (flag_set_6 & 0x11110000) >> 4;
+	uint8_t lower_nybble = (flag_set_6 & 0xF0) >> 4;
 
 
 	//////// TODO: Flag set 7 implementation ////////
@@ -142,9 +948,9 @@ int NES_Cpu::load_cpu(uint8_t* buffer, int size) {
 	}
 
 	/*
-		TODO: Upper nybble of mapper number
+		Upper nybble of mapper number
 	*/
-	uint8_t upper_nybble = (flag_set_7 & 0x11110000) >> 4;
+	uint8_t upper_nybble = (flag_set_7 & 0xF0) >> 4;
 	
 	//////// TODO: Flag set 8 implementation ////////
 
@@ -168,30 +974,314 @@ int NES_Cpu::load_cpu(uint8_t* buffer, int size) {
 	// The byte that is next to be read in the ROM
 	int rom_position = 16;
 
-	// If the trainer data flag is up, then we must copy 512 bytes of trainer data to 0x7000
-	if (trainer_data) {
-		memcpy(&(this->memory)[0x7000], &buffer[rom_position], 512);
-		rom_position += 512;
+	if (prg_rom == 0 || size < rom_position + (trainer_data ? 512 : 0) + PRG_ROM_UNIT * prg_rom) {
+		printf("ROM is smaller than its header says, expected %d KB of PRG ROM\n", prg_rom * 16);
+		return 1;
 	}
 
-	// Copy PRG ROM
-	memcpy(&(this->memory)[0x8000], &buffer[rom_position], PRG_ROM_UNIT * prg_rom);
-	rom_position += PRG_ROM_UNIT * prg_rom;
+	if (size < rom_position + (trainer_data ? 512 : 0) + PRG_ROM_UNIT * prg_rom + CHR_ROM_UNIT * chr_rom) {
+		printf("ROM is smaller than its header says, expected %d KB of CHR ROM\n", chr_rom * 8);
+		return 1;
+	}
+
+	int mapper_number = upper_nybble << 4 | lower_nybble;
+	const NES_Mapper* mapper = NES_Mapper::find(mapper_number);
+
+	if (mapper == NULL) {
+		printf("Mapper %d is not supported\n", mapper_number);
+		return 1;
+	}
+
+	// Instances running the same ROM share one image, only the first one builds it
+	uint64_t hash = file != NULL ? file->info()->hash : fnv1a(buffer, size);
+	const NES_Cartridge* image = NES_Cartridge::acquire(hash, size);
+
+	if (image != NULL) {
+		delete file;
+	}
+	else {
+		NES_Cartridge* building = new NES_Cartridge();
+
+		building->hash = hash;
+		building->size = size;
+		building->mapper_number = mapper_number;
+		building->mapper = mapper;
+		building->mirroring = ignore_mirror ? MIRROR_FOUR_SCREEN : mirror ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+
+		// If the trainer data flag is up, then we must copy 512 bytes of trainer data to 0x7000
+		building->has_trainer = trainer_data != 0;
+		if (trainer_data) {
+			memcpy(building->trainer, &buffer[rom_position], 512);
+		}
+
+		// PRG and CHR ROM stay in the file's mapping, otherwise they're copied in one piece
+		uint8_t* rom = &buffer[rom_position + (trainer_data ? 512 : 0)];
+		if (file == NULL) {
+			building->rom_copy.assign(rom, rom + PRG_ROM_UNIT * prg_rom + CHR_ROM_UNIT * chr_rom);
+			rom = building->rom_copy.data();
+		}
+		building->file = file;
+
+		building->prg_rom = rom;
+		building->prg_size = PRG_ROM_UNIT * prg_rom;
+
+		// Boards without CHR ROM have CHR RAM
+		building->chr_ram = chr_rom == 0;
+		building->chr_rom = chr_rom == 0 ? NULL : rom + PRG_ROM_UNIT * prg_rom;
+		building->chr_size = CHR_ROM_UNIT * chr_rom;
+
+		// Decoded once here for every instance sharing the image
+		building->chr_decoded.resize(building->chr_size / 2);
+		NES_Ppu::decode_tiles(building->chr_rom, building->chr_size, building->chr_decoded.data());
+
+		image = NES_Cartridge::share(building);
+	}
+
+	rom_position += (trainer_data ? 512 : 0) + PRG_ROM_UNIT * prg_rom + CHR_ROM_UNIT * chr_rom;
+
+	// Fresh writable parts for this instance
+	memset(prg_ram, 0, sizeof(prg_ram));
+	chr_ram.assign(image->chr_ram ? CHR_ROM_UNIT : 0, 0);
+	if (image->has_trainer) {
+		memcpy(&prg_ram[0x1000], image->trainer, sizeof(image->trainer));
+	}
+
+	// Power on the mapper's registers
+	memset(mapper_registers, 0, sizeof(mapper_registers));
+	set_cartridge(image);
+	image->mapper->power(this);
+
+	// Map it in, anything decoded before this point is stale
+	remap();
+	flush_decode_cache();
 
 	return rom_position;
 }
 
+int NES_Cpu::load_cpu(uint8_t* buffer, int size) {
+	return load_image(buffer, size, NULL);
+}
+
+// Returns what load_cpu() does, the image keeps the mapping while it is shared
+int NES_Cpu::load_rom(const char* path) {
+	NES_Rom_File* file = new NES_Rom_File();
+
+	if (file->open(path)) {
+		delete file;
+		return 1;
+	}
+
+	// The file is the image's (or gone, when the image was shared already) once it loaded
+	int used = load_image(file->data(), file->size(), file);
+	if (used <= 16) {
+		delete file;
+	}
+
+	return used;
+}
+
+// Takes over the caller's reference on image and drops the one held on the old cartridge
+void NES_Cpu::set_cartridge(const NES_Cartridge* image) {
+	NES_Cartridge::release(loaded_cartridge);
+
+	loaded_cartridge = image;
+	cartridge = image;
+	prg_decoded = decoding && image != NULL ? image->decoded_prg() : NULL;
+}
+
+
+// Core selection
+void NES_Cpu::set_core(int new_core) {
+	core = new_core;
+
+	// PRG ROM is only decoded once something uses it, the recompiler builds its blocks from it as well
+	if ((core == CORE_CACHED || core == CORE_JIT) && !decoding) {
+		decoding = true;
+		prg_decoded = cartridge != NULL ? cartridge->decoded_prg() : NULL;
+		map_decoded(0x00, 0xFF);
+	}
+
+	if (core == CORE_JIT && jit == NULL) {
+		jit = new NES_Jit();
+
+		if (!jit->available()) {
+			printf("Recompiler is not available on this host, using the predecoded core\n");
+			delete jit;
+			jit = NULL;
+			core = CORE_CACHED;
+		}
+	}
+}
+
 
 // Emulation cycling
 void NES_Cpu::cycle() {
+	execute(1);
+}
 
-	// Get opcode
-	opcode = memory[pc];
+void NES_Cpu::execute(unsigned long count) {
+	run(count, UINT64_MAX);
+}
+
+/*
+	Runs until count instructions are done or cycle_count reaches cycle_limit, whichever comes first. The cores run
+	uninterrupted up to the next event, and the events due are serviced before the next instruction, see
+	NES_Scheduler.
+*/
+void NES_Cpu::run(unsigned long count, uint64_t cycle_limit) {
+	while (count > 0 && cycle_count < cycle_limit) {
+		int source;
+		while ((source = events.due(cycle_count)) >= 0) {
+			service_event(source);
+		}
+
+		uint64_t next = events.next();
+		core_limit = next < cycle_limit ? next : cycle_limit;
+
+		unsigned long left = run_core(count);
+		instruction_count += count - left;
+		count = left;
+	}
+}
+
+// A core running right now has to stop at the event too
+void NES_Cpu::post_event(int source, uint64_t cycle) {
+	events.post(source, cycle);
+
+	if (cycle < core_limit) {
+		core_limit = cycle;
+	}
+}
+
+/*
+	Vertical blank, an NMI enabled during it and the mapper's IRQ all happen in scanline(), so catching the PPU up
+	takes the interrupt on the line it was posted for and posts the next events. A held IRQ line is checked after
+	every event, EVENT_IRQ only stops the core for it once I is cleared.
+*/
+void NES_Cpu::service_event(int source) {
+	switch (source) {
+		case EVENT_PPU:
+		case EVENT_MAPPER_IRQ:
+			ppu->catch_up();
+			break;
+
+		// Nothing to catch up, the held line is taken below
+		case EVENT_IRQ:
+			break;
+	}
 
-	if (trace){
-		printf("Opcode: %s\n", this->instruction_table[opcode].instr_name);
+	// The IRQ line is a level, whatever holds it is taken as long as I is clear
+	if (irq_held()) {
+		irq();
+	}
+}
+
+unsigned long NES_Cpu::run_core(unsigned long count) {
+
+	if (profile != NULL) {
+		return run_profiled(count);
+	}
+
+	// Pick the core once for the whole run instead of once per instruction
+	if (core == CORE_FUSED) {
+		return execute_fused<NES_Trace>(count);
+	}
+	else if (core == CORE_JIT && !NES_Trace::active) {
+		return execute_jit(count);
+	}
+	else if (core == CORE_CACHED || core == CORE_JIT) {
+		// Translated blocks can't record single instructions, traced builds run their code on the predecoded core
+		return execute_cached<NES_Trace>(count);
+	}
+
+	while (count > 0 && cycle_count < core_limit) {
+		count--;
+		cycle_table<NES_Trace>();
 	}
 
+	return count;
+}
+
+// Same cores counting into the attached profile, translated blocks run on the predecoded core like in traced builds
+unsigned long NES_Cpu::run_profiled(unsigned long count) {
+	if (core == CORE_FUSED) {
+		return execute_fused<NES_Trace_Profile>(count);
+	}
+	else if (core == CORE_CACHED || core == CORE_JIT) {
+		return execute_cached<NES_Trace_Profile>(count);
+	}
+
+	while (count > 0 && cycle_count < core_limit) {
+		count--;
+		cycle_table<NES_Trace_Profile>();
+	}
+
+	return count;
+}
+
+void NES_Cpu::set_profile(NES_Profile* new_profile) {
+	profile = new_profile;
+
+	if (profile != NULL) {
+		profile->begin(pc, cycle_count);
+	}
+}
+
+/*
+	Cycle budgeted execution
+
+	Instructions run whole, so the last one usually ends a few cycles past the target. The overshoot is returned and
+	stays in cycle_count, so a caller stepping run_until() by a fixed amount per frame doesn't drift.
+*/
+unsigned int NES_Cpu::run_until(uint64_t target_cycle) {
+	if (cycle_count >= target_cycle) {
+		return 0;
+	}
+
+	run(ULONG_MAX, target_cycle);
+
+	return cycle_count - target_cycle;
+}
+
+unsigned int NES_Cpu::run_cycles(unsigned int budget) {
+	return run_until(cycle_count + budget);
+}
+
+uint64_t NES_Cpu::get_cycles() {
+	return cycle_count;
+}
+
+uint64_t NES_Cpu::get_instructions() {
+	return instruction_count;
+}
+
+void NES_Cpu::draw_frames() {
+	ppu->draw();
+}
+
+const uint8_t* NES_Cpu::get_frame() {
+	return ppu->frame();
+}
+
+uint64_t NES_Cpu::get_frames() {
+	return ppu_frame;
+}
+
+// Taken branches cost one more cycle, and another when the target is on a different page
+inline void NES_Cpu::take_branch() {
+	cycle_count += 1 + ((pc ^ target_address) >> 8 != 0);
+	pc = target_address;
+}
+
+// Table-driven core, two indirect calls per instruction through instruction_table
+template<class TRACE>
+void NES_Cpu::cycle_table() {
+
+	// Get opcode
+	opcode = read(pc);
+
+	TRACE::record(this);
+
 	// Retrieve the instruction details, instruction_entry in format:
 	// {
 	//	std::string instr_name;
@@ -211,33 +1301,18 @@ void NES_Cpu::cycle() {
 	// Increment program counter
 	pc++;
 
-	
-	if (trace) {
-		printf("Pre-setup\n");
-		this->log();
-	}
-
-
 	// Setup addressing mode variables
-	(this->*instruction_table[opcode].addr_setup)();
-
-	if(trace){
-		printf("Post-setup\n");
-		this->log();
-	}
+	int page_crossed = (this->*instruction_table[opcode].addr_setup)();
 
 	// Run the operation for the appropriate amount of cycles
-	(this->*instruction_table[opcode].operation)();
+	int reads_operand = (this->*instruction_table[opcode].operation)();
 
-	if(trace){
-		printf("Post-operation\n");
-		this->log();
-	}
+	cycle_count += instruction_table[opcode].cycles + (page_crossed & reads_operand);
 
 	/*
 		Note on cycle counting. I may count the cycles through timing the time needed for the operation and then sleeping
 		off the rest of the time. Otherwise I could do the opposite and wait for a certain amount of time before I start
-		the instruction
+		the instruction. For now cycle_count only keeps track of them so run_until() can stop on a cycle budget.
 	*/
 
 }
@@ -253,36 +1328,68 @@ void NES_Cpu::irq() {
 		return;
 	}
 
+	uint16_t interrupted = pc;
+
 	// Push up the current program counter to the stack
-	memory[STACK_OFFSET + sp] = (pc >> 8) & 0x00FF;
-	memory[STACK_OFFSET + sp - 1] = pc & 0x00FF;
+	write(STACK_OFFSET + sp, (pc >> 8) & 0x00FF);
+	write(STACK_OFFSET + sp - 1, pc & 0x00FF);
 	sp -= 2;
 
 	// Push up the current status
-	memory[STACK_OFFSET + sp] = proc_status;
+	write(STACK_OFFSET + sp, get_status());
 	sp--;
 
+	// The handler runs with I set, so a line still held until it acknowledges doesn't take it again
+	proc_status |= DISABLE_FLAG;
+
 	// The program counter then must jump to the instruction in $FFFF and $FFFE
-	pc = (memory[0xFFFF] << 8) | memory[0xFFFE];
+	pc = (read(0xFFFF) << 8) | read(0xFFFE);
+
+	// Taking the interrupt takes 7 cycles
+	cycle_count += 7;
 
+	if (profile != NULL) {
+		profile->interrupt(interrupted, pc);
+	}
+}
+
+bool NES_Cpu::irq_held() {
+	return cartridge != NULL && cartridge->mapper->irq_line(this);
+}
+
+// The cores stop at the event before their next instruction, like they do for the PPU's
+void NES_Cpu::irq_enabled() {
+	if (!(proc_status & DISABLE_FLAG) && irq_held()) {
+		post_event(EVENT_IRQ, cycle_count);
+	}
 }
 
 void NES_Cpu::nmi() {
 
 	// Unlike IRQ, there is nothing that can stop the execution of the NMI
+	uint16_t interrupted = pc;
 
 	// Push up the current program counter to the stack
-	memory[STACK_OFFSET + sp] = (pc >> 8) & 0x00FF;
-	memory[STACK_OFFSET + sp - 1] = pc & 0x00FF;
+	write(STACK_OFFSET + sp, (pc >> 8) & 0x00FF);
+	write(STACK_OFFSET + sp - 1, pc & 0x00FF);
 	sp -= 2;
 
 	// Push up the current status
-	memory[STACK_OFFSET + sp] = proc_status;
+	write(STACK_OFFSET + sp, get_status());
 	sp--;
 
+	// An IRQ held at the same time waits for the NMI handler's RTI
+	proc_status |= DISABLE_FLAG;
+
 	// The program counter then must jump to the instruction in $FFFB and $FFFA
-	pc = (memory[0xFFFB] << 8) | memory[0xFFFA];
+	pc = (read(0xFFFB) << 8) | read(0xFFFA);
+
+	// Taking the interrupt takes 7 cycles
+	cycle_count += 7;
 
+	if (profile != NULL) {
+		profile->interrupt(interrupted, pc);
+	}
 }
 
 void NES_Cpu::reset() {
@@ -297,11 +1404,13 @@ void NES_Cpu::reset() {
 	target_address = 0x0000;
 
 	// Clear flags
-	proc_status = 0;
+	set_status(0);
 
 	// The program counter then must jump to the instruction in $FFFF and $FFFE
-	pc = (memory[0xFFFD] << 8) | memory[0xFFFC];
+	pc = (read(0xFFFD) << 8) | read(0xFFFC);
 
+	// The reset sequence takes 7 cycles, the master cycle count keeps running across resets
+	cycle_count += 7;
 }
 
 
@@ -309,6 +1418,11 @@ void NES_Cpu::reset() {
 	Instruction implementations are here
 
 	Returns 0 upon success and returns 1 when requiring an additional clock cycle.
+
+	The instructions that read their operand (ADC, AND, CMP, EOR, LDA, LDX, LDY, ORA, SBC) return 1, the addressing
+	modes return 1 when indexing crossed a page, and the extra cycle is only charged when both do. Stores and
+	read-modify-write instructions already have the longer timing in instruction_set. Branches add their taken and
+	page crossing cycles to cycle_count themselves through take_branch().
 */
 
 /*
@@ -316,34 +1430,20 @@ void NES_Cpu::reset() {
     + + + - - +
 */
 int NES_Cpu::ADC() {
-
 	// Add the accumulator with the data at the target address and the carry bit
-	uint16_t sum = accumulator + memory[target_address] + ((proc_status & CARRY_FLAG) ? 1 : 0);
+	uint8_t data = read(target_address);
+	uint16_t sum = accumulator + data + get_carry();
 
-	proc_status &= ~(CARRY_FLAG | ZERO_FLAG | NEGATIVE_FLAG | OVERFLOW_FLAG);
-	
-	// Check flags
-	if (sum >= 0x0100) { // Carry flag 
-		proc_status |= CARRY_FLAG;
-	}
-
-	if ((sum & 0x00FF) == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
-
-	if (sum & 0x0080) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
+	set_carry(sum >> 8);
+	set_nz(sum & 0x00FF);
 
 	// Explanation for signed overflow flags: http://forums.nesdev.com/viewtopic.php?t=6331
-	if (!((accumulator ^ memory[target_address]) & 0x80) && ((accumulator ^ sum) & 0x80)) { // Overflow flag, (!((AC ^ src) & 0x80) && ((AC ^ temp) & 0x80))
-		proc_status |= OVERFLOW_FLAG;
-	}
+	set_overflow(~(accumulator ^ data) & (accumulator ^ sum) & 0x80); // (!((AC ^ src) & 0x80) && ((AC ^ temp) & 0x80))
 
 	// Store result in accumulator
 	accumulator = sum & 0x00FF;
 
-	return 0;
+	return 1;
 }
 
 /*
@@ -351,22 +1451,12 @@ int NES_Cpu::ADC() {
 	+ + - - - -
 */
 int NES_Cpu::AND() {
-
 	// Bitwise AND with accumulator and data. Result is 1 byte
-	accumulator = accumulator & memory[target_address];
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
+	accumulator = accumulator & read(target_address);
 
-	// Check flags
-	if (accumulator & 0x0080) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
+	set_nz(accumulator);
 
-	if (accumulator == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
-
-	return 0;
+	return 1;
 }
 
 
@@ -375,47 +1465,27 @@ int NES_Cpu::AND() {
 	+ + + - - -
 */
 int NES_Cpu::ASL() {
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG | CARRY_FLAG);
-
 	if (use_accumulator) {
 		// Arithmetic shift left the accumulator
 
 		// Carry flag is set to original bit 7
-		if (accumulator & 0x0080) { // Carry flag 
-			proc_status |= CARRY_FLAG;
-		}
+		set_carry(accumulator >> 7);
 
 		accumulator <<= 1;
 
-		// Check flags
-		if (accumulator & 0x0080) { // Negative flag
-			proc_status |= NEGATIVE_FLAG;
-		}
-
-		if ((accumulator & 0x00FF) == 0) { // Zero flag
-			proc_status |= ZERO_FLAG;
-		}
+		set_nz(accumulator);
 	}
 	else {
 		// Arithmetic shift left the data at the target address
-		uint16_t shifted_result = memory[target_address] << 1;
+		uint8_t data = read(target_address);
+		uint8_t shifted_result = data << 1;
 
 		// Carry flag is set to original bit 7
-		if (memory[target_address] & 0x0080) { // Carry flag 
-			proc_status |= CARRY_FLAG;
-		}
+		set_carry(data >> 7);
 
-		memory[target_address] = shifted_result;
+		write(target_address, shifted_result);
 
-		// Check flags
-		if (shifted_result & 0x0080) { // Negative flag
-			proc_status |= NEGATIVE_FLAG;
-		}
-
-		if ((shifted_result & 0x00FF) == 0) { // Zero flag
-			proc_status |= ZERO_FLAG;
-		}
+		set_nz(shifted_result);
 	}
 
 	return 0;
@@ -426,10 +1496,9 @@ int NES_Cpu::ASL() {
 	- - - - - -
 */
 int NES_Cpu::BCC() {
-
 	// Branch if the carry flag is clear
-	if (!(proc_status & CARRY_FLAG)) { // Carry flag 
-		pc = target_address;
+	if (!flag(CARRY_FLAG)) {
+		take_branch();
 	}
 
 	return 0;
@@ -440,10 +1509,9 @@ int NES_Cpu::BCC() {
 	- - - - - -
 */
 int NES_Cpu::BCS() {
-
 	// Branch if the carry flag is set
-	if (proc_status & CARRY_FLAG) {
-		pc = target_address;
+	if (flag(CARRY_FLAG)) {
+		take_branch();
 	}
 
 	return 0;
@@ -454,10 +1522,9 @@ int NES_Cpu::BCS() {
 	- - - - - -
 */
 int NES_Cpu::BEQ() {
-
 	// Branch if the zero flag is set
-	if (proc_status & ZERO_FLAG) {
-		pc = target_address;
+	if (flag(ZERO_FLAG)) {
+		take_branch();
 	}
 
 	return 0;
@@ -468,24 +1535,12 @@ int NES_Cpu::BEQ() {
      M7 + - - - M6
 */
 int NES_Cpu::BIT() {
-
 	// Bitwise AND with accumulator and data, the result is not saved and is only used to set flags
-	uint16_t result = accumulator & memory[target_address];
+	uint8_t data = read(target_address);
 
-	proc_status &= ~(ZERO_FLAG | NEGATIVE_FLAG | OVERFLOW_FLAG);
-
-	// Check flags
-	if ((result & 0x00FF) == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
-
-	if (memory[target_address] & NEGATIVE_FLAG) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (memory[target_address] & OVERFLOW_FLAG) { // Overflow flag
-		proc_status |= OVERFLOW_FLAG;
-	}
+	set_zero(accumulator & data);
+	set_negative(data);
+	set_overflow(data & OVERFLOW_FLAG);
 
 	return 0;
 }
@@ -495,10 +1550,9 @@ int NES_Cpu::BIT() {
 	- - - - - -
 */
 int NES_Cpu::BMI() {
-
 	// Branch if the negative flag is set
-	if (proc_status & NEGATIVE_FLAG) {
-		pc = target_address;
+	if (flag(NEGATIVE_FLAG)) {
+		take_branch();
 	}
 
 	return 0;
@@ -509,10 +1563,9 @@ int NES_Cpu::BMI() {
 	- - - - - -
 */
 int NES_Cpu::BNE() {
-	
 	// Branch if the zero flag is clear
-	if (!(proc_status & ZERO_FLAG)) {
-		pc = target_address;
+	if (!flag(ZERO_FLAG)) {
+		take_branch();
 	}
 
 	return 0;
@@ -523,10 +1576,9 @@ int NES_Cpu::BNE() {
 	- - - - - -
 */
 int NES_Cpu::BPL() {
-
 	// Branch if the negative flag is clear
-	if (!(proc_status & NEGATIVE_FLAG)) {
-		pc = target_address;
+	if (!flag(NEGATIVE_FLAG)) {
+		take_branch();
 	}
 
 	return 0;
@@ -537,21 +1589,20 @@ int NES_Cpu::BPL() {
     - - - 1 - -
 */
 int NES_Cpu::BRK() {
-
 	// Set the interrupt disable flag
 	proc_status |= DISABLE_FLAG;
 
 	// Push the 2 byte program counter into the stack, remember to do it in little endian
-	memory[STACK_OFFSET + sp] = (pc >> 8) & 0x00FF;
-	memory[STACK_OFFSET + sp - 1] = pc & 0x00FF;
+	write(STACK_OFFSET + sp, (pc >> 8) & 0x00FF);
+	write(STACK_OFFSET + sp - 1, pc & 0x00FF);
 	sp -= 2;
 
 	// Push the proc_status with the break bit set into the stack
-	memory[STACK_OFFSET + sp] = proc_status | BREAK_FLAG;
+	write(STACK_OFFSET + sp, get_status() | BREAK_FLAG);
 	sp--;
 
 	// The program counter then must jump to the instruction in $FFFF and $FFFE
-	pc = (memory[0xFFFF] << 8) | memory[0xFFFE];
+	pc = (read(0xFFFF) << 8) | read(0xFFFE);
 
 	return 0;
 }
@@ -561,10 +1612,9 @@ int NES_Cpu::BRK() {
 	- - - - - -
 */
 int NES_Cpu::BVC() {
-
 	// Branch if the overflow flag is clear
-	if (!(proc_status & OVERFLOW_FLAG)) {
-		pc = target_address;
+	if (!flag(OVERFLOW_FLAG)) {
+		take_branch();
 	}
 
 	return 0;
@@ -575,10 +1625,9 @@ int NES_Cpu::BVC() {
 	- - - - - -
 */
 int NES_Cpu::BVS() {
-
 	// Branch if the overflow flag is set
-	if (proc_status & OVERFLOW_FLAG) {
-		pc = target_address;
+	if (flag(OVERFLOW_FLAG)) {
+		take_branch();
 	}
 
 	return 0;
@@ -589,11 +1638,8 @@ int NES_Cpu::BVS() {
     - - 0 - - -
 */
 int NES_Cpu::CLC() {
-
 	// Clear the carry flag
-	if (proc_status & CARRY_FLAG) {
-		proc_status &= ~CARRY_FLAG;
-	}
+	set_carry(0);
 
 	return 0;
 }
@@ -621,6 +1667,7 @@ int NES_Cpu::CLI() {
 	// Clear the interrupt disable flag
 	if (proc_status & DISABLE_FLAG) {
 		proc_status &= ~DISABLE_FLAG;
+		irq_enabled();
 	}
 
 	return 0;
@@ -631,11 +1678,8 @@ int NES_Cpu::CLI() {
 	- - - - - 0
 */
 int NES_Cpu::CLV() {
-
 	// Clear the overflow flag
-	if (proc_status & OVERFLOW_FLAG) {
-		proc_status &= ~OVERFLOW_FLAG;
-	}
+	set_overflow(0);
 
 	return 0;
 }
@@ -645,24 +1689,13 @@ int NES_Cpu::CLV() {
      + + + - - -
 */
 int NES_Cpu::CMP() {
-	uint8_t data = memory[target_address];
-	uint16_t diff = accumulator - data;
+	uint8_t data = read(target_address);
 
-	proc_status &= ~(NEGATIVE_FLAG | CARRY_FLAG | ZERO_FLAG);
+	set_negative(accumulator < data ? NEGATIVE_FLAG : 0);
+	set_carry(accumulator >= data);
+	set_zero(accumulator - data);
 
-	if (accumulator < data) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (accumulator >= data) { // Carry flag
-		proc_status |= CARRY_FLAG;
-	}
-	
-	if ((diff & 0x00FF) == 0x0000) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
-
-	return 0;
+	return 1;
 }
 
 /*
@@ -670,23 +1703,11 @@ int NES_Cpu::CMP() {
 	 + + + - - -
 */
 int NES_Cpu::CPX() {
+	uint8_t data = read(target_address);
 
-	uint8_t data = memory[target_address];
-	uint16_t diff = X - data;
-
-	proc_status &= ~(NEGATIVE_FLAG | CARRY_FLAG | ZERO_FLAG);
-
-	if (X < data) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (X >= data) { // Carry flag
-		proc_status |= CARRY_FLAG;
-	}
-
-	if ((diff & 0x00FF) == 0x0000) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_negative(X < data ? NEGATIVE_FLAG : 0);
+	set_carry(X >= data);
+	set_zero(X - data);
 
 	return 0;
 }
@@ -696,23 +1717,11 @@ int NES_Cpu::CPX() {
 	 + + + - - -
 */
 int NES_Cpu::CPY() {
+	uint8_t data = read(target_address);
 
-	uint8_t data = memory[target_address];
-	uint16_t diff = Y - data;
-
-	proc_status &= ~(NEGATIVE_FLAG | CARRY_FLAG | ZERO_FLAG);
-
-	if (Y < data) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (Y >= data) { // Carry flag
-		proc_status |= CARRY_FLAG;
-	}
-
-	if ((diff & 0x00FF) == 0x0000) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_negative(Y < data ? NEGATIVE_FLAG : 0);
+	set_carry(Y >= data);
+	set_zero(Y - data);
 
 	return 0;
 }
@@ -722,17 +1731,10 @@ int NES_Cpu::CPY() {
 	 + + - - - -
 */
 int NES_Cpu::DEC() {
-	memory[target_address]--;
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
+	uint8_t data = read(target_address) - 1;
+	write(target_address, data);
 
-	if (memory[target_address] & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (memory[target_address] == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(data);
 
 	return 0;
 }
@@ -744,15 +1746,7 @@ int NES_Cpu::DEC() {
 int NES_Cpu::DEX() {
 	X--;
 
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	if (X & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (X == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(X);
 
 	return 0;
 }
@@ -764,15 +1758,7 @@ int NES_Cpu::DEX() {
 int NES_Cpu::DEY() {
 	Y--;
 
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	if (Y & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (Y == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(Y);
 
 	return 0;
 }
@@ -782,20 +1768,11 @@ int NES_Cpu::DEY() {
 	 + + - - - -
 */
 int NES_Cpu::EOR() {
+	accumulator ^= read(target_address);
 
-	accumulator ^= memory[target_address];
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	if (accumulator & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
+	set_nz(accumulator);
 
-	if (accumulator == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
-
-	return 0;
+	return 1;
 }
 
 /*
@@ -803,17 +1780,10 @@ int NES_Cpu::EOR() {
 	 + + - - - -
 */
 int NES_Cpu::INC() {
-	memory[target_address]++;
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	if (memory[target_address] & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
+	uint8_t data = read(target_address) + 1;
+	write(target_address, data);
 
-	if (memory[target_address] == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(data);
 
 	return 0;
 }
@@ -825,15 +1795,7 @@ int NES_Cpu::INC() {
 int NES_Cpu::INX() {
 	X++;
 
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	if (X & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (X == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(X);
 
 	return 0;
 }
@@ -845,15 +1807,7 @@ int NES_Cpu::INX() {
 int NES_Cpu::INY() {
 	Y++;
 
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	if (Y & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (Y == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(Y);
 
 	return 0;
 }
@@ -865,7 +1819,7 @@ int NES_Cpu::INY() {
 int NES_Cpu::JMP() {
 
 	// Set program counter to the 2 byte instruction in the target address
-	pc = (memory[target_address + 1] << 8) | memory[target_address];
+	pc = (read(target_address + 1) << 8) | read(target_address);
 
 	return 0;
 }
@@ -877,12 +1831,12 @@ int NES_Cpu::JMP() {
 int NES_Cpu::JSR() {
 
 	// Store pc into stack first
-	memory[STACK_OFFSET + sp] = (pc >> 8) & 0x00FF;
-	memory[STACK_OFFSET + sp - 1] = pc & 0x00FF;
+	write(STACK_OFFSET + sp, (pc >> 8) & 0x00FF);
+	write(STACK_OFFSET + sp - 1, pc & 0x00FF);
 	sp -= 2;
 
 	// Set program counter to the 2 byte instruction in the target address
-	pc = (memory[target_address + 1] << 8) | memory[target_address];
+	pc = (read(target_address + 1) << 8) | read(target_address);
 
 	return 0;
 }
@@ -892,19 +1846,11 @@ int NES_Cpu::JSR() {
 	 + + - - - -
 */
 int NES_Cpu::LDA() {
-	accumulator = memory[target_address];
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	if (accumulator & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
+	accumulator = read(target_address);
 
-	if (accumulator == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(accumulator);
 
-	return 0;
+	return 1;
 }
 
 /*
@@ -912,19 +1858,11 @@ int NES_Cpu::LDA() {
 	 + + - - - -
 */
 int NES_Cpu::LDX() {
-	X = memory[target_address];
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	if (X & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
+	X = read(target_address);
 
-	if (X == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(X);
 
-	return 0;
+	return 1;
 }
 
 /*
@@ -932,19 +1870,11 @@ int NES_Cpu::LDX() {
 	 + + - - - -
 */
 int NES_Cpu::LDY() {
-	Y = memory[target_address];
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
+	Y = read(target_address);
 
-	if (Y & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (Y == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(Y);
 
-	return 0;
+	return 1;
 }
 
 /*
@@ -952,35 +1882,24 @@ int NES_Cpu::LDY() {
 	 0 + + - - -
 */
 int NES_Cpu::LSR() {
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG | CARRY_FLAG);
-
 	if (use_accumulator) {
 		// Arithmetic shift right the accumulator
-
-		if (accumulator & 0x0001) { // Carry flag 
-			proc_status |= CARRY_FLAG;
-		}
+		set_carry(accumulator & 0x01);
 
 		accumulator >>= 1;
 
-		if ((accumulator & 0x00FF) == 0) { // Zero flag
-			proc_status |= ZERO_FLAG;
-		}
+		set_nz(accumulator);
 	}
 	else {
 		// Arithmetic shift right the data at the target address
-		uint16_t shifted_result = memory[target_address] >> 1;
+		uint8_t data = read(target_address);
+		uint8_t shifted_result = data >> 1;
 
-		if (memory[target_address] & 0x0001) { // Carry flag 
-			proc_status |= CARRY_FLAG;
-		}
+		set_carry(data & 0x01);
 
-		memory[target_address] = shifted_result;
+		write(target_address, shifted_result);
 
-		if ((shifted_result & 0x00FF) == 0) { // Zero flag
-			proc_status |= ZERO_FLAG;
-		}
+		set_nz(shifted_result);
 	}
 
 	return 0;
@@ -1002,20 +1921,11 @@ int NES_Cpu::NOP() {
 	 + + - - - -
 */
 int NES_Cpu::ORA() {
+	accumulator |= read(target_address);
 
-	accumulator |= memory[target_address];
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
+	set_nz(accumulator);
 
-	if (accumulator & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (accumulator == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
-
-	return 0;
+	return 1;
 }
 
 /*
@@ -1025,7 +1935,7 @@ int NES_Cpu::ORA() {
 int NES_Cpu::PHA() {
 
 	// Push accumulator onto stack
-	memory[STACK_OFFSET + sp] = accumulator;
+	write(STACK_OFFSET + sp, accumulator);
 	sp--;
 
 	return 0;
@@ -1036,9 +1946,8 @@ int NES_Cpu::PHA() {
 	 - - - - - -
 */
 int NES_Cpu::PHP() {
-
 	// Push processor status onto stack
-	memory[STACK_OFFSET + sp] = proc_status;
+	write(STACK_OFFSET + sp, get_status());
 	sp--;
 
 	return 0;
@@ -1049,20 +1958,11 @@ int NES_Cpu::PHP() {
 	 + + - - - -
 */
 int NES_Cpu::PLA() {
-
 	// Pull accumulator from stack
 	sp++;
-	accumulator = memory[STACK_OFFSET + sp];
-
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
+	accumulator = read(STACK_OFFSET + sp);
 
-	if (accumulator & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (accumulator == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(accumulator);
 
 	return 0;
 }
@@ -1073,10 +1973,10 @@ int NES_Cpu::PLA() {
 	 From stacks
 */
 int NES_Cpu::PLP() {
-
 	// Pull proc_status from stack
 	sp++;
-	proc_status = memory[STACK_OFFSET + sp];
+	set_status(read(STACK_OFFSET + sp));
+	irq_enabled();
 
 	return 0;
 }
@@ -1086,40 +1986,28 @@ int NES_Cpu::PLP() {
 	 + + + - - -
 */
 int NES_Cpu::ROL() {
-
 	// Set up the data
-	uint8_t *reg;
+	uint8_t data;
 	if (use_accumulator) {
-		reg = &accumulator;
+		data = accumulator;
 	}
 	else {
-		reg = &memory[target_address];
-	}
-
-	proc_status &= ~(CARRY_FLAG | NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Check the carry bit first
-	if (*reg & 0x80) { // Check if the leftmost bit is 1
-		proc_status |= CARRY_FLAG;
+		data = read(target_address);
 	}
 
-	// Shift left and then fill last bit
-	*reg <<= 1;
+	// The leftmost bit goes to the carry and back in as the last bit
+	uint8_t carry = data >> 7;
+	data = (data << 1) | carry;
 
-	// Set last bit to carry bit
-	if (proc_status & CARRY_FLAG) { // Set last bit to 1
-		*reg |= 0x01;
-	}
-	else { // Set last bit to 0
-		*reg &= 0xFE;
-	}
+	set_carry(carry);
+	set_nz(data);
 
-	if (*reg & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
+	// Store the result back
+	if (use_accumulator) {
+		accumulator = data;
 	}
-
-	if (*reg == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
+	else {
+		write(target_address, data);
 	}
 
 	return 0;
@@ -1131,38 +2019,27 @@ int NES_Cpu::ROL() {
 */
 int NES_Cpu::ROR() {
 	// Set up the data
-	uint8_t *reg;
+	uint8_t data;
 	if (use_accumulator) {
-		reg = &accumulator;
+		data = accumulator;
 	}
 	else {
-		reg = &memory[target_address];
-	}
-
-	proc_status &= ~(CARRY_FLAG | NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Check the carry bit first
-	if (*reg & 0x01) { // Check if the rightmost bit is 1
-		proc_status |= CARRY_FLAG;
+		data = read(target_address);
 	}
 
-	// Shift right and then fill first bit
-	*reg >>= 1;
+	// The rightmost bit goes to the carry and back in as the first bit
+	uint8_t carry = data & 0x01;
+	data = (data >> 1) | (carry << 7);
 
-	// Set first bit to carry bit
-	if (proc_status & CARRY_FLAG) { // Set last bit to 1
-		*reg |= 0x80;
-	}
-	else { // Set first bit to 0
-		*reg &= 0x7F;
-	}
+	set_carry(carry);
+	set_nz(data);
 
-	if (*reg & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
+	// Store the result back
+	if (use_accumulator) {
+		accumulator = data;
 	}
-
-	if (*reg == 0x00) { // Zero flag
-		proc_status |= ZERO_FLAG;
+	else {
+		write(target_address, data);
 	}
 
 	return 0;
@@ -1173,14 +2050,14 @@ int NES_Cpu::ROR() {
 	 From stacks
 */
 int NES_Cpu::RTI() {
-
 	// Pull back proc_status
 	sp++;
-	proc_status = memory[STACK_OFFSET + sp];
+	set_status(read(STACK_OFFSET + sp));
 
 	// Pull back program counter
 	sp+= 2;
-	pc = (memory[STACK_OFFSET + sp] << 8) | memory[STACK_OFFSET + sp - 1];
+	pc = (read(STACK_OFFSET + sp) << 8) | read(STACK_OFFSET + sp - 1);
+	irq_enabled();
 
 	return 0;
 }
@@ -1193,7 +2070,7 @@ int NES_Cpu::RTS() {
 
 	// Pull back program counter
 	sp += 2;
-	pc = (memory[STACK_OFFSET + sp] << 8) | memory[STACK_OFFSET + sp - 1];
+	pc = (read(STACK_OFFSET + sp) << 8) | read(STACK_OFFSET + sp - 1);
 
 	return 0;
 }
@@ -1203,44 +2080,28 @@ int NES_Cpu::RTS() {
 	 + + + - - +
 */
 int NES_Cpu::SBC() {
-
 	// Set up the data
-	uint8_t *reg;
+	uint8_t data;
 	if (use_accumulator) {
-		reg = &accumulator;
+		data = accumulator;
 	}
 	else {
-		reg = &memory[target_address];
+		data = read(target_address);
 	}
 
 	// Get difference
-	uint16_t diff = accumulator - *reg;
-
-	// Clear flags
-	proc_status &= ~(CARRY_FLAG | NEGATIVE_FLAG | ZERO_FLAG | OVERFLOW_FLAG);
-
-	// Check flags
-	if (diff >= 0x0100) { // Carry flag 
-		proc_status |= CARRY_FLAG;
-	}
-
-	if ((diff & 0x00FF) == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	uint16_t diff = accumulator - data;
 
-	if (diff & 0x0080) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
+	set_carry(diff >> 8 ? 1 : 0);
+	set_nz(diff & 0x00FF);
 
 	// Explanation for signed overflow flags: http://forums.nesdev.com/viewtopic.php?t=6331
-	if (!((accumulator ^ *reg) & 0x80) && ((accumulator ^ diff) & 0x80)) { // Overflow flag, (!((AC ^ src) & 0x80) && ((AC ^ temp) & 0x80))
-		proc_status |= OVERFLOW_FLAG;
-	}
+	set_overflow(~(accumulator ^ data) & (accumulator ^ diff) & 0x80); // (!((AC ^ src) & 0x80) && ((AC ^ temp) & 0x80))
 
 	// Set accumulator to difference
 	accumulator = diff & 0x00FF;
 
-	return 0;
+	return 1;
 }
 
 /*
@@ -1248,9 +2109,8 @@ int NES_Cpu::SBC() {
 	 - - 1 - - -
 */
 int NES_Cpu::SEC() {
-
 	// Set carry flag
-	proc_status |= CARRY_FLAG;
+	set_carry(1);
 
 	return 0;
 }
@@ -1286,7 +2146,7 @@ int NES_Cpu::SEI() {
 int NES_Cpu::STA() {
 
 	// Set memory target to the accumulator
-	memory[target_address] = accumulator;
+	write(target_address, accumulator);
 
 	return 0;
 }
@@ -1298,7 +2158,7 @@ int NES_Cpu::STA() {
 int NES_Cpu::STX() {
 
 	// Set memory target to the X register
-	memory[target_address] = X;
+	write(target_address, X);
 
 	return 0;
 }
@@ -1310,7 +2170,7 @@ int NES_Cpu::STX() {
 int NES_Cpu::STY() {
 
 	// Set memory target to the Y register
-	memory[target_address] = Y;
+	write(target_address, Y);
 
 	return 0;
 }
@@ -1320,21 +2180,10 @@ int NES_Cpu::STY() {
 	 + + - - - -
 */
 int NES_Cpu::TAX() {
-
 	// Transfer accumulator to X
 	X = accumulator;
 
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Check flags
-	if (accumulator & 0x0080) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (accumulator == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(accumulator);
 
 	return 0;
 }
@@ -1344,24 +2193,10 @@ int NES_Cpu::TAX() {
 	 + + - - - -
 */
 int NES_Cpu::TAY() {
-
 	// Transfer accumulator to Y
 	Y = accumulator;
 
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Check flags
-	if (accumulator & 0x0080) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (accumulator == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(accumulator);
 
 	return 0;
 }
@@ -1371,24 +2206,10 @@ int NES_Cpu::TAY() {
 	 + + - - - -
 */
 int NES_Cpu::TSX() {
-
 	// Stores the stack pointer in X
 	X = sp;
 
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Check flags
-	if (sp & 0x80) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (sp == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(sp);
 
 	return 0;
 }
@@ -1398,24 +2219,10 @@ int NES_Cpu::TSX() {
 	 + + - - - -
 */
 int NES_Cpu::TXA() {
-
 	// Transfer X to accumulator
 	accumulator = X;
 
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Check flags
-	if (accumulator & 0x0080) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (accumulator == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(accumulator);
 
 	return 0;
 }
@@ -1437,24 +2244,10 @@ int NES_Cpu::TXS() {
 	 + + - - - -
 */
 int NES_Cpu::TYA() {
-
 	// Transfer Y to accumulator
 	accumulator = Y;
 
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Clear flags
-	proc_status &= ~(NEGATIVE_FLAG | ZERO_FLAG);
-
-	// Check flags
-	if (accumulator & 0x0080) { // Negative flag
-		proc_status |= NEGATIVE_FLAG;
-	}
-
-	if (accumulator == 0) { // Zero flag
-		proc_status |= ZERO_FLAG;
-	}
+	set_nz(accumulator);
 
 	return 0;
 }
@@ -1482,7 +2275,7 @@ int NES_Cpu::ACC() {
 int NES_Cpu::ABS() {
 
 	// Read little endian byte address
-	target_address = memory[pc] | memory[pc + 1] << 8;
+	target_address = read(pc) | read(pc + 1) << 8;
 
 	// Update to show that we have made two accesses
 	pc += 2;
@@ -1493,25 +2286,27 @@ int NES_Cpu::ABS() {
 int NES_Cpu::ABS_X() {
 
 	// Read little endian byte address and add X
-	target_address = memory[pc] | memory[pc + 1] << 8;
-	target_address += X;
+	uint16_t base_address = read(pc) | read(pc + 1) << 8;
+	target_address = base_address + X;
 
 	// Update to show that we have made two accesses
 	pc += 2;
 
-	return 0;
+	// Crossing into the next page takes a cycle
+	return (base_address ^ target_address) >> 8 != 0;
 }
 
 int NES_Cpu::ABS_Y() {
 
 	// Read little endian byte address and add Y
-	target_address = memory[pc] | memory[pc + 1] << 8;
-	target_address += Y;
+	uint16_t base_address = read(pc) | read(pc + 1) << 8;
+	target_address = base_address + Y;
 
 	// Update to show that we have made two accesses
 	pc += 2;
 
-	return 0;
+	// Crossing into the next page takes a cycle
+	return (base_address ^ target_address) >> 8 != 0;
 }
 
 int NES_Cpu::IMM() {
@@ -1535,8 +2330,8 @@ int NES_Cpu::IMP() {
 int NES_Cpu::IND() {
 
 	// Set target address to the address in the next two bytes
-	uint16_t indirect_address = memory[pc + 1] << 8 | memory[pc];
-	target_address = memory[indirect_address + 1] << 8 | memory[indirect_address];
+	uint16_t indirect_address = read(pc + 1) << 8 | read(pc);
+	target_address = read(indirect_address + 1) << 8 | read(indirect_address);
 
 	// Update to show that we have made two accesses
 	pc += 2;
@@ -1547,8 +2342,8 @@ int NES_Cpu::IND() {
 int NES_Cpu::IND_X() {
 
 	// Add immediate and X for the indirect address
-	uint16_t indirect_address = memory[pc] + X;
-	target_address = memory[indirect_address + 1] << 8 | memory[indirect_address];
+	uint16_t indirect_address = read(pc) + X;
+	target_address = read(indirect_address + 1) << 8 | read(indirect_address);
 
 	// Update to show that we have made an additional access
 	pc += 1;
@@ -1559,20 +2354,21 @@ int NES_Cpu::IND_X() {
 int NES_Cpu::IND_Y() {
 
 	// Add immediate's data and Y for the indirect address
-	uint16_t indirect_address = memory[pc];
-	target_address = memory[indirect_address + 1] << 8 | memory[indirect_address];
-	target_address += Y;
+	uint16_t indirect_address = read(pc);
+	uint16_t base_address = read(indirect_address + 1) << 8 | read(indirect_address);
+	target_address = base_address + Y;
 
 	// Update to show that we have made an additional access
 	pc += 1;
 
-	return 0;
+	// Crossing into the next page takes a cycle
+	return (base_address ^ target_address) >> 8 != 0;
 }
 
 int NES_Cpu::REL() {
 
 	// Target address is the pc plus the value after it
-	target_address = pc + memory[pc];
+	target_address = pc + read(pc);
 
 	// Update to show that we have made an additional access
 	pc += 1;
@@ -1583,7 +2379,7 @@ int NES_Cpu::REL() {
 int NES_Cpu::ZPG() {
 
 	// Target address is in the next byte
-	target_address = memory[pc];
+	target_address = read(pc);
 
 	// Update to show that we have made an additional access
 	pc += 1;
@@ -1594,7 +2390,7 @@ int NES_Cpu::ZPG() {
 int NES_Cpu::ZPG_X() {
 
 	// Target address is the first byte of the sum of the X register and the next byte
-	target_address = (memory[pc] + X) & 0x00FF;
+	target_address = (read(pc) + X) & 0x00FF;
 
 	// Update to show that we have made an additional access
 	pc += 1;
@@ -1605,10 +2401,456 @@ int NES_Cpu::ZPG_X() {
 int NES_Cpu::ZPG_Y() {
 
 	// Target address is the first byte of the sum of the Y register and the next byte
-	target_address = (memory[pc] + Y) & 0x00FF;
+	target_address = (read(pc) + Y) & 0x00FF;
 
 	// Update to show that we have made an additional access
 	pc += 1;
 
 	return 0;
 }
+
+
+/*
+	Templated opcode handlers
+
+	Both the addressing mode and the instruction are template parameters, so the member function pointers are
+	looked up in a constant expression and the calls turn into direct (and usually inlined) calls. Every opcode in
+	instruction_set gets its own copy with the addressing math and flag updates specialized for it.
+*/
+template<int MODE, int OP>
+inline int NES_Cpu::step() {
+	constexpr addr_setup setup = addr_functions[MODE];
+	constexpr operation instruction = operation_functions[OP];
+
+	// Extra cycle for a page crossed by an instruction that reads its operand
+	int page_crossed = (this->*setup)();
+	return page_crossed & (this->*instruction)();
+}
+
+
+/*
+	Fused interpreter core
+
+	Each of the 256 opcodes gets its own handler, generated from instruction_set through step(), instead of going
+	through the two member function pointers in instruction_table.
+
+	With GCC/Clang the handlers are threaded together with computed gotos (every handler jumps straight to the next
+	one), everywhere else a plain switch is used.
+*/
+#define FUSED_ROW(X, hi)																	\
+	X(0x##hi##0) X(0x##hi##1) X(0x##hi##2) X(0x##hi##3) X(0x##hi##4) X(0x##hi##5) X(0x##hi##6) X(0x##hi##7)	\
+	X(0x##hi##8) X(0x##hi##9) X(0x##hi##A) X(0x##hi##B) X(0x##hi##C) X(0x##hi##D) X(0x##hi##E) X(0x##hi##F)
+
+#define FUSED_OPCODES(X)																	\
+	FUSED_ROW(X, 0) FUSED_ROW(X, 1) FUSED_ROW(X, 2) FUSED_ROW(X, 3) FUSED_ROW(X, 4) FUSED_ROW(X, 5)		\
+	FUSED_ROW(X, 6) FUSED_ROW(X, 7) FUSED_ROW(X, 8) FUSED_ROW(X, 9) FUSED_ROW(X, A) FUSED_ROW(X, B)		\
+	FUSED_ROW(X, C) FUSED_ROW(X, D) FUSED_ROW(X, E) FUSED_ROW(X, F)
+
+#define FUSED_STEP(code) cycle_count += instruction_set[code].cycles + step<instruction_set[code].addr_mode, instruction_set[code].operation>()
+
+template<class TRACE>
+unsigned long NES_Cpu::execute_fused(unsigned long count) {
+
+#if defined(__GNUC__)
+
+	// Label addresses for every handler, indexed by opcode
+	#define X(code) &&fused_##code,
+	static void* const dispatch_table[0x0100] = { FUSED_OPCODES(X) };
+	#undef X
+
+	// Fetch the next opcode and jump straight to its handler
+	#define FUSED_DISPATCH()						\
+		if (count == 0 || cycle_count >= core_limit) {	\
+			return count;							\
+		}											\
+		count--;									\
+		opcode = read(pc);						\
+		TRACE::record(this);						\
+		use_accumulator = 0;						\
+		pc++;										\
+		goto *dispatch_table[opcode];
+
+	FUSED_DISPATCH();
+
+	#define X(code) fused_##code: FUSED_STEP(code); FUSED_DISPATCH();
+	FUSED_OPCODES(X)
+	#undef X
+
+	#undef FUSED_DISPATCH
+
+#else
+
+	while (count > 0 && cycle_count < core_limit) {
+		count--;
+		opcode = read(pc);
+		TRACE::record(this);
+		use_accumulator = 0;
+		pc++;
+
+		switch (opcode) {
+			#define X(code) case code: FUSED_STEP(code); break;
+			FUSED_OPCODES(X)
+			#undef X
+		}
+	}
+
+#endif
+
+	return count;
+}
+
+
+/*
+	Predecoded interpreter core
+
+	step_decoded() is step() with the addressing mode working off the operand stored in the decode cache instead of
+	reading it through the bus at pc. The program counter is already past the instruction when the handler runs, which is
+	where the addressing mode functions leave it as well.
+*/
+template<int MODE, int OP>
+inline int NES_Cpu::step_decoded(uint16_t operand) {
+	constexpr operation instruction = operation_functions[OP];
+	int page_crossed = 0;
+
+	if constexpr (MODE == MODE_ACC) {
+		use_accumulator = 1;
+	}
+	else if constexpr (MODE == MODE_ABS) {
+		target_address = operand;
+	}
+	else if constexpr (MODE == MODE_ABS_X) {
+		target_address = operand + X;
+		page_crossed = (operand ^ target_address) >> 8 != 0;
+	}
+	else if constexpr (MODE == MODE_ABS_Y) {
+		target_address = operand + Y;
+		page_crossed = (operand ^ target_address) >> 8 != 0;
+	}
+	else if constexpr (MODE == MODE_IMM) {
+		// Data is in the byte before the next instruction
+		target_address = pc - 1;
+	}
+	else if constexpr (MODE == MODE_IND) {
+		target_address = read(operand + 1) << 8 | read(operand);
+	}
+	else if constexpr (MODE == MODE_IND_X) {
+		uint16_t indirect_address = operand + X;
+		target_address = read(indirect_address + 1) << 8 | read(indirect_address);
+	}
+	else if constexpr (MODE == MODE_IND_Y) {
+		uint16_t base_address = read(operand + 1) << 8 | read(operand);
+		target_address = base_address + Y;
+		page_crossed = (base_address ^ target_address) >> 8 != 0;
+	}
+	else if constexpr (MODE == MODE_REL) {
+		// Relative to the operand byte, like REL()
+		target_address = pc - 1 + operand;
+	}
+	else if constexpr (MODE == MODE_ZPG) {
+		target_address = operand;
+	}
+	else if constexpr (MODE == MODE_ZPG_X) {
+		target_address = (operand + X) & 0x00FF;
+	}
+	else if constexpr (MODE == MODE_ZPG_Y) {
+		target_address = (operand + Y) & 0x00FF;
+	}
+
+	return page_crossed & (this->*instruction)();
+}
+
+// Handlers called through the decode cache only count the extra cycles, the caller adds the base cycles
+template<int CODE>
+void NES_Cpu::run_decoded(NES_Cpu* cpu, uint16_t operand) {
+	cpu->cycle_count += cpu->step_decoded<instruction_set[CODE].addr_mode, instruction_set[CODE].operation>(operand);
+}
+
+#define X(code) &NES_Cpu::run_decoded<code>,
+const decoded_handler NES_Cpu::decoded_handlers[0x0100] = { FUSED_OPCODES(X) };
+#undef X
+
+// The table-driven core's dispatch table, one copy for every instance
+#define X(code) { instruction_set[code].instr_name, operation_functions[instruction_set[code].operation],	\
+	addr_functions[instruction_set[code].addr_mode], instruction_set[code].cycles },
+const NES_Cpu::instruction_entry NES_Cpu::instruction_table[0x0100] = { FUSED_OPCODES(X) };
+#undef X
+
+static_assert(std::is_trivially_copyable<NES_Cpu_State>::value, "NES_Cpu_State must stay plain data");
+
+// Entries for pages with nothing decoded behind them, which run on the table core
+static const decoded_entry undecoded_page[0x100] = {};
+
+// Every offset of PRG ROM decoded as if an instruction started there, for NES_Cartridge::decoded_prg()
+void NES_Cpu::decode_prg(const uint8_t* prg, uint32_t size, decoded_entry* decoded) {
+	for (uint32_t offset = 0; offset < size; offset++) {
+		uint8_t code = prg[offset];
+		uint8_t length = operand_length[instruction_set[code].addr_mode];
+		decoded_entry* entry = &decoded[offset];
+
+		entry->opcode = code;
+		entry->length = length;
+		entry->cycles = instruction_set[code].cycles;
+		entry->operand = 0;
+
+		// The bytes past the end of a bank can be any other bank once the mapper switches, so those aren't decoded
+		if (offset % PRG_BANK_MIN + length >= PRG_BANK_MIN) {
+			entry->handler = NULL;
+			continue;
+		}
+
+		entry->handler = decoded_handlers[code];
+		if (length >= 1) {
+			entry->operand = prg[offset + 1];
+		}
+		if (length == 2) {
+			entry->operand |= prg[offset + 2] << 8;
+		}
+	}
+}
+
+decoded_entry* NES_Cpu::ram_entry(int offset) {
+	std::vector<decoded_entry>& page = ram_decoded[offset >> 8];
+	return page.empty() ? NULL : &page[offset & 0x00FF];
+}
+
+int NES_Cpu::ram_offset(uint16_t address) {
+	const uint8_t* memory = read_pages[address >> 8];
+	if (memory == NULL) {
+		return -1;
+	}
+
+	memory += address & 0x00FF;
+	if (memory >= ram && memory < ram + sizeof(ram)) {
+		return memory - ram;
+	}
+	if (memory >= prg_ram && memory < prg_ram + sizeof(prg_ram)) {
+		return sizeof(ram) + (memory - prg_ram);
+	}
+	return -1;
+}
+
+void NES_Cpu::map_decoded(int first_page, int last_page) {
+	for (int page = first_page; page <= last_page; page++) {
+		const uint8_t* memory = read_pages[page];
+		decode_pages[page] = undecoded_page;
+
+		if (memory == NULL) {
+			continue;
+		}
+		if (prg_decoded != NULL && memory >= cartridge->prg_rom && memory < cartridge->prg_rom + cartridge->prg_size) {
+			decode_pages[page] = prg_decoded + (memory - cartridge->prg_rom);
+		}
+		else if (ram_offset(page << 8) >= 0 && ram_entry(ram_offset(page << 8)) != NULL) {
+			decode_pages[page] = ram_entry(ram_offset(page << 8));
+		}
+	}
+}
+
+// remap() keeps internal RAM at $0000 - $1FFF and PRG RAM at $6000 - $7FFF, so each byte has fixed addresses
+void NES_Cpu::mark_code(int offset, bool covered) {
+	int mirrors = offset < (int) sizeof(ram) ? 4 : 1;
+	uint16_t address = offset < (int) sizeof(ram) ? offset : 0x6000 + offset - sizeof(ram);
+
+	for (int mirror = 0; mirror < mirrors; mirror++) {
+		uint16_t mirrored = address + mirror * sizeof(ram);
+		if (covered) {
+			code_bitmap[mirrored >> 3] |= 1 << (mirrored & 0x07);
+		}
+		else {
+			code_bitmap[mirrored >> 3] &= ~(1 << (mirrored & 0x07));
+		}
+	}
+}
+
+// Code read from registers (the PPU's, say) can change without a write and reads have side effects, so only code in
+// RAM is decoded here, PRG ROM already is
+const decoded_entry* NES_Cpu::decode(uint16_t address) {
+	int offset = ram_offset(address);
+	if (!decoding || offset < 0) {
+		return NULL;
+	}
+
+	// The operand has to be in the same memory, past its end a mirror or another device follows
+	const uint8_t* memory = offset < (int) sizeof(ram) ? ram : prg_ram - sizeof(ram);
+	int end = offset < (int) sizeof(ram) ? sizeof(ram) : sizeof(ram) + sizeof(prg_ram);
+	uint8_t code = memory[offset];
+	uint8_t length = operand_length[instruction_set[code].addr_mode];
+	if (offset + length >= end) {
+		return NULL;
+	}
+
+	// The page is allocated the first time, and mapped through all its mirrors
+	if (ram_entry(offset) == NULL) {
+		ram_decoded[offset >> 8].resize(0x100);
+		map_decoded(0x00, 0xFF);
+	}
+
+	decoded_entry* entry = ram_entry(offset);
+	entry->opcode = code;
+	entry->length = length;
+	entry->cycles = instruction_set[code].cycles;
+	entry->handler = decoded_handlers[code];
+
+	entry->operand = 0;
+	if (length >= 1) {
+		entry->operand = memory[offset + 1];
+	}
+	if (length == 2) {
+		entry->operand |= memory[offset + 2] << 8;
+	}
+
+	// Mark every byte of the instruction so writes to it are noticed
+	for (int i = 0; i <= length; i++) {
+		mark_code(offset + i, true);
+	}
+
+	return entry;
+}
+
+const decoded_entry* NES_Cpu::find_decoded(uint16_t address) {
+	const decoded_entry* entry = &decode_pages[address >> 8][address & 0x00FF];
+	return entry->handler != NULL ? entry : decode(address);
+}
+
+void NES_Cpu::drop_decoded(int offset) {
+	if (offset < 0) {
+		return;
+	}
+
+	int start = offset < (int) sizeof(ram) ? 0 : sizeof(ram);
+	int end = offset < (int) sizeof(ram) ? sizeof(ram) : sizeof(ram) + sizeof(prg_ram);
+
+	// Any instruction starting up to two bytes before the offset can cover it
+	for (int i = 0; i <= 2 && offset - i >= start; i++) {
+		decoded_entry* entry = ram_entry(offset - i);
+		if (entry != NULL && entry->handler != NULL && entry->length >= i) {
+			entry->handler = NULL;
+		}
+	}
+
+	// The dropped entries covered at most two bytes either side, those stay marked only if another entry covers them
+	for (int byte = std::max(offset - 2, start); byte <= std::min(offset + 2, end - 1); byte++) {
+		bool covered = false;
+		for (int i = 0; i <= 2 && byte - i >= start && !covered; i++) {
+			const decoded_entry* entry = ram_entry(byte - i);
+			covered = entry != NULL && entry->handler != NULL && entry->length >= i;
+		}
+		mark_code(byte, covered);
+	}
+}
+
+void NES_Cpu::invalidate(uint16_t address) {
+
+	// Translated code can't be dropped while it may be running, the recompiler flushes before its next block
+	if (jit != NULL && jit->covers(address, address)) {
+		jit->flush_pending = 1;
+	}
+
+	drop_decoded(ram_offset(address));
+}
+
+// Drops what is decoded in first - last, for memory that changed without going through write(). RAM mirrors share
+// their entries, so one of them is enough.
+void NES_Cpu::invalidate_range(uint16_t first, uint16_t last) {
+	if (jit != NULL && jit->covers(first, last)) {
+		jit->flush_pending = 1;
+	}
+
+	for (uint32_t address = first; address <= last; address++) {
+		if (code_bitmap[address >> 3] == 0) {
+			address |= 0x07;
+			continue;
+		}
+
+		if (code_bitmap[address >> 3] & (1 << (address & 0x07))) {
+			drop_decoded(ram_offset(address));
+		}
+	}
+}
+
+void NES_Cpu::flush_decode_cache() {
+	memset(code_bitmap, 0, sizeof(code_bitmap));
+
+	if (jit != NULL) {
+		jit->flush();
+	}
+
+	for (std::vector<decoded_entry>& page : ram_decoded) {
+		for (decoded_entry& entry : page) {
+			entry.handler = NULL;
+		}
+	}
+}
+
+template<class TRACE>
+unsigned long NES_Cpu::execute_cached(unsigned long count) {
+
+#if defined(__GNUC__)
+
+	// Same threading as the fused core, but the handlers take their operand from the decode cache
+	#define X(code) &&cached_##code,
+	static void* const dispatch_table[0x0100] = { FUSED_OPCODES(X) };
+	#undef X
+
+	const decoded_entry* entry;
+
+	#define CACHED_DISPATCH()						\
+		for (;;) {									\
+			if (count == 0 || cycle_count >= core_limit) {	\
+				return count;						\
+			}										\
+			count--;								\
+			entry = &decode_pages[pc >> 8][pc & 0x00FF];	\
+			if (entry->handler != NULL || (entry = decode(pc)) != NULL) {	\
+				break;								\
+			}										\
+			cycle_table<TRACE>();					\
+		}											\
+		opcode = entry->opcode;						\
+		TRACE::record(this);						\
+		use_accumulator = 0;						\
+		goto *dispatch_table[opcode];
+
+	CACHED_DISPATCH();
+
+	// The instruction length is a constant in each handler, so the next fetch does not wait on the cache entry
+	#define X(code)																		\
+		cached_##code:																	\
+			pc += 1 + operand_length[instruction_set[code].addr_mode];					\
+			cycle_count += instruction_set[code].cycles +								\
+				step_decoded<instruction_set[code].addr_mode, instruction_set[code].operation>(entry->operand);	\
+			CACHED_DISPATCH();
+
+	FUSED_OPCODES(X)
+	#undef X
+
+	#undef CACHED_DISPATCH
+
+#else
+
+	while (count > 0 && cycle_count < core_limit) {
+		count--;
+		const decoded_entry* entry = find_decoded(pc);
+
+		if (entry == NULL) {
+			cycle_table<TRACE>();
+			continue;
+		}
+
+		opcode = entry->opcode;
+		TRACE::record(this);
+		use_accumulator = 0;
+		pc += 1 + entry->length;
+
+		// Handlers see cycle_count where the instruction started, as with the threaded dispatch
+		entry->handler(this, entry->operand);
+		cycle_count += entry->cycles;
+	}
+
+#endif
+
+	return count;
+}
+
+// The recompiler runs RAM code and instructions that aren't decoded on this core
+template unsigned long NES_Cpu::execute_cached<NES_Trace>(unsigned long count);
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "NES.h"
+#include "util.h"
+
+
+NES_Batch::NES_Batch(int thread_count) : queues(thread_count > 0 ? thread_count : 1) {
+	this->thread_count = thread_count > 0 ? thread_count : 1;
+	seconds = 0;
+}
+
+// Parse a core name the same way the command line does, -1 when it isn't one
+static int core_from_name(const char* name) {
+	if (strcmp(name, "table") == 0) {
+		return CORE_TABLE;
+	}
+	else if (strcmp(name, "fused") == 0) {
+		return CORE_FUSED;
+	}
+	else if (strcmp(name, "cached") == 0) {
+		return CORE_CACHED;
+	}
+	else if (strcmp(name, "jit") == 0) {
+		return CORE_JIT;
+	}
+
+	return -1;
+}
+
+int NES_Batch::load_jobs(const char* path) {
+	FILE* list = fopen(path, "r");
+	if (list == NULL) {
+		printf("Failed to open job list %s\n", path);
+		return 1;
+	}
+
+	char line[1024];
+	int line_number = 0;
+
+	while (fgets(line, sizeof(line), list) != NULL) {
+		line_number++;
+
+		char* token = strtok(line, " \t\r\n");
+		if (token == NULL || token[0] == '#') {
+			continue;
+		}
+
+		batch_job job;
+		job.rom = token;
+		job.frames = 0;
+		job.cycles = 0;
+		job.core = CORE_CACHED;
+
+		// Options after the ROM
+		while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+			if (strncmp(token, "frames=", 7) == 0) {
+				job.frames = strtoull(token + 7, NULL, 10);
+			}
+			else if (strncmp(token, "cycles=", 7) == 0) {
+				job.cycles = strtoull(token + 7, NULL, 10);
+			}
+			else if (strncmp(token, "core=", 5) == 0 && core_from_name(token + 5) >= 0) {
+				job.core = core_from_name(token + 5);
+			}
+			else if (strncmp(token, "input=", 6) == 0) {
+				job.input = token + 6;
+			}
+			else {
+				printf("%s:%d: unknown option %s\n", path, line_number, token);
+				fclose(list);
+				return 1;
+			}
+		}
+
+		if (job.frames == 0 && job.cycles == 0) {
+			job.frames = 60;
+		}
+
+		add_job(job);
+	}
+
+	fclose(list);
+
+	return 0;
+}
+
+void NES_Batch::add_job(const batch_job& job) {
+	jobs.push_back(job);
+}
+
+void NES_Batch::run() {
+	results.assign(jobs.size(), batch_result());
+
+	// Deal the jobs out round robin, stealing evens out whatever this gets wrong
+	for (size_t i = 0; i < jobs.size(); i++) {
+		queues[i % thread_count].jobs.push_back(i);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < thread_count; i++) {
+		threads.push_back(std::thread(&NES_Batch::worker, this, i));
+	}
+
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void NES_Batch::worker(int index) {
+	size_t job;
+
+	while (next_job(index, &job)) {
+		run_job(job);
+	}
+}
+
+// Own queue from the back first, then steal from the front of the others
+bool NES_Batch::next_job(int index, size_t* job) {
+	{
+		std::lock_guard<std::mutex> guard(queues[index].lock);
+
+		if (!queues[index].jobs.empty()) {
+			*job = queues[index].jobs.back();
+			queues[index].jobs.pop_back();
+			return true;
+		}
+	}
+
+	for (int i = 1; i < thread_count; i++) {
+		work_queue* victim = &queues[(index + i) % thread_count];
+		std::lock_guard<std::mutex> guard(victim->lock);
+
+		if (!victim->jobs.empty()) {
+			*job = victim->jobs.front();
+			victim->jobs.pop_front();
+			return true;
+		}
+	}
+
+	// Nothing is added once the run started, so every queue being empty means we're done
+	return false;
+}
+
+void NES_Batch::run_job(size_t index) {
+	const batch_job* job = &jobs[index];
+	batch_result* result = &results[index];
+
+	result->ok = false;
+	result->frames = 0;
+	result->cycles = 0;
+	result->state_hash = 0;
+	result->seconds = 0;
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Input script, "frame pad0 [pad1]" per line
+	std::vector<uint64_t> input_frames;
+	std::vector<uint16_t> input_buttons;
+
+	if (!job->input.empty() && read_input_script(job->input.c_str(), &input_frames, &input_buttons)) {
+		return;
+	}
+
+	// Jobs on the same ROM share its mapping
+	NES_Cpu* cpu = new NES_Cpu();
+
+	if (cpu->load_rom(job->rom.c_str()) <= 16) {
+		delete cpu;
+		return;
+	}
+
+	cpu->reset();
+	cpu->set_core(job->core);
+
+	uint64_t start_cycle = cpu->get_cycles();
+	uint64_t cycle_limit = job->cycles ? start_cycle + job->cycles : UINT64_MAX;
+	size_t next_input = 0;
+
+	// One frame at a time so the buttons change on frame boundaries
+	for (uint64_t frame = 0; job->frames == 0 || frame < job->frames; frame++) {
+		while (next_input < input_frames.size() && input_frames[next_input] <= frame) {
+			cpu->set_buttons(0, input_buttons[next_input] & 0x00FF);
+			cpu->set_buttons(1, input_buttons[next_input] >> 8);
+			next_input++;
+		}
+
+		uint64_t frame_end = start_cycle + (frame + 1) * CYCLES_PER_FRAME;
+		cpu->run_until(frame_end < cycle_limit ? frame_end : cycle_limit);
+		result->frames = frame + 1;
+
+		if (cpu->get_cycles() >= cycle_limit) {
+			break;
+		}
+	}
+
+	result->ok = true;
+	result->cycles = cpu->get_cycles() - start_cycle;
+	result->state_hash = cpu->state_hash();
+	result->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	delete cpu;
+}
+
+int NES_Batch::report() {
+	int failed = 0;
+	uint64_t cycles = 0;
+	double job_seconds = 0;
+
+	for (size_t i = 0; i < jobs.size(); i++) {
+		const batch_result* result = &results[i];
+
+		if (!result->ok) {
+			printf("FAIL  %s\n", jobs[i].rom.c_str());
+			failed++;
+			continue;
+		}
+
+		printf("ok    %s  frames %llu  cycles %llu  hash %016llx  %.3f s\n", jobs[i].rom.c_str(),
+			(unsigned long long) result->frames, (unsigned long long) result->cycles,
+			(unsigned long long) result->state_hash, result->seconds);
+
+		cycles += result->cycles;
+		job_seconds += result->seconds;
+	}
+
+	// Emulated time over wall time, and how much of the threads' time went into jobs
+	double emulated = (double) cycles / CPU_FREQUENCY;
+	printf("%zu jobs, %d failed, %d threads, %.3f s (%.1fx real time, %.0f%% thread use)\n", jobs.size(), failed,
+		thread_count, seconds, seconds > 0 ? emulated / seconds : 0,
+		seconds > 0 ? 100 * job_seconds / (seconds * thread_count) : 0);
+
+	return failed;
+}
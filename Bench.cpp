@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <chrono>
+#include <map>
+#include "NES.h"
+
+
+/*
+	Benchmark program layout
+
+	$8000	Prologue: pointers for the indirect modes at $20/$21 ($0300), the stack page filled with BENCH_BODY's
+			bytes so RTS and RTI come back to it, then a JMP to the body
+	$9090	Body: BENCH_COPIES instructions followed by a JMP back to the body, or a single instruction that comes
+			back to itself (RTS, RTI, BRK)
+	$D000	Subroutine called by JSR in the mixes
+	$E000	Pointers to the next copy for JMP and JSR, which jump to the address stored at their operand
+	$F000	Pointers to the $E000 pointers for JMP (IND)
+
+	Operands stay on internal RAM ($30, $0300) so no device is touched, and branches have an offset of 1 from their
+	operand, so taken or not they land on the next instruction.
+*/
+#define BENCH_BODY			0x9090
+#define BENCH_SUBROUTINE	0xD000
+#define BENCH_SUB_POINTER	0xDFF0
+#define BENCH_BODY_POINTER	0xDFF2
+#define BENCH_CHAIN			0xE000
+#define BENCH_CHAIN_INDIRECT	0xF000
+#define BENCH_COPIES		1000
+
+static const char* core_names[] = { "table", "fused", "cached", "jit" };
+
+static const char* mode_names[] = {
+	"ILL", "ACC", "ABS", "ABS_X", "ABS_Y", "IMM", "IMP", "IND", "IND_X", "IND_Y", "REL", "ZPG", "ZPG_X", "ZPG_Y"
+};
+
+/*
+	Instruction mixes
+
+	Each body instruction is picked from the mix's opcodes by a fixed sequence, so a mix is the same program every
+	run. Control flow other than branches and JSR is left out since it doesn't come back to the body.
+*/
+typedef struct bench_mix {
+	const char* name;
+	std::vector<uint8_t> opcodes;
+} bench_mix;
+
+static const bench_mix mixes[] = {
+	// Loads and stores in every addressing mode
+	{ "memory", { 0xA5, 0xAD, 0xB5, 0xBD, 0xB9, 0xB1, 0xA1, 0x85, 0x8D, 0x95, 0x9D, 0x99, 0x91, 0x81, 0xA6, 0xA4,
+		0x86, 0x84, 0xAE, 0xAC } },
+	// Arithmetic, logic and shifts on the accumulator
+	{ "alu", { 0x69, 0x65, 0xE9, 0xE5, 0x29, 0x25, 0x09, 0x05, 0x49, 0x45, 0xC9, 0xC5, 0x0A, 0x4A, 0x2A, 0x6A, 0x18,
+		0x38, 0xAA, 0x8A } },
+	// Compares, branches and loop counters
+	{ "branch", { 0xC9, 0xE0, 0xC0, 0x10, 0x30, 0x50, 0x70, 0x90, 0xB0, 0xD0, 0xF0, 0xE8, 0xCA, 0xC8, 0x88 } },
+	// Read-modify-write on memory
+	{ "rmw", { 0xE6, 0xC6, 0xEE, 0xCE, 0xF6, 0xFE, 0x06, 0x46, 0x26, 0x66, 0x0E, 0x4E, 0x2E, 0x6E } },
+	// Subroutine calls and the stack
+	{ "stack", { 0x20, 0x48, 0x68, 0x08, 0x28, 0xBA, 0x9A } },
+	// Roughly what game code looks like: mostly loads, stores, compares and branches
+	{ "typical", { 0xA5, 0xA5, 0xAD, 0xBD, 0xB1, 0x85, 0x85, 0x8D, 0x9D, 0xA9, 0xA9, 0xA2, 0xA0, 0xC9, 0xD0, 0xD0,
+		0xF0, 0x90, 0xB0, 0x10, 0xE8, 0xC8, 0xCA, 0x88, 0x69, 0x29, 0x18, 0x0A, 0x4A, 0xAA, 0xA8, 0xE6, 0x20 } },
+};
+
+
+NES_Bench::NES_Bench(unsigned long instructions) {
+	this->instructions = instructions;
+}
+
+// PRG ROM offset of a CPU address in $8000 - $FFFF
+static inline size_t prg(uint16_t address) {
+	return 16 + (address - 0x8000);
+}
+
+void NES_Bench::put_byte(uint16_t address, uint8_t data) {
+	rom[prg(address)] = data;
+}
+
+void NES_Bench::put_word(uint16_t address, uint16_t data) {
+	put_byte(address, data & 0x00FF);
+	put_byte(address + 1, data >> 8);
+}
+
+/*
+	Write one instruction at address, returns the address after it. index is the copy number, JMP and JSR use it
+	to jump to the next copy through their own pointer unless they call the subroutine.
+*/
+uint16_t NES_Bench::put_instruction(uint16_t address, uint8_t code, int index, bool call) {
+	const NES_Cpu::instruction_desc* desc = &NES_Cpu::instruction_set[code];
+	uint16_t next = address + 1 + NES_Cpu::operand_length[desc->addr_mode];
+
+	put_byte(address, code);
+
+	if (desc->operation == OP_JMP || desc->operation == OP_JSR) {
+		uint16_t pointer = BENCH_CHAIN + index * 2;
+
+		if (call) {
+			pointer = BENCH_SUB_POINTER;
+		}
+		else if (desc->addr_mode == MODE_IND) {
+			put_word(BENCH_CHAIN_INDIRECT + index * 2, pointer);
+			pointer = BENCH_CHAIN_INDIRECT + index * 2;
+		}
+
+		// Filled in with the next copy's address once it is known
+		put_word(address + 1, pointer);
+		return next;
+	}
+
+	switch (desc->addr_mode) {
+		case MODE_IMM:
+			put_byte(address + 1, 0x00);
+			break;
+
+		case MODE_REL:
+			put_byte(address + 1, 0x01);
+			break;
+
+		case MODE_ZPG:
+		case MODE_ZPG_X:
+		case MODE_ZPG_Y:
+			put_byte(address + 1, 0x30);
+			break;
+
+		case MODE_IND_X:
+		case MODE_IND_Y:
+			put_byte(address + 1, 0x20);
+			break;
+
+		case MODE_ABS:
+		case MODE_ABS_X:
+		case MODE_ABS_Y:
+			put_word(address + 1, 0x0300);
+			break;
+	}
+
+	return next;
+}
+
+/*
+	Build the benchmark ROM around a body of codes, one instruction per copy picked in turn (count 1 repeats the
+	same opcode). Returns the number of instructions the prologue runs before the body starts.
+*/
+unsigned long NES_Bench::build(const uint8_t* codes, size_t count) {
+	rom.assign(16 + 2 * PRG_ROM_UNIT, 0x00);
+	memcpy(&rom[0], "NES\x1A", 4);
+	rom[PRG_ROM] = 2;
+
+	// Prologue
+	uint16_t address = 0x8000;
+	unsigned long prologue = 0;
+	const uint8_t setup[] = { 0xA9, 0x00, 0x85, 0x20, 0xA9, 0x03, 0x85, 0x21, 0xA9, BENCH_BODY & 0x00FF };
+
+	for (size_t i = 0; i < sizeof(setup); i++) {
+		put_byte(address++, setup[i]);
+	}
+	prologue += 5;
+
+	for (int i = 0; i < 0x100; i++) {
+		put_byte(address, 0x8D);
+		put_word(address + 1, STACK_OFFSET + i);
+		address += 3;
+		prologue++;
+	}
+
+	put_byte(address, 0x4C);
+	put_word(address + 1, BENCH_BODY_POINTER);
+	put_word(BENCH_BODY_POINTER, BENCH_BODY);
+	prologue++;
+
+	// Subroutine for JSR in the mixes
+	const uint8_t subroutine[] = { 0xA5, 0x30, 0x69, 0x01, 0x85, 0x30, 0x60 };
+	for (size_t i = 0; i < sizeof(subroutine); i++) {
+		put_byte(BENCH_SUBROUTINE + i, subroutine[i]);
+	}
+	put_word(BENCH_SUB_POINTER, BENCH_SUBROUTINE);
+
+	// Vectors, BRK comes back to the body
+	put_word(0xFFFC, 0x8000);
+	put_word(0xFFFE, BENCH_BODY);
+	put_word(0xFFFA, BENCH_BODY);
+
+	// Instructions that return through the stack or the vector come back to themselves
+	uint8_t operation = NES_Cpu::instruction_set[codes[0]].operation;
+	if (count == 1 && (operation == OP_RTS || operation == OP_RTI || operation == OP_BRK)) {
+		put_instruction(BENCH_BODY, codes[0], 0, false);
+		return prologue;
+	}
+
+	// A fixed sequence so the mixes don't change between runs
+	uint32_t seed = 12345;
+
+	address = BENCH_BODY;
+	for (int i = 0; i < BENCH_COPIES; i++) {
+		seed = seed * 1103515245 + 12345;
+		uint8_t code = codes[count > 1 ? (seed >> 16) % count : 0];
+
+		address = put_instruction(address, code, i, count > 1);
+		put_word(BENCH_CHAIN + i * 2, address);
+	}
+
+	put_byte(address, 0x4C);
+	put_word(address + 1, BENCH_BODY_POINTER);
+
+	return prologue;
+}
+
+/*
+	MMC3 IRQ program
+
+	$8000	Turns rendering and the NMI on, has the mapper raise its IRQ every 8 lines and clears I, then loops
+	$D100	IRQ handler, spends about 10 lines before it acknowledges on $E000 so the line stays held across the
+			events in between, then enables the IRQ again on $E001
+	$D200	NMI handler
+
+	Branches only go forward in this core, so the loops go back with a JMP, which takes its target from the
+	pointers at $D1F0.
+*/
+unsigned long NES_Bench::build_irq() {
+	rom.assign(16 + 2 * PRG_ROM_UNIT, 0x00);
+	memcpy(&rom[0], "NES\x1A", 4);
+	rom[PRG_ROM] = 2;
+	rom[FLG_6] = MAPPER_MMC3 << 4;
+
+	const uint8_t reset[] = {
+		0xA9, 0x1E, 0x8D, 0x01, 0x20,		// LDA #$1E, STA $2001
+		0xA9, 0x80, 0x8D, 0x00, 0x20,		// LDA #$80, STA $2000
+		0xA9, 0x07, 0x8D, 0x00, 0xC0,		// LDA #$07, STA $C000
+		0x8D, 0x01, 0xC0,					// STA $C001
+		0x8D, 0x01, 0xE0,					// STA $E001
+		0x58,								// CLI
+		0xE6, 0x30, 0xA5, 0x30, 0x29, 0x0F, 0xAA,	// $8016: INC $30, LDA $30, AND #$0F, TAX
+		0x4C, 0xF0, 0xD1					// JMP ($D1F0) = $8016
+	};
+	const uint8_t irq[] = {
+		0xE6, 0x31,							// INC $31
+		0xA2, 0xD0,							// LDX #$D0
+		0xCA,								// $D104: DEX
+		0xF0, 0x04,							// BEQ $D10A
+		0x4C, 0xF2, 0xD1,					// JMP ($D1F2) = $D104
+		0x8D, 0x00, 0xE0,					// $D10A: STA $E000
+		0x8D, 0x01, 0xE0,					// STA $E001
+		0x40								// RTI
+	};
+	const uint8_t nmi[] = { 0xE6, 0x32, 0x40 };	// INC $32, RTI
+
+	for (size_t i = 0; i < sizeof(reset); i++) {
+		put_byte(0x8000 + i, reset[i]);
+	}
+	for (size_t i = 0; i < sizeof(irq); i++) {
+		put_byte(0xD100 + i, irq[i]);
+	}
+	for (size_t i = 0; i < sizeof(nmi); i++) {
+		put_byte(0xD200 + i, nmi[i]);
+	}
+
+	put_word(0xD1F0, 0x8016);
+	put_word(0xD1F2, 0xD104);
+	put_word(0xFFFC, 0x8000);
+	put_word(0xFFFE, 0xD100);
+	put_word(0xFFFA, 0xD200);
+
+	return 0;
+}
+
+// Best time of BENCH_REPEATS runs of the built ROM on core, in nanoseconds per instruction
+double NES_Bench::time_rom(int core, unsigned long prologue) {
+	NES_Cpu* cpu = new NES_Cpu();
+	if (cpu->load_cpu(&rom[0], rom.size()) <= 16) {
+		delete cpu;
+		return -1;
+	}
+
+	cpu->set_core(core);
+	cpu->reset();
+	cpu->execute(prologue);
+
+	// Once through the body first, so the caches and translated blocks are warm
+	cpu->execute(BENCH_COPIES * 2);
+
+	double best = -1;
+	for (int i = 0; i < BENCH_REPEATS; i++) {
+		auto start = std::chrono::steady_clock::now();
+		cpu->execute(instructions);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (best < 0 || seconds < best) {
+			best = seconds;
+		}
+	}
+
+	delete cpu;
+
+	return best * 1e9 / instructions;
+}
+
+/*
+	State hash after the prologue and instructions more of the built ROM on core, 0 if it didn't load. With reload
+	the run is done again from a state saved halfway into a fresh instance, and 0 is returned when that one ends
+	somewhere else.
+*/
+uint64_t NES_Bench::hash_rom(int core, unsigned long prologue, bool reload) {
+	NES_Cpu* cpu = new NES_Cpu();
+	if (cpu->load_cpu(&rom[0], rom.size()) <= 16) {
+		delete cpu;
+		return 0;
+	}
+
+	cpu->set_core(core);
+	cpu->reset();
+	cpu->execute(prologue + instructions);
+
+	uint64_t hash = cpu->state_hash();
+	delete cpu;
+
+	if (!reload) {
+		return hash;
+	}
+
+	unsigned long half = (prologue + instructions) / 2;
+	std::vector<uint8_t> state(STATE_MAX_SIZE);
+
+	NES_Cpu* saved = new NES_Cpu();
+	saved->load_cpu(&rom[0], rom.size());
+	saved->set_core(core);
+	saved->reset();
+	saved->execute(half);
+	size_t size = saved->save_state(&state[0], state.size());
+	delete saved;
+
+	NES_Cpu* restored = new NES_Cpu();
+	restored->load_cpu(&rom[0], rom.size());
+	restored->set_core(core);
+	if (size == 0 || restored->load_state(&state[0], size)) {
+		delete restored;
+		return 0;
+	}
+
+	restored->execute(prologue + instructions - half);
+	uint64_t reloaded = restored->state_hash();
+	delete restored;
+
+	return reloaded == hash ? hash : 0;
+}
+
+// Every case on every core from first to last, timed or hashed
+void NES_Bench::each_case(int core, bool timed) {
+	int first = core < 0 ? CORE_TABLE : core;
+	int last = core < 0 ? CORE_JIT : core;
+
+	for (int c = first; c <= last; c++) {
+		// Every documented opcode, the undocumented ones are all named ???
+		for (int code = 0; code < 0x100; code++) {
+			const NES_Cpu::instruction_desc* desc = &NES_Cpu::instruction_set[code];
+			if (strcmp(desc->instr_name, "???") == 0) {
+				continue;
+			}
+
+			uint8_t opcode = code;
+			unsigned long prologue = build(&opcode, 1);
+
+			bench_result result;
+			result.core = core_names[c];
+			result.opcode = code;
+			result.name = std::string(desc->instr_name) + "_" + mode_names[desc->addr_mode];
+			result.ns = timed ? time_rom(c, prologue) : -1;
+			result.hash = timed ? 0 : hash_rom(c, prologue, false);
+			results.push_back(result);
+		}
+
+		for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+			unsigned long prologue = build(&mixes[m].opcodes[0], mixes[m].opcodes.size());
+
+			bench_result result;
+			result.core = core_names[c];
+			result.opcode = -1;
+			result.name = std::string("mix_") + mixes[m].name;
+			result.ns = timed ? time_rom(c, prologue) : -1;
+			result.hash = timed ? 0 : hash_rom(c, prologue, false);
+			results.push_back(result);
+		}
+
+		// Interrupts, checked through a state load as well
+		unsigned long prologue = build_irq();
+
+		bench_result result;
+		result.core = core_names[c];
+		result.opcode = -1;
+		result.name = "irq_mmc3";
+		result.ns = timed ? time_rom(c, prologue) : -1;
+		result.hash = timed ? 0 : hash_rom(c, prologue, true);
+		results.push_back(result);
+	}
+}
+
+void NES_Bench::run(int core) {
+	each_case(core, true);
+}
+
+// Returns the number of cases that didn't load or ended elsewhere after a state load
+int NES_Bench::check(int core) {
+	each_case(core, false);
+
+	int failed = 0;
+	for (size_t i = 0; i < results.size(); i++) {
+		if (results[i].hash == 0) {
+			printf("%s %s failed its check\n", results[i].core.c_str(), results[i].name.c_str());
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+// Opcode in hex, -- for the mixes, the NOP opcodes all have the same case name so results are keyed on this
+static std::string opcode_field(const bench_result* result) {
+	char field[8];
+	if (result->opcode < 0) {
+		snprintf(field, sizeof(field), "--");
+	}
+	else {
+		snprintf(field, sizeof(field), "%02X", (unsigned) result->opcode & 0xFF);
+	}
+
+	return field;
+}
+
+static std::string result_key(const bench_result* result) {
+	return result->core + " " + opcode_field(result) + " " + result->name;
+}
+
+int NES_Bench::save(const char* path) {
+	FILE* out = fopen(path, "w");
+	if (out == NULL) {
+		printf("Failed to write benchmark results to %s\n", path);
+		return 1;
+	}
+
+	fprintf(out, "# core opcode case ns/instruction, %lu instructions, best of %d\n", instructions, BENCH_REPEATS);
+	for (size_t i = 0; i < results.size(); i++) {
+		fprintf(out, "%s %s %s %.3f\n", results[i].core.c_str(), opcode_field(&results[i]).c_str(),
+			results[i].name.c_str(), results[i].ns);
+	}
+
+	fclose(out);
+
+	return 0;
+}
+
+int NES_Bench::save_hashes(const char* path) {
+	FILE* out = fopen(path, "w");
+	if (out == NULL) {
+		printf("Failed to write state hashes to %s\n", path);
+		return 1;
+	}
+
+	fprintf(out, "# core opcode case hash, %lu instructions\n", instructions);
+	for (size_t i = 0; i < results.size(); i++) {
+		fprintf(out, "%s %s %s %016llx\n", results[i].core.c_str(), opcode_field(&results[i]).c_str(),
+			results[i].name.c_str(), (unsigned long long) results[i].hash);
+	}
+
+	fclose(out);
+
+	return 0;
+}
+
+/*
+	Prints every case that got slower or faster than the baseline by more than tolerance percent, and the geometric
+	mean of now / baseline for each core. Returns the number of slower cases, cases missing on either side are
+	skipped.
+*/
+int NES_Bench::compare(const char* path, double tolerance) {
+	FILE* in = fopen(path, "r");
+	if (in == NULL) {
+		printf("No baseline at %s, copy a results file there to compare against it\n", path);
+		return 0;
+	}
+
+	std::map<std::string, double> baseline;
+	char line[256];
+	char core[64];
+	char opcode[8];
+	char name[64];
+	double ns;
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (line[0] != '#' && sscanf(line, "%63s %7s %63s %lf", core, opcode, name, &ns) == 4) {
+			baseline[std::string(core) + " " + opcode + " " + name] = ns;
+		}
+	}
+
+	fclose(in);
+
+	int slower = 0;
+	int faster = 0;
+	std::map<std::string, double> log_sum;
+	std::map<std::string, int> cases;
+
+	for (size_t i = 0; i < results.size(); i++) {
+		auto found = baseline.find(result_key(&results[i]));
+		if (found == baseline.end() || found->second <= 0 || results[i].ns <= 0) {
+			continue;
+		}
+
+		double ratio = results[i].ns / found->second;
+		log_sum[results[i].core] += log(ratio);
+		cases[results[i].core]++;
+
+		if (ratio > 1 + tolerance / 100) {
+			printf("slower  %-7s %-3s %-12s %8.3f -> %8.3f ns  %+.1f%%\n", results[i].core.c_str(),
+				opcode_field(&results[i]).c_str(), results[i].name.c_str(),
+				found->second, results[i].ns, (ratio - 1) * 100);
+			slower++;
+		}
+		else if (ratio < 1 - tolerance / 100) {
+			printf("faster  %-7s %-3s %-12s %8.3f -> %8.3f ns  %+.1f%%\n", results[i].core.c_str(),
+				opcode_field(&results[i]).c_str(), results[i].name.c_str(),
+				found->second, results[i].ns, (ratio - 1) * 100);
+			faster++;
+		}
+	}
+
+	for (auto i = cases.begin(); i != cases.end(); i++) {
+		printf("%-7s %d cases, %.3fx the baseline time\n", i->first.c_str(), i->second, exp(log_sum[i->first] / i->second));
+	}
+
+	printf("%d slower and %d faster than %s by more than %.0f%%\n", slower, faster, path, tolerance);
+
+	return slower;
+}
+
+void NES_Bench::report() {
+	for (size_t i = 0; i < results.size(); i++) {
+		printf("%-7s %-3s %-12s %8.3f ns\n", results[i].core.c_str(), opcode_field(&results[i]).c_str(),
+			results[i].name.c_str(), results[i].ns);
+	}
+}
@@ -0,0 +1,1191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "NES.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// The recompiler emits x86-64 code, other hosts only get the interpreters
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_HOST 1
+#else
+#define JIT_HOST 0
+#endif
+
+// Offset of a register inside the CPU, the translated code addresses everything relative to the CPU pointer in rbx
+#define CPU_OFFSET(cpu, member) ((int32_t)((uint8_t*)&(cpu)->member - (uint8_t*)(cpu)))
+
+// x86 register numbers for the ModRM fields
+#define REGISTER_EAX	0
+#define REGISTER_ECX	1
+#define REGISTER_EDX	2
+#define REGISTER_DL		2
+#define REGISTER_AH		4
+#define REGISTER_EBP	5
+
+
+// Initialization
+NES_Jit::NES_Jit() {
+	flush_pending = 0;
+	used = 0;
+	stubs_end = 0;
+	enter = NULL;
+	exit_code = NULL;
+	emit_position = NULL;
+	call_pc = 0;
+	call_opcode = 0;
+	buffer = NULL;
+
+#if JIT_HOST
+#if defined(_WIN32)
+	buffer = (uint8_t*) VirtualAlloc(NULL, JIT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	void* mapping = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping != MAP_FAILED) {
+		buffer = (uint8_t*) mapping;
+	}
+#endif
+#endif
+
+	flush();
+}
+
+// Destruction
+NES_Jit::~NES_Jit() {
+	if (buffer == NULL) {
+		return;
+	}
+
+#if defined(_WIN32)
+	VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+	munmap(buffer, JIT_BUFFER_SIZE);
+#endif
+}
+
+bool NES_Jit::available() {
+	return buffer != NULL;
+}
+
+const uint8_t* NES_Jit::lookup(uint16_t address) {
+	return entries[address];
+}
+
+unsigned long NES_Jit::run(NES_Cpu* cpu, unsigned long count, const uint8_t* code) {
+	return enter(cpu, count, code);
+}
+
+bool NES_Jit::covers(uint16_t first, uint16_t last) {
+	for (uint32_t address = first; address <= last; address++) {
+		if (block_bitmap[address >> 3] == 0) {
+			address |= 0x07;
+			continue;
+		}
+
+		if (block_bitmap[address >> 3] & (1 << (address & 0x07))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The entry and exit stubs at the start of the buffer stay
+void NES_Jit::flush() {
+	memset(entries, 0, sizeof(entries));
+	memset(block_bitmap, 0, sizeof(block_bitmap));
+	used = stubs_end;
+	flush_pending = 0;
+}
+
+
+/*
+	x86-64 code emission
+
+	The CPU pointer lives in rbx for the whole block, registers are read and written in place through [rbx + disp32].
+	r12 holds the instructions left to run, r13 points at entries, r14 holds cycle_count and r15 core_limit. rbp holds
+	the address of a memory operand. rax, rcx and rdx are scratch.
+*/
+void NES_Jit::emit(uint8_t byte) {
+	*emit_position++ = byte;
+}
+
+void NES_Jit::emit32(uint32_t value) {
+	memcpy(emit_position, &value, 4);
+	emit_position += 4;
+}
+
+void NES_Jit::emit64(uint64_t value) {
+	memcpy(emit_position, &value, 8);
+	emit_position += 8;
+}
+
+// mov byte [rbx + offset], value
+void NES_Jit::emit_store8(int32_t offset, uint8_t value) {
+	emit(0xC6); emit(0x83); emit32(offset); emit(value);
+}
+
+// mov word [rbx + offset], value
+void NES_Jit::emit_store16(int32_t offset, uint16_t value) {
+	emit(0x66); emit(0xC7); emit(0x83); emit32(offset);
+	emit(value & 0x00FF); emit(value >> 8);
+}
+
+// and byte [rbx + offset], value
+void NES_Jit::emit_and8(int32_t offset, uint8_t value) {
+	emit(0x80); emit(0xA3); emit32(offset); emit(value);
+}
+
+// or byte [rbx + offset], value
+void NES_Jit::emit_or8(int32_t offset, uint8_t value) {
+	emit(0x80); emit(0x8B); emit32(offset); emit(value);
+}
+
+// mov al, byte [rbx + offset]
+void NES_Jit::emit_load_al(int32_t offset) {
+	emit(0x8A); emit(0x83); emit32(offset);
+}
+
+// mov byte [rbx + offset], al
+void NES_Jit::emit_store_al(int32_t offset) {
+	emit(0x88); emit(0x83); emit32(offset);
+}
+
+// Set N and Z from al, without branches
+void NES_Jit::emit_flags_nz(NES_Cpu* cpu) {
+#if LAZY_FLAGS
+	emit_store_al(CPU_OFFSET(cpu, flag_n));
+	emit_store_al(CPU_OFFSET(cpu, flag_z));
+#else
+	int32_t status_offset = CPU_OFFSET(cpu, proc_status);
+
+	emit(0x88); emit(0xC1);								// mov cl, al
+	emit(0x80); emit(0xE1); emit(NEGATIVE_FLAG);		// and cl, NEGATIVE_FLAG
+	emit(0x84); emit(0xC0);								// test al, al
+	emit(0x0F); emit(0x94); emit(0xC2);					// sete dl
+	emit(0x00); emit(0xD2);								// add dl, dl (ZERO_FLAG)
+	emit(0x08); emit(0xD1);								// or cl, dl
+	emit_and8(status_offset, (uint8_t) ~(NEGATIVE_FLAG | ZERO_FLAG));
+	emit(0x08); emit(0x8B); emit32(status_offset);		// or byte [rbx + status], cl
+#endif
+}
+
+// Call a decoded handler with the CPU and the operand
+void NES_Jit::emit_call(void* function, uint16_t operand) {
+#if defined(_WIN32)
+	emit(0x48); emit(0x89); emit(0xD9);					// mov rcx, rbx
+	emit(0xBA); emit32(operand);						// mov edx, operand
+#else
+	emit(0x48); emit(0x89); emit(0xDF);					// mov rdi, rbx
+	emit(0xBE); emit32(operand);						// mov esi, operand
+#endif
+	emit(0x48); emit(0xB8); emit64((uint64_t) function);	// mov rax, function
+	emit(0xFF); emit(0xD0);								// call rax
+}
+
+// cycle_count and core_limit into r14 and r15, after anything that may have moved them
+void NES_Jit::emit_load_cycles(NES_Cpu* cpu) {
+	emit(0x4C); emit(0x8B); emit(0xB3); emit32(CPU_OFFSET(cpu, cycle_count));	// mov r14, [rbx + cycle_count]
+	emit(0x4C); emit(0x8B); emit(0xBB); emit32(CPU_OFFSET(cpu, core_limit));	// mov r15, [rbx + core_limit]
+}
+
+// r14 back into cycle_count, before anything that reads it
+void NES_Jit::emit_store_cycles(NES_Cpu* cpu) {
+	emit(0x4C); emit(0x89); emit(0xB3); emit32(CPU_OFFSET(cpu, cycle_count));	// mov [rbx + cycle_count], r14
+}
+
+/*
+	Shared entry and exit
+
+	enter(cpu, count, code) saves the registers the translated code uses, loads them and jumps to code. Every way out of
+	a block ends up in exit_code, which stores cycle_count and returns the instructions left. Both are emitted once at
+	the start of the buffer, the CPU offsets are the same for every instance.
+*/
+void NES_Jit::emit_stubs(NES_Cpu* cpu) {
+	emit_position = buffer;
+	enter = (jit_entry) emit_position;
+
+	emit(0x53);											// push rbx
+	emit(0x55);											// push rbp
+	emit(0x41); emit(0x54);								// push r12
+	emit(0x41); emit(0x55);								// push r13
+	emit(0x41); emit(0x56);								// push r14
+	emit(0x41); emit(0x57);								// push r15
+#if defined(_WIN32)
+	emit(0x48); emit(0x83); emit(0xEC); emit(0x28);		// sub rsp, 40, shadow space for the calls
+	emit(0x48); emit(0x89); emit(0xCB);					// mov rbx, rcx
+	emit(0x41); emit(0x89); emit(0xD4);					// mov r12d, edx
+#else
+	emit(0x48); emit(0x83); emit(0xEC); emit(0x08);		// sub rsp, 8, keeps the calls aligned
+	emit(0x48); emit(0x89); emit(0xFB);					// mov rbx, rdi
+	emit(0x49); emit(0x89); emit(0xF4);					// mov r12, rsi
+#endif
+	emit(0x49); emit(0xBD); emit64((uint64_t) entries);	// mov r13, entries
+	emit_load_cycles(cpu);
+	emit_store8(CPU_OFFSET(cpu, use_accumulator), 0);
+#if defined(_WIN32)
+	emit(0x41); emit(0xFF); emit(0xE0);					// jmp r8
+#else
+	emit(0xFF); emit(0xE2);								// jmp rdx
+#endif
+
+	exit_code = emit_position;
+	emit_store_cycles(cpu);
+	emit(0x4C); emit(0x89); emit(0xE0);					// mov rax, r12
+#if defined(_WIN32)
+	emit(0x48); emit(0x83); emit(0xC4); emit(0x28);		// add rsp, 40
+#else
+	emit(0x48); emit(0x83); emit(0xC4); emit(0x08);		// add rsp, 8
+#endif
+	emit(0x41); emit(0x5F);								// pop r15
+	emit(0x41); emit(0x5E);								// pop r14
+	emit(0x41); emit(0x5D);								// pop r13
+	emit(0x41); emit(0x5C);								// pop r12
+	emit(0x5D);											// pop rbp
+	emit(0x5B);											// pop rbx
+	emit(0xC3);											// ret
+
+	stubs_end = ((emit_position - buffer) + 15) & ~(size_t)15;
+}
+
+/*
+	Exits
+
+	The jumps out of a block go to stubs emitted after its code, which store what the boundary they leave on still
+	needs and continue to exit_code. condition is the second byte of a jcc rel32 (0x84 je, 0x83 jae, 0x85 jne), 0
+	for a plain jmp.
+*/
+int NES_Jit::add_exit(uint16_t pc, uint8_t opcode, bool store_pc, uint8_t cycles) {
+	jit_exit exit;
+	exit.jump_count = 0;
+	exit.pc = pc;
+	exit.opcode = opcode;
+	exit.store_pc = store_pc;
+	exit.cycles = cycles;
+
+	exits.push_back(exit);
+	return exits.size() - 1;
+}
+
+void NES_Jit::emit_jump_exit(int exit, uint8_t condition) {
+	if (condition == 0) {
+		emit(0xE9);										// jmp rel32
+	}
+	else {
+		emit(0x0F); emit(condition);					// jcc rel32
+	}
+
+	exits[exit].jumps[exits[exit].jump_count++] = emit_position;
+	emit32(0);
+}
+
+// Count the instruction that just ran and leave if that was the last one or cycle_count reached core_limit
+void NES_Jit::emit_boundary(uint8_t cycles, int exit) {
+	emit(0x49); emit(0x83); emit(0xC6); emit(cycles);	// add r14, cycles
+	emit(0x49); emit(0x83); emit(0xEC); emit(0x01);		// sub r12, 1
+	emit_jump_exit(exit, 0x84);							// je exit
+	emit(0x4D); emit(0x39); emit(0xFE);					// cmp r14, r15
+	emit_jump_exit(exit, 0x83);							// jae exit
+}
+
+// Leave right after the instruction that just ran if it wrote over translated code, its boundary is still to come
+void NES_Jit::emit_exit_if_flushed(int exit) {
+	emit(0x48); emit(0xB8); emit64((uint64_t) &flush_pending);	// mov rax, &flush_pending
+	emit(0x83); emit(0x38); emit(0x00);					// cmp dword [rax], 0
+	emit_jump_exit(exit, 0x85);							// jne exit
+}
+
+void NES_Jit::emit_exits(NES_Cpu* cpu) {
+	for (size_t i = 0; i < exits.size(); i++) {
+		const jit_exit* exit = &exits[i];
+
+		for (int j = 0; j < exit->jump_count; j++) {
+			int32_t distance = (int32_t)(emit_position - (exit->jumps[j] + 4));
+			memcpy(exit->jumps[j], &distance, 4);
+		}
+
+		if (exit->cycles) {
+			emit(0x49); emit(0x83); emit(0xC6); emit(exit->cycles);	// add r14, cycles
+			emit(0x49); emit(0x83); emit(0xEC); emit(0x01);		// sub r12, 1
+		}
+		if (exit->store_pc) {
+			emit_store16(CPU_OFFSET(cpu, pc), exit->pc);
+			emit_store8(CPU_OFFSET(cpu, opcode), exit->opcode);
+		}
+
+		emit(0xE9); emit32((uint32_t)(exit_code - (emit_position + 4)));	// jmp exit_code
+	}
+}
+
+/*
+	Operand access
+
+	Memory instructions find their operand the way the addressing modes in 2A03.cpp do. A zero page or absolute operand
+	in internal RAM is a single load or store at a known offset of ram. Every address ends up in ebp, which survives the
+	calls, and in target_address, as the addressing modes leave it. Addresses that can be anything go through
+	read_pages and write_pages like read() and write(), device pages and writes that land on decoded code call
+	bus_read and bus_write with cycle_count stored, the same as a handler would. A write through the bus can switch
+	banks or write over translated code, so it leaves through exit when flush_pending is set after it.
+*/
+
+// ModRM and disp32 of [rbx + offset], reg is the register field
+void NES_Jit::emit_cpu_operand(uint8_t reg, int32_t offset) {
+	emit(0x83 | (reg << 3)); emit32(offset);
+}
+
+// ModRM, SIB and disp32 of [rbx + index + offset]
+void NES_Jit::emit_cpu_indexed(uint8_t reg, uint8_t index, int32_t offset) {
+	emit(0x84 | (reg << 3)); emit((index << 3) | 0x03); emit32(offset);
+}
+
+/*
+	The slow paths are emitted after the block like the exits, so the accesses that don't need them run straight
+	through. add_call() starts one for the instruction being translated, emit_jump_call() jumps to it and resume is
+	where it comes back.
+*/
+int NES_Jit::add_call(bool write, int exit) {
+	jit_call call;
+	call.jump_count = 0;
+	call.resume = NULL;
+	call.write = write;
+	call.pc = call_pc;
+	call.opcode = call_opcode;
+	call.exit = exit;
+
+	calls.push_back(call);
+	return calls.size() - 1;
+}
+
+void NES_Jit::emit_jump_call(int call, uint8_t condition) {
+	emit(0x0F); emit(condition);						// jcc rel32
+	calls[call].jumps[calls[call].jump_count++] = emit_position;
+	emit32(0);
+}
+
+// Carry from the x86 flags, condition is the second byte of a setcc (0x92 setc, 0x93 setnc)
+void NES_Jit::emit_flag_carry(NES_Cpu* cpu, uint8_t condition) {
+#if LAZY_FLAGS
+	emit(0x0F); emit(condition); emit_cpu_operand(0, CPU_OFFSET(cpu, flag_c));	// setcc [rbx + flag_c]
+#else
+	int32_t status_offset = CPU_OFFSET(cpu, proc_status);
+
+	emit(0x0F); emit(condition); emit(0xC2);			// setcc dl
+	emit_and8(status_offset, (uint8_t) ~CARRY_FLAG);
+	emit(0x08); emit_cpu_operand(REGISTER_DL, status_offset);	// or byte [rbx + status], dl
+#endif
+}
+
+// The slow paths of the block, they leave the CPU as a handler call would
+void NES_Jit::emit_calls(NES_Cpu* cpu) {
+	for (size_t i = 0; i < calls.size(); i++) {
+		const jit_call* call = &calls[i];
+
+		for (int j = 0; j < call->jump_count; j++) {
+			int32_t distance = (int32_t)(emit_position - (call->jumps[j] + 4));
+			memcpy(call->jumps[j], &distance, 4);
+		}
+
+		emit_store16(CPU_OFFSET(cpu, pc), call->pc);
+		emit_store8(CPU_OFFSET(cpu, opcode), call->opcode);
+		emit_bus_call(cpu, call->write);
+		if (call->exit >= 0) {
+			emit_exit_if_flushed(call->exit);
+		}
+
+		emit(0xE9); emit32((uint32_t)(call->resume - (emit_position + 4)));	// jmp resume
+	}
+}
+
+// bus_read(cpu, ebp) into cl or bus_write(cpu, ebp, al), with cycle_count stored and reloaded around it
+void NES_Jit::emit_bus_call(NES_Cpu* cpu, bool write) {
+	emit_store_cycles(cpu);
+#if defined(_WIN32)
+	if (write) {
+		emit(0x44); emit(0x0F); emit(0xB6); emit(0xC0);	// movzx r8d, al
+	}
+	emit(0x48); emit(0x89); emit(0xD9);					// mov rcx, rbx
+	emit(0x89); emit(0xEA);								// mov edx, ebp
+#else
+	if (write) {
+		emit(0x0F); emit(0xB6); emit(0xD0);				// movzx edx, al
+	}
+	emit(0x48); emit(0x89); emit(0xDF);					// mov rdi, rbx
+	emit(0x89); emit(0xEE);								// mov esi, ebp
+#endif
+	void* function = write ? (void*) &NES_Cpu::bus_write : (void*) &NES_Cpu::bus_read;
+	emit(0x48); emit(0xB8); emit64((uint64_t) function);	// mov rax, function
+	emit(0xFF); emit(0xD0);								// call rax
+	if (!write) {
+		emit(0x89); emit(0xC1);							// mov ecx, eax
+	}
+	emit_load_cycles(cpu);
+}
+
+// mov ebp, address and target_address = bp
+void NES_Jit::emit_target(NES_Cpu* cpu, uint16_t address) {
+	emit(0xBD); emit32(address);						// mov ebp, address
+	emit(0x66); emit(0x89); emit_cpu_operand(REGISTER_EBP, CPU_OFFSET(cpu, target_address));	// mov word [rbx + target_address], bp
+}
+
+/*
+	Emits what the addressing mode computes and returns where the operand is, -1 for modes that need the handler.
+	constant is the operand byte of ACCESS_IMMEDIATE and the address of ACCESS_RAM. The implied shifts work on
+	target_address as the instruction before left it, which isn't known here since any instruction can be entered.
+*/
+int NES_Jit::emit_address(NES_Cpu* cpu, uint8_t mode, uint16_t operand, uint16_t address, uint16_t* constant) {
+	int32_t ram = CPU_OFFSET(cpu, ram);
+	int32_t x = CPU_OFFSET(cpu, X);
+	int32_t y = CPU_OFFSET(cpu, Y);
+	int32_t target_offset = CPU_OFFSET(cpu, target_address);
+	int access = ACCESS_BUS;
+
+	switch (mode) {
+		case MODE_IMM:
+			emit_target(cpu, address + 1);
+			*constant = operand & 0x00FF;
+			return ACCESS_IMMEDIATE;
+
+		case MODE_ZPG:
+		case MODE_ABS:
+			emit_target(cpu, operand);
+			*constant = operand;
+			return operand < 0x2000 ? ACCESS_RAM : ACCESS_BUS;
+
+		case MODE_IMP:
+			emit(0x0F); emit(0xB7); emit_cpu_operand(REGISTER_EBP, target_offset);	// movzx ebp, word [rbx + target_address]
+			return ACCESS_BUS;
+
+		case MODE_ZPG_X:
+		case MODE_ZPG_Y:
+			emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_EBP, mode == MODE_ZPG_X ? x : y);	// movzx ebp, byte [rbx + index]
+			emit(0x81); emit(0xC5); emit32(operand);	// add ebp, operand
+			emit(0x81); emit(0xE5); emit32(0x00FF);		// and ebp, 0xFF
+			access = ACCESS_ZERO_PAGE;
+			break;
+
+		case MODE_ABS_X:
+		case MODE_ABS_Y:
+			emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_EBP, mode == MODE_ABS_X ? x : y);	// movzx ebp, byte [rbx + index]
+			emit(0x81); emit(0xC5); emit32(operand);	// add ebp, operand
+			emit(0x81); emit(0xE5); emit32(0xFFFF);		// and ebp, 0xFFFF
+			access = operand + 0x00FF < 0x2000 ? ACCESS_RAM_INDEXED : ACCESS_BUS;
+			break;
+
+		case MODE_IND_X:
+			// The pointer is at operand + X without wrapping, so both its bytes are in internal RAM
+			emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_EAX, x);	// movzx eax, byte [rbx + X]
+			emit(0x05); emit32(operand);				// add eax, operand
+			emit(0x0F); emit(0xB6); emit_cpu_indexed(REGISTER_EBP, REGISTER_EAX, ram + 1);	// movzx ebp, byte [rbx + rax + ram + 1]
+			emit(0xC1); emit(0xE5); emit(0x08);			// shl ebp, 8
+			emit(0x0F); emit(0xB6); emit_cpu_indexed(REGISTER_ECX, REGISTER_EAX, ram);	// movzx ecx, byte [rbx + rax + ram]
+			emit(0x09); emit(0xCD);						// or ebp, ecx
+			break;
+
+		case MODE_IND_Y:
+			emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_EBP, ram + operand + 1);	// movzx ebp, byte [rbx + ram + operand + 1]
+			emit(0xC1); emit(0xE5); emit(0x08);			// shl ebp, 8
+			emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_ECX, ram + operand);	// movzx ecx, byte [rbx + ram + operand]
+			emit(0x09); emit(0xCD);						// or ebp, ecx
+			emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_ECX, y);	// movzx ecx, byte [rbx + Y]
+			emit(0x01); emit(0xCD);						// add ebp, ecx
+			emit(0x81); emit(0xE5); emit32(0xFFFF);		// and ebp, 0xFFFF
+			break;
+
+		default:
+			return -1;
+	}
+
+	emit(0x66); emit(0x89); emit_cpu_operand(REGISTER_EBP, target_offset);	// mov word [rbx + target_address], bp
+	return access;
+}
+
+// The extra cycle of a read that crossed a page, leaves cl alone
+void NES_Jit::emit_page_cross(NES_Cpu* cpu, uint8_t mode, uint16_t operand) {
+	if (mode == MODE_ABS_X || mode == MODE_ABS_Y) {
+		int32_t index = mode == MODE_ABS_X ? CPU_OFFSET(cpu, X) : CPU_OFFSET(cpu, Y);
+
+		emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_EAX, index);	// movzx eax, byte [rbx + index]
+		emit(0x04); emit(operand & 0x00FF);				// add al, low byte of operand
+	}
+	else if (mode == MODE_IND_Y) {
+		emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_EAX, CPU_OFFSET(cpu, ram) + operand);	// movzx eax, byte [rbx + ram + operand]
+		emit(0x02); emit_cpu_operand(REGISTER_EAX, CPU_OFFSET(cpu, Y));	// add al, [rbx + Y]
+	}
+	else {
+		return;
+	}
+	emit(0x49); emit(0x83); emit(0xD6); emit(0x00);		// adc r14, 0
+}
+
+// Operand into cl
+void NES_Jit::emit_fetch(NES_Cpu* cpu, int access, uint16_t constant) {
+	int32_t ram = CPU_OFFSET(cpu, ram);
+
+	switch (access) {
+		case ACCESS_IMMEDIATE:
+			emit(0xB1); emit(constant);					// mov cl, constant
+			return;
+
+		case ACCESS_RAM:
+			emit(0x8A); emit_cpu_operand(REGISTER_ECX, ram + (constant & 0x07FF));	// mov cl, [rbx + ram + address]
+			return;
+
+		case ACCESS_ZERO_PAGE:
+			emit(0x8A); emit_cpu_indexed(REGISTER_ECX, REGISTER_EBP, ram);	// mov cl, [rbx + rbp + ram]
+			return;
+
+		case ACCESS_RAM_INDEXED:
+			emit(0x89); emit(0xE8);						// mov eax, ebp
+			emit(0x25); emit32(0x07FF);					// and eax, 0x7FF
+			emit(0x8A); emit_cpu_indexed(REGISTER_ECX, REGISTER_EAX, ram);	// mov cl, [rbx + rax + ram]
+			return;
+	}
+
+	emit(0x89); emit(0xE8);								// mov eax, ebp
+	emit(0xC1); emit(0xE8); emit(0x08);					// shr eax, 8
+	emit(0x48); emit(0x8B); emit(0x84); emit(0xC3); emit32(CPU_OFFSET(cpu, read_pages));	// mov rax, [rbx + rax * 8 + read_pages]
+	emit(0x48); emit(0x85); emit(0xC0);					// test rax, rax
+	int call = add_call(false, -1);
+	emit_jump_call(call, 0x84);							// jz call
+	emit(0x40); emit(0x0F); emit(0xB6); emit(0xCD);		// movzx ecx, bpl
+	emit(0x8A); emit(0x0C); emit(0x08);					// mov cl, [rax + rcx]
+	calls[call].resume = emit_position;
+}
+
+// al to the operand, exit is where a bus write that set flush_pending leaves
+void NES_Jit::emit_write(NES_Cpu* cpu, int access, uint16_t constant, int exit) {
+	int32_t ram = CPU_OFFSET(cpu, ram);
+	int32_t bitmap = CPU_OFFSET(cpu, code_bitmap);
+	int call = add_call(true, access == ACCESS_BUS ? exit : -1);
+
+	if (access == ACCESS_RAM) {
+		emit(0xF6); emit_cpu_operand(0, bitmap + (constant >> 3)); emit(1 << (constant & 0x07));	// test byte [rbx + code_bitmap + address / 8], bit
+		emit_jump_call(call, 0x85);						// jnz call
+		emit(0x88); emit_cpu_operand(REGISTER_EAX, ram + (constant & 0x07FF));	// mov [rbx + ram + address], al
+	}
+	else {
+		if (access == ACCESS_BUS) {
+			emit(0x89); emit(0xE9);						// mov ecx, ebp
+			emit(0xC1); emit(0xE9); emit(0x08);			// shr ecx, 8
+			emit(0x48); emit(0x8B); emit(0x8C); emit(0xCB); emit32(CPU_OFFSET(cpu, write_pages));	// mov rcx, [rbx + rcx * 8 + write_pages]
+			emit(0x48); emit(0x85); emit(0xC9);			// test rcx, rcx
+			emit_jump_call(call, 0x84);					// jz call
+		}
+
+		// Any decoded byte next to the address sends it the slow way
+		emit(0x89); emit(0xEA);							// mov edx, ebp
+		emit(0xC1); emit(0xEA); emit(0x03);				// shr edx, 3
+		emit(0x80); emit_cpu_indexed(7, REGISTER_EDX, bitmap); emit(0x00);	// cmp byte [rbx + rdx + code_bitmap], 0
+		emit_jump_call(call, 0x85);						// jne call
+
+		if (access == ACCESS_BUS) {
+			emit(0x40); emit(0x0F); emit(0xB6); emit(0xD5);	// movzx edx, bpl
+			emit(0x88); emit(0x04); emit(0x11);			// mov [rcx + rdx], al
+		}
+		else if (access == ACCESS_ZERO_PAGE) {
+			emit(0x88); emit_cpu_indexed(REGISTER_EAX, REGISTER_EBP, ram);	// mov [rbx + rbp + ram], al
+		}
+		else {
+			emit(0x89); emit(0xEA);						// mov edx, ebp
+			emit(0x81); emit(0xE2); emit32(0x07FF);		// and edx, 0x7FF
+			emit(0x88); emit_cpu_indexed(REGISTER_EAX, REGISTER_EDX, ram);	// mov [rbx + rdx + ram], al
+		}
+	}
+
+	calls[call].resume = emit_position;
+}
+
+/*
+	Native translations
+
+	Register transfers, flag changes and the instructions that load, store, combine or change their operand are emitted
+	directly and match the instruction functions in 2A03.cpp bit for bit, the operand is in cl once fetched. Returns
+	false when the instruction needs its handler.
+*/
+bool NES_Jit::emit_native(NES_Cpu* cpu, const decoded_entry* entry, uint16_t address) {
+	const NES_Cpu::instruction_desc* desc = &NES_Cpu::instruction_set[entry->opcode];
+	uint16_t operand = entry->operand;
+
+	int32_t accumulator = CPU_OFFSET(cpu, accumulator);
+	int32_t x = CPU_OFFSET(cpu, X);
+	int32_t y = CPU_OFFSET(cpu, Y);
+	int32_t sp = CPU_OFFSET(cpu, sp);
+	int32_t status = CPU_OFFSET(cpu, proc_status);
+
+	// Register receiving an immediate load
+	bool immediate_load = false;
+	int32_t load_target = 0;
+
+	// Source and destination of a transfer, increment or decrement
+	int32_t source = 0;
+	int32_t destination = 0;
+	int change = 0;
+	bool set_flags = true;
+
+	switch (desc->operation) {
+#if LAZY_FLAGS
+		case OP_CLC: emit_store8(CPU_OFFSET(cpu, flag_c), 0); return true;
+		case OP_CLV: emit_store8(CPU_OFFSET(cpu, flag_v), 0); return true;
+		case OP_SEC: emit_store8(CPU_OFFSET(cpu, flag_c), 1); return true;
+#else
+		case OP_CLC: emit_and8(status, (uint8_t) ~CARRY_FLAG); return true;
+		case OP_CLV: emit_and8(status, (uint8_t) ~OVERFLOW_FLAG); return true;
+		case OP_SEC: emit_or8(status, CARRY_FLAG); return true;
+#endif
+		case OP_CLD: emit_and8(status, (uint8_t) ~DECIMAL_FLAG); return true;
+		case OP_SED: emit_or8(status, DECIMAL_FLAG); return true;
+		case OP_SEI: emit_or8(status, DISABLE_FLAG); return true;
+
+		case OP_NOP:
+		case OP_ILL:
+			return desc->addr_mode == MODE_IMP;
+
+		case OP_LDA: immediate_load = true; load_target = accumulator; break;
+		case OP_LDX: immediate_load = true; load_target = x; break;
+		case OP_LDY: immediate_load = true; load_target = y; break;
+
+		case OP_TAX: source = accumulator; destination = x; break;
+		case OP_TAY: source = accumulator; destination = y; break;
+		case OP_TXA: source = x; destination = accumulator; break;
+		case OP_TYA: source = y; destination = accumulator; break;
+		case OP_TSX: source = sp; destination = x; break;
+		case OP_TXS: source = x; destination = sp; set_flags = false; break;
+
+		case OP_INX: source = x; destination = x; change = 1; break;
+		case OP_INY: source = y; destination = y; change = 1; break;
+		case OP_DEX: source = x; destination = x; change = -1; break;
+		case OP_DEY: source = y; destination = y; change = -1; break;
+
+		case OP_PHA:
+			emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_EBP, sp);	// movzx ebp, byte [rbx + sp]
+			emit(0x81); emit(0xCD); emit32(STACK_OFFSET);	// or ebp, STACK_OFFSET
+			emit_load_al(accumulator);
+			emit_write(cpu, ACCESS_RAM_INDEXED, 0, -1);
+			emit(0xFE); emit_cpu_operand(1, sp);		// dec byte [rbx + sp]
+			return true;
+
+		case OP_PLA:
+			emit(0xFE); emit_cpu_operand(0, sp);		// inc byte [rbx + sp]
+			emit(0x0F); emit(0xB6); emit_cpu_operand(REGISTER_EAX, sp);	// movzx eax, byte [rbx + sp]
+			emit(0x8A); emit_cpu_indexed(REGISTER_EAX, REGISTER_EAX, CPU_OFFSET(cpu, ram) + STACK_OFFSET);	// mov al, [rbx + rax + ram + STACK_OFFSET]
+			emit_store_al(accumulator);
+			emit_flags_nz(cpu);
+			return true;
+
+		default:
+			return emit_memory(cpu, entry, address);
+	}
+
+	// Immediate loads have their value and flags known at translation time
+	if (immediate_load) {
+		if (desc->addr_mode != MODE_IMM) {
+			return emit_memory(cpu, entry, address);
+		}
+
+		uint8_t value = operand & 0x00FF;
+
+		emit_target(cpu, address + 1);
+		emit_store8(load_target, value);
+#if LAZY_FLAGS
+		emit_store8(CPU_OFFSET(cpu, flag_n), value);
+		emit_store8(CPU_OFFSET(cpu, flag_z), value);
+#else
+		uint8_t flags = (value & NEGATIVE_FLAG) | (value == 0 ? ZERO_FLAG : 0);
+
+		emit_and8(status, (uint8_t) ~(NEGATIVE_FLAG | ZERO_FLAG));
+		if (flags) {
+			emit_or8(status, flags);
+		}
+#endif
+
+		return true;
+	}
+
+	emit_load_al(source);
+	if (change == 1) {
+		emit(0xFE); emit(0xC0);							// inc al
+	}
+	else if (change == -1) {
+		emit(0xFE); emit(0xC8);							// dec al
+	}
+	emit_store_al(destination);
+
+	if (set_flags) {
+		emit_flags_nz(cpu);
+	}
+
+	return true;
+}
+
+// Instructions with an operand in memory, false for the ones left to their handler
+bool NES_Jit::emit_memory(NES_Cpu* cpu, const decoded_entry* entry, uint16_t address) {
+	const NES_Cpu::instruction_desc* desc = &NES_Cpu::instruction_set[entry->opcode];
+	uint8_t mode = desc->addr_mode;
+
+	int32_t accumulator = CPU_OFFSET(cpu, accumulator);
+	int32_t x = CPU_OFFSET(cpu, X);
+	int32_t y = CPU_OFFSET(cpu, Y);
+#if !LAZY_FLAGS
+	int32_t status = CPU_OFFSET(cpu, proc_status);
+#endif
+
+	// What the operation does with the operand, page_cycle for the ones whose function returns 1
+	bool reads = false;
+	bool writes = false;
+	bool page_cycle = false;
+	int32_t reg = accumulator;
+
+	switch (desc->operation) {
+		case OP_LDA: case OP_ADC: case OP_SBC: case OP_AND: case OP_ORA: case OP_EOR: case OP_CMP:
+			reads = true;
+			page_cycle = true;
+			break;
+		case OP_LDX: reads = true; page_cycle = true; reg = x; break;
+		case OP_LDY: reads = true; page_cycle = true; reg = y; break;
+		case OP_BIT: reads = true; break;
+		case OP_CPX: reads = true; reg = x; break;
+		case OP_CPY: reads = true; reg = y; break;
+		case OP_STA: writes = true; break;
+		case OP_STX: writes = true; reg = x; break;
+		case OP_STY: writes = true; reg = y; break;
+		case OP_INC: case OP_DEC: case OP_ASL: case OP_LSR: case OP_ROL: case OP_ROR:
+			reads = true;
+			writes = true;
+			break;
+		default:
+			return false;
+	}
+
+	if (mode == MODE_IMP && desc->operation != OP_ASL && desc->operation != OP_LSR && desc->operation != OP_ROL
+		&& desc->operation != OP_ROR) {
+		return false;
+	}
+
+	uint16_t constant = 0;
+	int access = emit_address(cpu, mode, entry->operand, address, &constant);
+	if (access < 0) {
+		return false;
+	}
+
+	// A write through the bus leaves with the instruction done but its boundary still to come
+	int exit = -1;
+	if (writes && access == ACCESS_BUS) {
+		exit = add_exit(address + 1 + entry->length, entry->opcode, true, entry->cycles);
+	}
+
+	if (!reads) {
+		emit_load_al(reg);
+		emit_write(cpu, access, constant, exit);
+		return true;
+	}
+
+	emit_fetch(cpu, access, constant);
+
+	switch (desc->operation) {
+		case OP_LDA:
+		case OP_LDX:
+		case OP_LDY:
+			emit(0x88); emit_cpu_operand(REGISTER_ECX, reg);	// mov [rbx + reg], cl
+			emit(0x88); emit(0xC8);						// mov al, cl
+			emit_flags_nz(cpu);
+			break;
+
+		case OP_AND:
+		case OP_ORA:
+		case OP_EOR:
+			emit_load_al(accumulator);
+			emit(desc->operation == OP_AND ? 0x20 : desc->operation == OP_ORA ? 0x08 : 0x30); emit(0xC8);	// and / or / xor al, cl
+			emit_store_al(accumulator);
+			emit_flags_nz(cpu);
+			break;
+
+		case OP_ADC:
+			emit_load_al(accumulator);
+#if LAZY_FLAGS
+			emit(0x8A); emit_cpu_operand(REGISTER_EDX, CPU_OFFSET(cpu, flag_c));	// mov dl, [rbx + flag_c]
+#else
+			emit(0x8A); emit_cpu_operand(REGISTER_EDX, status);	// mov dl, [rbx + status]
+#endif
+			emit(0xD0); emit(0xEA);						// shr dl, 1, the carry into CF
+			emit(0x10); emit(0xC8);						// adc al, cl
+#if LAZY_FLAGS
+			emit(0x0F); emit(0x92); emit_cpu_operand(0, CPU_OFFSET(cpu, flag_c));	// setc [rbx + flag_c]
+			emit(0x0F); emit(0x90); emit_cpu_operand(0, CPU_OFFSET(cpu, flag_v));	// seto [rbx + flag_v]
+#else
+			emit(0x0F); emit(0x92); emit(0xC2);			// setc dl
+			emit(0x0F); emit(0x90); emit(0xC1);			// seto cl
+			emit(0xC0); emit(0xE1); emit(0x06);			// shl cl, 6 (OVERFLOW_FLAG)
+			emit(0x08); emit(0xCA);						// or dl, cl
+			emit_and8(status, (uint8_t) ~(CARRY_FLAG | OVERFLOW_FLAG));
+			emit(0x08); emit_cpu_operand(REGISTER_DL, status);	// or byte [rbx + status], dl
+#endif
+			emit_store_al(accumulator);
+			emit_flags_nz(cpu);
+			break;
+
+		case OP_SBC:
+			// No borrow in, carry set when the subtraction borrowed, as SBC() does
+			emit_load_al(accumulator);
+			emit(0x88); emit(0xC2);						// mov dl, al
+			emit(0x28); emit(0xC8);						// sub al, cl
+			emit(0x0F); emit(0x92); emit(0xC4);			// setc ah
+			emit(0x30); emit(0xD1);						// xor cl, dl
+			emit(0xF6); emit(0xD1);						// not cl
+			emit(0x30); emit(0xC2);						// xor dl, al
+			emit(0x20); emit(0xCA);						// and dl, cl
+			emit(0x80); emit(0xE2); emit(0x80);			// and dl, 0x80
+#if LAZY_FLAGS
+			emit(0x88); emit_cpu_operand(REGISTER_AH, CPU_OFFSET(cpu, flag_c));	// mov [rbx + flag_c], ah
+			emit(0x88); emit_cpu_operand(REGISTER_DL, CPU_OFFSET(cpu, flag_v));	// mov [rbx + flag_v], dl
+#else
+			emit(0xD0); emit(0xEA);						// shr dl, 1 (OVERFLOW_FLAG)
+			emit(0x08); emit(0xE2);						// or dl, ah
+			emit_and8(status, (uint8_t) ~(CARRY_FLAG | OVERFLOW_FLAG));
+			emit(0x08); emit_cpu_operand(REGISTER_DL, status);	// or byte [rbx + status], dl
+#endif
+			emit_store_al(accumulator);
+			emit_flags_nz(cpu);
+			break;
+
+		case OP_CMP:
+		case OP_CPX:
+		case OP_CPY:
+			emit_load_al(reg);
+			emit(0x28); emit(0xC8);						// sub al, cl
+#if LAZY_FLAGS
+			emit(0x0F); emit(0x93); emit_cpu_operand(0, CPU_OFFSET(cpu, flag_c));	// setnc [rbx + flag_c]
+			emit(0x0F); emit(0x92); emit(0xC2);			// setc dl
+			emit(0xC0); emit(0xE2); emit(0x07);			// shl dl, 7
+			emit(0x88); emit_cpu_operand(REGISTER_DL, CPU_OFFSET(cpu, flag_n));	// mov [rbx + flag_n], dl
+			emit_store_al(CPU_OFFSET(cpu, flag_z));
+#else
+			emit(0x0F); emit(0x93); emit(0xC4);			// setnc ah
+			emit(0x0F); emit(0x92); emit(0xC2);			// setc dl
+			emit(0xC0); emit(0xE2); emit(0x07);			// shl dl, 7
+			emit(0x08); emit(0xE2);						// or dl, ah
+			emit(0x84); emit(0xC0);						// test al, al
+			emit(0x0F); emit(0x94); emit(0xC1);			// sete cl
+			emit(0x00); emit(0xC9);						// add cl, cl (ZERO_FLAG)
+			emit(0x08); emit(0xCA);						// or dl, cl
+			emit_and8(status, (uint8_t) ~(NEGATIVE_FLAG | ZERO_FLAG | CARRY_FLAG));
+			emit(0x08); emit_cpu_operand(REGISTER_DL, status);	// or byte [rbx + status], dl
+#endif
+			break;
+
+		case OP_BIT:
+			emit(0x88); emit(0xCA);						// mov dl, cl
+			emit_load_al(accumulator);
+			emit(0x20); emit(0xC8);						// and al, cl
+#if LAZY_FLAGS
+			emit(0x88); emit_cpu_operand(REGISTER_ECX, CPU_OFFSET(cpu, flag_n));	// mov [rbx + flag_n], cl
+			emit(0x80); emit(0xE2); emit(OVERFLOW_FLAG);	// and dl, OVERFLOW_FLAG
+			emit(0x88); emit_cpu_operand(REGISTER_DL, CPU_OFFSET(cpu, flag_v));	// mov [rbx + flag_v], dl
+			emit_store_al(CPU_OFFSET(cpu, flag_z));
+#else
+			emit(0x80); emit(0xE2); emit(NEGATIVE_FLAG | OVERFLOW_FLAG);	// and dl, NEGATIVE_FLAG | OVERFLOW_FLAG
+			emit(0x84); emit(0xC0);						// test al, al
+			emit(0x0F); emit(0x94); emit(0xC1);			// sete cl
+			emit(0x00); emit(0xC9);						// add cl, cl (ZERO_FLAG)
+			emit(0x08); emit(0xCA);						// or dl, cl
+			emit_and8(status, (uint8_t) ~(NEGATIVE_FLAG | ZERO_FLAG | OVERFLOW_FLAG));
+			emit(0x08); emit_cpu_operand(REGISTER_DL, status);	// or byte [rbx + status], dl
+#endif
+			break;
+
+		default:
+			// Read-modify-write, the shifts and rotates don't take the old carry in, as in 2A03.cpp
+			emit(0x88); emit(0xC8);						// mov al, cl
+			switch (desc->operation) {
+				case OP_INC: emit(0xFE); emit(0xC0); break;	// inc al
+				case OP_DEC: emit(0xFE); emit(0xC8); break;	// dec al
+				case OP_ASL: emit(0xD0); emit(0xE0); break;	// shl al, 1
+				case OP_LSR: emit(0xD0); emit(0xE8); break;	// shr al, 1
+				case OP_ROL: emit(0xD0); emit(0xC0); break;	// rol al, 1
+				case OP_ROR: emit(0xD0); emit(0xC8); break;	// ror al, 1
+			}
+			if (desc->operation != OP_INC && desc->operation != OP_DEC) {
+				emit_flag_carry(cpu, 0x92);
+			}
+			emit_flags_nz(cpu);
+			emit_write(cpu, access, constant, exit);
+			break;
+	}
+
+	if (page_cycle) {
+		emit_page_cross(cpu, mode, entry->operand);
+	}
+
+	return true;
+}
+
+/*
+	Branches and chaining
+
+	A branch tests its flag in place and jumps to code emitted after the block, which counts the taken branch with its
+	extra cycles and goes on to the target. Blocks go straight to the code of the next one when it is already
+	translated and through entries when it may be by the time they run, so translated code only returns to the core
+	when the instruction count or core_limit run out, an instruction wrote over translated code or the next
+	instruction isn't translated.
+*/
+void NES_Jit::emit_branch(NES_Cpu* cpu, const decoded_entry* entry, uint16_t address) {
+	uint16_t next = address + 2;
+	uint16_t branch_target = address + 1 + entry->operand;
+	uint8_t flag = 0;
+	bool taken_when_set = true;
+
+	switch (NES_Cpu::instruction_set[entry->opcode].operation) {
+		case OP_BCC: flag = CARRY_FLAG; taken_when_set = false; break;
+		case OP_BCS: flag = CARRY_FLAG; break;
+		case OP_BNE: flag = ZERO_FLAG; taken_when_set = false; break;
+		case OP_BEQ: flag = ZERO_FLAG; break;
+		case OP_BPL: flag = NEGATIVE_FLAG; taken_when_set = false; break;
+		case OP_BMI: flag = NEGATIVE_FLAG; break;
+		case OP_BVC: flag = OVERFLOW_FLAG; taken_when_set = false; break;
+		case OP_BVS: flag = OVERFLOW_FLAG; break;
+	}
+
+	// REL leaves target_address on the target whether the branch is taken or not
+	emit_target(cpu, branch_target);
+
+	// jnz when the flag is set
+	uint8_t condition = 0x85;
+#if LAZY_FLAGS
+	switch (flag) {
+		case NEGATIVE_FLAG: emit_test8(CPU_OFFSET(cpu, flag_n), 0x80); break;
+		case ZERO_FLAG: emit_test8(CPU_OFFSET(cpu, flag_z), 0xFF); condition = 0x84; break;
+		case CARRY_FLAG: emit_test8(CPU_OFFSET(cpu, flag_c), 0xFF); break;
+		case OVERFLOW_FLAG: emit_test8(CPU_OFFSET(cpu, flag_v), 0xFF); break;
+	}
+#else
+	emit_test8(CPU_OFFSET(cpu, proc_status), flag);
+#endif
+	if (!taken_when_set) {
+		condition ^= 0x01;
+	}
+
+	jit_branch branch;
+	emit(0x0F); emit(condition);						// jcc taken
+	branch.jump = emit_position;
+	emit32(0);
+	branch.pc = branch_target;
+	branch.opcode = entry->opcode;
+	branch.cycles = entry->cycles + 1 + ((next ^ branch_target) >> 8 != 0);
+	branches.push_back(branch);
+}
+
+// test byte [rbx + offset], mask
+void NES_Jit::emit_test8(int32_t offset, uint8_t mask) {
+	emit(0xF6); emit_cpu_operand(0, offset); emit(mask);
+}
+
+// Continue at address, through exit when it isn't translated
+void NES_Jit::emit_chain(uint16_t address, int exit) {
+	if (address < JIT_MIN_ADDRESS) {
+		emit_jump_exit(exit, 0);
+		return;
+	}
+
+	if (entries[address] != NULL) {
+		emit(0xE9); emit32((uint32_t)(entries[address] - (emit_position + 4)));	// jmp code
+		return;
+	}
+
+	emit(0x49); emit(0x8B); emit(0x85); emit32(address * sizeof(entries[0]));	// mov rax, [r13 + address * 8]
+	emit(0x48); emit(0x85); emit(0xC0);					// test rax, rax
+	emit_jump_exit(exit, 0x84);							// jz exit
+	emit(0xFF); emit(0xE0);								// jmp rax
+}
+
+// Continue at pc after an instruction that set it, through exit when it isn't translated
+void NES_Jit::emit_chain_pc(NES_Cpu* cpu, int exit) {
+	emit(0x0F); emit(0xB7); emit_cpu_operand(REGISTER_EAX, CPU_OFFSET(cpu, pc));	// movzx eax, word [rbx + pc]
+	emit(0x49); emit(0x8B); emit(0x44); emit(0xC5); emit(0x00);	// mov rax, [r13 + rax * 8]
+	emit(0x48); emit(0x85); emit(0xC0);					// test rax, rax
+	emit_jump_exit(exit, 0x84);							// jz exit
+	emit(0xFF); emit(0xE0);								// jmp rax
+}
+
+// Instructions whose next one isn't known until they ran
+bool NES_Jit::ends_block(const NES_Cpu::instruction_desc* desc) {
+	switch (desc->operation) {
+		case OP_JMP:
+		case OP_JSR:
+		case OP_RTS:
+		case OP_RTI:
+		case OP_BRK:
+			return true;
+	}
+
+	return false;
+}
+
+// Instructions whose handler writes memory and so may write over translated code
+bool NES_Jit::writes_memory(const NES_Cpu::instruction_desc* desc) {
+	switch (desc->operation) {
+		case OP_ASL:
+		case OP_DEC:
+		case OP_INC:
+		case OP_LSR:
+		case OP_ROL:
+		case OP_ROR:
+		case OP_STA:
+		case OP_STX:
+		case OP_STY:
+		case OP_PHA:
+		case OP_PHP:
+			return true;
+	}
+
+	return false;
+}
+
+const uint8_t* NES_Jit::compile(NES_Cpu* cpu, uint16_t address) {
+
+	if (buffer == NULL || address < JIT_MIN_ADDRESS) {
+		return NULL;
+	}
+
+	if (cpu->find_decoded(address) == NULL) {
+		return NULL;
+	}
+
+	if (enter == NULL) {
+		emit_stubs(cpu);
+		used = stubs_end;
+	}
+
+	// Worst case every instruction is a read-modify-write through the bus with both its exits
+	size_t worst_case = JIT_MAX_BLOCK * 512;
+	if (used + worst_case > JIT_BUFFER_SIZE) {
+		flush();
+	}
+
+	used = (used + 15) & ~(size_t)15;
+	emit_position = buffer + used;
+	exits.clear();
+	branches.clear();
+	calls.clear();
+
+	const uint8_t* start = emit_position;
+	int32_t pc_offset = CPU_OFFSET(cpu, pc);
+	int32_t opcode_offset = CPU_OFFSET(cpu, opcode);
+
+	uint16_t position = address;
+	int exit = -1;
+	int count = 0;
+	bool dynamic = false;
+
+	while (count < JIT_MAX_BLOCK) {
+		const decoded_entry* entry = cpu->find_decoded(position);
+		if (entry == NULL) {
+			break;
+		}
+
+		const NES_Cpu::instruction_desc* desc = &NES_Cpu::instruction_set[entry->opcode];
+		uint16_t next = position + 1 + entry->length;
+
+		entries[position] = emit_position;
+		call_pc = next;
+		call_opcode = entry->opcode;
+
+		bool native = true;
+		if (desc->addr_mode == MODE_REL) {
+			emit_branch(cpu, entry, position);
+		}
+		else {
+			native = emit_native(cpu, entry, position);
+		}
+
+		if (!native) {
+			// The handler sees the same pc, opcode and cycle_count the interpreter would give it
+			emit_store16(pc_offset, next);
+			emit_store8(opcode_offset, entry->opcode);
+			emit_store_cycles(cpu);
+			emit_call((void*) entry->handler, entry->operand);
+			emit_load_cycles(cpu);
+
+			if (writes_memory(desc)) {
+				emit_exit_if_flushed(add_exit(next, entry->opcode, false, entry->cycles));
+			}
+		}
+
+		// Writes to any byte of the block flush it
+		for (uint16_t byte = position; byte != next; byte++) {
+			block_bitmap[byte >> 3] |= 1 << (byte & 0x07);
+		}
+
+		// Handlers leave pc and opcode in the CPU, native instructions only at the exits
+		exit = add_exit(next, entry->opcode, native, 0);
+		emit_boundary(entry->cycles, exit);
+
+		count++;
+		position = next;
+
+		if (ends_block(desc)) {
+			dynamic = true;
+			break;
+		}
+		if (next < JIT_MIN_ADDRESS || entries[next] != NULL) {
+			break;
+		}
+	}
+
+	if (dynamic) {
+		emit_chain_pc(cpu, exit);
+	}
+	else {
+		emit_chain(position, exit);
+	}
+
+	for (size_t i = 0; i < branches.size(); i++) {
+		const jit_branch* branch = &branches[i];
+		int32_t distance = (int32_t)(emit_position - (branch->jump + 4));
+		memcpy(branch->jump, &distance, 4);
+
+		int taken = add_exit(branch->pc, branch->opcode, true, 0);
+		emit_boundary(branch->cycles, taken);
+		emit_chain(branch->pc, taken);
+	}
+
+	emit_calls(cpu);
+	emit_exits(cpu);
+
+	used = emit_position - buffer;
+
+	return start;
+}
+
+
+/*
+	Recompiler core
+
+	Runs translated code until count instructions are done or cycle_count reaches core_limit, the translated code
+	checks both after every instruction. RAM code and the few instructions that aren't decoded run on the predecoded
+	core, one at a time.
+*/
+unsigned long NES_Cpu::execute_jit(unsigned long count) {
+
+	while (count > 0 && cycle_count < core_limit) {
+		if (jit->flush_pending) {
+			jit->flush();
+		}
+
+		const uint8_t* code = jit->lookup(pc);
+		if (code == NULL) {
+			code = jit->compile(this, pc);
+		}
+
+		if (code == NULL) {
+			execute_cached<NES_Trace>(1);
+			count--;
+			continue;
+		}
+
+		count = jit->run(this, count, code);
+	}
+
+	return count;
+}
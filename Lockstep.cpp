@@ -0,0 +1,1099 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "NES.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LOCKSTEP_AVX2	1
+#define AVX2_TARGET		__attribute__((target("avx2")))
+#else
+#define LOCKSTEP_AVX2	0
+#endif
+
+
+NES_Lockstep::NES_Lockstep(int lane_count) {
+	this->lane_count = lane_count > 0 ? lane_count : 1;
+	width = (this->lane_count + LOCKSTEP_WIDTH - 1) / LOCKSTEP_WIDTH * LOCKSTEP_WIDTH;
+
+#if LOCKSTEP_AVX2
+	use_avx2 = __builtin_cpu_supports("avx2");
+#else
+	use_avx2 = false;
+#endif
+
+	vector_instructions = 0;
+	scalar_instructions = 0;
+
+	pc.assign(width, 0);
+	target_address.assign(width, 0);
+	opcode.assign(width, 0);
+	sp.assign(width, 0);
+	accumulator.assign(width, 0);
+	X.assign(width, 0);
+	Y.assign(width, 0);
+	proc_status.assign(width, 0);
+	flag_n.assign(width, 0);
+	flag_z.assign(width, 0);
+	flag_c.assign(width, 0);
+	flag_v.assign(width, 0);
+	ram.assign(0x0800 * width, 0);
+	pending.assign(width / LOCKSTEP_WIDTH, 0);
+	group.assign(width / LOCKSTEP_WIDTH, 0);
+	due.assign(width / LOCKSTEP_WIDTH, 0);
+	deferred.assign(width / LOCKSTEP_WIDTH, 0);
+	shared.assign(width / LOCKSTEP_WIDTH, 0);
+	other_banks.assign(width / LOCKSTEP_WIDTH, 0);
+	rejoin.assign(0x10000 / 64, 0);
+
+	// Lanes past lane_count only pad the arrays out to a whole register, they never fall short of a cycle limit
+	cycle_count.assign(width, UINT64_MAX);
+	event_deadline.assign(width, EVENT_NONE);
+	next_event = EVENT_NONE;
+	memset(first_banks, 0, sizeof(first_banks));
+
+	contexts.resize(this->lane_count);
+	for (int i = 0; i < this->lane_count; i++) {
+		NES_Cpu* cpu = new NES_Cpu();
+		cpu->set_core(CORE_FUSED);
+
+		contexts[i].engine = this;
+		contexts[i].index = i;
+		cpu->bus_context = &contexts[i];
+		cpu->map_io(0x00, 0x1F, &NES_Lockstep::read_lane_ram, &NES_Lockstep::write_lane_ram);
+
+		cpus.push_back(cpu);
+		store_lane(i);
+	}
+}
+
+NES_Lockstep::~NES_Lockstep() {
+	for (size_t i = 0; i < cpus.size(); i++) {
+		delete cpus[i];
+	}
+}
+
+int NES_Lockstep::load(uint8_t* buffer, int size) {
+	int used = 0;
+
+	for (int i = 0; i < lane_count; i++) {
+		used = cpus[i]->load_cpu(buffer, size);
+		if (used <= 16) {
+			return used;
+		}
+
+		// load_cpu() maps internal RAM back onto the instance
+		cpus[i]->map_io(0x00, 0x1F, &NES_Lockstep::read_lane_ram, &NES_Lockstep::write_lane_ram);
+		track_lane(i);
+	}
+
+	return used;
+}
+
+void NES_Lockstep::reset() {
+	for (int i = 0; i < lane_count; i++) {
+		load_lane(i);
+		cpus[i]->reset();
+		store_lane(i);
+	}
+}
+
+void NES_Lockstep::set_buttons(int lane, int pad, uint8_t pressed) {
+	cpus[lane]->set_buttons(pad, pressed);
+}
+
+int NES_Lockstep::lanes() {
+	return lane_count;
+}
+
+bool NES_Lockstep::together() {
+	return use_avx2;
+}
+
+NES_Cpu* NES_Lockstep::lane(int index) {
+	NES_Cpu* cpu = cpus[index];
+
+	load_lane(index);
+	for (int address = 0; address < 0x0800; address++) {
+		cpu->ram[address] = ram[address * width + index];
+	}
+
+	return cpu;
+}
+
+
+/*
+	Lane state
+
+	The arrays keep the flags the way LAZY_FLAGS does, the lane's NES_Cpu gets them through set_status() and hands
+	them back through get_status() so either setting of LAZY_FLAGS works.
+*/
+void NES_Lockstep::load_lane(int index) {
+	NES_Cpu* cpu = cpus[index];
+
+	cpu->pc = pc[index];
+	cpu->target_address = target_address[index];
+	cpu->opcode = opcode[index];
+	cpu->sp = sp[index];
+	cpu->accumulator = accumulator[index];
+	cpu->X = X[index];
+	cpu->Y = Y[index];
+	cpu->cycle_count = cycle_count[index];
+
+	uint8_t status = proc_status[index] & ~(NEGATIVE_FLAG | ZERO_FLAG | CARRY_FLAG | OVERFLOW_FLAG);
+	status |= flag_n[index] & NEGATIVE_FLAG;
+	status |= flag_z[index] == 0 ? ZERO_FLAG : 0;
+	status |= flag_c[index] ? CARRY_FLAG : 0;
+	status |= flag_v[index] ? OVERFLOW_FLAG : 0;
+	cpu->set_status(status);
+}
+
+void NES_Lockstep::store_lane(int index) {
+	NES_Cpu* cpu = cpus[index];
+
+	pc[index] = cpu->pc;
+	target_address[index] = cpu->target_address;
+	opcode[index] = cpu->opcode;
+	sp[index] = cpu->sp;
+	accumulator[index] = cpu->accumulator;
+	X[index] = cpu->X;
+	Y[index] = cpu->Y;
+	cycle_count[index] = cpu->cycle_count;
+
+	uint8_t status = cpu->get_status();
+	proc_status[index] = status;
+	flag_n[index] = status;
+	flag_z[index] = (status & ZERO_FLAG) ? 0 : 1;
+	flag_c[index] = (status & CARRY_FLAG) ? 1 : 0;
+	flag_v[index] = status & OVERFLOW_FLAG;
+
+	track_lane(index);
+}
+
+/*
+	Only the lane's own NES_Cpu posts events and switches banks, so its deadline and whether its banks are the
+	first lane's are looked at once it ran there. Lanes only get to their deadline on the AVX2 path, which can't
+	service it, so next_event only has to be found again when the earliest lane moved its deadline on.
+*/
+void NES_Lockstep::track_lane(int index) {
+	NES_Cpu* cpu = cpus[index];
+	uint64_t previous = event_deadline[index];
+
+	event_deadline[index] = cpu->events.next();
+	if (event_deadline[index] < next_event) {
+		next_event = event_deadline[index];
+	}
+	else if (previous == next_event && event_deadline[index] != previous) {
+		next_event = EVENT_NONE;
+		for (int i = 0; i < lane_count; i++) {
+			next_event = event_deadline[i] < next_event ? event_deadline[i] : next_event;
+		}
+	}
+
+	// New banks on the first lane are compared against every other lane again
+	if (index == 0) {
+		if (memcmp(cpu->mapper_registers, first_banks, MAPPER_REGISTERS) == 0) {
+			return;
+		}
+
+		memcpy(first_banks, cpu->mapper_registers, MAPPER_REGISTERS);
+		for (int i = 1; i < (int) cpus.size(); i++) {
+			track_lane(i);
+		}
+		return;
+	}
+
+	uint32_t bit = (uint32_t) 1 << (index % LOCKSTEP_WIDTH);
+	if (memcmp(cpu->mapper_registers, first_banks, MAPPER_REGISTERS) != 0) {
+		other_banks[index / LOCKSTEP_WIDTH] |= bit;
+	}
+	else {
+		other_banks[index / LOCKSTEP_WIDTH] &= ~bit;
+	}
+}
+
+// Internal RAM of a lane's NES_Cpu, one column of the shared arrays
+uint8_t NES_Lockstep::read_lane_ram(NES_Cpu* cpu, uint16_t address) {
+	lane_context* context = (lane_context*) cpu->bus_context;
+
+	return context->engine->ram[(address & 0x07FF) * context->engine->width + context->index];
+}
+
+void NES_Lockstep::write_lane_ram(NES_Cpu* cpu, uint16_t address, uint8_t data) {
+	lane_context* context = (lane_context*) cpu->bus_context;
+
+	context->engine->ram[(address & 0x07FF) * context->engine->width + context->index] = data;
+}
+
+// Through the first lane's PRG banks, step_vector() makes sure the group's lanes have the same ones
+uint8_t NES_Lockstep::fetch(uint16_t address) {
+	return cpus[0]->read_pages[address >> 8][address & 0xFF];
+}
+
+
+/*
+	Lane masks
+
+	pending and group have one bit per lane, LOCKSTEP_WIDTH lanes to a word.
+*/
+static int count_lanes(uint32_t bits) {
+#if defined(__GNUC__)
+	return __builtin_popcount(bits);
+#else
+	int count = 0;
+
+	for (; bits != 0; bits &= bits - 1) {
+		count++;
+	}
+
+	return count;
+#endif
+}
+
+static int first_lane(uint32_t bits) {
+#if defined(__GNUC__)
+	return __builtin_ctz(bits);
+#else
+	int lane = 0;
+
+	while (!(bits >> lane & 0x01)) {
+		lane++;
+	}
+
+	return lane;
+#endif
+}
+
+// LOCKSTEP_WIDTH lanes starting at cycles whose count is below cycle_limit
+static uint32_t lanes_short_of(const uint64_t* cycles, uint64_t cycle_limit) {
+	uint32_t bits = 0;
+
+	for (int j = 0; j < LOCKSTEP_WIDTH; j++) {
+		bits |= (uint32_t) (cycles[j] < cycle_limit) << j;
+	}
+
+	return bits;
+}
+
+// LOCKSTEP_WIDTH lanes starting at pc whose program counter is address
+static uint32_t lanes_at(const uint16_t* pc, uint16_t address) {
+	uint32_t bits = 0;
+
+	for (int j = 0; j < LOCKSTEP_WIDTH; j++) {
+		bits |= (uint32_t) (pc[j] == address) << j;
+	}
+
+	return bits;
+}
+
+#if LOCKSTEP_AVX2
+
+// Same as lanes_short_of(), the unsigned compare done signed with the top bits flipped
+AVX2_TARGET static uint32_t lanes_short_of_avx2(const uint64_t* cycles, uint64_t cycle_limit) {
+	const __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+	__m256i limit = _mm256_xor_si256(_mm256_set1_epi64x(cycle_limit), flip);
+	uint32_t bits = 0;
+
+	for (int j = 0; j < LOCKSTEP_WIDTH; j += 4) {
+		__m256i count = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) &cycles[j]), flip);
+		__m256i below = _mm256_cmpgt_epi64(limit, count);
+
+		bits |= (uint32_t) _mm256_movemask_pd(_mm256_castsi256_pd(below)) << j;
+	}
+
+	return bits;
+}
+
+// Same as lanes_at(), packing the two halves of 16-bit compares into one byte mask
+AVX2_TARGET static uint32_t lanes_at_avx2(const uint16_t* pc, uint16_t address) {
+	__m256i wanted = _mm256_set1_epi16(address);
+	__m256i low = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*) pc), wanted);
+	__m256i high = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*) &pc[16]), wanted);
+
+	return (uint32_t) _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(low, high), 0xD8));
+}
+
+// One bit per lane to 0xFF/0x00 per byte, for blending
+AVX2_TARGET static __m256i expand_lanes(uint32_t bits) {
+	const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+		2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+	const __m256i select = _mm256_set1_epi64x(0x8040201008040201);
+
+	__m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(bits), spread);
+
+	return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, select), select);
+}
+
+#endif
+
+// lanes_short_of() with AVX2 when the host has it
+static uint32_t lanes_short_of(const uint64_t* cycles, uint64_t cycle_limit, bool avx2) {
+#if LOCKSTEP_AVX2
+	if (avx2) {
+		return lanes_short_of_avx2(cycles, cycle_limit);
+	}
+#endif
+
+	return lanes_short_of(cycles, cycle_limit);
+}
+
+
+/*
+	Stepping
+
+	Lanes are grouped by program counter, starting from the first lane that hasn't run yet, until every lane ran one
+	instruction. Lanes that stay together form one group per step. The groups AVX2 can't run, and lanes on their own,
+	are left for step_deferred() once the others are done.
+*/
+void NES_Lockstep::step() {
+	step_lanes(UINT64_MAX);
+}
+
+void NES_Lockstep::run_until(uint64_t target_cycle) {
+	if (!use_avx2) {
+		// Nothing to gain from stepping the lanes together, run each one through on its own
+		for (int i = 0; i < lane_count; i++) {
+			load_lane(i);
+			cpus[i]->run_until(target_cycle);
+			store_lane(i);
+		}
+		return;
+	}
+
+	while (step_lanes(target_cycle) > 0) {
+	}
+}
+
+int NES_Lockstep::step_lanes(uint64_t cycle_limit) {
+	int remaining = select_pending(cycle_limit);
+	int stepped = remaining;
+	int word = 0;
+	bool scalar = false;
+
+	while (remaining > 0) {
+		while (pending[word] == 0) {
+			word++;
+		}
+
+		// Every pending lane sitting on the same instruction as the first one
+		int first = word * LOCKSTEP_WIDTH + first_lane(pending[word]);
+		uint16_t address = pc[first];
+		int count = select_group(address, word);
+
+		remaining -= count;
+
+		// A lane on its own is cheaper to run on its NES_Cpu
+		if (use_avx2 && count > 1 && step_vector(address)) {
+			vector_instructions += count;
+			continue;
+		}
+
+		for (int w = word; w < width / LOCKSTEP_WIDTH; w++) {
+			deferred[w] |= group[w];
+			shared[w] |= count > 1 ? group[w] : 0;
+		}
+		scalar = true;
+	}
+
+	if (scalar) {
+		step_deferred(cycle_limit);
+	}
+
+	return stepped;
+}
+
+/*
+	Marks the lanes short of cycle_limit in pending, returns how many there are. The ones at or past next_event go in
+	due too, step_vector() only has to look at their own deadlines.
+*/
+int NES_Lockstep::select_pending(uint64_t cycle_limit) {
+	int count = 0;
+
+	for (int base = 0; base < width; base += LOCKSTEP_WIDTH) {
+		uint32_t bits = lanes_short_of(&cycle_count[base], cycle_limit, use_avx2);
+
+		pending[base / LOCKSTEP_WIDTH] = bits;
+		due[base / LOCKSTEP_WIDTH] = bits & ~lanes_short_of(&cycle_count[base], next_event, use_avx2);
+		count += count_lanes(bits);
+	}
+
+	return count;
+}
+
+// Moves the pending lanes at address from pending to group, starting at word, returns how many there are
+int NES_Lockstep::select_group(uint16_t address, int word) {
+	int count = 0;
+
+	for (int w = 0; w < word; w++) {
+		group[w] = 0;
+	}
+
+	for (int base = word * LOCKSTEP_WIDTH; base < width; base += LOCKSTEP_WIDTH) {
+		uint32_t bits;
+
+#if LOCKSTEP_AVX2
+		if (use_avx2) {
+			bits = lanes_at_avx2(&pc[base], address);
+		}
+		else
+#endif
+		{
+			bits = lanes_at(&pc[base], address);
+		}
+
+		bits &= pending[base / LOCKSTEP_WIDTH];
+		pending[base / LOCKSTEP_WIDTH] &= ~bits;
+		group[base / LOCKSTEP_WIDTH] = bits;
+		count += count_lanes(bits);
+	}
+
+	return count;
+}
+
+/*
+	Runs the deferred lanes one after the other. The addresses of the lanes that ran with AVX2 go in rejoin first,
+	a lane stopping at one of them is in their group again on the next step.
+*/
+void NES_Lockstep::step_deferred(uint64_t cycle_limit) {
+	for (int base = 0; base < width; base += LOCKSTEP_WIDTH) {
+		uint32_t bits = lanes_short_of(&cycle_count[base], cycle_limit, use_avx2) & ~deferred[base / LOCKSTEP_WIDTH];
+
+		for (; bits != 0; bits &= bits - 1) {
+			uint16_t address = pc[base + first_lane(bits)];
+			rejoin[address >> 6] |= (uint64_t) 1 << (address & 0x3F);
+		}
+	}
+
+	for (int base = 0; base < width; base += LOCKSTEP_WIDTH) {
+		for (uint32_t bits = deferred[base / LOCKSTEP_WIDTH]; bits != 0; bits &= bits - 1) {
+			step_scalar(base + first_lane(bits), cycle_limit);
+		}
+
+		deferred[base / LOCKSTEP_WIDTH] = 0;
+		shared[base / LOCKSTEP_WIDTH] = 0;
+	}
+
+	// Lanes that ran with AVX2 are still where they were
+	for (int base = 0; base < width; base += LOCKSTEP_WIDTH) {
+		for (uint32_t bits = lanes_short_of(&cycle_count[base], cycle_limit, use_avx2); bits != 0; bits &= bits - 1) {
+			rejoin[pc[base + first_lane(bits)] >> 6] = 0;
+		}
+	}
+}
+
+/*
+	Runs the lane on its own NES_Cpu up to its next event or cycle_limit, or until it gets to an address in rejoin.
+	A lane that was in a group stops at the next instruction step_vector() may run as well, the others of the group
+	take the same path and stop there with it.
+*/
+void NES_Lockstep::step_scalar(int index, uint64_t cycle_limit) {
+	NES_Cpu* cpu = cpus[index];
+	bool in_group = shared[index / LOCKSTEP_WIDTH] >> (index % LOCKSTEP_WIDTH) & 0x01;
+	uint64_t start = cpu->instruction_count;
+
+	load_lane(index);
+
+	do {
+		cpu->execute(1);
+	} while (cpu->cycle_count < cycle_limit && cpu->cycle_count < cpu->events.next() &&
+		!(rejoin[cpu->pc >> 6] >> (cpu->pc & 0x3F) & 0x01) && !(in_group && can_vector(cpu)));
+
+	store_lane(index);
+	scalar_instructions += cpu->instruction_count - start;
+}
+
+
+// Operands come from internal RAM or PRG ROM, which is only written to where the board ignores it (rom_writes)
+static bool vector_address(uint16_t address, bool writes, bool rom_writes) {
+	return address < 0x2000 || (address >= 0x8000 && (!writes || rom_writes));
+}
+
+/*
+	What the instruction does with its operand, false for the ones that always run scalar: interrupts, the status on
+	the stack, CLI, which can let a held IRQ in, and operands outside vector_address(). The implied shifts go through
+	target_address and the indirect modes through pointers in each lane's RAM, those are up to the caller.
+*/
+static bool vector_operation(int op, int mode, uint16_t absolute, bool rom_writes, bool* reads, bool* writes,
+	bool* extra_cycle) {
+	*reads = false;
+	*writes = false;
+	*extra_cycle = false;
+
+	switch (op) {
+		case OP_ADC: case OP_AND: case OP_CMP: case OP_EOR: case OP_LDA: case OP_LDX: case OP_LDY: case OP_ORA:
+		case OP_SBC:
+			*reads = true;
+			*extra_cycle = true;
+			break;
+		case OP_BIT: case OP_CPX: case OP_CPY:
+			*reads = true;
+			break;
+		case OP_STA: case OP_STX: case OP_STY:
+			*writes = true;
+			break;
+		case OP_ASL: case OP_DEC: case OP_INC: case OP_LSR: case OP_ROL: case OP_ROR:
+			*reads = true;
+			*writes = true;
+			break;
+		case OP_BCC: case OP_BCS: case OP_BEQ: case OP_BMI: case OP_BNE: case OP_BPL: case OP_BVC: case OP_BVS:
+		case OP_CLC: case OP_CLD: case OP_CLV: case OP_SEC: case OP_SED: case OP_SEI:
+		case OP_DEX: case OP_DEY: case OP_INX: case OP_INY:
+		case OP_TAX: case OP_TAY: case OP_TSX: case OP_TXA: case OP_TXS: case OP_TYA:
+		case OP_NOP: case OP_ILL:
+		case OP_PHA: case OP_PLA: case OP_RTS:
+			break;
+		case OP_JMP:
+		case OP_JSR:
+			// Both bytes of the jump address have to come from PRG ROM or internal RAM
+			if (mode != MODE_ABS || !(absolute < 0x1FFF || (absolute >= 0x8000 && absolute < 0xFFFF))) {
+				return false;
+			}
+			break;
+		default:
+			return false;
+	}
+
+	switch (mode) {
+		case MODE_IMM:
+			return !*writes;
+		case MODE_ABS:
+			return vector_address(absolute, *writes, rom_writes) || op == OP_JMP || op == OP_JSR;
+		case MODE_ABS_X:
+		case MODE_ABS_Y:
+			// Past $FFFF the index wraps into internal RAM
+			return absolute + 0xFF < 0x2000 || (absolute >= 0x8000 && vector_address(absolute, *writes, rom_writes));
+		case MODE_IMP:
+		case MODE_ZPG:
+		case MODE_ZPG_X:
+		case MODE_ZPG_Y:
+		case MODE_IND_X:
+		case MODE_IND_Y:
+		case MODE_REL:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Lane arrays an instruction from vector_operation() changes, the others are left as they are
+enum {
+	CHANGES_A = 0x001,
+	CHANGES_X = 0x002,
+	CHANGES_Y = 0x004,
+	CHANGES_S = 0x008,
+	CHANGES_P = 0x010,
+	CHANGES_NZ = 0x020,
+	CHANGES_C = 0x040,
+	CHANGES_V = 0x080
+};
+
+static int vector_changes(int op) {
+	switch (op) {
+		case OP_LDA: case OP_AND: case OP_ORA: case OP_EOR: case OP_TXA: case OP_TYA:
+			return CHANGES_A | CHANGES_NZ;
+		case OP_LDX: case OP_TAX: case OP_TSX: case OP_INX: case OP_DEX:
+			return CHANGES_X | CHANGES_NZ;
+		case OP_LDY: case OP_TAY: case OP_INY: case OP_DEY:
+			return CHANGES_Y | CHANGES_NZ;
+		case OP_ADC: case OP_SBC:
+			return CHANGES_A | CHANGES_NZ | CHANGES_C | CHANGES_V;
+		case OP_CMP: case OP_CPX: case OP_CPY: case OP_ASL: case OP_LSR: case OP_ROL: case OP_ROR:
+			return CHANGES_NZ | CHANGES_C;
+		case OP_BIT:
+			return CHANGES_NZ | CHANGES_V;
+		case OP_INC: case OP_DEC:
+			return CHANGES_NZ;
+		case OP_CLC: case OP_SEC:
+			return CHANGES_C;
+		case OP_CLV:
+			return CHANGES_V;
+		case OP_CLD: case OP_SED: case OP_SEI:
+			return CHANGES_P;
+		case OP_TXS: case OP_PHA: case OP_JSR: case OP_RTS:
+			return CHANGES_S;
+		case OP_PLA:
+			return CHANGES_S | CHANGES_A | CHANGES_NZ;
+		default:
+			return 0;
+	}
+}
+
+// Through the lane's own banks, what the group may still turn down (banks, events) is looked at in step_vector()
+bool NES_Lockstep::can_vector(NES_Cpu* cpu) {
+	uint16_t address = cpu->pc;
+	if (address < 0x8000 || address > 0xFFFD || cpu->read_pages[address >> 8] == NULL) {
+		return false;
+	}
+
+	uint8_t code = cpu->read_pages[address >> 8][address & 0xFF];
+	uint16_t operand = address + 1;
+	uint8_t low = cpu->read_pages[operand >> 8][operand & 0xFF];
+	operand++;
+	uint16_t absolute = low | cpu->read_pages[operand >> 8][operand & 0xFF] << 8;
+
+	const NES_Cpu::instruction_desc* desc = &NES_Cpu::instruction_set[code];
+	bool rom_writes = cpu->write_handlers[0x80] == &NES_Cpu::write_ignored;
+	bool reads;
+	bool writes;
+	bool extra_cycle;
+
+	if (!vector_operation(desc->operation, desc->addr_mode, absolute, rom_writes, &reads, &writes, &extra_cycle)) {
+		return false;
+	}
+
+	return desc->addr_mode != MODE_IMP || !(reads || writes) || vector_address(cpu->target_address, writes, rom_writes);
+}
+
+// (zp,X) and (zp),Y of the lane, the pointer is always in internal RAM
+uint16_t NES_Lockstep::indirect_address(int index, int mode, uint8_t operand) {
+	uint16_t pointer = mode == MODE_IND_X ? operand + X[index] : operand;
+	uint16_t address = ram[((pointer + 1) & 0x07FF) * width + index] << 8 | ram[(pointer & 0x07FF) * width + index];
+
+	return mode == MODE_IND_Y ? address + Y[index] : address;
+}
+
+
+/*
+	AVX2 execution
+
+	The group's instruction is decoded once from PRG ROM, so every lane in it runs the same opcode with the same
+	operand bytes. The operand is the immediate byte, one row of the RAM arrays for zero page and absolute
+	addresses, or gathered lane by lane for indexed and indirect addresses and the stack. PRG ROM operands are read
+	through fetch(). The results follow the NES_Cpu instruction implementations (flags included) and are blended into
+	the lanes of the group only, and only into the arrays the instruction changes.
+*/
+#if LOCKSTEP_AVX2
+
+AVX2_TARGET bool NES_Lockstep::step_vector(uint16_t address) {
+	if (address < 0x8000 || address > 0xFFFD || cpus[0]->cartridge == NULL || cpus[0]->cartridge->prg_size == 0) {
+		return false;
+	}
+
+	// Lanes can switch banks on their own, the decode only holds when the group's lanes have the same ones. A lane at
+	// its PPU event runs scalar, which catches its PPU up (and maybe takes an interrupt) first.
+	for (int base = 0; base < width; base += LOCKSTEP_WIDTH) {
+		if (group[base / LOCKSTEP_WIDTH] & other_banks[base / LOCKSTEP_WIDTH]) {
+			return false;
+		}
+
+		for (uint32_t bits = group[base / LOCKSTEP_WIDTH] & due[base / LOCKSTEP_WIDTH]; bits != 0; bits &= bits - 1) {
+			int i = base + first_lane(bits);
+			if (cycle_count[i] >= event_deadline[i]) {
+				return false;
+			}
+		}
+	}
+
+	uint8_t code = fetch(address);
+	const NES_Cpu::instruction_desc* desc = &NES_Cpu::instruction_set[code];
+	int op = desc->operation;
+	int mode = desc->addr_mode;
+
+	uint8_t low = fetch(address + 1);
+	uint16_t absolute = low | fetch(address + 2) << 8;
+
+	bool rom_writes = cpus[0]->write_handlers[0x80] == &NES_Cpu::write_ignored;
+	bool reads;
+	bool writes;
+	bool extra_cycle;
+	if (!vector_operation(op, mode, absolute, rom_writes, &reads, &writes, &extra_cycle)) {
+		return false;
+	}
+
+	// Operands have to be the immediate byte or at a vector_address(), the accumulator forms of the shifts (and the
+	// $EB SBC) go through target_address like the rest and the indirect modes through each lane's pointer
+	bool indirect = mode == MODE_IND_X || mode == MODE_IND_Y;
+	bool stale = mode == MODE_IMP && (reads || writes);
+	bool same_target = true;
+	uint16_t stale_address = 0;
+
+	if (stale || indirect) {
+		int first = -1;
+
+		// Lanes that stayed together usually left the same address behind
+		for (int base = 0; base < width; base += LOCKSTEP_WIDTH) {
+			for (uint32_t bits = group[base / LOCKSTEP_WIDTH]; bits != 0; bits &= bits - 1) {
+				int i = base + first_lane(bits);
+				uint16_t effective = stale ? target_address[i] : indirect_address(i, mode, low);
+
+				if (!vector_address(effective, writes, rom_writes)) {
+					return false;
+				}
+
+				if (first < 0) {
+					first = i;
+				}
+				same_target &= target_address[i] == target_address[first];
+			}
+		}
+
+		stale_address = target_address[first];
+	}
+
+	// Operand addresses that differ from lane to lane
+	bool indexed = mode == MODE_ZPG_X || mode == MODE_ZPG_Y || mode == MODE_ABS_X || mode == MODE_ABS_Y;
+	bool per_lane = indexed || indirect || (stale && !same_target);
+
+	// The stack is in each lane's internal RAM, at its own stack pointer
+	bool stack = op == OP_JSR || op == OP_RTS || op == OP_PHA || op == OP_PLA;
+	uint16_t return_address = address + 3;
+
+	// JMP and JSR read the new program counter through their operand, from PRG ROM for every lane or from each lane's
+	// RAM, RTS pulls it from each lane's stack
+	bool jump_rom = (op == OP_JMP || op == OP_JSR) && absolute >= 0x8000;
+	bool jump_ram = (op == OP_JMP || op == OP_JSR) && absolute < 0x2000;
+
+	uint16_t next = address + 1 + NES_Cpu::operand_length[mode];
+	if (jump_rom) {
+		next = fetch(absolute) | fetch(absolute + 1) << 8;
+	}
+
+	int changes = vector_changes(op);
+
+	uint16_t branch_target = address + 1 + low;
+	uint8_t branch_cycles = 1 + ((next ^ branch_target) >> 8 != 0);
+
+	// Address every lane uses when the operand isn't indexed
+	uint16_t uniform = 0;
+	if (mode == MODE_IMM) {
+		uniform = address + 1;
+	}
+	else if (mode == MODE_ZPG) {
+		uniform = low;
+	}
+	else if (mode == MODE_ABS) {
+		uniform = absolute;
+	}
+	else if (mode == MODE_REL) {
+		uniform = branch_target;
+	}
+	else if (stale) {
+		uniform = stale_address;
+	}
+
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i all = _mm256_cmpeq_epi8(zero, zero);
+	const __m256i ones = _mm256_set1_epi8(0x01);
+	const __m256i sign = _mm256_set1_epi8((char) 0x80);
+	const __m256i low_bits = _mm256_set1_epi8(0x7F);
+
+	alignas(32) uint16_t targets[LOCKSTEP_WIDTH];
+	alignas(32) uint16_t jumps[LOCKSTEP_WIDTH];
+	alignas(32) uint8_t operands[LOCKSTEP_WIDTH];
+	alignas(32) uint8_t crossed[LOCKSTEP_WIDTH];
+	alignas(32) uint8_t results[LOCKSTEP_WIDTH];
+	alignas(32) uint8_t deltas[LOCKSTEP_WIDTH];
+
+	for (int base = 0; base < width; base += LOCKSTEP_WIDTH) {
+		uint32_t bits = group[base / LOCKSTEP_WIDTH];
+		if (bits == 0) {
+			continue;
+		}
+
+		__m256i lanes = expand_lanes(bits);
+
+		__m256i a = _mm256_loadu_si256((const __m256i*) &accumulator[base]);
+		__m256i x = _mm256_loadu_si256((const __m256i*) &X[base]);
+		__m256i y = _mm256_loadu_si256((const __m256i*) &Y[base]);
+		__m256i s = _mm256_loadu_si256((const __m256i*) &sp[base]);
+		__m256i p = _mm256_loadu_si256((const __m256i*) &proc_status[base]);
+		__m256i n = _mm256_loadu_si256((const __m256i*) &flag_n[base]);
+		__m256i z = _mm256_loadu_si256((const __m256i*) &flag_z[base]);
+		__m256i c = _mm256_loadu_si256((const __m256i*) &flag_c[base]);
+		__m256i v = _mm256_loadu_si256((const __m256i*) &flag_v[base]);
+
+		// Operand
+		__m256i m = zero;
+		__m256i extra = zero;
+		uint8_t* row = &ram[(uniform & 0x07FF) * width + base];
+
+		if (per_lane) {
+			const uint8_t* index = (mode == MODE_ZPG_X || mode == MODE_ABS_X) ? &X[base] : &Y[base];
+			bool zero_page = mode == MODE_ZPG_X || mode == MODE_ZPG_Y;
+
+			for (int j = 0; j < LOCKSTEP_WIDTH; j++) {
+				uint16_t effective;
+				uint16_t unindexed = absolute;
+				if (stale) {
+					effective = target_address[base + j];
+				}
+				else if (indirect) {
+					effective = indirect_address(base + j, mode, low);
+					unindexed = effective - Y[base + j];
+				}
+				else {
+					effective = zero_page ? (low + index[j]) & 0x00FF : absolute + index[j];
+				}
+
+				targets[j] = effective;
+				crossed[j] = (mode == MODE_ABS_X || mode == MODE_ABS_Y || mode == MODE_IND_Y) &&
+					(unindexed ^ effective) >> 8 != 0;
+
+				// Lanes outside the group may point anywhere, only those in it were checked
+				if (effective < 0x2000) {
+					operands[j] = ram[(effective & 0x07FF) * width + base + j];
+				}
+				else {
+					operands[j] = bits >> j & 0x01 ? fetch(effective) : 0;
+				}
+			}
+
+			m = _mm256_load_si256((const __m256i*) operands);
+			if (extra_cycle) {
+				extra = _mm256_load_si256((const __m256i*) crossed);
+			}
+		}
+		else if (mode == MODE_IMM) {
+			m = _mm256_set1_epi8((char) low);
+		}
+		else if (reads && uniform >= 0x2000) {
+			m = _mm256_set1_epi8((char) fetch(uniform));
+		}
+		else if (reads) {
+			m = _mm256_loadu_si256((const __m256i*) row);
+		}
+
+		// Pushes go in before JSR reads its jump address, like JSR() does them
+		if (stack) {
+			for (int j = 0; j < LOCKSTEP_WIDTH; j++) {
+				uint8_t* column = &ram[base + j];
+				uint16_t top = STACK_OFFSET + sp[base + j];
+				uint16_t pulled = STACK_OFFSET + (uint8_t) (sp[base + j] + (op == OP_RTS ? 2 : 1));
+
+				if (op == OP_PLA) {
+					operands[j] = column[(pulled & 0x07FF) * width];
+				}
+				else if (op == OP_RTS) {
+					jumps[j] = column[(pulled & 0x07FF) * width] << 8 | column[((pulled - 1) & 0x07FF) * width];
+				}
+				else if (!(bits >> j & 0x01)) {
+					continue;
+				}
+				else if (op == OP_PHA) {
+					column[(top & 0x07FF) * width] = accumulator[base + j];
+				}
+				else {
+					column[(top & 0x07FF) * width] = return_address >> 8;
+					column[((top - 1) & 0x07FF) * width] = return_address & 0xFF;
+				}
+			}
+
+			m = _mm256_load_si256((const __m256i*) operands);
+		}
+
+		__m256i result = zero;
+		__m256i taken = zero;
+		__m256i greater_equal;
+
+		switch (op) {
+			case OP_LDA: a = m; n = m; z = m; break;
+			case OP_LDX: x = m; n = m; z = m; break;
+			case OP_LDY: y = m; n = m; z = m; break;
+			case OP_STA: result = a; break;
+			case OP_STX: result = x; break;
+			case OP_STY: result = y; break;
+			case OP_AND: a = _mm256_and_si256(a, m); n = a; z = a; break;
+			case OP_ORA: a = _mm256_or_si256(a, m); n = a; z = a; break;
+			case OP_EOR: a = _mm256_xor_si256(a, m); n = a; z = a; break;
+			case OP_ADC: {
+				__m256i sum = _mm256_add_epi8(_mm256_add_epi8(a, m), c);
+
+				// Carry out of bit 7 from the inputs and the sum, overflow as in ADC()
+				__m256i carries = _mm256_or_si256(_mm256_and_si256(a, m), _mm256_andnot_si256(sum, _mm256_or_si256(a, m)));
+				c = _mm256_and_si256(_mm256_srli_epi16(carries, 7), ones);
+				v = _mm256_and_si256(_mm256_andnot_si256(_mm256_xor_si256(a, m), _mm256_xor_si256(a, sum)), sign);
+				a = sum; n = sum; z = sum;
+				break;
+			}
+			case OP_SBC: {
+				// No borrow in, carry set when the subtraction wrapped, as in SBC()
+				__m256i diff = _mm256_sub_epi8(a, m);
+
+				greater_equal = _mm256_cmpeq_epi8(_mm256_max_epu8(a, m), a);
+				c = _mm256_andnot_si256(greater_equal, ones);
+				v = _mm256_and_si256(_mm256_andnot_si256(_mm256_xor_si256(a, m), _mm256_xor_si256(a, diff)), sign);
+				a = diff; n = diff; z = diff;
+				break;
+			}
+			case OP_CMP:
+			case OP_CPX:
+			case OP_CPY: {
+				__m256i reg = op == OP_CMP ? a : (op == OP_CPX ? x : y);
+
+				greater_equal = _mm256_cmpeq_epi8(_mm256_max_epu8(reg, m), reg);
+				n = _mm256_andnot_si256(greater_equal, sign);
+				c = _mm256_and_si256(greater_equal, ones);
+				z = _mm256_sub_epi8(reg, m);
+				break;
+			}
+			case OP_BIT:
+				z = _mm256_and_si256(a, m);
+				n = m;
+				v = _mm256_and_si256(m, _mm256_set1_epi8(OVERFLOW_FLAG));
+				break;
+			case OP_INC: result = _mm256_add_epi8(m, ones); n = result; z = result; break;
+			case OP_DEC: result = _mm256_sub_epi8(m, ones); n = result; z = result; break;
+			case OP_ASL:
+				c = _mm256_and_si256(_mm256_srli_epi16(m, 7), ones);
+				result = _mm256_add_epi8(m, m);
+				n = result; z = result;
+				break;
+			case OP_LSR:
+				c = _mm256_and_si256(m, ones);
+				result = _mm256_and_si256(_mm256_srli_epi16(m, 1), low_bits);
+				n = result; z = result;
+				break;
+			case OP_ROL:
+				c = _mm256_and_si256(_mm256_srli_epi16(m, 7), ones);
+				result = _mm256_or_si256(_mm256_add_epi8(m, m), c);
+				n = result; z = result;
+				break;
+			case OP_ROR:
+				c = _mm256_and_si256(m, ones);
+				result = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(m, 1), low_bits), _mm256_and_si256(_mm256_slli_epi16(m, 7), sign));
+				n = result; z = result;
+				break;
+			case OP_TAX: x = a; n = a; z = a; break;
+			case OP_TAY: y = a; n = a; z = a; break;
+			case OP_TXA: a = x; n = x; z = x; break;
+			case OP_TYA: a = y; n = y; z = y; break;
+			case OP_TSX: x = s; n = s; z = s; break;
+			case OP_TXS: s = x; break;
+			case OP_INX: x = _mm256_add_epi8(x, ones); n = x; z = x; break;
+			case OP_INY: y = _mm256_add_epi8(y, ones); n = y; z = y; break;
+			case OP_DEX: x = _mm256_sub_epi8(x, ones); n = x; z = x; break;
+			case OP_DEY: y = _mm256_sub_epi8(y, ones); n = y; z = y; break;
+			case OP_CLC: c = zero; break;
+			case OP_SEC: c = ones; break;
+			case OP_CLV: v = zero; break;
+			case OP_CLD: p = _mm256_andnot_si256(_mm256_set1_epi8(DECIMAL_FLAG), p); break;
+			case OP_SED: p = _mm256_or_si256(p, _mm256_set1_epi8(DECIMAL_FLAG)); break;
+			case OP_SEI: p = _mm256_or_si256(p, _mm256_set1_epi8(DISABLE_FLAG)); break;
+			case OP_PHA: s = _mm256_sub_epi8(s, ones); break;
+			case OP_PLA: s = _mm256_add_epi8(s, ones); a = m; n = m; z = m; break;
+			case OP_JSR: s = _mm256_sub_epi8(s, _mm256_set1_epi8(2)); break;
+			case OP_RTS: s = _mm256_add_epi8(s, _mm256_set1_epi8(2)); break;
+			case OP_BPL: taken = _mm256_cmpeq_epi8(_mm256_and_si256(n, sign), zero); break;
+			case OP_BMI: taken = _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_and_si256(n, sign), zero), all); break;
+			case OP_BVC: taken = _mm256_cmpeq_epi8(v, zero); break;
+			case OP_BVS: taken = _mm256_xor_si256(_mm256_cmpeq_epi8(v, zero), all); break;
+			case OP_BCC: taken = _mm256_cmpeq_epi8(c, zero); break;
+			case OP_BCS: taken = _mm256_xor_si256(_mm256_cmpeq_epi8(c, zero), all); break;
+			case OP_BNE: taken = _mm256_xor_si256(_mm256_cmpeq_epi8(z, zero), all); break;
+			case OP_BEQ: taken = _mm256_cmpeq_epi8(z, zero); break;
+		}
+
+		if (mode == MODE_REL) {
+			extra = _mm256_and_si256(taken, _mm256_set1_epi8(branch_cycles));
+		}
+
+		// Registers and flags the instruction changed, only for the lanes of the group
+		#define BLEND_STORE(array, value) \
+			_mm256_storeu_si256((__m256i*) &array[base], \
+				_mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*) &array[base]), value, lanes))
+
+		if (changes & CHANGES_A) {
+			BLEND_STORE(accumulator, a);
+		}
+		if (changes & CHANGES_X) {
+			BLEND_STORE(X, x);
+		}
+		if (changes & CHANGES_Y) {
+			BLEND_STORE(Y, y);
+		}
+		if (changes & CHANGES_S) {
+			BLEND_STORE(sp, s);
+		}
+		if (changes & CHANGES_P) {
+			BLEND_STORE(proc_status, p);
+		}
+		if (changes & CHANGES_NZ) {
+			BLEND_STORE(flag_n, n);
+			BLEND_STORE(flag_z, z);
+		}
+		if (changes & CHANGES_C) {
+			BLEND_STORE(flag_c, c);
+		}
+		if (changes & CHANGES_V) {
+			BLEND_STORE(flag_v, v);
+		}
+		BLEND_STORE(opcode, _mm256_set1_epi8((char) code));
+
+		#undef BLEND_STORE
+
+		// Memory
+		if (jump_ram) {
+			for (int j = 0; j < LOCKSTEP_WIDTH; j++) {
+				jumps[j] = ram[(absolute & 0x07FF) * width + base + j] | ram[((absolute + 1) & 0x07FF) * width + base + j] << 8;
+			}
+		}
+
+		if (writes && per_lane) {
+			_mm256_store_si256((__m256i*) results, result);
+
+			for (int j = 0; j < LOCKSTEP_WIDTH; j++) {
+				if ((bits >> j & 0x01) && targets[j] < 0x2000) {
+					ram[(targets[j] & 0x07FF) * width + base + j] = results[j];
+				}
+			}
+		}
+		else if (writes && uniform < 0x2000) {
+			_mm256_storeu_si256((__m256i*) row, _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*) row), result, lanes));
+		}
+
+		// Program counter and target address, 16 lanes at a time
+		for (int half = 0; half < 2; half++) {
+			if ((bits >> (half * 16) & 0xFFFF) == 0) {
+				continue;
+			}
+
+			__m128i lanes_half = half ? _mm256_extracti128_si256(lanes, 1) : _mm256_castsi256_si128(lanes);
+			__m128i taken_half = half ? _mm256_extracti128_si256(taken, 1) : _mm256_castsi256_si128(taken);
+			__m256i lanes16 = _mm256_cvtepi8_epi16(lanes_half);
+			__m256i taken16 = _mm256_cvtepi8_epi16(taken_half);
+
+			uint16_t* pc_half = &pc[base + half * 16];
+			__m256i next_pc = _mm256_blendv_epi8(_mm256_set1_epi16(next), _mm256_set1_epi16(branch_target), taken16);
+			if (jump_ram || op == OP_RTS) {
+				next_pc = _mm256_load_si256((const __m256i*) &jumps[half * 16]);
+			}
+			_mm256_storeu_si256((__m256i*) pc_half,
+				_mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*) pc_half), next_pc, lanes16));
+
+			if (mode != MODE_IMP) {
+				uint16_t* target_half = &target_address[base + half * 16];
+				__m256i target = per_lane ? _mm256_load_si256((const __m256i*) &targets[half * 16]) : _mm256_set1_epi16(uniform);
+				_mm256_storeu_si256((__m256i*) target_half,
+					_mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*) target_half), target, lanes16));
+			}
+		}
+
+		// Cycles, widened to 64 bits 4 lanes at a time
+		__m256i delta = _mm256_and_si256(_mm256_add_epi8(_mm256_set1_epi8(desc->cycles), extra), lanes);
+		_mm256_store_si256((__m256i*) deltas, delta);
+
+		for (int j = 0; j < LOCKSTEP_WIDTH; j += 4) {
+			if ((bits >> j & 0x0F) == 0) {
+				continue;
+			}
+
+			int32_t packed;
+			memcpy(&packed, &deltas[j], sizeof(packed));
+
+			uint64_t* cycles = &cycle_count[base + j];
+			__m256i wide = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+			_mm256_storeu_si256((__m256i*) cycles, _mm256_add_epi64(_mm256_loadu_si256((const __m256i*) cycles), wide));
+		}
+	}
+
+	return true;
+}
+
+#else
+
+bool NES_Lockstep::step_vector(uint16_t address) {
+	return false;
+}
+
+#endif
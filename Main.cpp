@@ -1,9 +1,11 @@
 #include <stdio.h>
-#include <windows.h> 
 #include <iostream>
 #include <string>
+#include <chrono>
+#include <thread>
 
 #include "NES.h"
+#include "util.h"
 
 using namespace std;
 
@@ -18,69 +20,662 @@ int load(NES_Cpu* cpu, const char* game) {
 
 	printf("Game: %s\n", game);
 
-	// Open the game file and read it into our memory
-	FILE *game_file = fopen(game, "rb");
-	if (game_file == NULL) {
+	// Map the game file, PRG and CHR are used from the mapping without being copied
+	int bytes_mapped = cpu->load_rom(game);
+	if (bytes_mapped <= 16) {
+		printf("Error while loading ROM to the CPU, please report the bug or try a different ROM");
+		return 1;
+	}
+
+	if (trace) {
+		printf("CPU loading used the first %d byte(s) of ROM\n", bytes_mapped);
+	}
+
+
+	printf("Game loaded\n");
+
+	return 0;
+}
+
+// Run a fixed number of instructions and report the throughput of the selected core
+void benchmark(NES_Cpu* cpu, unsigned long instructions) {
+
+	cpu->reset();
+
+	auto start = chrono::steady_clock::now();
+	cpu->execute(instructions);
+	auto end = chrono::steady_clock::now();
+
+	double seconds = chrono::duration<double>(end - start).count();
+	printf("Executed %lu instructions in %.3f s (%.0f instructions/s, %llu cycles)\n", instructions, seconds,
+		instructions / seconds, (unsigned long long) cpu->get_cycles());
+}
+
+// Differential run of every core against the table-driven core, returns 1 on the first mismatch
+int verify(const char* game, unsigned long instructions) {
+	const int cores[] = { CORE_FUSED, CORE_CACHED, CORE_JIT };
+	const char* names[] = { "fused", "cached", "jit" };
+
+	// Odd step so blocks keep getting split at different places
+	const unsigned long step = 997;
+
+	for (int c = 0; c < 3; c++) {
+		NES_Cpu* reference = new NES_Cpu();
+		NES_Cpu* candidate = new NES_Cpu();
+
+		if (load(reference, game) || load(candidate, game)) {
+			delete reference;
+			delete candidate;
+			return 1;
+		}
+
+		reference->reset();
+		candidate->reset();
+		candidate->set_core(cores[c]);
+
+		unsigned long done = 0;
+		while (done < instructions) {
+			unsigned long chunk = instructions - done < step ? instructions - done : step;
+			reference->execute(chunk);
+			done += chunk;
+
+			// Every other chunk the candidate runs on the cycle budget the reference reached instead
+			if ((done / step) % 2) {
+				candidate->run_until(reference->get_cycles());
+			}
+			else {
+				candidate->execute(chunk);
+			}
+
+			if (!candidate->same_state(reference)) {
+				printf("%s core diverged from the table core within instructions %lu - %lu\n", names[c], done - chunk, done);
+				delete reference;
+				delete candidate;
+				return 1;
+			}
+		}
+
+		printf("%s core matches the table core over %lu instructions\n", names[c], instructions);
+		delete reference;
+		delete candidate;
+	}
+
+	return 0;
+}
+
+// Run lanes of the game together with different buttons on each and check every lane against its own NES_Cpu
+int lockstep(const char* game, int lanes, unsigned long frames) {
+	int size = 0;
+	uint8_t* rom = read_file(game, &size);
+	if (rom == NULL) {
 		printf("Failed to open game file\n");
 		return 1;
 	}
 
-	// Find the file size
-	fseek(game_file, 0, SEEK_END);
-	int size = ftell(game_file);
-	fseek(game_file, 0, SEEK_SET);
+	NES_Lockstep* engine = new NES_Lockstep(lanes);
+	if (engine->load(rom, size) <= 16) {
+		free(rom);
+		delete engine;
+		return 1;
+	}
+
+	engine->reset();
+	lanes = engine->lanes();
 
-	// Reserve space to work on file
-	uint8_t *buffer = (uint8_t *) malloc(sizeof(uint8_t) * size);
-	int bytes_read = fread(buffer, 1, size, game_file);
-	
-	// Close the file
-	fclose(game_file);
+	// Lanes only drift apart once the game reads the pads
+	for (int i = 0; i < lanes; i++) {
+		engine->set_buttons(i, 0, i & 0xFF);
+	}
+
+	uint64_t target = engine->lane(0)->get_cycles() + frames * CYCLES_PER_FRAME;
+
+	auto start = chrono::steady_clock::now();
+	engine->run_until(target);
+	double lockstep_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	// The same runs one instance at a time
+	double separate_seconds = 0;
+	int diverged = 0;
+
+	for (int i = 0; i < lanes; i++) {
+		NES_Cpu* reference = new NES_Cpu();
+		reference->load_cpu(rom, size);
+		reference->set_core(CORE_FUSED);
+		reference->reset();
+		reference->set_buttons(0, i & 0xFF);
+
+		start = chrono::steady_clock::now();
+		reference->run_until(target);
+		separate_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if (!reference->same_state(engine->lane(i))) {
+			if (diverged == 0) {
+				printf("Lane %d diverged from its own run\n", i);
+			}
+			diverged++;
+		}
+
+		delete reference;
+	}
+
+	uint64_t total = engine->vector_instructions + engine->scalar_instructions;
+	printf("%d lanes, %lu frames: lockstep %.3f s (%.1f%% of instructions vectorized), separate %.3f s, %d lanes diverged\n",
+		lanes, frames, lockstep_seconds, total ? 100.0 * engine->vector_instructions / total : 0.0, separate_seconds, diverged);
+
+	// Running the lanes together is only worth it when it beats running them one at a time
+	bool slower = engine->together() && lockstep_seconds > separate_seconds;
+	if (slower) {
+		printf("Lockstep was slower than the separate runs\n");
+	}
 
-	// Check bytes read
-	if (bytes_read != size) {
-		printf("Reading error, expected to read %d bytes, but instead read %d\n", size, bytes_read);
-		free(buffer);
+	free(rom);
+	delete engine;
+
+	return diverged || slower ? 1 : 0;
+}
+
+// Take a state every frame, then load the one from halfway through and check the rest of the run comes out the same
+int save_states(const char* game, unsigned long frames) {
+	NES_Cpu* cpu = new NES_Cpu();
+	if (load(cpu, game)) {
+		delete cpu;
 		return 1;
 	}
 
-	// Print contents of the game file
-	if (trace) {
-		printf("Bytes Read: %d\nSize: %d\n", bytes_read, size);
-		//print_hex(buffer, size);
+	cpu->reset();
+	cpu->set_core(CORE_JIT);
+
+	uint8_t* state = (uint8_t*) malloc(STATE_MAX_SIZE);
+	uint8_t* halfway = (uint8_t*) malloc(STATE_MAX_SIZE);
+	size_t size = 0;
+	unsigned long middle = frames / 2;
+	uint64_t start_cycle = cpu->get_cycles();
+	double save_seconds = 0;
+
+	for (unsigned long frame = 0; frame < frames; frame++) {
+		// Buttons change every frame so they have to come back with the state
+		cpu->set_buttons(0, (frame * 37) & 0xFF);
+
+		auto start = chrono::steady_clock::now();
+		size = cpu->save_state(state, STATE_MAX_SIZE);
+		save_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if (frame == middle) {
+			memcpy(halfway, state, size);
+		}
+
+		cpu->run_until(start_cycle + (frame + 1) * CYCLES_PER_FRAME);
 	}
 
-	// Map the bytes to the correct locations in memory
-	int bytes_mapped = cpu->load_cpu(buffer, size);
-	if (bytes_mapped <= 16) {
-		printf("Error while loading ROM to the CPU, please report the bug or try a different ROM");
-		free(buffer);
+	uint64_t expected = cpu->state_hash();
+
+	// Timed over loads going back and forth between the last state and the halfway one, so each load changes memory
+	const int loads = 100;
+	int failed = 0;
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < loads && !failed; i++) {
+		failed = cpu->load_state(state, STATE_MAX_SIZE) || cpu->load_state(halfway, STATE_MAX_SIZE);
+	}
+	double load_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() / (2 * loads);
+
+	for (unsigned long frame = middle; frame < frames && !failed; frame++) {
+		cpu->set_buttons(0, (frame * 37) & 0xFF);
+		cpu->run_until(start_cycle + (frame + 1) * CYCLES_PER_FRAME);
+	}
+
+	bool same = !failed && cpu->state_hash() == expected;
+	printf("%lu states of %zu bytes, %.2f us per save, %.2f us per load, run from frame %lu %s\n", frames, size,
+		frames ? save_seconds * 1e6 / frames : 0.0, load_seconds * 1e6, middle, same ? "matches" : "diverged");
+
+	free(state);
+	free(halfway);
+	delete cpu;
+
+	return same ? 0 : 1;
+}
+
+// Record every frame into the rewind buffer, then step all the way back checking each frame comes back as it was
+int rewind_history(const char* game, unsigned long frames, size_t buffer_size) {
+	NES_Cpu* cpu = new NES_Cpu();
+	if (load(cpu, game)) {
+		delete cpu;
 		return 1;
 	}
 
-	if (trace) {
-		printf("CPU loading used the first %d byte(s) of ROM");
+	cpu->reset();
+	cpu->set_core(CORE_CACHED);
+
+	NES_Rewind* history = new NES_Rewind(buffer_size);
+	vector<uint64_t> hashes;
+	uint64_t start_cycle = cpu->get_cycles();
+	double push_seconds = 0;
+
+	for (unsigned long frame = 0; frame < frames; frame++) {
+		cpu->set_buttons(0, (frame * 37) & 0xFF);
+
+		auto start = chrono::steady_clock::now();
+		history->push(cpu);
+		push_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		hashes.push_back(cpu->state_hash());
+		cpu->run_until(start_cycle + (frame + 1) * CYCLES_PER_FRAME);
 	}
 
+	size_t held = history->frames();
+	size_t bytes = history->bytes();
+	double pop_seconds = 0;
+	unsigned long wrong = 0;
+
+	for (size_t i = 0; i < held; i++) {
+		auto start = chrono::steady_clock::now();
+		bool popped = history->pop(cpu);
+		pop_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-	// TODO: Learn about PPU and initialize it here, continuing with bytes_mapped
+		if (!popped || cpu->state_hash() != hashes[frames - 1 - i]) {
+			wrong++;
+		}
+	}
 
+	printf("%zu of %lu frames held in %zu bytes (%.0f bytes per frame), %.2f us per push, %.2f us per step back, %lu wrong\n",
+		held, frames, bytes, held ? (double) bytes / held : 0.0, frames ? push_seconds * 1e6 / frames : 0.0,
+		held ? pop_seconds * 1e6 / held : 0.0, wrong);
 
-	printf("Game loaded\n");
+	delete history;
+	delete cpu;
+
+	return wrong ? 1 : 0;
+}
+
+// Record a movie of the game from reset, with the buttons of an input script or none held
+int record_movie(const char* game, const char* path, unsigned long frames, const char* script) {
+	vector<uint64_t> input_frames;
+	vector<uint16_t> input_buttons;
+
+	if (script != NULL && read_input_script(script, &input_frames, &input_buttons)) {
+		printf("Failed to read input script %s\n", script);
+		return 1;
+	}
 
-	free(buffer);
+	NES_Cpu* cpu = new NES_Cpu();
+	if (load(cpu, game)) {
+		delete cpu;
+		return 1;
+	}
+
+	cpu->reset();
+	cpu->set_core(CORE_JIT);
+
+	NES_Movie movie;
+	movie.begin(cpu);
+
+	uint16_t held = 0;
+	size_t next_input = 0;
+
+	for (unsigned long frame = 0; frame < frames; frame++) {
+		while (next_input < input_frames.size() && input_frames[next_input] <= frame) {
+			held = input_buttons[next_input++];
+		}
+
+		movie.record(cpu, held & 0x00FF, held >> 8);
+	}
+
+	delete cpu;
+
+	if (movie.save(path)) {
+		printf("Failed to write movie %s\n", path);
+		return 1;
+	}
+
+	printf("%zu frames recorded, end state %016llx\n", movie.frames(), (unsigned long long) movie.end_state());
 
 	return 0;
 }
 
-int main(int argc, char * argv[]) {
+// Play a movie back headless from reset and check it ends on the recorded state
+int replay_movie(const char* game, const char* path) {
+	NES_Movie movie;
+	if (movie.load(path)) {
+		printf("Failed to read movie %s\n", path);
+		return 1;
+	}
 
-	// Get the path to the game
-	char game_file[20];
-	printf("Enter the game's name\n");
-	cin >> game_file;
+	NES_Cpu* cpu = new NES_Cpu();
+	if (load(cpu, game)) {
+		delete cpu;
+		return 1;
+	}
+
+	cpu->reset();
+	cpu->set_core(CORE_JIT);
+
+	if (cpu->state_hash() != movie.start_state()) {
+		printf("Start state %016llx doesn't match the movie's %016llx\n", (unsigned long long) cpu->state_hash(),
+			(unsigned long long) movie.start_state());
+		delete cpu;
+		return 1;
+	}
+
+	auto start = chrono::steady_clock::now();
+	int failed = movie.play(cpu);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	printf("%zu frames in %.3f s (%.0f frames/s), end state %016llx, %s\n", movie.frames(), seconds,
+		seconds > 0 ? movie.frames() / seconds : 0.0, (unsigned long long) cpu->state_hash(),
+		failed ? "MISMATCH" : "matches");
+
+	delete cpu;
+
+	return failed;
+}
+
+// Run the game on the predecoded core with and without the profiler, then report where the cycles went
+int profile(const char* game, unsigned long frames, const char* collapsed, const char* symbols) {
+	NES_Profile* profile = new NES_Profile();
+	if (symbols != NULL && profile->load_symbols(symbols)) {
+		delete profile;
+		return 1;
+	}
+
+	double seconds[2];
+
+	for (int profiled = 0; profiled < 2; profiled++) {
+		NES_Cpu* cpu = new NES_Cpu();
+		if (load(cpu, game)) {
+			delete cpu;
+			delete profile;
+			return 1;
+		}
+
+		cpu->reset();
+		cpu->set_core(CORE_CACHED);
+		cpu->set_profile(profiled ? profile : NULL);
+
+		auto start = chrono::steady_clock::now();
+		cpu->run_until(cpu->get_cycles() + frames * CYCLES_PER_FRAME);
+		seconds[profiled] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		delete cpu;
+	}
+
+	profile->report(20);
+	printf("%lu frames in %.3f s profiled, %.3f s without (%.2fx)\n", frames, seconds[1], seconds[0],
+		seconds[0] > 0 ? seconds[1] / seconds[0] : 0.0);
+
+	int failed = collapsed != NULL ? profile->save_collapsed(collapsed, true) : 0;
+	delete profile;
+
+	return failed;
+}
+
+// Run the game from reset for a number of frames and write the last one drawn as a binary PPM
+int screenshot(const char* game, const char* path, unsigned long frames) {
+	NES_Cpu* cpu = new NES_Cpu();
+	if (load(cpu, game)) {
+		delete cpu;
+		return 1;
+	}
+
+	cpu->reset();
+	cpu->set_core(CORE_CACHED);
+	cpu->draw_frames();
+
+	uint64_t target = cpu->get_frames() + frames;
+	while (cpu->get_frames() < target) {
+		cpu->run_until(cpu->get_cycles() + CYCLES_PER_FRAME / 4);
+	}
+
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		printf("Failed to open %s\n", path);
+		delete cpu;
+		return 1;
+	}
+
+	const uint8_t* frame = cpu->get_frame();
+	fprintf(file, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+
+	for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+		fwrite(NES_Ppu::colors[frame[i] & 0x3F], 1, 3, file);
+	}
+
+	fclose(file);
+	printf("Frame %llu written to %s\n", (unsigned long long) cpu->get_frames(), path);
+
+	delete cpu;
+	return 0;
+}
+
+/*
+	Runs the game from reset for a number of frames, a frame being CYCLES_PER_FRAME cycles. There is no window
+	yet, so a run that isn't headless only keeps to the console's frame rate. The bench report is the whole-system
+	throughput: PPU, mapper and events included, unlike benchmark() and NES_Bench.
+*/
+int run_game(const char* game, unsigned long frames, int core, bool headless, bool bench) {
+	NES_Cpu* cpu = new NES_Cpu();
+	if (load(cpu, game)) {
+		delete cpu;
+		return 1;
+	}
+
+	cpu->reset();
+	cpu->set_core(core);
+
+	if (!headless) {
+		printf("No display in this build, running at %.2f frames/s without one\n", (double) CPU_FREQUENCY / CYCLES_PER_FRAME);
+	}
+
+	uint64_t start_cycle = cpu->get_cycles();
+	auto start = chrono::steady_clock::now();
+
+	for (unsigned long frame = 0; frame < frames; frame++) {
+		cpu->run_until(start_cycle + (frame + 1) * CYCLES_PER_FRAME);
+
+		if (!headless) {
+			this_thread::sleep_until(start + chrono::nanoseconds((uint64_t)(frame + 1) * CYCLES_PER_FRAME * 1000000000 /
+				CPU_FREQUENCY));
+		}
+	}
+
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	uint64_t instructions = cpu->get_instructions();
+
+	if (bench) {
+		printf("%lu frames in %.3f s (%.1f frames/s, %.1fx real time), %llu instructions (%.0f instructions/s), "
+			"%llu cycles\n", frames, seconds, seconds > 0 ? frames / seconds : 0.0,
+			seconds > 0 ? frames / seconds * CYCLES_PER_FRAME / CPU_FREQUENCY : 0.0, (unsigned long long) instructions,
+			seconds > 0 ? instructions / seconds : 0.0, (unsigned long long) (cpu->get_cycles() - start_cycle));
+	}
 
-	int load_result = load(&cpu, game_file);
+	printf("End state %016llx after %llu frames\n", (unsigned long long) cpu->state_hash(),
+		(unsigned long long) cpu->get_frames());
 
+	delete cpu;
 	return 0;
 }
+
+int main(int argc, char * argv[]) {
+
+	/*
+		Usage: NES run [game] [--frames N] [--headless] [--bench] [--core table|fused|cached|jit]
+		       NES [game] [table|fused|cached|jit|verify] [instructions]
+		       NES [game] lockstep [lanes] [frames]
+		       NES [game] state [frames]
+		       NES [game] rewind [frames] [buffer bytes]
+		       NES [game] record [movie] [frames] [input script]
+		       NES [game] replay [movie]
+		       NES [game] profile [frames] [collapsed stacks] [symbols]
+		       NES [game] screenshot [image] [frames]
+		       NES batch [job list] [threads]
+		       NES bench [results] [baseline] [table|fused|cached|jit]
+		       NES check [hashes] [table|fused|cached|jit]
+
+		run plays the game from reset for N frames (600 by default) on the cached core unless another is given,
+		at the console's frame rate or as fast as it goes when headless. --bench reports the emulated frames,
+		instructions per second and wall time, the standard measure of whole-system throughput.
+		Without arguments the game's name is read from the prompt. When an instruction count is given, the
+		game is run headless for that many instructions on the chosen core and the throughput is printed.
+		verify runs every other core next to the table-driven core and compares their state as they go.
+		lockstep runs many lanes of the game together (see NES_Lockstep) and checks them against separate runs,
+		it fails when a lane ends elsewhere or running them together was the slower of the two.
+		state takes a save state every frame and checks that loading one replays the same.
+		rewind records every frame into an NES_Rewind buffer and checks stepping back through all of them.
+		record saves the buttons of every frame from reset into a movie (see NES_Movie), replay plays one back
+		as fast as it goes and checks it ends on the recorded state.
+		profile counts the cycles of every address and call stack (see NES_Profile) and prints the busiest
+		addresses, the call stacks are written in the collapsed format flamegraph.pl reads.
+		screenshot runs the game for a number of frames and writes the picture the PPU drew last as a PPM image.
+		batch runs every job of the list on its own instance across all hardware threads (see NES_Batch).
+		bench times every instruction and addressing mode on every core, or only the given one (see NES_Bench),
+		writes the results and compares them against the baseline, failing when a case got slower.
+		check runs the same programs and an MMC3 IRQ one untimed and writes the state hash each ends on, failing
+		when the IRQ program ends elsewhere after a state load. make flags diffs the files of a lazy and an eager
+		flags build.
+	*/
+	if (argc > 2 && strcmp(argv[1], "batch") == 0) {
+		int threads = argc > 3 ? atoi(argv[3]) : (int) thread::hardware_concurrency();
+		NES_Batch batch(threads);
+
+		if (batch.load_jobs(argv[2])) {
+			return 1;
+		}
+
+		batch.run();
+		return batch.report() ? 1 : 0;
+	}
+
+	if (argc > 2 && strcmp(argv[1], "run") == 0) {
+		const char* cores[] = { "table", "fused", "cached", "jit" };
+		unsigned long frames = 600;
+		int core = CORE_CACHED;
+		bool headless = false;
+		bool bench = false;
+
+		for (int i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+				frames = strtoul(argv[++i], NULL, 10);
+			}
+			else if (strcmp(argv[i], "--headless") == 0) {
+				headless = true;
+			}
+			else if (strcmp(argv[i], "--bench") == 0) {
+				bench = true;
+			}
+			else if (strcmp(argv[i], "--core") == 0 && i + 1 < argc) {
+				core = -1;
+				i++;
+
+				for (int c = 0; c < 4; c++) {
+					if (strcmp(argv[i], cores[c]) == 0) {
+						core = c;
+					}
+				}
+
+				if (core < 0) {
+					printf("Unknown core %s\n", argv[i]);
+					return 1;
+				}
+			}
+			else {
+				printf("Unknown option %s\n", argv[i]);
+				return 1;
+			}
+		}
+
+		return run_game(argv[2], frames, core, headless, bench);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		const char* cores[] = { "table", "fused", "cached", "jit" };
+		int core = -1;
+
+		for (int c = 0; c < 4; c++) {
+			if (argc > 4 && strcmp(argv[4], cores[c]) == 0) {
+				core = c;
+			}
+		}
+
+		NES_Bench bench;
+		bench.run(core);
+		bench.report();
+
+		if (argc > 2 && bench.save(argv[2])) {
+			return 1;
+		}
+
+		return argc > 3 && bench.compare(argv[3], BENCH_TOLERANCE) ? 1 : 0;
+	}
+
+	if (argc > 2 && strcmp(argv[1], "check") == 0) {
+		const char* cores[] = { "table", "fused", "cached", "jit" };
+		int core = -1;
+
+		for (int c = 0; c < 4; c++) {
+			if (argc > 3 && strcmp(argv[3], cores[c]) == 0) {
+				core = c;
+			}
+		}
+
+		NES_Bench bench(BENCH_CHECK_INSTRUCTIONS);
+		int failed = bench.check(core);
+
+		return bench.save_hashes(argv[2]) || failed ? 1 : 0;
+	}
+
+	if (argc > 1) {
+		if (load(&cpu, argv[1])) {
+			return 1;
+		}
+
+		if (argc > 2 && strcmp(argv[2], "fused") == 0) {
+			cpu.set_core(CORE_FUSED);
+		}
+		else if (argc > 2 && strcmp(argv[2], "cached") == 0) {
+			cpu.set_core(CORE_CACHED);
+		}
+		else if (argc > 2 && strcmp(argv[2], "jit") == 0) {
+			cpu.set_core(CORE_JIT);
+		}
+		else if (argc > 2 && strcmp(argv[2], "verify") == 0) {
+			return verify(argv[1], argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000);
+		}
+		else if (argc > 2 && strcmp(argv[2], "state") == 0) {
+			return save_states(argv[1], argc > 3 ? strtoul(argv[3], NULL, 10) : 600);
+		}
+		else if (argc > 2 && strcmp(argv[2], "rewind") == 0) {
+			return rewind_history(argv[1], argc > 3 ? strtoul(argv[3], NULL, 10) : 3600,
+				argc > 4 ? strtoul(argv[4], NULL, 10) : REWIND_BUFFER_SIZE);
+		}
+		else if (argc > 3 && strcmp(argv[2], "record") == 0) {
+			return record_movie(argv[1], argv[3], argc > 4 ? strtoul(argv[4], NULL, 10) : 3600, argc > 5 ? argv[5] : NULL);
+		}
+		else if (argc > 3 && strcmp(argv[2], "replay") == 0) {
+			return replay_movie(argv[1], argv[3]);
+		}
+		else if (argc > 2 && strcmp(argv[2], "profile") == 0) {
+			return profile(argv[1], argc > 3 ? strtoul(argv[3], NULL, 10) : 600, argc > 4 ? argv[4] : NULL,
+				argc > 5 ? argv[5] : NULL);
+		}
+		else if (argc > 3 && strcmp(argv[2], "screenshot") == 0) {
+			return screenshot(argv[1], argv[3], argc > 4 ? strtoul(argv[4], NULL, 10) : 60);
+		}
+		else if (argc > 2 && strcmp(argv[2], "lockstep") == 0) {
+			return lockstep(argv[1], argc > 3 ? atoi(argv[3]) : 64, argc > 4 ? strtoul(argv[4], NULL, 10) : 60);
+		}
+
+		if (argc > 3) {
+			benchmark(&cpu, strtoul(argv[3], NULL, 10));
+
+			// Last instructions that ran, only recorded when built with TRACE_POLICY set to TRACE_RING
+			cpu.dump_trace();
+		}
+
+		return 0;
+	}
+
+	// Get the path to the game, the whole line so paths can have spaces
+	string game_file;
+	printf("Enter the game's name\n");
+	getline(cin, game_file);
+
+	return load(&cpu, game_file.c_str());
+}
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "NES.h"
+
+
+/*
+	Bank mapping
+
+	Every helper only rewrites page pointers. A CPU page that ends up pointing where it already did keeps its
+	decoded code, one that changes has whatever was decoded on it dropped, so switching to the bank that is
+	already in costs nothing and switching to another doesn't depend on how big it is.
+*/
+void NES_Mapper::power(NES_Cpu*) const {
+}
+
+void NES_Mapper::scanline(NES_Cpu*) const {
+}
+
+int NES_Mapper::scanlines_to_irq(NES_Cpu*) const {
+	return 0;
+}
+
+bool NES_Mapper::irq_line(NES_Cpu*) const {
+	return false;
+}
+
+bool NES_Mapper::has_registers() const {
+	return true;
+}
+
+bool NES_Mapper::has_irq() const {
+	return false;
+}
+
+uint8_t* NES_Mapper::registers(NES_Cpu* cpu) {
+	return cpu->mapper_registers;
+}
+
+uint32_t NES_Mapper::prg_size(NES_Cpu* cpu) {
+	return cpu->cartridge->prg_size;
+}
+
+int NES_Mapper::header_mirroring(NES_Cpu* cpu) {
+	return cpu->cartridge->mirroring;
+}
+
+void NES_Mapper::map_prg(NES_Cpu* cpu, int first_page, int pages, uint32_t offset) {
+	const NES_Cartridge* cartridge = cpu->cartridge;
+
+	for (int i = 0; i < pages; i++) {
+		int page = first_page + i;
+		uint8_t* memory_page = cartridge->prg_rom + (offset + (i << 8)) % cartridge->prg_size;
+
+		if (cpu->read_pages[page] != memory_page) {
+			cpu->read_pages[page] = memory_page;
+			cpu->invalidate_range(page << 8, page << 8 | 0x00FF);
+		}
+
+		// Writes to ROM are the mapper's, a board without registers ignores them without disturbing the PPU
+		cpu->write_pages[page] = NULL;
+		cpu->read_handlers[page] = NULL;
+		cpu->write_handlers[page] = cartridge->mapper->has_registers() ? &NES_Cpu::write_mapper : &NES_Cpu::write_ignored;
+	}
+
+	// The decoded instructions follow the bank
+	cpu->map_decoded(first_page, first_page + pages - 1);
+}
+
+void NES_Mapper::map_chr(NES_Cpu* cpu, int first_page, int pages, uint32_t offset) {
+	const NES_Cartridge* cartridge = cpu->cartridge;
+
+	// CHR RAM is the instance's own
+	uint8_t* chr = cartridge->chr_ram ? cpu->chr_ram.data() : cartridge->chr_rom;
+	uint32_t chr_size = cartridge->chr_ram ? cpu->chr_ram.size() : cartridge->chr_size;
+
+	for (int i = 0; i < pages; i++) {
+		cpu->chr_pages[first_page + i] = chr + (offset + (i << 10)) % chr_size;
+	}
+}
+
+void NES_Mapper::map_nametables(NES_Cpu* cpu, int mirroring) {
+	// Which 1 KB of vram each of the four nametables uses
+	static const int layouts[5][4] = {
+		{ 0, 0, 1, 1 },				// MIRROR_HORIZONTAL
+		{ 0, 1, 0, 1 },				// MIRROR_VERTICAL
+		{ 0, 0, 0, 0 },				// MIRROR_SINGLE_LOWER
+		{ 1, 1, 1, 1 },				// MIRROR_SINGLE_UPPER
+		{ 0, 1, 2, 3 }				// MIRROR_FOUR_SCREEN
+	};
+
+	for (int i = 0; i < 4; i++) {
+		cpu->nametable_pages[i] = cpu->vram + layouts[mirroring][i] * 0x0400;
+	}
+}
+
+
+/*
+	NROM (0)
+
+	16 or 32 KB of PRG ROM and 8 KB of CHR, nothing switches.
+*/
+class NES_Mapper_NROM : public NES_Mapper {
+	public:
+		void write(NES_Cpu*, uint16_t, uint8_t) const {
+		}
+
+		bool has_registers() const {
+			return false;
+		}
+
+		void map(NES_Cpu* cpu) const {
+			map_prg(cpu, 0x80, 0x80, 0);
+			map_chr(cpu, 0, 8, 0);
+			map_nametables(cpu, header_mirroring(cpu));
+		}
+};
+
+
+/*
+	MMC1 (1)
+
+	Registers are written one bit at a time through a 5 bit shift register, bit 7 set resets it. The fifth write
+	goes to the register picked by address bits 13 - 14:
+
+		$8000	Control	(CPPMM)	CHR in 4 KB banks (C), PRG mode (PP), mirroring (MM)
+		$A000	CHR bank 0, the 8 KB bank when C is clear (low bit ignored)
+		$C000	CHR bank 1
+		$E000	PRG bank, 16 KB
+
+	PRG modes 0 and 1 switch 32 KB at $8000 (low bit ignored), 2 fixes the first bank at $8000 and switches $C000,
+	3 switches $8000 and fixes the last bank at $C000. On 512 KB boards (SUROM) bit 4 of CHR bank 0 picks the
+	256 KB half the PRG banks come from.
+*/
+#define MMC1_SHIFT		0
+#define MMC1_COUNT		1
+#define MMC1_CONTROL	2
+#define MMC1_CHR0		3
+#define MMC1_CHR1		4
+#define MMC1_PRG		5
+
+class NES_Mapper_MMC1 : public NES_Mapper {
+	public:
+		void power(NES_Cpu* cpu) const {
+			registers(cpu)[MMC1_CONTROL] = 0x0C;
+		}
+
+		void write(NES_Cpu* cpu, uint16_t address, uint8_t data) const {
+			uint8_t* r = registers(cpu);
+
+			if (data & 0x80) {
+				r[MMC1_SHIFT] = 0;
+				r[MMC1_COUNT] = 0;
+				r[MMC1_CONTROL] |= 0x0C;
+				map(cpu);
+				return;
+			}
+
+			r[MMC1_SHIFT] |= (data & 0x01) << r[MMC1_COUNT];
+			r[MMC1_COUNT]++;
+
+			if (r[MMC1_COUNT] == 5) {
+				r[MMC1_CONTROL + ((address >> 13) & 0x03)] = r[MMC1_SHIFT];
+				r[MMC1_SHIFT] = 0;
+				r[MMC1_COUNT] = 0;
+				map(cpu);
+			}
+		}
+
+		void map(NES_Cpu* cpu) const {
+			uint8_t* r = registers(cpu);
+			uint32_t outer = prg_size(cpu) > 0x40000 ? (r[MMC1_CHR0] & 0x10) * 0x4000 : 0;
+			uint32_t bank = outer + (r[MMC1_PRG] & 0x0F) * 0x4000;
+
+			switch ((r[MMC1_CONTROL] >> 2) & 0x03) {
+				case 0:
+				case 1:
+					map_prg(cpu, 0x80, 0x80, bank & ~0x7FFF);
+					break;
+
+				case 2:
+					map_prg(cpu, 0x80, 0x40, outer);
+					map_prg(cpu, 0xC0, 0x40, bank);
+					break;
+
+				case 3:
+					map_prg(cpu, 0x80, 0x40, bank);
+					map_prg(cpu, 0xC0, 0x40, outer + 0x3C000);
+					break;
+			}
+
+			if (r[MMC1_CONTROL] & 0x10) {
+				map_chr(cpu, 0, 4, r[MMC1_CHR0] * 0x1000);
+				map_chr(cpu, 4, 4, r[MMC1_CHR1] * 0x1000);
+			}
+			else {
+				map_chr(cpu, 0, 8, (r[MMC1_CHR0] & 0x1E) * 0x1000);
+			}
+
+			static const int mirroring[4] = { MIRROR_SINGLE_LOWER, MIRROR_SINGLE_UPPER, MIRROR_VERTICAL, MIRROR_HORIZONTAL };
+			map_nametables(cpu, mirroring[r[MMC1_CONTROL] & 0x03]);
+		}
+};
+
+
+/*
+	UxROM (2)
+
+	Any write switches the 16 KB at $8000, the last bank is fixed at $C000. CHR is 8 KB of RAM.
+*/
+class NES_Mapper_UxROM : public NES_Mapper {
+	public:
+		void write(NES_Cpu* cpu, uint16_t, uint8_t data) const {
+			registers(cpu)[0] = data;
+			map(cpu);
+		}
+
+		void map(NES_Cpu* cpu) const {
+			map_prg(cpu, 0x80, 0x40, registers(cpu)[0] * 0x4000);
+			map_prg(cpu, 0xC0, 0x40, prg_size(cpu) - 0x4000);
+			map_chr(cpu, 0, 8, 0);
+			map_nametables(cpu, header_mirroring(cpu));
+		}
+};
+
+
+/*
+	CNROM (3)
+
+	PRG is fixed like NROM, any write switches the 8 KB of CHR.
+*/
+class NES_Mapper_CNROM : public NES_Mapper {
+	public:
+		void write(NES_Cpu* cpu, uint16_t, uint8_t data) const {
+			registers(cpu)[0] = data;
+			map(cpu);
+		}
+
+		void map(NES_Cpu* cpu) const {
+			map_prg(cpu, 0x80, 0x80, 0);
+			map_chr(cpu, 0, 8, registers(cpu)[0] * 0x2000);
+			map_nametables(cpu, header_mirroring(cpu));
+		}
+};
+
+
+/*
+	MMC3 (4)
+
+	Even and odd addresses in each 8 KB range are different registers:
+
+		$8000	Bank select (CP-- -RRR)	CHR A12 inversion (C), PRG mode (P), register R0 - R7 the next $8001 sets
+		$8001	Bank data
+		$A000	Mirroring, 0 vertical, 1 horizontal
+		$A001	PRG RAM protect, ignored
+		$C000	IRQ latch
+		$C001	IRQ reload
+		$E000	IRQ disable
+		$E001	IRQ enable
+
+	R0 and R1 are 2 KB CHR banks, R2 - R5 1 KB ones, in the other half of the pattern tables when C is set. R6 and
+	R7 are 8 KB PRG banks at $8000 (or $C000 when P is set) and $A000, the second to last bank takes the other of
+	$8000/$C000 and the last is fixed at $E000. The IRQ counter is clocked by scanline(). Reaching 0 holds the
+	CPU's IRQ line until $E000 acknowledges it, so an IRQ raised while I is set is taken once the program clears it.
+*/
+#define MMC3_SELECT		0
+#define MMC3_BANKS		1				// R0 - R7
+#define MMC3_MIRRORING	9
+#define MMC3_LATCH		10
+#define MMC3_COUNTER	11
+#define MMC3_RELOAD		12
+#define MMC3_ENABLE		13
+#define MMC3_PENDING	14				// Holding the IRQ line
+
+class NES_Mapper_MMC3 : public NES_Mapper {
+	public:
+		bool has_irq() const {
+			return true;
+		}
+
+		void power(NES_Cpu* cpu) const {
+			static const uint8_t banks[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+			memcpy(registers(cpu) + MMC3_BANKS, banks, sizeof(banks));
+		}
+
+		void write(NES_Cpu* cpu, uint16_t address, uint8_t data) const {
+			uint8_t* r = registers(cpu);
+
+			switch (address & 0xE001) {
+				case 0x8000:
+					r[MMC3_SELECT] = data;
+					map(cpu);
+					break;
+
+				case 0x8001:
+					r[MMC3_BANKS + (r[MMC3_SELECT] & 0x07)] = data;
+					map(cpu);
+					break;
+
+				case 0xA000:
+					r[MMC3_MIRRORING] = data & 0x01;
+					map(cpu);
+					break;
+
+				case 0xC000:
+					r[MMC3_LATCH] = data;
+					break;
+
+				case 0xC001:
+					r[MMC3_COUNTER] = 0;
+					r[MMC3_RELOAD] = 1;
+					break;
+
+				case 0xE000:
+					r[MMC3_ENABLE] = 0;
+					r[MMC3_PENDING] = 0;
+					break;
+
+				case 0xE001:
+					r[MMC3_ENABLE] = 1;
+					break;
+			}
+		}
+
+		void map(NES_Cpu* cpu) const {
+			uint8_t* r = registers(cpu);
+			uint8_t* bank = r + MMC3_BANKS;
+			uint32_t second_last = prg_size(cpu) - 0x4000;
+
+			map_prg(cpu, (r[MMC3_SELECT] & 0x40) ? 0xC0 : 0x80, 0x20, bank[6] * 0x2000);
+			map_prg(cpu, 0xA0, 0x20, bank[7] * 0x2000);
+			map_prg(cpu, (r[MMC3_SELECT] & 0x40) ? 0x80 : 0xC0, 0x20, second_last);
+			map_prg(cpu, 0xE0, 0x20, second_last + 0x2000);
+
+			int inversion = (r[MMC3_SELECT] & 0x80) ? 4 : 0;
+			map_chr(cpu, 0 ^ inversion, 2, (bank[0] & 0xFE) * 0x0400);
+			map_chr(cpu, 2 ^ inversion, 2, (bank[1] & 0xFE) * 0x0400);
+			for (int i = 0; i < 4; i++) {
+				map_chr(cpu, (4 + i) ^ inversion, 1, bank[2 + i] * 0x0400);
+			}
+
+			if (header_mirroring(cpu) == MIRROR_FOUR_SCREEN) {
+				map_nametables(cpu, MIRROR_FOUR_SCREEN);
+			}
+			else {
+				map_nametables(cpu, r[MMC3_MIRRORING] ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
+			}
+		}
+
+		void scanline(NES_Cpu* cpu) const {
+			uint8_t* r = registers(cpu);
+
+			if (r[MMC3_COUNTER] == 0 || r[MMC3_RELOAD]) {
+				r[MMC3_COUNTER] = r[MMC3_LATCH];
+				r[MMC3_RELOAD] = 0;
+			}
+			else {
+				r[MMC3_COUNTER]--;
+			}
+
+			// The CPU takes it when it services the line's event, or once I is cleared
+			if (r[MMC3_COUNTER] == 0 && r[MMC3_ENABLE]) {
+				r[MMC3_PENDING] = 1;
+			}
+		}
+
+		bool irq_line(NES_Cpu* cpu) const {
+			return registers(cpu)[MMC3_PENDING] != 0;
+		}
+
+		// The first clock reloads or counts down once, every one after that counts down
+		int scanlines_to_irq(NES_Cpu* cpu) const {
+			uint8_t* r = registers(cpu);
+
+			if (!r[MMC3_ENABLE]) {
+				return 0;
+			}
+
+			int after_first = (r[MMC3_COUNTER] == 0 || r[MMC3_RELOAD]) ? r[MMC3_LATCH] : r[MMC3_COUNTER] - 1;
+			return 1 + after_first;
+		}
+};
+
+
+/*
+	AxROM (7)
+
+	Any write switches 32 KB of PRG with bits 0 - 2 and picks the single nametable with bit 4. CHR is 8 KB of RAM.
+*/
+class NES_Mapper_AxROM : public NES_Mapper {
+	public:
+		void write(NES_Cpu* cpu, uint16_t, uint8_t data) const {
+			registers(cpu)[0] = data;
+			map(cpu);
+		}
+
+		void map(NES_Cpu* cpu) const {
+			map_prg(cpu, 0x80, 0x80, (registers(cpu)[0] & 0x07) * 0x8000);
+			map_chr(cpu, 0, 8, 0);
+			map_nametables(cpu, (registers(cpu)[0] & 0x10) ? MIRROR_SINGLE_UPPER : MIRROR_SINGLE_LOWER);
+		}
+};
+
+
+const NES_Mapper* NES_Mapper::find(int number) {
+	static const NES_Mapper_NROM nrom;
+	static const NES_Mapper_MMC1 mmc1;
+	static const NES_Mapper_UxROM uxrom;
+	static const NES_Mapper_CNROM cnrom;
+	static const NES_Mapper_MMC3 mmc3;
+	static const NES_Mapper_AxROM axrom;
+
+	switch (number) {
+		case MAPPER_NROM:
+			return &nrom;
+		case MAPPER_MMC1:
+			return &mmc1;
+		case MAPPER_UXROM:
+			return &uxrom;
+		case MAPPER_CNROM:
+			return &cnrom;
+		case MAPPER_MMC3:
+			return &mmc3;
+		case MAPPER_AXROM:
+			return &axrom;
+	}
+
+	return NULL;
+}
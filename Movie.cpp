@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "NES.h"
+#include "util.h"
+
+
+#define MOVIE_HEADER_SIZE	28
+
+
+NES_Movie::NES_Movie() {
+	start_hash = 0;
+	end_hash = 0;
+	start_cycle = 0;
+}
+
+void NES_Movie::begin(NES_Cpu* cpu) {
+	inputs.clear();
+	start_hash = cpu->state_hash();
+	end_hash = start_hash;
+	start_cycle = cpu->get_cycles();
+}
+
+void NES_Movie::record(NES_Cpu* cpu, uint8_t pad0, uint8_t pad1) {
+	cpu->set_buttons(0, pad0);
+	cpu->set_buttons(1, pad1);
+	inputs.push_back(pad1 << 8 | pad0);
+
+	cpu->run_until(start_cycle + inputs.size() * CYCLES_PER_FRAME);
+	end_hash = cpu->state_hash();
+}
+
+int NES_Movie::save(const char* path) {
+	std::vector<uint8_t> file(MOVIE_HEADER_SIZE + inputs.size() * 2);
+
+	uint8_t* out = &file[0];
+	memcpy(out, "NESM", 4);
+	out = put16(out + 4, MOVIE_VERSION);
+	out = put16(out, 0);
+	out = put32(out, inputs.size());
+	out = put64(out, start_hash);
+	out = put64(out, end_hash);
+
+	for (size_t i = 0; i < inputs.size(); i++) {
+		out = put16(out, inputs[i]);
+	}
+
+	FILE* movie = fopen(path, "wb");
+	if (movie == NULL) {
+		return 1;
+	}
+
+	size_t written = fwrite(&file[0], 1, file.size(), movie);
+	fclose(movie);
+
+	return written == file.size() ? 0 : 1;
+}
+
+int NES_Movie::load(const char* path) {
+	int size = 0;
+	uint8_t* file = read_file(path, &size);
+	if (file == NULL) {
+		return 1;
+	}
+
+	// Newer versions might not run the same, so only this one is accepted
+	if (size < MOVIE_HEADER_SIZE || memcmp(file, "NESM", 4) != 0 || get16(file + 4) != MOVIE_VERSION ||
+		(size_t) size != MOVIE_HEADER_SIZE + (size_t) get32(file + 8) * 2) {
+		free(file);
+		return 1;
+	}
+
+	start_hash = get64(file + 12);
+	end_hash = get64(file + 20);
+	start_cycle = 0;
+
+	inputs.resize(get32(file + 8));
+	for (size_t i = 0; i < inputs.size(); i++) {
+		inputs[i] = get16(file + MOVIE_HEADER_SIZE + i * 2);
+	}
+
+	free(file);
+
+	return 0;
+}
+
+int NES_Movie::play(NES_Cpu* cpu) {
+	if (cpu->state_hash() != start_hash) {
+		return 1;
+	}
+
+	uint64_t first_cycle = cpu->get_cycles();
+	uint16_t held = 0;
+
+	cpu->set_buttons(0, 0);
+	cpu->set_buttons(1, 0);
+
+	for (size_t frame = 0; frame < inputs.size(); frame++) {
+		if (inputs[frame] != held) {
+			held = inputs[frame];
+			cpu->set_buttons(0, held & 0x00FF);
+			cpu->set_buttons(1, held >> 8);
+		}
+
+		cpu->run_until(first_cycle + (frame + 1) * CYCLES_PER_FRAME);
+	}
+
+	return cpu->state_hash() == end_hash ? 0 : 1;
+}
+
+size_t NES_Movie::frames() {
+	return inputs.size();
+}
+
+uint64_t NES_Movie::start_state() {
+	return start_hash;
+}
+
+uint64_t NES_Movie::end_state() {
+	return end_hash;
+}
@@ -2,9 +2,12 @@
 
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
 #include <string.h>
 
-// Address modes
+// Address modes, indexes into NES_Cpu::addr_functions
 #define MODE_ILL	0
 #define MODE_ACC	1
 #define MODE_ABS	2
@@ -20,6 +23,65 @@
 #define MODE_ZPG_X	12
 #define MODE_ZPG_Y	13
 
+// Instruction types, indexes into NES_Cpu::operation_functions
+#define OP_ADC		0
+#define OP_AND		1
+#define OP_ASL		2
+#define OP_BCC		3
+#define OP_BCS		4
+#define OP_BEQ		5
+#define OP_BIT		6
+#define OP_BMI		7
+#define OP_BNE		8
+#define OP_BPL		9
+#define OP_BRK		10
+#define OP_BVC		11
+#define OP_BVS		12
+#define OP_CLC		13
+#define OP_CLD		14
+#define OP_CLI		15
+#define OP_CLV		16
+#define OP_CMP		17
+#define OP_CPX		18
+#define OP_CPY		19
+#define OP_DEC		20
+#define OP_DEX		21
+#define OP_DEY		22
+#define OP_EOR		23
+#define OP_INC		24
+#define OP_INX		25
+#define OP_INY		26
+#define OP_JMP		27
+#define OP_JSR		28
+#define OP_LDA		29
+#define OP_LDX		30
+#define OP_LDY		31
+#define OP_LSR		32
+#define OP_NOP		33
+#define OP_ORA		34
+#define OP_PHA		35
+#define OP_PHP		36
+#define OP_PLA		37
+#define OP_PLP		38
+#define OP_ROL		39
+#define OP_ROR		40
+#define OP_RTI		41
+#define OP_RTS		42
+#define OP_SBC		43
+#define OP_SEC		44
+#define OP_SED		45
+#define OP_SEI		46
+#define OP_STA		47
+#define OP_STX		48
+#define OP_STY		49
+#define OP_TAX		50
+#define OP_TAY		51
+#define OP_TSX		52
+#define OP_TXA		53
+#define OP_TXS		54
+#define OP_TYA		55
+#define OP_ILL		56
+
 // Locations
 #define STACK_OFFSET 0x0200
 
@@ -44,10 +106,428 @@
 // Common sizes
 #define PRG_ROM_UNIT	16384
 #define CHR_ROM_UNIT	8192
+#define PRG_BANK_MIN	0x2000				// Smallest PRG ROM bank a mapper switches, decoded instructions don't cross one
+
+// ROM index, hashes and headers of the ROM files opened so far
+#define ROM_INDEX_DIR	"nes-emulator"			// Under $XDG_CACHE_HOME, or ~/.cache without it
+#define ROM_INDEX_FILE	"rom_index"
+
+// Mappers, by iNES mapper number
+#define MAPPER_NROM		0
+#define MAPPER_MMC1		1
+#define MAPPER_UXROM	2
+#define MAPPER_CNROM	3
+#define MAPPER_MMC3		4
+#define MAPPER_AXROM	7
+#define MAPPER_REGISTERS	16				// Bytes of bank registers kept in the CPU state
+
+// Nametable mirroring
+#define MIRROR_HORIZONTAL	0				// $2000/$2400 share one nametable, $2800/$2C00 the other
+#define MIRROR_VERTICAL		1				// $2000/$2800 share one nametable, $2400/$2C00 the other
+#define MIRROR_SINGLE_LOWER	2				// All four are the first nametable
+#define MIRROR_SINGLE_UPPER	3				// All four are the second nametable
+#define MIRROR_FOUR_SCREEN	4				// Four separate nametables, the cartridge has the other 2 KB
+
+// Timing
+#define CPU_FREQUENCY		1789773			// NTSC CPU clock in Hz
+#define CYCLES_PER_FRAME	29781			// CPU cycles in an NTSC frame (341 * 262 / 3 PPU dots)
+#define OAM_DMA_ADDRESS		0x4014			// Writing a page number here copies the page into OAM
+#define OAM_DMA_CYCLES		513				// CPU cycles the copy halts the CPU for, one more when it starts on an odd one
+
+// Event sources, each has at most one event posted to NES_Scheduler at a time
+#define EVENT_PPU			0				// Vertical blank, or the line after an NMI was enabled during it
+#define EVENT_MAPPER_IRQ	1				// Line whose scanline counter clock raises the mapper's IRQ
+#define EVENT_IRQ			2				// I was cleared while the IRQ line is held, taken before the next instruction
+#define EVENT_SOURCES		3
+#define EVENT_NONE			UINT64_MAX		// Cycle of a source without an event
+
+// PPU
+#define PPU_DOTS_PER_SCANLINE	341			// Three dots per CPU cycle
+#define PPU_SCANLINES			262			// Per frame: 240 visible, post-render, 20 of vertical blank, pre-render
+#define PPU_VBLANK_SCANLINE		241
+#define PPU_PRERENDER_SCANLINE	261
+#define SCREEN_WIDTH			256
+#define SCREEN_HEIGHT			240
+
+// PPU register bits
+#define PPUCTRL_INCREMENT		0x04		// $2007 steps by 32 instead of 1
+#define PPUCTRL_SPRITE_TABLE	0x08		// 8x8 sprites use the pattern table at $1000
+#define PPUCTRL_BACKGROUND_TABLE	0x10	// Background uses the pattern table at $1000
+#define PPUCTRL_SPRITE_SIZE		0x20		// 8x16 sprites
+#define PPUCTRL_NMI				0x80		// NMI at the start of vertical blank
+#define PPUMASK_GRAYSCALE		0x01
+#define PPUMASK_BACKGROUND_LEFT	0x02		// Background in the leftmost 8 pixels
+#define PPUMASK_SPRITES_LEFT	0x04		// Sprites in the leftmost 8 pixels
+#define PPUMASK_BACKGROUND		0x08
+#define PPUMASK_SPRITES			0x10
+#define PPUSTATUS_OVERFLOW		0x20		// More than 8 sprites on a line
+#define PPUSTATUS_SPRITE_ZERO	0x40		// Sprite 0 overlapped the background
+#define PPUSTATUS_VBLANK		0x80
+
+// Controller buttons, in the order $4016/$4017 shift them out
+#define BUTTON_A		0x01
+#define BUTTON_B		0x02
+#define BUTTON_SELECT	0x04
+#define BUTTON_START	0x08
+#define BUTTON_UP		0x10
+#define BUTTON_DOWN		0x20
+#define BUTTON_LEFT		0x40
+#define BUTTON_RIGHT	0x80
+
+// Flag evaluation, 1 keeps N, Z, C and V as their last results and only builds proc_status when it is read
+#ifndef LAZY_FLAGS
+#define LAZY_FLAGS		1
+#endif
+
+// Interpreter cores
+#define CORE_TABLE		0					// Table-driven core, dispatches through instruction_table
+#define CORE_FUSED		1					// Fused core, one handler per opcode
+#define CORE_CACHED		2					// Predecoded core, runs handlers out of the decode cache
+#define CORE_JIT		3					// Basic block recompiler, falls back to CORE_CACHED
+
+// Recompiler limits
+#define JIT_BUFFER_SIZE	0x400000			// Bytes of executable memory for translated blocks
+#define JIT_MAX_BLOCK	64					// Most 6502 instructions translated into one block
+#define JIT_MIN_ADDRESS	0x4020				// Only cartridge space is translated, RAM code is interpreted
+
+// Save states
+#define STATE_VERSION	4					// Format written by save_state(), the only one load_state() takes
+#define STATE_MAX_SIZE	0x6000				// Largest state save_state() writes in this version
+
+// Rewind
+#define REWIND_BUFFER_SIZE	0x1000000		// Default bytes of history, 16 MB
+#define REWIND_KEYFRAME		60					// Frames per full state, the ones between are deltas against it
+
+// Microbenchmarks
+#define BENCH_INSTRUCTIONS	1000000		// Instructions per timed run of a case
+#define BENCH_REPEATS		5				// Timed runs per case, the fastest counts
+#define BENCH_TOLERANCE		10				// Percent slower than the baseline that counts as a regression
+#define BENCH_CHECK_INSTRUCTIONS	100000	// Instructions per case before check() hashes the state
+
+// Input movies
+#define MOVIE_VERSION	1					// Format written by NES_Movie::save()
+
+// Lockstep execution
+#define LOCKSTEP_WIDTH	32					// Lanes in one AVX2 register, lane counts are rounded up to a multiple
+
+// Instruction tracing, picked at compile time so the cores carry no checks for it
+#define TRACE_NONE		0					// No tracing
+#define TRACE_RING		1					// Binary records kept in a ring buffer, printed by dump_trace()
+#define TRACE_LOG		2					// Every instruction printed as it runs
+
+#ifndef TRACE_POLICY
+#define TRACE_POLICY	TRACE_NONE
+#endif
+
+#define TRACE_RING_SIZE	0x1000				// Records kept by TRACE_RING, a power of two
+
+// Guest profiler
+#define PROFILE_MAX_NODES	0x10000			// Call tree nodes, calls past this are counted in the caller
+#define PROFILE_MAX_DEPTH	256				// Deepest call stack kept, JSR recursion past it stays in the caller
+
+// Debug tracing, defined in util.cpp
+extern int trace;
+
+
+class NES_Jit;
+class NES_Cpu;
+class NES_Profile;
+
+// Device handlers for bus pages that aren't plain memory
+typedef uint8_t (*bus_read_handler)(NES_Cpu* cpu, uint16_t address);
+typedef void (*bus_write_handler)(NES_Cpu* cpu, uint16_t address, uint8_t data);
+
+// An instruction as the predecoded core keeps it, see NES_Cpu's decode cache
+typedef void (*decoded_handler)(NES_Cpu* cpu, uint16_t operand);
+
+typedef struct decoded_entry {
+	decoded_handler handler;					// Handler for the opcode, NULL when the entry is not decoded
+	uint16_t operand;							// Operand bytes following the opcode, little endian
+	uint8_t opcode;								// Opcode
+	uint8_t length;								// Number of operand bytes
+	uint8_t cycles;								// Base cycle count
+} decoded_entry;
+
+// CPU state before an instruction, as recorded by the trace policies
+typedef struct trace_record {
+	uint64_t cycle;								// cycle_count before the instruction
+	uint16_t pc;								// Address of the opcode
+	uint8_t opcode;
+	uint8_t operand[2];							// Bytes following the opcode
+	uint8_t accumulator;
+	uint8_t X;
+	uint8_t Y;
+	uint8_t sp;
+	uint8_t status;
+} trace_record;
+
+/*
+	Trace policies
+
+	The interpreter cores take one of these as a template parameter and call record() before every instruction.
+	NES_Trace_None does nothing and compiles away. NES_Trace_Ring copies the state into a trace_record in a
+	preallocated ring buffer and leaves the formatting to dump_trace(). NES_Trace_Log prints every record as it is
+	made. TRACE_POLICY picks which one NES_Trace is.
+
+	NES_Trace_Profile is not picked at compile time, the cores run with it while an NES_Profile is attached.
+*/
+class NES_Trace_None {
+	public:
+		static constexpr bool active = false;
+		static void record(NES_Cpu* cpu);
+};
+
+class NES_Trace_Ring {
+	public:
+		static constexpr bool active = true;
+		static void record(NES_Cpu* cpu);
+};
+
+class NES_Trace_Log {
+	public:
+		static constexpr bool active = true;
+		static void record(NES_Cpu* cpu);
+};
+
+class NES_Trace_Profile {
+	public:
+		static constexpr bool active = true;
+		static void record(NES_Cpu* cpu);
+};
+
+#if TRACE_POLICY == TRACE_RING
+typedef NES_Trace_Ring NES_Trace;
+#elif TRACE_POLICY == TRACE_LOG
+typedef NES_Trace_Log NES_Trace;
+#else
+typedef NES_Trace_None NES_Trace;
+#endif
+
+/*
+	Mappers
+
+	The board logic of a cartridge. A mapper keeps its bank registers in NES_Cpu_State::mapper_registers, so they
+	are copied, saved and hashed with the rest of the state, and map() turns them into page pointers: the CPU pages
+	of PRG ROM at $8000 - $FFFF, the 1 KB CHR pages at PPU $0000 - $1FFF and the four nametables. A bank switch only
+	rewrites those pointers, so it costs the same whatever the size of the bank, and only code decoded on CPU pages
+	that now point somewhere else is dropped. Mappers have no state of their own, find() hands out one shared
+	instance per mapper number.
+*/
+class NES_Mapper {
+	public:
+		virtual ~NES_Mapper() {}
+
+		virtual void power(NES_Cpu* cpu) const;										// Registers at power on, zero unless overridden
+		virtual void write(NES_Cpu* cpu, uint16_t address, uint8_t data) const = 0;	// CPU write to $8000 - $FFFF
+		virtual void map(NES_Cpu* cpu) const = 0;									// Point the pages at the selected banks
+		virtual void scanline(NES_Cpu* cpu) const;									// Once per rendered scanline, for IRQ counters
+		virtual int scanlines_to_irq(NES_Cpu* cpu) const;							// scanline() calls until an IRQ, 0 for none
+		virtual bool irq_line(NES_Cpu* cpu) const;									// Holding the IRQ line until it's acknowledged
+		virtual bool has_registers() const;											// Writes to $8000 - $FFFF do something
+		virtual bool has_irq() const;												// Has a scanline IRQ counter
+
+		static const NES_Mapper* find(int number);									// NULL when the mapper isn't supported
+
+	protected:
+		static uint8_t* registers(NES_Cpu* cpu);
+		static uint32_t prg_size(NES_Cpu* cpu);
+		static int header_mirroring(NES_Cpu* cpu);
+
+		// Banks are byte offsets into PRG ROM or CHR, wrapping around their size
+		static void map_prg(NES_Cpu* cpu, int first_page, int pages, uint32_t offset);	// 256 byte CPU pages
+		static void map_chr(NES_Cpu* cpu, int first_page, int pages, uint32_t offset);	// 1 KB PPU pages
+		static void map_nametables(NES_Cpu* cpu, int mirroring);					// MIRROR_*
+};
+
+/*
+	ROM files
+
+	A .nes file mapped read only, so loading it copies neither PRG nor CHR and every instance of the same file shares
+	its pages in the page cache. Only what gets read is ever faulted in.
+
+	The content hash of every file opened is kept in a small text index in the user's cache directory
+	(ROM_INDEX_DIR/ROM_INDEX_FILE), keyed by path, size and modification time. Without a cache directory nothing is
+	indexed. A file that hasn't changed since it was indexed isn't read through again to be hashed, the header is
+	in the first page and always parsed from the file. Adding a file rewrites the index with one line per file that
+	is still there unchanged, so it only grows with the ROMs in use.
+*/
+typedef struct rom_info {
+	uint64_t hash;									// FNV-1a of the whole file
+	uint64_t size;
+	int64_t modified;								// Modification time in ns
+} rom_info;
+
+class NES_Rom_File {
+	public:
+		NES_Rom_File();
+		~NES_Rom_File();
+
+		NES_Rom_File(const NES_Rom_File&) = delete;
+		NES_Rom_File& operator=(const NES_Rom_File&) = delete;
+
+		int open(const char* path);						// Returns 1 when the file can't be mapped
+		void close();
+
+		uint8_t* data();								// Read only, writing to it faults
+		int size();
+		const rom_info* info();
+
+	private:
+		uint8_t* mapping;
+		size_t length;
+		rom_info header;
+
+		static bool index_path(char* path, size_t size, bool create);
+		static bool find_index(const char* path, rom_info* info);
+		static void add_index(const char* path, const rom_info* info);
+};
+
+/*
+	Scheduler
+
+	Future events keyed on the CPU cycle count, in a binary min-heap of sources. What drives an interrupt posts the
+	cycle its next one is due instead of being asked after every instruction: the PPU its vertical blank and NMI,
+	the mapper (through the PPU, which clocks it) its IRQ. run() lets the core go until the earliest event and
+	services the ones due before the next instruction, so nmi() and irq() are taken on the cycle they were posted
+	for. Posting again moves a source's event. The heap is plain data inside NES_Cpu_State and copies with it.
+*/
+class NES_Scheduler {
+	public:
+		void clear();
+		void post(int source, uint64_t cycle);		// Replaces the source's event
+		void cancel(int source);
+		uint64_t next();							// Cycle of the earliest event, EVENT_NONE without one
+		uint64_t deadline(int source);				// Cycle of the source's event, EVENT_NONE without one
+		int due(uint64_t cycle);					// Takes off the earliest event due by cycle, returns its source or -1
+
+	private:
+		uint64_t deadlines[EVENT_SOURCES];			// Per source
+		uint8_t heap[EVENT_SOURCES];				// Sources with an event, earliest first
+		uint8_t slots[EVENT_SOURCES];				// Index of each source in heap
+		uint8_t count;								// Sources in heap
+
+		void swap(int a, int b);
+		void sift_up(int index);
+		void sift_down(int index);
+};
+
+/*
+	PPU
+
+	A scanline renderer that runs behind the CPU. scanline() draws a whole line from the registers as they are when
+	it starts and moves on to the next one, but lines are only run when something could tell the difference:
+	sync() catches up to the CPU before every access to $2000 - $2007 and every mapper write, which is all that can
+	change what a line draws, and the CPU only stops at the events schedule() posts for what the PPU does to the CPU,
+	vertical blank (the end of the frame and its NMI), an NMI enabled during vertical blank and a mapper IRQ. In between the CPU
+	runs without looking at the PPU at all. Raster effects still land on the scanline boundary after they were
+	written. A sprite 0 hit needs no event of its own, it only shows through $2002, whose read catches up first.
+
+	Pattern tables are used predecoded: each 8 pixel row of a tile is a uint64_t with one byte per pixel, leftmost
+	first, holding its 2 bit color. CHR ROM is decoded once into the shared cartridge image. CHR RAM is decoded here,
+	and a tile is only decoded again after $2007 wrote to it. Bank switches need nothing, the decoded pages are
+	looked up through chr_pages at the start of each line. A background row is then one load OR'd with its attribute
+	bits, sprites are merged 8 pixels at a time, and the only per pixel step left is the palette lookup.
+*/
+class NES_Ppu {
+	public:
+		NES_Ppu(NES_Cpu* cpu);
+
+		uint8_t read_register(uint16_t address);
+		void write_register(uint16_t address, uint8_t data);
+
+		void scanline();							// Start the next scanline, the CPU is at or past ppu_deadline
+		void sync();								// Run the lines started before the CPU's cycle, short of its events
+		void catch_up();							// Run every line started before the CPU's cycle, then schedule()
+		void schedule();							// Post EVENT_PPU and EVENT_MAPPER_IRQ from the registers and mapper
+		void invalidate_chr();						// CHR RAM changed behind $2007's back (clone, state load)
 
+		void draw();								// Keep a picture from now on, lines only run for the CPU until then
+		const uint8_t* frame();						// SCREEN_WIDTH x SCREEN_HEIGHT NES colors (0 - 63), NULL until draw()
+
+		static void decode_tiles(const uint8_t* chr, uint32_t size, uint64_t* decoded);	// 8 rows per 16 byte tile
+		static const uint8_t colors[64][3];			// RGB of the NES colors
 
-class NES_Cpu {
 	private:
+		NES_Cpu* cpu;
+		std::vector<uint8_t> framebuffer;			// Allocated by draw()
+
+		std::vector<uint64_t> chr_ram_decoded;		// CHR RAM decoded, allocated for boards that have it
+		uint64_t chr_ram_dirty[CHR_ROM_UNIT / 16 / 64];	// One bit per CHR RAM tile written since it was decoded
+		bool chr_ram_changed;
+		const uint64_t* pattern_pages[8];			// Decoded rows behind each 1 KB of chr_pages, for the current line
+
+		uint8_t read_vram(uint16_t address);
+		void write_vram(uint16_t address, uint8_t data);
+
+		uint64_t line_start(int line);				// CPU cycle line starts on next, at or after ppu_deadline
+
+		void update_patterns();
+		uint64_t pattern_row(uint16_t address, int row);
+		void render_line(int line);
+		void render_background(uint8_t* pixels);
+		bool render_sprites(int line, uint8_t* pixels);
+};
+
+/*
+	Cartridge
+
+	The read only parts of the .nes file the CPU and PPU see. The mapper decides which banks of PRG ROM show up at
+	$8000 - $FFFF and which of CHR at PPU $0000 - $1FFF.
+
+	A cartridge is an immutable image shared by every instance in the process running the same ROM, found by the
+	hash and size of the file and freed when the last instance lets go of it. So is what is derived from the ROM: the
+	decoded CHR tiles and the decoded PRG ROM the predecoded core and the recompiler run from. What the instances
+	write (PRG RAM, mapper registers, CHR RAM on the boards that have it) is each instance's own. PRG and CHR ROM
+	either point into rom_copy or straight into a mapped ROM file, which the image then owns. They are never
+	written, the pages they're mapped on have no write pointer.
+*/
+class NES_Cartridge {
+	public:
+		NES_Cartridge();
+		~NES_Cartridge();
+
+		NES_Cartridge(const NES_Cartridge&) = delete;
+		NES_Cartridge& operator=(const NES_Cartridge&) = delete;
+
+		uint64_t hash;								// FNV-1a of the .nes file, with size the key images are shared by
+		uint32_t size;
+		int mapper_number;							// iNES mapper number, MAPPER_*
+		const NES_Mapper* mapper;					// Shared instance for mapper_number
+		int mirroring;								// MIRROR_* from the header, for boards that don't switch it
+		uint8_t* prg_rom;							// PRG ROM, a multiple of PRG_ROM_UNIT
+		uint32_t prg_size;
+		uint8_t* chr_rom;							// CHR ROM, NULL for boards with CHR RAM
+		uint32_t chr_size;
+		std::vector<uint64_t> chr_decoded;			// CHR ROM decoded by NES_Ppu::decode_tiles()
+		bool chr_ram;								// The board has CHR RAM (NES_Cpu::chr_ram) instead
+		bool has_trainer;
+		uint8_t trainer[512];						// Loaded at $7000 into every instance's PRG RAM
+		std::vector<uint8_t> rom_copy;				// PRG and CHR ROM, when they weren't borrowed
+		NES_Rom_File* file;							// Mapping PRG and CHR ROM are borrowed from, NULL when copied
+
+		const decoded_entry* decoded_prg() const;	// PRG ROM decoded at every offset, built the first time it's asked for
+
+		// Images in use, the references are counted under one lock
+		static const NES_Cartridge* acquire(uint64_t hash, uint32_t size);	// Shared image with another reference, or NULL
+		static const NES_Cartridge* share(NES_Cartridge* image);			// Make a new image shared, or drop it for one already is
+		static void retain(const NES_Cartridge* image);
+		static void release(const NES_Cartridge* image);					// Frees the image with its last reference
+
+	private:
+		mutable int references;
+		mutable std::vector<decoded_entry> prg_decoded;	// Built by decoded_prg() under the lock
+};
+
+/*
+	CPU State
+
+	Everything that changes while the CPU runs: registers, flags, internal RAM, the PPU's memory, the mapper's
+	registers and the cycle count. It is plain data with no owned resources and no pointers into the instance, so an
+	instance can be copied with one memcpy (see NES_Cpu::clone()). The instruction tables are static and shared, the
+	cartridge is only referenced, and the bus page tables, decode cache, recompiler and trace buffer stay in NES_Cpu.
+*/
+class NES_Cpu_State {
+	protected:
 		/*
 			CPU Memory
 			- The $0000 - $FFFF range acts as the 16-bit address bus, while each address acts as the 8-bit data bus
@@ -100,7 +580,54 @@ class NES_Cpu {
 				$FFFE - $FFFF - IRQ (Interrupt Request) vector
 
 		*/
-		uint8_t memory[0xFFFF];
+		uint8_t ram[0x0800];						// Internal RAM, $0000 - $07FF and its mirrors
+		const NES_Cartridge* cartridge;				// Shared image behind $8000 - $FFFF, referenced by loaded_cartridge
+		uint8_t prg_ram[0x2000];					// PRG RAM at $6000 - $7FFF, with the trainer at $7000
+
+		/*
+			PPU
+
+			ppu_registers keeps PPUCTRL, PPUMASK, PPUSTATUS and OAMADDR at their offsets and the other registers as
+			last written. v, t, x and w are the PPU's internal scroll and address registers. The PPU runs a scanline
+			at a time and behind the CPU: ppu_scanline is the next line to start, at PPU dot ppu_line_dot counted
+			from power on, and ppu_deadline is the CPU cycle that dot falls on, usually long past.
+		*/
+		uint8_t ppu_registers[0x08];				// $2000 - $2007
+		uint16_t ppu_v;								// Current VRAM address
+		uint16_t ppu_t;								// Temporary VRAM address, the top left of the screen
+		uint8_t ppu_x;								// Fine X scroll
+		uint8_t ppu_w;								// First or second write of $2005/$2006
+		uint8_t ppu_buffer;							// $2007 read buffer
+		uint8_t ppu_nmi_pending;					// NMI enabled during vertical blank, taken at the next scanline
+		uint16_t ppu_scanline;						// Next scanline to start, 0 - 261
+		uint64_t ppu_line_dot;						// PPU dot it starts on
+		uint64_t ppu_deadline;						// CPU cycle it starts on
+		uint64_t ppu_frame;							// Frames that reached vertical blank
+		uint8_t oam[0x100];							// Sprites, 4 bytes each
+		uint8_t palette[0x20];						// Palette RAM, $3F10/$3F14/$3F18/$3F1C are $3F00/$3F04/$3F08/$3F0C
+
+		uint8_t vram[0x1000];						// Nametable RAM, 2 KB on the console and 2 KB more for four-screen boards
+
+		/*
+			Events
+
+			The cycles the PPU and the mapper next do something to the CPU, posted by NES_Ppu::schedule() and
+			serviced by run(). Derived from the rest of the state, so remap() posts them again after a load.
+		*/
+		NES_Scheduler events;
+
+		uint8_t mapper_registers[MAPPER_REGISTERS];	// Bank registers, what each byte holds is up to the mapper
+		uint8_t io_registers[0x20];					// $4000 - $401F, until there is an APU
+
+		/*
+			Controllers
+
+			Writing 1 then 0 to $4016 latches the buttons of both pads, then each read of $4016/$4017 returns the
+			next button in bit 0, A first. After all eight the pads keep returning 1.
+		*/
+		uint8_t buttons[2];							// Buttons held on each pad, BUTTON_*
+		uint8_t button_shift[2];					// Buttons still to be read since the last latch
+		uint8_t button_strobe;						// Bit 0 of the last $4016 write, reloads the shift while set
 
 		uint16_t pc;								// Program counter
 		uint8_t opcode;								// Current opcode
@@ -110,6 +637,19 @@ class NES_Cpu {
 		uint8_t Y;									// Y register
 		uint8_t proc_status;						// Process Status - (N,V,-,B,D,I,Z,C)
 
+		/*
+			Lazy Flags
+
+			With LAZY_FLAGS the instructions don't update proc_status, they only keep what each flag comes from. N is
+			bit 7 of flag_n, Z is set while flag_z is zero, C is flag_c (0 or 1) and V is set while flag_v is not
+			zero. proc_status still holds the I, D and B bits, and get_status() puts the whole byte together for
+			whatever reads it (PHP, BRK, interrupts, log()). Branches only look at the one flag they test.
+		*/
+		uint8_t flag_n;								// Result that N comes from
+		uint8_t flag_z;								// Result that Z comes from
+		uint8_t flag_c;								// Carry
+		uint8_t flag_v;								// Overflow
+
 		/*
 			Adressing Mode Variables
 
@@ -120,13 +660,89 @@ class NES_Cpu {
 		uint8_t use_accumulator;					// Flag to use accumulator
 		uint16_t target_address;					// Stores target address for addressing modes
 
+		uint64_t cycle_count;						// Master cycle counter, CPU cycles since power on
+};
+
+class NES_Cpu : public NES_Cpu_State {
+	friend class NES_Cartridge;
+	friend class NES_Jit;
+	friend class NES_Lockstep;
+	friend class NES_Bench;
+	friend class NES_Mapper;
+	friend class NES_Ppu;
+	friend class NES_Trace_Ring;
+	friend class NES_Trace_Log;
+	friend class NES_Trace_Profile;
+
+	private:
+
+		int core;									// Interpreter core used by cycle() and execute()
+		uint64_t instruction_count;					// Instructions run() has executed, not part of the state
+
+		/*
+			Memory Bus
+
+			The 64 KB address space is split into 256 pages of 256 bytes. A page backed by memory (RAM, its mirrors,
+			PRG ROM/RAM) has a pointer to its bytes, so an access is one table load and one memory access. Pages
+			belonging to a device (PPU registers at $2000 - $3FFF, APU/IO at $4000 - $40FF) have NULL pointers and
+			their accesses go to the page's handler instead. A NULL write pointer on a memory page makes it read only.
+			The tables point into the instance itself, so they aren't part of the state and remap() builds them from
+			it after a copy or a load.
+		*/
+		uint8_t* read_pages[0x100];					// Memory behind each page for reads, NULL for device pages
+		uint8_t* write_pages[0x100];				// Memory behind each page for writes, NULL for device or read only pages
+		bus_read_handler read_handlers[0x100];		// Device reads, used when read_pages is NULL
+		bus_write_handler write_handlers[0x100];	// Device writes, used when write_pages is NULL
+		void* bus_context;							// Handed to the handlers through the CPU, NULL unless a device sets it
+
+		/*
+			PPU Bus
+
+			The pattern tables at PPU $0000 - $1FFF are 8 pages of 1 KB pointing into the cartridge's CHR ROM or
+			chr_ram, the four nametables at $2000 - $2FFF point into vram. Both are set by the cartridge's mapper, like
+			the PRG ROM pages of the CPU bus. CHR RAM is only allocated for the boards that have it, most carry CHR ROM.
+		*/
+		uint8_t* chr_pages[8];						// CHR behind each 1 KB of the pattern tables
+		uint8_t* nametable_pages[4];				// vram behind each nametable
+		std::vector<uint8_t> chr_ram;				// CHR RAM, sized by load_image() for boards without CHR ROM
+
+		/*
+			Decode Cache
+
+			The cached core decodes each instruction once and keeps the result, so the opcode, handler and operand
+			bytes are not fetched and resolved again every time it runs. decode_pages points every CPU page at the
+			entries of the memory behind it, the way read_pages does for the bytes. PRG ROM never changes, so it is
+			decoded at every offset once per cartridge image and shared by all the instances running it. Code in
+			internal RAM and PRG RAM is decoded as it runs into ram_decoded, one entry per byte of memory so the RAM
+			mirrors share them, allocated 256 entries at a time for the pages code runs from. Every byte of those that
+			belongs to a decoded instruction is marked in code_bitmap, through each of its mirrors, and a write to a
+			marked byte drops the entries that cover it, which keeps self-modifying code correct. An instruction is
+			only decoded when all its bytes are in the same PRG_BANK_MIN bank of PRG ROM or the same RAM, the few
+			others run on the table core.
+		*/
+		const decoded_entry* decode_pages[0x100];	// Entries behind each page, never decoded ones on device pages
+		const decoded_entry* prg_decoded;			// The cartridge's decoded PRG ROM, NULL until decoding is on
+		std::vector<decoded_entry> ram_decoded[(sizeof(ram) + sizeof(prg_ram)) / 0x100];	// Allocated as code runs
+		uint8_t code_bitmap[0x10000 / 8];			// One bit per RAM address that belongs to a decoded instruction
+		bool decoding;								// CORE_CACHED or CORE_JIT was selected
+
+		NES_Jit* jit;								// Block recompiler, created when CORE_JIT is selected
+		NES_Ppu* ppu;								// Renderer and PPU registers, the state is in NES_Cpu_State
+		const NES_Cartridge* loaded_cartridge;		// Reference held on the cartridge, NULL without one
+
+		std::vector<trace_record> trace_buffer;		// TRACE_RING_SIZE records, allocated when TRACE_POLICY is TRACE_RING
+		uint64_t trace_count;						// Records written to trace_buffer so far
+
+		NES_Profile* profile;						// Profiler counting every instruction, NULL when not profiling
+
 
 		/*
 			INSTRUCTION TABLE
 
-			This lists out each possible instruction, their addressing modes and their cycle timings. Each entry goes:
+			This lists out each possible instruction, their addressing modes and their cycle timings. The table is a
+			constexpr description so the templated handlers can resolve each opcode at compile time. Each entry goes:
 
-				{	INSTRUCTION TYPE	,	INSTRUCTION FUNCTION	, ADDRESSING MODE ,	ADDRESSING MODE FUNCTION ,	REQUIRED CYCLES	}
+				{	INSTRUCTION NAME	,	INSTRUCTION TYPE (OP_*)	,	ADDRESSING MODE (MODE_*)	,	REQUIRED CYCLES	}
 
 			INSTRUCTION TYPES (56 Different Instructions)
 
@@ -135,9 +751,8 @@ class NES_Cpu {
 			JSR LDA LDX LDY LSR NOP ORA PHA PHP PLA PLP ROL ROR RTI
 			RTS SBC SEC SED SEI STA STX STY TAX TAY TSX TXA TXS TYA
 
-			- The instruction function carries out the actual instruction
-			- The addressing mode will carry the name of the addressing mode for further identification
-			- The addressing mode function will set up the required variables
+			- The instruction type picks the instruction function that carries out the actual instruction
+			- The addressing mode picks the addressing mode function that will set up the required variables
 			for the instruction function to succeed
 			- The required cycles will represent the maximum number of cycles needed to run the operation
 			- The above represents legal instructions, whereas we will represent illegal instructions as ILL
@@ -147,53 +762,43 @@ class NES_Cpu {
 		typedef int (NES_Cpu::*operation)();
 		typedef int (NES_Cpu::*addr_setup)();
 
+		// Compile time description of an opcode
+		typedef struct instruction_desc {
+			const char* instr_name;
+			uint8_t operation;
+			uint8_t addr_mode;
+			uint8_t cycles;
+		} instruction_desc;
+
 		// Definitions for the instruction and address mode functions
 		typedef struct instruction_entry {
-			std::string instr_name;
+			const char* instr_name;
 			int (NES_Cpu::*operation)();
 			int (NES_Cpu::*addr_setup)();
 			unsigned int cycles;
 		} instruction_entry;
 
-		// For windows
-		instruction_entry instruction_table[0x0100] = {
-			{ "BRK", &BRK, &IMM, 7 },{ "ORA", &ORA, &IND_X, 6 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 3 },{ "ORA", &ORA, &ZPG, 3 },{ "ASL", &ASL, &ZPG, 5 },{ "???", &ILL, &IMP, 5 },{ "PHP", &PHP, &IMP, 3 },{ "ORA", &ORA, &IMM, 2 },{ "ASL", &ASL, &IMP, 2 },{ "???", &ILL, &IMP, 2 },{ "???", &NOP, &IMP, 4 },{ "ORA", &ORA, &ABS, 4 },{ "ASL", &ASL, &ABS, 6 },{ "???", &ILL, &IMP, 6 },
-			{ "BPL", &BPL, &REL, 2 },{ "ORA", &ORA, &IND_Y, 5 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 4 },{ "ORA", &ORA, &ZPG_X, 4 },{ "ASL", &ASL, &ZPG_X, 6 },{ "???", &ILL, &IMP, 6 },{ "CLC", &CLC, &IMP, 2 },{ "ORA", &ORA, &ABS_Y, 4 },{ "???", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 7 },{ "???", &NOP, &IMP, 4 },{ "ORA", &ORA, &ABS_X, 4 },{ "ASL", &ASL, &ABS_X, 7 },{ "???", &ILL, &IMP, 7 },
-			{ "JSR", &JSR, &ABS, 6 },{ "AND", &AND, &IND_X, 6 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "BIT", &BIT, &ZPG, 3 },{ "AND", &AND, &ZPG, 3 },{ "ROL", &ROL, &ZPG, 5 },{ "???", &ILL, &IMP, 5 },{ "PLP", &PLP, &IMP, 4 },{ "AND", &AND, &IMM, 2 },{ "ROL", &ROL, &IMP, 2 },{ "???", &ILL, &IMP, 2 },{ "BIT", &BIT, &ABS, 4 },{ "AND", &AND, &ABS, 4 },{ "ROL", &ROL, &ABS, 6 },{ "???", &ILL, &IMP, 6 },
-			{ "BMI", &BMI, &REL, 2 },{ "AND", &AND, &IND_Y, 5 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 4 },{ "AND", &AND, &ZPG_X, 4 },{ "ROL", &ROL, &ZPG_X, 6 },{ "???", &ILL, &IMP, 6 },{ "SEC", &SEC, &IMP, 2 },{ "AND", &AND, &ABS_Y, 4 },{ "???", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 7 },{ "???", &NOP, &IMP, 4 },{ "AND", &AND, &ABS_X, 4 },{ "ROL", &ROL, &ABS_X, 7 },{ "???", &ILL, &IMP, 7 },
-			{ "RTI", &RTI, &IMP, 6 },{ "EOR", &EOR, &IND_X, 6 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 3 },{ "EOR", &EOR, &ZPG, 3 },{ "LSR", &LSR, &ZPG, 5 },{ "???", &ILL, &IMP, 5 },{ "PHA", &PHA, &IMP, 3 },{ "EOR", &EOR, &IMM, 2 },{ "LSR", &LSR, &IMP, 2 },{ "???", &ILL, &IMP, 2 },{ "JMP", &JMP, &ABS, 3 },{ "EOR", &EOR, &ABS, 4 },{ "LSR", &LSR, &ABS, 6 },{ "???", &ILL, &IMP, 6 },
-			{ "BVC", &BVC, &REL, 2 },{ "EOR", &EOR, &IND_Y, 5 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 4 },{ "EOR", &EOR, &ZPG_X, 4 },{ "LSR", &LSR, &ZPG_X, 6 },{ "???", &ILL, &IMP, 6 },{ "CLI", &CLI, &IMP, 2 },{ "EOR", &EOR, &ABS_Y, 4 },{ "???", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 7 },{ "???", &NOP, &IMP, 4 },{ "EOR", &EOR, &ABS_X, 4 },{ "LSR", &LSR, &ABS_X, 7 },{ "???", &ILL, &IMP, 7 },
-			{ "RTS", &RTS, &IMP, 6 },{ "ADC", &ADC, &IND_X, 6 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 3 },{ "ADC", &ADC, &ZPG, 3 },{ "ROR", &ROR, &ZPG, 5 },{ "???", &ILL, &IMP, 5 },{ "PLA", &PLA, &IMP, 4 },{ "ADC", &ADC, &IMM, 2 },{ "ROR", &ROR, &IMP, 2 },{ "???", &ILL, &IMP, 2 },{ "JMP", &JMP, &IND, 5 },{ "ADC", &ADC, &ABS, 4 },{ "ROR", &ROR, &ABS, 6 },{ "???", &ILL, &IMP, 6 },
-			{ "BVS", &BVS, &REL, 2 },{ "ADC", &ADC, &IND_Y, 5 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 4 },{ "ADC", &ADC, &ZPG_X, 4 },{ "ROR", &ROR, &ZPG_X, 6 },{ "???", &ILL, &IMP, 6 },{ "SEI", &SEI, &IMP, 2 },{ "ADC", &ADC, &ABS_Y, 4 },{ "???", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 7 },{ "???", &NOP, &IMP, 4 },{ "ADC", &ADC, &ABS_X, 4 },{ "ROR", &ROR, &ABS_X, 7 },{ "???", &ILL, &IMP, 7 },
-			{ "???", &NOP, &IMP, 2 },{ "STA", &STA, &IND_X, 6 },{ "???", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 6 },{ "STY", &STY, &ZPG, 3 },{ "STA", &STA, &ZPG, 3 },{ "STX", &STX, &ZPG, 3 },{ "???", &ILL, &IMP, 3 },{ "DEY", &DEY, &IMP, 2 },{ "???", &NOP, &IMP, 2 },{ "TXA", &TXA, &IMP, 2 },{ "???", &ILL, &IMP, 2 },{ "STY", &STY, &ABS, 4 },{ "STA", &STA, &ABS, 4 },{ "STX", &STX, &ABS, 4 },{ "???", &ILL, &IMP, 4 },
-			{ "BCC", &BCC, &REL, 2 },{ "STA", &STA, &IND_Y, 6 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 6 },{ "STY", &STY, &ZPG_X, 4 },{ "STA", &STA, &ZPG_X, 4 },{ "STX", &STX, &ZPG_Y, 4 },{ "???", &ILL, &IMP, 4 },{ "TYA", &TYA, &IMP, 2 },{ "STA", &STA, &ABS_Y, 5 },{ "TXS", &TXS, &IMP, 2 },{ "???", &ILL, &IMP, 5 },{ "???", &NOP, &IMP, 5 },{ "STA", &STA, &ABS_X, 5 },{ "???", &ILL, &IMP, 5 },{ "???", &ILL, &IMP, 5 },
-			{ "LDY", &LDY, &IMM, 2 },{ "LDA", &LDA, &IND_X, 6 },{ "LDX", &LDX, &IMM, 2 },{ "???", &ILL, &IMP, 6 },{ "LDY", &LDY, &ZPG, 3 },{ "LDA", &LDA, &ZPG, 3 },{ "LDX", &LDX, &ZPG, 3 },{ "???", &ILL, &IMP, 3 },{ "TAY", &TAY, &IMP, 2 },{ "LDA", &LDA, &IMM, 2 },{ "TAX", &TAX, &IMP, 2 },{ "???", &ILL, &IMP, 2 },{ "LDY", &LDY, &ABS, 4 },{ "LDA", &LDA, &ABS, 4 },{ "LDX", &LDX, &ABS, 4 },{ "???", &ILL, &IMP, 4 },
-			{ "BCS", &BCS, &REL, 2 },{ "LDA", &LDA, &IND_Y, 5 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 5 },{ "LDY", &LDY, &ZPG_X, 4 },{ "LDA", &LDA, &ZPG_X, 4 },{ "LDX", &LDX, &ZPG_Y, 4 },{ "???", &ILL, &IMP, 4 },{ "CLV", &CLV, &IMP, 2 },{ "LDA", &LDA, &ABS_Y, 4 },{ "TSX", &TSX, &IMP, 2 },{ "???", &ILL, &IMP, 4 },{ "LDY", &LDY, &ABS_X, 4 },{ "LDA", &LDA, &ABS_X, 4 },{ "LDX", &LDX, &ABS_Y, 4 },{ "???", &ILL, &IMP, 4 },
-			{ "CPY", &CPY, &IMM, 2 },{ "CMP", &CMP, &IND_X, 6 },{ "???", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "CPY", &CPY, &ZPG, 3 },{ "CMP", &CMP, &ZPG, 3 },{ "DEC", &DEC, &ZPG, 5 },{ "???", &ILL, &IMP, 5 },{ "INY", &INY, &IMP, 2 },{ "CMP", &CMP, &IMM, 2 },{ "DEX", &DEX, &IMP, 2 },{ "???", &ILL, &IMP, 2 },{ "CPY", &CPY, &ABS, 4 },{ "CMP", &CMP, &ABS, 4 },{ "DEC", &DEC, &ABS, 6 },{ "???", &ILL, &IMP, 6 },
-			{ "BNE", &BNE, &REL, 2 },{ "CMP", &CMP, &IND_Y, 5 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 4 },{ "CMP", &CMP, &ZPG_X, 4 },{ "DEC", &DEC, &ZPG_X, 6 },{ "???", &ILL, &IMP, 6 },{ "CLD", &CLD, &IMP, 2 },{ "CMP", &CMP, &ABS_Y, 4 },{ "NOP", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 7 },{ "???", &NOP, &IMP, 4 },{ "CMP", &CMP, &ABS_X, 4 },{ "DEC", &DEC, &ABS_X, 7 },{ "???", &ILL, &IMP, 7 },
-			{ "CPX", &CPX, &IMM, 2 },{ "SBC", &SBC, &IND_X, 6 },{ "???", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "CPX", &CPX, &ZPG, 3 },{ "SBC", &SBC, &ZPG, 3 },{ "INC", &INC, &ZPG, 5 },{ "???", &ILL, &IMP, 5 },{ "INX", &INX, &IMP, 2 },{ "SBC", &SBC, &IMM, 2 },{ "NOP", &NOP, &IMP, 2 },{ "???", &SBC, &IMP, 2 },{ "CPX", &CPX, &ABS, 4 },{ "SBC", &SBC, &ABS, 4 },{ "INC", &INC, &ABS, 6 },{ "???", &ILL, &IMP, 6 },
-			{ "BEQ", &BEQ, &REL, 2 },{ "SBC", &SBC, &IND_Y, 5 },{ "???", &ILL, &IMP, 2 },{ "???", &ILL, &IMP, 8 },{ "???", &NOP, &IMP, 4 },{ "SBC", &SBC, &ZPG_X, 4 },{ "INC", &INC, &ZPG_X, 6 },{ "???", &ILL, &IMP, 6 },{ "SED", &SED, &IMP, 2 },{ "SBC", &SBC, &ABS_Y, 4 },{ "NOP", &NOP, &IMP, 2 },{ "???", &ILL, &IMP, 7 },{ "???", &NOP, &IMP, 4 },{ "SBC", &SBC, &ABS_X, 4 },{ "INC", &INC, &ABS_X, 7 },{ "???", &ILL, &IMP, 7 }
+		static constexpr instruction_desc instruction_set[0x0100] = {
+			{ "BRK", OP_BRK, MODE_IMM, 7 },{ "ORA", OP_ORA, MODE_IND_X, 6 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 3 },{ "ORA", OP_ORA, MODE_ZPG, 3 },{ "ASL", OP_ASL, MODE_ZPG, 5 },{ "???", OP_ILL, MODE_IMP, 5 },{ "PHP", OP_PHP, MODE_IMP, 3 },{ "ORA", OP_ORA, MODE_IMM, 2 },{ "ASL", OP_ASL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_NOP, MODE_IMP, 4 },{ "ORA", OP_ORA, MODE_ABS, 4 },{ "ASL", OP_ASL, MODE_ABS, 6 },{ "???", OP_ILL, MODE_IMP, 6 },
+			{ "BPL", OP_BPL, MODE_REL, 2 },{ "ORA", OP_ORA, MODE_IND_Y, 5 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 4 },{ "ORA", OP_ORA, MODE_ZPG_X, 4 },{ "ASL", OP_ASL, MODE_ZPG_X, 6 },{ "???", OP_ILL, MODE_IMP, 6 },{ "CLC", OP_CLC, MODE_IMP, 2 },{ "ORA", OP_ORA, MODE_ABS_Y, 4 },{ "???", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 7 },{ "???", OP_NOP, MODE_IMP, 4 },{ "ORA", OP_ORA, MODE_ABS_X, 4 },{ "ASL", OP_ASL, MODE_ABS_X, 7 },{ "???", OP_ILL, MODE_IMP, 7 },
+			{ "JSR", OP_JSR, MODE_ABS, 6 },{ "AND", OP_AND, MODE_IND_X, 6 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "BIT", OP_BIT, MODE_ZPG, 3 },{ "AND", OP_AND, MODE_ZPG, 3 },{ "ROL", OP_ROL, MODE_ZPG, 5 },{ "???", OP_ILL, MODE_IMP, 5 },{ "PLP", OP_PLP, MODE_IMP, 4 },{ "AND", OP_AND, MODE_IMM, 2 },{ "ROL", OP_ROL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 2 },{ "BIT", OP_BIT, MODE_ABS, 4 },{ "AND", OP_AND, MODE_ABS, 4 },{ "ROL", OP_ROL, MODE_ABS, 6 },{ "???", OP_ILL, MODE_IMP, 6 },
+			{ "BMI", OP_BMI, MODE_REL, 2 },{ "AND", OP_AND, MODE_IND_Y, 5 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 4 },{ "AND", OP_AND, MODE_ZPG_X, 4 },{ "ROL", OP_ROL, MODE_ZPG_X, 6 },{ "???", OP_ILL, MODE_IMP, 6 },{ "SEC", OP_SEC, MODE_IMP, 2 },{ "AND", OP_AND, MODE_ABS_Y, 4 },{ "???", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 7 },{ "???", OP_NOP, MODE_IMP, 4 },{ "AND", OP_AND, MODE_ABS_X, 4 },{ "ROL", OP_ROL, MODE_ABS_X, 7 },{ "???", OP_ILL, MODE_IMP, 7 },
+			{ "RTI", OP_RTI, MODE_IMP, 6 },{ "EOR", OP_EOR, MODE_IND_X, 6 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 3 },{ "EOR", OP_EOR, MODE_ZPG, 3 },{ "LSR", OP_LSR, MODE_ZPG, 5 },{ "???", OP_ILL, MODE_IMP, 5 },{ "PHA", OP_PHA, MODE_IMP, 3 },{ "EOR", OP_EOR, MODE_IMM, 2 },{ "LSR", OP_LSR, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 2 },{ "JMP", OP_JMP, MODE_ABS, 3 },{ "EOR", OP_EOR, MODE_ABS, 4 },{ "LSR", OP_LSR, MODE_ABS, 6 },{ "???", OP_ILL, MODE_IMP, 6 },
+			{ "BVC", OP_BVC, MODE_REL, 2 },{ "EOR", OP_EOR, MODE_IND_Y, 5 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 4 },{ "EOR", OP_EOR, MODE_ZPG_X, 4 },{ "LSR", OP_LSR, MODE_ZPG_X, 6 },{ "???", OP_ILL, MODE_IMP, 6 },{ "CLI", OP_CLI, MODE_IMP, 2 },{ "EOR", OP_EOR, MODE_ABS_Y, 4 },{ "???", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 7 },{ "???", OP_NOP, MODE_IMP, 4 },{ "EOR", OP_EOR, MODE_ABS_X, 4 },{ "LSR", OP_LSR, MODE_ABS_X, 7 },{ "???", OP_ILL, MODE_IMP, 7 },
+			{ "RTS", OP_RTS, MODE_IMP, 6 },{ "ADC", OP_ADC, MODE_IND_X, 6 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 3 },{ "ADC", OP_ADC, MODE_ZPG, 3 },{ "ROR", OP_ROR, MODE_ZPG, 5 },{ "???", OP_ILL, MODE_IMP, 5 },{ "PLA", OP_PLA, MODE_IMP, 4 },{ "ADC", OP_ADC, MODE_IMM, 2 },{ "ROR", OP_ROR, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 2 },{ "JMP", OP_JMP, MODE_IND, 5 },{ "ADC", OP_ADC, MODE_ABS, 4 },{ "ROR", OP_ROR, MODE_ABS, 6 },{ "???", OP_ILL, MODE_IMP, 6 },
+			{ "BVS", OP_BVS, MODE_REL, 2 },{ "ADC", OP_ADC, MODE_IND_Y, 5 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 4 },{ "ADC", OP_ADC, MODE_ZPG_X, 4 },{ "ROR", OP_ROR, MODE_ZPG_X, 6 },{ "???", OP_ILL, MODE_IMP, 6 },{ "SEI", OP_SEI, MODE_IMP, 2 },{ "ADC", OP_ADC, MODE_ABS_Y, 4 },{ "???", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 7 },{ "???", OP_NOP, MODE_IMP, 4 },{ "ADC", OP_ADC, MODE_ABS_X, 4 },{ "ROR", OP_ROR, MODE_ABS_X, 7 },{ "???", OP_ILL, MODE_IMP, 7 },
+			{ "???", OP_NOP, MODE_IMP, 2 },{ "STA", OP_STA, MODE_IND_X, 6 },{ "???", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 6 },{ "STY", OP_STY, MODE_ZPG, 3 },{ "STA", OP_STA, MODE_ZPG, 3 },{ "STX", OP_STX, MODE_ZPG, 3 },{ "???", OP_ILL, MODE_IMP, 3 },{ "DEY", OP_DEY, MODE_IMP, 2 },{ "???", OP_NOP, MODE_IMP, 2 },{ "TXA", OP_TXA, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 2 },{ "STY", OP_STY, MODE_ABS, 4 },{ "STA", OP_STA, MODE_ABS, 4 },{ "STX", OP_STX, MODE_ABS, 4 },{ "???", OP_ILL, MODE_IMP, 4 },
+			{ "BCC", OP_BCC, MODE_REL, 2 },{ "STA", OP_STA, MODE_IND_Y, 6 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 6 },{ "STY", OP_STY, MODE_ZPG_X, 4 },{ "STA", OP_STA, MODE_ZPG_X, 4 },{ "STX", OP_STX, MODE_ZPG_Y, 4 },{ "???", OP_ILL, MODE_IMP, 4 },{ "TYA", OP_TYA, MODE_IMP, 2 },{ "STA", OP_STA, MODE_ABS_Y, 5 },{ "TXS", OP_TXS, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 5 },{ "???", OP_NOP, MODE_IMP, 5 },{ "STA", OP_STA, MODE_ABS_X, 5 },{ "???", OP_ILL, MODE_IMP, 5 },{ "???", OP_ILL, MODE_IMP, 5 },
+			{ "LDY", OP_LDY, MODE_IMM, 2 },{ "LDA", OP_LDA, MODE_IND_X, 6 },{ "LDX", OP_LDX, MODE_IMM, 2 },{ "???", OP_ILL, MODE_IMP, 6 },{ "LDY", OP_LDY, MODE_ZPG, 3 },{ "LDA", OP_LDA, MODE_ZPG, 3 },{ "LDX", OP_LDX, MODE_ZPG, 3 },{ "???", OP_ILL, MODE_IMP, 3 },{ "TAY", OP_TAY, MODE_IMP, 2 },{ "LDA", OP_LDA, MODE_IMM, 2 },{ "TAX", OP_TAX, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 2 },{ "LDY", OP_LDY, MODE_ABS, 4 },{ "LDA", OP_LDA, MODE_ABS, 4 },{ "LDX", OP_LDX, MODE_ABS, 4 },{ "???", OP_ILL, MODE_IMP, 4 },
+			{ "BCS", OP_BCS, MODE_REL, 2 },{ "LDA", OP_LDA, MODE_IND_Y, 5 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 5 },{ "LDY", OP_LDY, MODE_ZPG_X, 4 },{ "LDA", OP_LDA, MODE_ZPG_X, 4 },{ "LDX", OP_LDX, MODE_ZPG_Y, 4 },{ "???", OP_ILL, MODE_IMP, 4 },{ "CLV", OP_CLV, MODE_IMP, 2 },{ "LDA", OP_LDA, MODE_ABS_Y, 4 },{ "TSX", OP_TSX, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 4 },{ "LDY", OP_LDY, MODE_ABS_X, 4 },{ "LDA", OP_LDA, MODE_ABS_X, 4 },{ "LDX", OP_LDX, MODE_ABS_Y, 4 },{ "???", OP_ILL, MODE_IMP, 4 },
+			{ "CPY", OP_CPY, MODE_IMM, 2 },{ "CMP", OP_CMP, MODE_IND_X, 6 },{ "???", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "CPY", OP_CPY, MODE_ZPG, 3 },{ "CMP", OP_CMP, MODE_ZPG, 3 },{ "DEC", OP_DEC, MODE_ZPG, 5 },{ "???", OP_ILL, MODE_IMP, 5 },{ "INY", OP_INY, MODE_IMP, 2 },{ "CMP", OP_CMP, MODE_IMM, 2 },{ "DEX", OP_DEX, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 2 },{ "CPY", OP_CPY, MODE_ABS, 4 },{ "CMP", OP_CMP, MODE_ABS, 4 },{ "DEC", OP_DEC, MODE_ABS, 6 },{ "???", OP_ILL, MODE_IMP, 6 },
+			{ "BNE", OP_BNE, MODE_REL, 2 },{ "CMP", OP_CMP, MODE_IND_Y, 5 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 4 },{ "CMP", OP_CMP, MODE_ZPG_X, 4 },{ "DEC", OP_DEC, MODE_ZPG_X, 6 },{ "???", OP_ILL, MODE_IMP, 6 },{ "CLD", OP_CLD, MODE_IMP, 2 },{ "CMP", OP_CMP, MODE_ABS_Y, 4 },{ "NOP", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 7 },{ "???", OP_NOP, MODE_IMP, 4 },{ "CMP", OP_CMP, MODE_ABS_X, 4 },{ "DEC", OP_DEC, MODE_ABS_X, 7 },{ "???", OP_ILL, MODE_IMP, 7 },
+			{ "CPX", OP_CPX, MODE_IMM, 2 },{ "SBC", OP_SBC, MODE_IND_X, 6 },{ "???", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "CPX", OP_CPX, MODE_ZPG, 3 },{ "SBC", OP_SBC, MODE_ZPG, 3 },{ "INC", OP_INC, MODE_ZPG, 5 },{ "???", OP_ILL, MODE_IMP, 5 },{ "INX", OP_INX, MODE_IMP, 2 },{ "SBC", OP_SBC, MODE_IMM, 2 },{ "NOP", OP_NOP, MODE_IMP, 2 },{ "???", OP_SBC, MODE_IMP, 2 },{ "CPX", OP_CPX, MODE_ABS, 4 },{ "SBC", OP_SBC, MODE_ABS, 4 },{ "INC", OP_INC, MODE_ABS, 6 },{ "???", OP_ILL, MODE_IMP, 6 },
+			{ "BEQ", OP_BEQ, MODE_REL, 2 },{ "SBC", OP_SBC, MODE_IND_Y, 5 },{ "???", OP_ILL, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 8 },{ "???", OP_NOP, MODE_IMP, 4 },{ "SBC", OP_SBC, MODE_ZPG_X, 4 },{ "INC", OP_INC, MODE_ZPG_X, 6 },{ "???", OP_ILL, MODE_IMP, 6 },{ "SED", OP_SED, MODE_IMP, 2 },{ "SBC", OP_SBC, MODE_ABS_Y, 4 },{ "NOP", OP_NOP, MODE_IMP, 2 },{ "???", OP_ILL, MODE_IMP, 7 },{ "???", OP_NOP, MODE_IMP, 4 },{ "SBC", OP_SBC, MODE_ABS_X, 4 },{ "INC", OP_INC, MODE_ABS_X, 7 },{ "???", OP_ILL, MODE_IMP, 7 }
 		};
 
-		// For my linux laptop
-		instruction_entry instruction_table[0x0100] = {
-			{ "BRK", &NES_Cpu::BRK, &NES_Cpu::IMM, 7 },{ "ORA", &NES_Cpu::ORA, &NES_Cpu::IND_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 3 },{ "ORA", &NES_Cpu::ORA, &NES_Cpu::ZPG, 3 },{ "ASL", &NES_Cpu::ASL, &NES_Cpu::ZPG, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "PHP", &NES_Cpu::PHP, &NES_Cpu::IMP, 3 },{ "ORA", &NES_Cpu::ORA, &NES_Cpu::IMM, 2 },{ "ASL", &NES_Cpu::ASL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "ORA", &NES_Cpu::ORA, &NES_Cpu::ABS, 4 },{ "ASL", &NES_Cpu::ASL, &NES_Cpu::ABS, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },
-			{ "BPL", &NES_Cpu::BPL, &NES_Cpu::REL, 2 },{ "ORA", &NES_Cpu::ORA, &NES_Cpu::IND_Y, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "ORA", &NES_Cpu::ORA, &NES_Cpu::ZPG_X, 4 },{ "ASL", &NES_Cpu::ASL, &NES_Cpu::ZPG_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "CLC", &NES_Cpu::CLC, &NES_Cpu::IMP, 2 },{ "ORA", &NES_Cpu::ORA, &NES_Cpu::ABS_Y, 4 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "ORA", &NES_Cpu::ORA, &NES_Cpu::ABS_X, 4 },{ "ASL", &NES_Cpu::ASL, &NES_Cpu::ABS_X, 7 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },
-			{ "JSR", &NES_Cpu::JSR, &NES_Cpu::ABS, 6 },{ "AND", &NES_Cpu::AND, &NES_Cpu::IND_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "BIT", &NES_Cpu::BIT, &NES_Cpu::ZPG, 3 },{ "AND", &NES_Cpu::AND, &NES_Cpu::ZPG, 3 },{ "ROL", &NES_Cpu::ROL, &NES_Cpu::ZPG, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "PLP", &NES_Cpu::PLP, &NES_Cpu::IMP, 4 },{ "AND", &NES_Cpu::AND, &NES_Cpu::IMM, 2 },{ "ROL", &NES_Cpu::ROL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "BIT", &NES_Cpu::BIT, &NES_Cpu::ABS, 4 },{ "AND", &NES_Cpu::AND, &NES_Cpu::ABS, 4 },{ "ROL", &NES_Cpu::ROL, &NES_Cpu::ABS, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },
-			{ "BMI", &NES_Cpu::BMI, &NES_Cpu::REL, 2 },{ "AND", &NES_Cpu::AND, &NES_Cpu::IND_Y, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "AND", &NES_Cpu::AND, &NES_Cpu::ZPG_X, 4 },{ "ROL", &NES_Cpu::ROL, &NES_Cpu::ZPG_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "SEC", &NES_Cpu::SEC, &NES_Cpu::IMP, 2 },{ "AND", &NES_Cpu::AND, &NES_Cpu::ABS_Y, 4 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "AND", &NES_Cpu::AND, &NES_Cpu::ABS_X, 4 },{ "ROL", &NES_Cpu::ROL, &NES_Cpu::ABS_X, 7 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },
-			{ "RTI", &NES_Cpu::RTI, &NES_Cpu::IMP, 6 },{ "EOR", &NES_Cpu::EOR, &NES_Cpu::IND_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 3 },{ "EOR", &NES_Cpu::EOR, &NES_Cpu::ZPG, 3 },{ "LSR", &NES_Cpu::LSR, &NES_Cpu::ZPG, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "PHA", &NES_Cpu::PHA, &NES_Cpu::IMP, 3 },{ "EOR", &NES_Cpu::EOR, &NES_Cpu::IMM, 2 },{ "LSR", &NES_Cpu::LSR, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "JMP", &NES_Cpu::JMP, &NES_Cpu::ABS, 3 },{ "EOR", &NES_Cpu::EOR, &NES_Cpu::ABS, 4 },{ "LSR", &NES_Cpu::LSR, &NES_Cpu::ABS, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },
-			{ "BVC", &NES_Cpu::BVC, &NES_Cpu::REL, 2 },{ "EOR", &NES_Cpu::EOR, &NES_Cpu::IND_Y, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "EOR", &NES_Cpu::EOR, &NES_Cpu::ZPG_X, 4 },{ "LSR", &NES_Cpu::LSR, &NES_Cpu::ZPG_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "CLI", &NES_Cpu::CLI, &NES_Cpu::IMP, 2 },{ "EOR", &NES_Cpu::EOR, &NES_Cpu::ABS_Y, 4 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "EOR", &NES_Cpu::EOR, &NES_Cpu::ABS_X, 4 },{ "LSR", &NES_Cpu::LSR, &NES_Cpu::ABS_X, 7 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },
-			{ "RTS", &NES_Cpu::RTS, &NES_Cpu::IMP, 6 },{ "ADC", &NES_Cpu::ADC, &NES_Cpu::IND_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 3 },{ "ADC", &NES_Cpu::ADC, &NES_Cpu::ZPG, 3 },{ "ROR", &NES_Cpu::ROR, &NES_Cpu::ZPG, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "PLA", &NES_Cpu::PLA, &NES_Cpu::IMP, 4 },{ "ADC", &NES_Cpu::ADC, &NES_Cpu::IMM, 2 },{ "ROR", &NES_Cpu::ROR, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "JMP", &NES_Cpu::JMP, &NES_Cpu::IND, 5 },{ "ADC", &NES_Cpu::ADC, &NES_Cpu::ABS, 4 },{ "ROR", &NES_Cpu::ROR, &NES_Cpu::ABS, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },
-			{ "BVS", &NES_Cpu::BVS, &NES_Cpu::REL, 2 },{ "ADC", &NES_Cpu::ADC, &NES_Cpu::IND_Y, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "ADC", &NES_Cpu::ADC, &NES_Cpu::ZPG_X, 4 },{ "ROR", &NES_Cpu::ROR, &NES_Cpu::ZPG_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "SEI", &NES_Cpu::SEI, &NES_Cpu::IMP, 2 },{ "ADC", &NES_Cpu::ADC, &NES_Cpu::ABS_Y, 4 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "ADC", &NES_Cpu::ADC, &NES_Cpu::ABS_X, 4 },{ "ROR", &NES_Cpu::ROR, &NES_Cpu::ABS_X, 7 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },
-			{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "STA", &NES_Cpu::STA, &NES_Cpu::IND_X, 6 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "STY", &NES_Cpu::STY, &NES_Cpu::ZPG, 3 },{ "STA", &NES_Cpu::STA, &NES_Cpu::ZPG, 3 },{ "STX", &NES_Cpu::STX, &NES_Cpu::ZPG, 3 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 3 },{ "DEY", &NES_Cpu::DEY, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "TXA", &NES_Cpu::TXA, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "STY", &NES_Cpu::STY, &NES_Cpu::ABS, 4 },{ "STA", &NES_Cpu::STA, &NES_Cpu::ABS, 4 },{ "STX", &NES_Cpu::STX, &NES_Cpu::ABS, 4 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 4 },
-			{ "BCC", &NES_Cpu::BCC, &NES_Cpu::REL, 2 },{ "STA", &NES_Cpu::STA, &NES_Cpu::IND_Y, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "STY", &NES_Cpu::STY, &NES_Cpu::ZPG_X, 4 },{ "STA", &NES_Cpu::STA, &NES_Cpu::ZPG_X, 4 },{ "STX", &NES_Cpu::STX, &NES_Cpu::ZPG_Y, 4 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 4 },{ "TYA", &NES_Cpu::TYA, &NES_Cpu::IMP, 2 },{ "STA", &NES_Cpu::STA, &NES_Cpu::ABS_Y, 5 },{ "TXS", &NES_Cpu::TXS, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 5 },{ "STA", &NES_Cpu::STA, &NES_Cpu::ABS_X, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },
-			{ "LDY", &NES_Cpu::LDY, &NES_Cpu::IMM, 2 },{ "LDA", &NES_Cpu::LDA, &NES_Cpu::IND_X, 6 },{ "LDX", &NES_Cpu::LDX, &NES_Cpu::IMM, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "LDY", &NES_Cpu::LDY, &NES_Cpu::ZPG, 3 },{ "LDA", &NES_Cpu::LDA, &NES_Cpu::ZPG, 3 },{ "LDX", &NES_Cpu::LDX, &NES_Cpu::ZPG, 3 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 3 },{ "TAY", &NES_Cpu::TAY, &NES_Cpu::IMP, 2 },{ "LDA", &NES_Cpu::LDA, &NES_Cpu::IMM, 2 },{ "TAX", &NES_Cpu::TAX, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "LDY", &NES_Cpu::LDY, &NES_Cpu::ABS, 4 },{ "LDA", &NES_Cpu::LDA, &NES_Cpu::ABS, 4 },{ "LDX", &NES_Cpu::LDX, &NES_Cpu::ABS, 4 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 4 },
-			{ "BCS", &NES_Cpu::BCS, &NES_Cpu::REL, 2 },{ "LDA", &NES_Cpu::LDA, &NES_Cpu::IND_Y, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "LDY", &NES_Cpu::LDY, &NES_Cpu::ZPG_X, 4 },{ "LDA", &NES_Cpu::LDA, &NES_Cpu::ZPG_X, 4 },{ "LDX", &NES_Cpu::LDX, &NES_Cpu::ZPG_Y, 4 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 4 },{ "CLV", &NES_Cpu::CLV, &NES_Cpu::IMP, 2 },{ "LDA", &NES_Cpu::LDA, &NES_Cpu::ABS_Y, 4 },{ "TSX", &NES_Cpu::TSX, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 4 },{ "LDY", &NES_Cpu::LDY, &NES_Cpu::ABS_X, 4 },{ "LDA", &NES_Cpu::LDA, &NES_Cpu::ABS_X, 4 },{ "LDX", &NES_Cpu::LDX, &NES_Cpu::ABS_Y, 4 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 4 },
-			{ "CPY", &NES_Cpu::CPY, &NES_Cpu::IMM, 2 },{ "CMP", &NES_Cpu::CMP, &NES_Cpu::IND_X, 6 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "CPY", &NES_Cpu::CPY, &NES_Cpu::ZPG, 3 },{ "CMP", &NES_Cpu::CMP, &NES_Cpu::ZPG, 3 },{ "DEC", &NES_Cpu::DEC, &NES_Cpu::ZPG, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "INY", &NES_Cpu::INY, &NES_Cpu::IMP, 2 },{ "CMP", &NES_Cpu::CMP, &NES_Cpu::IMM, 2 },{ "DEX", &NES_Cpu::DEX, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "CPY", &NES_Cpu::CPY, &NES_Cpu::ABS, 4 },{ "CMP", &NES_Cpu::CMP, &NES_Cpu::ABS, 4 },{ "DEC", &NES_Cpu::DEC, &NES_Cpu::ABS, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },
-			{ "BNE", &NES_Cpu::BNE, &NES_Cpu::REL, 2 },{ "CMP", &NES_Cpu::CMP, &NES_Cpu::IND_Y, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "CMP", &NES_Cpu::CMP, &NES_Cpu::ZPG_X, 4 },{ "DEC", &NES_Cpu::DEC, &NES_Cpu::ZPG_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "CLD", &NES_Cpu::CLD, &NES_Cpu::IMP, 2 },{ "CMP", &NES_Cpu::CMP, &NES_Cpu::ABS_Y, 4 },{ "NOP", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "CMP", &NES_Cpu::CMP, &NES_Cpu::ABS_X, 4 },{ "DEC", &NES_Cpu::DEC, &NES_Cpu::ABS_X, 7 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },
-			{ "CPX", &NES_Cpu::CPX, &NES_Cpu::IMM, 2 },{ "SBC", &NES_Cpu::SBC, &NES_Cpu::IND_X, 6 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "CPX", &NES_Cpu::CPX, &NES_Cpu::ZPG, 3 },{ "SBC", &NES_Cpu::SBC, &NES_Cpu::ZPG, 3 },{ "INC", &NES_Cpu::INC, &NES_Cpu::ZPG, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 5 },{ "INX", &NES_Cpu::INX, &NES_Cpu::IMP, 2 },{ "SBC", &NES_Cpu::SBC, &NES_Cpu::IMM, 2 },{ "NOP", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::SBC, &NES_Cpu::IMP, 2 },{ "CPX", &NES_Cpu::CPX, &NES_Cpu::ABS, 4 },{ "SBC", &NES_Cpu::SBC, &NES_Cpu::ABS, 4 },{ "INC", &NES_Cpu::INC, &NES_Cpu::ABS, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },
-			{ "BEQ", &NES_Cpu::BEQ, &NES_Cpu::REL, 2 },{ "SBC", &NES_Cpu::SBC, &NES_Cpu::IND_Y, 5 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 8 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "SBC", &NES_Cpu::SBC, &NES_Cpu::ZPG_X, 4 },{ "INC", &NES_Cpu::INC, &NES_Cpu::ZPG_X, 6 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 6 },{ "SED", &NES_Cpu::SED, &NES_Cpu::IMP, 2 },{ "SBC", &NES_Cpu::SBC, &NES_Cpu::ABS_Y, 4 },{ "NOP", &NES_Cpu::NOP, &NES_Cpu::IMP, 2 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 },{ "???", &NES_Cpu::NOP, &NES_Cpu::IMP, 4 },{ "SBC", &NES_Cpu::SBC, &NES_Cpu::ABS_X, 4 },{ "INC", &NES_Cpu::INC, &NES_Cpu::ABS_X, 7 },{ "???", &NES_Cpu::ILL, &NES_Cpu::IMP, 7 }
-		};
+		// Runtime dispatch table for the table-driven core, built from instruction_set and shared by every instance
+		static const instruction_entry instruction_table[0x0100];
 
 		// All instruction functions
 		int ADC();
@@ -271,6 +876,109 @@ class NES_Cpu {
 		int ZPG_X();
 		int ZPG_Y();
 
+		// Instruction and addressing mode functions, indexed by OP_* and MODE_*
+		static constexpr operation operation_functions[] = {
+			&NES_Cpu::ADC, &NES_Cpu::AND, &NES_Cpu::ASL, &NES_Cpu::BCC, &NES_Cpu::BCS, &NES_Cpu::BEQ, &NES_Cpu::BIT, &NES_Cpu::BMI,
+			&NES_Cpu::BNE, &NES_Cpu::BPL, &NES_Cpu::BRK, &NES_Cpu::BVC, &NES_Cpu::BVS, &NES_Cpu::CLC, &NES_Cpu::CLD, &NES_Cpu::CLI,
+			&NES_Cpu::CLV, &NES_Cpu::CMP, &NES_Cpu::CPX, &NES_Cpu::CPY, &NES_Cpu::DEC, &NES_Cpu::DEX, &NES_Cpu::DEY, &NES_Cpu::EOR,
+			&NES_Cpu::INC, &NES_Cpu::INX, &NES_Cpu::INY, &NES_Cpu::JMP, &NES_Cpu::JSR, &NES_Cpu::LDA, &NES_Cpu::LDX, &NES_Cpu::LDY,
+			&NES_Cpu::LSR, &NES_Cpu::NOP, &NES_Cpu::ORA, &NES_Cpu::PHA, &NES_Cpu::PHP, &NES_Cpu::PLA, &NES_Cpu::PLP, &NES_Cpu::ROL,
+			&NES_Cpu::ROR, &NES_Cpu::RTI, &NES_Cpu::RTS, &NES_Cpu::SBC, &NES_Cpu::SEC, &NES_Cpu::SED, &NES_Cpu::SEI, &NES_Cpu::STA,
+			&NES_Cpu::STX, &NES_Cpu::STY, &NES_Cpu::TAX, &NES_Cpu::TAY, &NES_Cpu::TSX, &NES_Cpu::TXA, &NES_Cpu::TXS, &NES_Cpu::TYA,
+			&NES_Cpu::ILL
+		};
+
+		static constexpr addr_setup addr_functions[] = {
+			&NES_Cpu::IMP, &NES_Cpu::ACC, &NES_Cpu::ABS, &NES_Cpu::ABS_X, &NES_Cpu::ABS_Y, &NES_Cpu::IMM, &NES_Cpu::IMP,
+			&NES_Cpu::IND, &NES_Cpu::IND_X, &NES_Cpu::IND_Y, &NES_Cpu::REL, &NES_Cpu::ZPG, &NES_Cpu::ZPG_X, &NES_Cpu::ZPG_Y
+		};
+
+		// Number of operand bytes following the opcode, indexed by MODE_*
+		static constexpr uint8_t operand_length[] = {
+			0, 0, 2, 2, 2, 1, 0, 2, 1, 1, 1, 1, 1, 1
+		};
+
+		// One specialized handler per addressing mode and instruction pair, resolved at compile time
+		template<int MODE, int OP> int step();
+		template<int MODE, int OP> int step_decoded(uint16_t operand);
+		template<int CODE> static void run_decoded(NES_Cpu* cpu, uint16_t operand);
+
+		// Decode cache handlers, indexed by opcode
+		static const decoded_handler decoded_handlers[0x0100];
+
+		// Memory reads and writes through the page table, writes are checked against code_bitmap
+		uint8_t read(uint16_t address);
+		uint8_t peek(uint16_t address);				// Memory byte without calling a handler, 0 on device pages
+		void write(uint16_t address, uint8_t data);
+
+		// read() and write() for translated code, which only calls them for what isn't plain RAM
+		static uint8_t bus_read(NES_Cpu* cpu, uint16_t address);
+		static void bus_write(NES_Cpu* cpu, uint16_t address, uint8_t data);
+
+		// Default device handlers
+		static uint8_t read_open_bus(NES_Cpu* cpu, uint16_t address);
+		static void write_ignored(NES_Cpu* cpu, uint16_t address, uint8_t data);
+		static uint8_t read_ppu_register(NES_Cpu* cpu, uint16_t address);
+		static void write_ppu_register(NES_Cpu* cpu, uint16_t address, uint8_t data);
+		static uint8_t read_io_register(NES_Cpu* cpu, uint16_t address);
+		static void write_io_register(NES_Cpu* cpu, uint16_t address, uint8_t data);
+		static void write_mapper(NES_Cpu* cpu, uint16_t address, uint8_t data);
+		void oam_dma(uint8_t page);
+
+		// Parse the .nes file in buffer and attach its shared image, PRG and CHR are borrowed when file owns buffer
+		int load_image(uint8_t* buffer, int size, NES_Rom_File* file);
+		void set_cartridge(const NES_Cartridge* image);		// Move loaded_cartridge's reference to image
+
+		// Branch to target_address, counting the taken and page crossing cycles
+		void take_branch();
+
+		// Flag updates and reads, lazy or straight into proc_status depending on LAZY_FLAGS
+		void set_nz(uint8_t result);
+		void set_negative(uint8_t result);
+		void set_zero(uint8_t result);
+		void set_carry(uint8_t carry);
+		void set_overflow(uint8_t overflow);
+		uint8_t get_carry();
+		bool flag(uint8_t mask);
+		uint8_t get_status() const;
+		void set_status(uint8_t status);
+
+		// Tracing
+		void fill_trace_record(trace_record* record);
+		static void print_trace_record(const trace_record* record);
+
+		// Decode cache management
+		const decoded_entry* decode(uint16_t address);	// Decode RAM code, NULL for code that isn't decoded
+		const decoded_entry* find_decoded(uint16_t address);	// Entry at address, decoded if it wasn't yet
+		void map_decoded(int first_page, int last_page);	// Point decode_pages at the entries behind read_pages
+		int ram_offset(uint16_t address);				// Offset into RAM then PRG RAM of an address, -1 elsewhere
+		decoded_entry* ram_entry(int offset);			// Entry of a ram_offset(), NULL while its page isn't allocated
+		void mark_code(int offset, bool covered);		// Set or clear the code_bitmap bits of a ram_offset()
+		void drop_decoded(int offset);					// Drop the entries covering a ram_offset()
+		void invalidate(uint16_t address);
+		void invalidate_range(uint16_t first, uint16_t last);
+		void flush_decode_cache();
+		void load_memory(uint8_t* memory, const uint8_t* in, size_t size, uint16_t address);	// From a save state
+		static void decode_prg(const uint8_t* prg, uint32_t size, decoded_entry* decoded);	// Every offset of PRG ROM
+
+		/*
+			Interpreter cores, each runs count instructions or until cycle_count reaches core_limit and returns how
+			many of count are left. run() sets core_limit to its own limit or the next event, whichever comes first,
+			and post_event() lowers it when a register write brings an event closer in the middle of a run.
+		*/
+		uint64_t core_limit;
+
+		void post_event(int source, uint64_t cycle);
+		void service_event(int source);
+
+		template<class TRACE> void cycle_table();									// Table-driven core, one instruction
+		template<class TRACE> unsigned long execute_fused(unsigned long count);		// Fused core
+		template<class TRACE> unsigned long execute_cached(unsigned long count);	// Predecoded core
+		unsigned long execute_jit(unsigned long count);								// Recompiled blocks
+		void run(unsigned long count, uint64_t cycle_limit);						// Selected core, with the PPU
+		unsigned long run_core(unsigned long count);								// Selected core
+		unsigned long run_profiled(unsigned long count);							// Selected core with NES_Trace_Profile
+
 
 	public:
 
@@ -278,17 +986,561 @@ class NES_Cpu {
 		NES_Cpu();
 		~NES_Cpu();
 
+		// Owns the recompiler's executable memory, so instances are not copied
+		NES_Cpu(const NES_Cpu&) = delete;
+		NES_Cpu& operator=(const NES_Cpu&) = delete;
+
 		// Setup functions
-		int load_cpu(uint8_t* reading_space, int size);
+		int load_cpu(uint8_t* reading_space, int size);	// Copies PRG and CHR unless the image is already shared
+		int load_rom(const char* path);					// Map the ROM file and borrow PRG and CHR from it
+
+		// Bus setup, pages are the high byte of the address
+		void map_memory(uint8_t first_page, uint8_t last_page, uint8_t* base, uint32_t size, bool writable);
+		void map_io(uint8_t first_page, uint8_t last_page, bus_read_handler read, bus_write_handler write);
+		void remap();									// Rebuild the page table for this instance's RAM and cartridge
+
+		// Copy the whole CPU state of source, sharing its cartridge image
+		void clone(const NES_Cpu* source);
 
 		// Interrupts
 		void irq();										// Maskable Interrupt. Ignorable in certain cases
+		bool irq_held();								// A device holds the IRQ line, it is taken whenever I is clear
+		void irq_enabled();								// I was cleared, take a held IRQ before the next instruction
 		void nmi();										// Non-Maskable Interrupt. Not ignorable
 		void reset();									// System reset
 
 		// Emulation
+		void set_core(int new_core);					// Select CORE_TABLE, CORE_FUSED, CORE_CACHED or CORE_JIT
+		void set_profile(NES_Profile* new_profile);		// Count every instruction into new_profile from here on, NULL stops
 		void cycle();									// Run a cycle of the emulation
+		void execute(unsigned long count);				// Run count instructions with the selected core
+
+		/*
+			Cycle budgeted execution
+
+			Run whole instructions with the selected core until the master cycle counter reaches target_cycle (or
+			budget more cycles), counting page crossings and taken branches. Returns how many cycles the last
+			instruction ran past the target.
+		*/
+		unsigned int run_until(uint64_t target_cycle);
+		unsigned int run_cycles(unsigned int budget);
+		uint64_t get_cycles();							// Master cycle counter
+		uint64_t get_instructions();					// Instructions executed through execute() and run_until()
+		void draw_frames();								// Have the PPU draw its picture, see NES_Ppu::draw()
+		const uint8_t* get_frame();						// Picture the PPU drew, see NES_Ppu::frame()
+		uint64_t get_frames();							// Frames that reached vertical blank
+
+		// Input
+		void set_buttons(int pad, uint8_t pressed);		// Buttons held on pad 0 or 1, BUTTON_*
+
+		// Save states, see the format in 2A03.cpp
+		size_t save_state(uint8_t* buffer, size_t size);			// Returns the bytes written, 0 when buffer is too small
+		int load_state(const uint8_t* buffer, size_t size);		// Returns 1 when the state is not valid
 
 		// Debugging function
 		void log();
+		void dump_trace();								// Print the ring buffer, oldest instruction first
+		bool same_state(const NES_Cpu* other);			// Registers and memory match, for differential runs
+		uint64_t state_hash();							// FNV-1a hash of the registers, RAM and cycle count
+};
+
+
+/*
+	Batch runner
+
+	Runs a list of headless jobs, each on its own NES_Cpu, across a pool of threads. Jobs are dealt out to the
+	workers' queues up front, a worker takes from the back of its own queue and steals from the front of the others
+	once it runs dry, so long jobs don't leave threads idle. Results are kept in job order.
+
+	A job list has one job per line, blank lines and lines starting with # are skipped:
+
+		rom.nes [frames=N] [cycles=N] [core=table|fused|cached|jit] [input=script.txt]
+
+	frames and cycles both stop the job, whichever comes first (60 frames when neither is given). An input script
+	has one "frame pad0 [pad1]" line per change of buttons, with the buttons as hex BUTTON_* masks.
+*/
+typedef struct batch_job {
+	std::string rom;							// Path to the .nes file
+	std::string input;							// Path to the input script, empty for none
+	uint64_t frames;							// Frames to run, 0 for no limit
+	uint64_t cycles;							// CPU cycles to run, 0 for no limit
+	int core;									// CORE_*
+} batch_job;
+
+typedef struct batch_result {
+	bool ok;									// Loaded and ran
+	uint64_t frames;							// Frames run
+	uint64_t cycles;							// CPU cycles run
+	uint64_t state_hash;						// NES_Cpu::state_hash() at the end
+	double seconds;								// Wall time of the job
+} batch_result;
+
+class NES_Batch {
+	public:
+		NES_Batch(int thread_count);
+
+		int load_jobs(const char* path);				// Read a job list, returns 1 on error
+		void add_job(const batch_job& job);
+		void run();										// Run every job, blocks until they are done
+		int report();									// Print the results, returns the number of failed jobs
+
+	private:
+		typedef struct work_queue {
+			std::mutex lock;
+			std::deque<size_t> jobs;					// Indexes into jobs
+		} work_queue;
+
+		int thread_count;
+		std::vector<batch_job> jobs;
+		std::vector<batch_result> results;
+		std::vector<work_queue> queues;					// One per worker
+		double seconds;									// Wall time of run()
+
+		void worker(int index);
+		bool next_job(int index, size_t* job);
+		void run_job(size_t job);
+};
+
+
+/*
+	Rewind buffer
+
+	Keeps a save state per frame in a fixed size ring buffer. Every REWIND_KEYFRAME frames the whole state is
+	stored, the frames in between only keep what changed since that keyframe: the state XORed with the keyframe's,
+	then run-length encoded, so the RAM that didn't change shrinks down to a few bytes. When the buffer is full the
+	oldest keyframe goes together with the deltas depending on it.
+
+	Stepping back decodes one entry, and one keyframe when it crosses into an older one, so it can be done every
+	frame.
+*/
+class NES_Rewind {
+	public:
+		NES_Rewind(size_t buffer_size = REWIND_BUFFER_SIZE);
+
+		bool push(NES_Cpu* cpu);						// Record the current state, once per frame
+		bool pop(NES_Cpu* cpu);							// Load the last recorded state and drop it, false when empty
+
+		size_t frames();								// States held
+		size_t bytes();									// Bytes of the buffer in use
+
+	private:
+		typedef struct rewind_entry {
+			size_t offset;								// Position in buffer
+			size_t size;								// Encoded size
+			uint64_t serial;							// Consecutive numbers, entries[serial - front serial]
+			uint64_t keyframe;							// Serial of the keyframe it is a delta of, its own for keyframes
+		} rewind_entry;
+
+		std::vector<uint8_t> buffer;					// Ring of encoded states
+		std::deque<rewind_entry> entries;				// Oldest first
+		size_t write_offset;							// Where the next entry goes
+		size_t used;
+
+		std::vector<uint8_t> reference;					// Decoded keyframe the newest entries are deltas of
+		size_t reference_size;
+		uint64_t reference_serial;
+		bool reference_valid;
+
+		std::vector<uint8_t> state;						// Scratch for save_state()/load_state()
+		std::vector<uint8_t> packed;					// Scratch for encoding
+
+		size_t reserve(size_t size);					// Offset with room for a new entry, dropping the oldest ones
+		void drop_oldest();
+		bool load_reference(uint64_t keyframe);
+};
+
+
+/*
+	Microbenchmarks
+
+	Times every documented opcode in instruction_set on its own, and a few instruction mixes, on each core. Every
+	case is a generated ROM whose body repeats the instruction (see Bench.cpp for the layout), so the time per
+	instruction covers the dispatch, the addressing mode and the instruction itself. Results are saved one case per
+	line as "core opcode case ns/instruction", e.g. "table 71 ADC_IND_Y 4.210", and a saved file can be used as the
+	baseline for a later run.
+
+	check() runs the same cases without timing them and keeps the state hash each one ends on instead, saved as
+	"core opcode case hash". The cases don't depend on timing, so two builds that emulate the same have identical
+	files: make flags compares a LAZY_FLAGS=0 build against a LAZY_FLAGS=1 one this way.
+*/
+typedef struct bench_result {
+	std::string core;							// Core name as given on the command line
+	int opcode;									// -1 for the mixes
+	std::string name;							// Instruction and addressing mode, or mix_ and the mix name
+	double ns;									// Nanoseconds per instruction, -1 if the case didn't load
+	uint64_t hash;								// state_hash() at the end of check(), 0 if the case failed
+} bench_result;
+
+class NES_Bench {
+	public:
+		NES_Bench(unsigned long instructions = BENCH_INSTRUCTIONS);
+
+		void run(int core);								// One core, or every core when core is -1
+		int check(int core);							// Same cases, hashing the end state instead of timing
+		int save(const char* path);
+		int save_hashes(const char* path);
+		int compare(const char* path, double tolerance);	// Returns the number of cases slower than the baseline
+		void report();
+
+	private:
+		unsigned long instructions;
+		std::vector<bench_result> results;
+		std::vector<uint8_t> rom;						// .nes image of the case being built
+
+		void put_byte(uint16_t address, uint8_t data);
+		void put_word(uint16_t address, uint16_t data);
+		uint16_t put_instruction(uint16_t address, uint8_t code, int index, bool call);
+		unsigned long build(const uint8_t* codes, size_t count);
+		double time_rom(int core, unsigned long prologue);
+		unsigned long build_irq();
+		uint64_t hash_rom(int core, unsigned long prologue, bool reload);
+		void each_case(int core, bool timed);
+};
+
+
+/*
+	Guest profiler
+
+	Counts the instructions and cycles of the 6502 program, per address and per call stack. While attached to an
+	NES_Cpu (see set_profile()) the cores call step() before every instruction, which charges the cycles of the one
+	before it to its address and to the call tree node it ran in. The per address counters are flat arrays indexed
+	by the program counter. The call tree follows JSR/RTS, and BRK, NMI and IRQ through RTI, one node per distinct
+	stack of called addresses, and is only walked on calls, so a profiled run stays close to the speed of the
+	interpreter it runs on. The recompiler can't count single instructions, so CORE_JIT runs on the predecoded core
+	while profiling.
+
+	The call tree is written as collapsed stacks, "root;caller;callee count" per line, which flamegraph.pl and
+	compatible tools read. Addresses are named from ld65 label files (-Ln, "al 00C000 .reset") or cc65 debug info
+	(--dbgfile, "sym" lines with name and val) when they are loaded, and as $C000 otherwise.
+*/
+class NES_Profile {
+	public:
+		NES_Profile();
+
+		void step(uint16_t pc, uint8_t opcode, uint64_t cycle);		// Before every instruction, see 2A03.cpp
+		void interrupt(uint16_t from, uint16_t handler);			// NMI or IRQ taken at from
+
+		int load_symbols(const char* path);
+		void report(int count);										// Print the count addresses with the most cycles
+		int save_collapsed(const char* path, bool cycles);			// Collapsed stacks weighed by cycles or instructions
+
+		uint64_t instructions();
+		uint64_t cycles();
+
+	private:
+		friend class NES_Cpu;
+
+		typedef struct profile_node {
+			uint32_t parent;
+			uint32_t first_child;
+			uint32_t next_sibling;
+			uint16_t function;							// Address called, the starting pc for the root
+			uint16_t depth;
+			uint64_t instructions;						// Run in this function itself, not in its callees
+			uint64_t cycles;
+		} profile_node;
+
+		typedef struct profile_counter {
+			uint64_t instructions;
+			uint64_t cycles;
+		} profile_counter;
+
+		std::vector<profile_counter> pc_counters;		// Indexed by pc
+		std::vector<profile_node> nodes;				// Call tree, the root is node 0
+		uint32_t node;									// Node the current instruction runs in
+		uint32_t overflow;								// Calls not given a node since PROFILE_MAX_DEPTH or PROFILE_MAX_NODES
+
+		uint16_t last_pc;								// Instruction before the current one, its cycles are charged next
+		uint8_t last_opcode;
+		uint32_t last_node;
+		uint64_t last_cycle;
+
+		std::vector<int32_t> symbol_index;				// Name in symbol_names for each address, -1 for none
+		std::vector<std::string> symbol_names;
+
+		void begin(uint16_t pc, uint64_t cycle);
+		void enter(uint16_t function);
+		void leave();
+		std::string name(uint16_t address);
+};
+
+
+/*
+	Input movie
+
+	Records the controller state of every frame from a known starting point, right after reset or a loaded save
+	state, together with the state hash at the start and at the end. Since the emulation only depends on the inputs
+	read through $4016/$4017, playing the inputs back from the same start has to end on the same hash, so a movie is
+	also a check that a build or core still runs the game the same way. Playback runs headless, as fast as the core
+	goes.
+
+	File format, little endian: "NESM", version u16, reserved u16, frame count u32, start hash u64, end hash u64,
+	then the buttons of every frame as pad0, pad1.
+*/
+class NES_Movie {
+	public:
+		NES_Movie();
+
+		void begin(NES_Cpu* cpu);						// Start recording from the current state
+		void record(NES_Cpu* cpu, uint8_t pad0, uint8_t pad1);	// Run one frame with these buttons held
+
+		int save(const char* path);
+		int load(const char* path);
+
+		int play(NES_Cpu* cpu);							// Run all frames, 1 when the start or end state doesn't match
+
+		size_t frames();
+		uint64_t start_state();
+		uint64_t end_state();
+
+	private:
+		uint64_t start_hash;
+		uint64_t end_hash;
+		uint64_t start_cycle;							// Frames are counted from here while recording
+		std::vector<uint16_t> inputs;					// (pad1 << 8) | pad0 per frame
+};
+
+
+/*
+	Lockstep runner
+
+	Runs many instances of the same ROM together, one instruction on every lane per step. The registers, flags, cycle
+	counts and internal RAM of all lanes are kept as structure of arrays (RAM as ram[address * lanes + lane]), so one
+	AVX2 register holds a register of LOCKSTEP_WIDTH lanes and a zero page or absolute RAM access is one contiguous
+	load or store across them.
+
+	Each step groups the lanes by program counter. A group running from PRG ROM whose instruction only touches
+	registers, flags, branches, jumps, the stack and internal RAM, or reads PRG ROM, is executed with AVX2 across all
+	its lanes at once. Everything else (lanes on their own, interrupts, the status on the stack, device and PRG RAM
+	accesses, code in RAM) runs one lane at a time on the lane's own NES_Cpu with the fused core, whose internal RAM
+	pages are mapped onto the shared arrays.
+	Those lanes run after the groups of the step, each for a stretch that ends at its next event, at an address
+	where other lanes are, or (for lanes that were together) at the next instruction AVX2 can run, so they fall back
+	in with the rest. Without AVX2 every lane takes that path.
+
+	Every lane has its own PRG RAM and mapper registers on the shared cartridge image, the ROM bytes are fetched through
+	the first lane's banks.
+*/
+class NES_Lockstep {
+	public:
+		NES_Lockstep(int lane_count);
+		~NES_Lockstep();
+
+		NES_Lockstep(const NES_Lockstep&) = delete;
+		NES_Lockstep& operator=(const NES_Lockstep&) = delete;
+
+		int load(uint8_t* buffer, int size);			// Load the ROM into every lane, returns what load_cpu() does
+		void reset();									// Reset every lane
+		void set_buttons(int lane, int pad, uint8_t pressed);
+
+		void step();									// One instruction on every lane, or a stretch on the lanes that run alone
+		void run_until(uint64_t target_cycle);			// Every lane until its cycle count reaches target_cycle
+
+		int lanes();									// Lanes asked for
+		bool together();								// Lanes run together with AVX2, one after the other without it
+		NES_Cpu* lane(int index);						// The lane's NES_Cpu, with its registers and RAM written back
+
+		uint64_t vector_instructions;					// Lane instructions run with AVX2
+		uint64_t scalar_instructions;					// Lane instructions run on the lanes' own NES_Cpu, while stepping
+
+	private:
+		typedef struct lane_context {
+			NES_Lockstep* engine;
+			int index;
+		} lane_context;
+
+		int lane_count;									// Lanes asked for
+		int width;										// lane_count rounded up to LOCKSTEP_WIDTH
+		bool use_avx2;									// Host supports AVX2
+
+		std::vector<NES_Cpu*> cpus;						// One per lane, runs the scalar instructions
+		std::vector<lane_context> contexts;				// bus_context of each lane's NES_Cpu
+
+		// Lane state, width entries each
+		std::vector<uint16_t> pc;
+		std::vector<uint16_t> target_address;
+		std::vector<uint8_t> opcode;
+		std::vector<uint8_t> sp;
+		std::vector<uint8_t> accumulator;
+		std::vector<uint8_t> X;
+		std::vector<uint8_t> Y;
+		std::vector<uint8_t> proc_status;				// I, D and B, the others are kept lazily like NES_Cpu does
+		std::vector<uint8_t> flag_n;
+		std::vector<uint8_t> flag_z;
+		std::vector<uint8_t> flag_c;
+		std::vector<uint8_t> flag_v;
+		std::vector<uint64_t> cycle_count;
+		std::vector<uint8_t> ram;						// 0x800 * width bytes, ram[address * width + lane]
+
+		std::vector<uint32_t> pending;					// Bit per lane still to run this step
+		std::vector<uint32_t> group;					// Bit per lane in the group being run
+		std::vector<uint32_t> due;						// Bit per pending lane at or past next_event
+		std::vector<uint32_t> deferred;					// Bit per lane left to run on its own NES_Cpu this step
+		std::vector<uint32_t> shared;					// Bit per deferred lane that was in a group with others
+
+		/*
+			Only instructions run on a lane's own NES_Cpu reach the devices, so its events and banks only change
+			there and are kept from one scalar run to the next instead of looking at every lane on every step.
+		*/
+		std::vector<uint64_t> event_deadline;			// Next event of each lane, EVENT_NONE past lane_count
+		uint64_t next_event;							// Earliest of them
+		std::vector<uint32_t> other_banks;				// Bit per lane whose mapper registers differ from the first lane's
+		uint8_t first_banks[MAPPER_REGISTERS];			// The first lane's mapper registers other_banks was made against
+
+		std::vector<uint64_t> rejoin;					// Bit per address some lane that ran with AVX2 is at
+
+		void load_lane(int index);						// Lane state into its NES_Cpu
+		void store_lane(int index);						// Lane state back from its NES_Cpu
+		void track_lane(int index);						// Its event deadline and banks after it ran on its NES_Cpu
+		int step_lanes(uint64_t cycle_limit);			// One instruction on every lane short of cycle_limit, returns how many ran
+		int select_pending(uint64_t cycle_limit);
+		int select_group(uint16_t address, int word);
+		void step_deferred(uint64_t cycle_limit);
+		void step_scalar(int index, uint64_t cycle_limit);
+		bool step_vector(uint16_t address);				// Run the group with AVX2, false when it can't be
+		bool can_vector(NES_Cpu* cpu);					// The lane's next instruction is one step_vector() may run
+		uint16_t indirect_address(int index, int mode, uint8_t operand);
+
+		uint8_t fetch(uint16_t address);				// PRG ROM byte
+
+		static uint8_t read_lane_ram(NES_Cpu* cpu, uint16_t address);
+		static void write_lane_ram(NES_Cpu* cpu, uint16_t address, uint8_t data);
+};
+
+
+/*
+	Basic block recompiler
+
+	Translates runs of 6502 code into x86-64 machine code. A block ends at a JMP, JSR, RTS, RTI, BRK, after
+	JIT_MAX_BLOCK instructions or where code that is already translated starts, branches jump out of the middle of
+	it. Loads, stores, arithmetic, logic, compares, shifts and increments on immediate, RAM and indexed operands are
+	emitted as native code along with branches, register transfers, flag changes, PHA and PLA. Accesses that land
+	on device pages or on decoded code go through read() and write(); the remaining instructions (JMP, JSR, RTS, RTI,
+	BRK, PHP, PLP and CLI) become a call into their decoded handler.
+
+	The translated code keeps the instruction count and cycle_count in registers and checks both after every
+	instruction, so it stops on the same instruction boundary as the interpreters. cycle_count is written back before
+	each call out, so devices catch up to the cycle the instruction really starts on. Blocks jump straight to each
+	other, the core only runs again when the count or core_limit run out or the next code isn't translated yet.
+	entries has the code of every translated instruction, so a run that stopped in the middle of a block picks up
+	there instead of translating the rest of the block again.
+
+	Blocks are built from the decode cache, so a write to a translated byte is seen through code_bitmap and the
+	whole translation cache is flushed before the next block runs.
+*/
+class NES_Jit {
+	public:
+		int flush_pending;								// Set when translated code was written to
+
+		NES_Jit();
+		~NES_Jit();
+
+		bool available();								// Executable memory could be mapped on this host
+		const uint8_t* lookup(uint16_t address);		// Code of the instruction at address, NULL if not translated
+		const uint8_t* compile(NES_Cpu* cpu, uint16_t address);
+		unsigned long run(NES_Cpu* cpu, unsigned long count, const uint8_t* code);	// Returns the count left
+		bool covers(uint16_t first, uint16_t last);	// Any byte of first - last is in a block
+		void flush();
+
+	private:
+		typedef unsigned long (*jit_entry)(NES_Cpu* cpu, unsigned long count, const uint8_t* code);
+
+		// Way out of a block, the stores the instruction boundary it leaves on still needs
+		typedef struct jit_exit {
+			uint8_t* jumps[3];							// rel32 fields of the jumps to it
+			int jump_count;
+			uint16_t pc;								// Address of the next instruction
+			uint8_t opcode;								// Instruction that ran last
+			bool store_pc;								// pc and opcode aren't in the CPU yet
+			uint8_t cycles;								// Base cycles of an instruction left before its boundary
+		} jit_exit;
+
+		// Taken side of a branch, emitted after the block
+		typedef struct jit_branch {
+			uint8_t* jump;								// rel32 field of the jcc
+			uint16_t pc;								// Branch target
+			uint8_t opcode;
+			uint8_t cycles;								// Base cycles with the taken and page crossing ones
+		} jit_branch;
+
+		// Call out of a memory access that isn't plain memory, emitted after the block
+		typedef struct jit_call {
+			uint8_t* jumps[2];							// rel32 fields of the jumps to it
+			int jump_count;
+			uint8_t* resume;							// Where the access goes on
+			bool write;									// bus_write, bus_read otherwise
+			uint16_t pc;								// pc and opcode to store for the devices
+			uint8_t opcode;
+			int exit;									// Exit taken when the write set flush_pending, -1 for none
+		} jit_call;
+
+		// Where the operand of a memory instruction is
+		enum {
+			ACCESS_IMMEDIATE,							// The operand byte
+			ACCESS_RAM,									// Internal RAM at an address known when translating
+			ACCESS_ZERO_PAGE,							// Zero page at ebp
+			ACCESS_RAM_INDEXED,							// Internal RAM or its mirrors at ebp
+			ACCESS_BUS									// Anything at ebp, through the page tables
+		};
+
+		uint8_t* buffer;								// Executable memory
+		size_t used;									// Bytes of buffer in use
+		size_t stubs_end;								// Bytes taken by enter and exit_code, kept by flush()
+		jit_entry enter;								// Loads the registers and jumps into translated code
+		uint8_t* exit_code;								// Stores the registers back and returns the count left
+		const uint8_t* entries[0x10000];				// Translated code per instruction address
+		uint8_t block_bitmap[0x10000 / 8];				// One bit per address covered by a block
+		std::vector<jit_exit> exits;					// Exits of the block being translated
+		std::vector<jit_branch> branches;				// Branches of the block being translated
+		std::vector<jit_call> calls;					// Calls out of the block being translated
+		uint16_t call_pc;								// pc and opcode the calls out of the instruction being translated store
+		uint8_t call_opcode;
+
+		// Code emission
+		uint8_t* emit_position;
+		void emit(uint8_t byte);
+		void emit32(uint32_t value);
+		void emit64(uint64_t value);
+		void emit_store8(int32_t offset, uint8_t value);
+		void emit_store16(int32_t offset, uint16_t value);
+		void emit_and8(int32_t offset, uint8_t value);
+		void emit_or8(int32_t offset, uint8_t value);
+		void emit_load_al(int32_t offset);
+		void emit_store_al(int32_t offset);
+		void emit_flags_nz(NES_Cpu* cpu);
+		void emit_call(void* function, uint16_t operand);
+		void emit_load_cycles(NES_Cpu* cpu);
+		void emit_store_cycles(NES_Cpu* cpu);
+		void emit_stubs(NES_Cpu* cpu);
+		int add_exit(uint16_t pc, uint8_t opcode, bool store_pc, uint8_t cycles);
+		void emit_jump_exit(int exit, uint8_t condition);
+		void emit_boundary(uint8_t cycles, int exit);
+		void emit_exit_if_flushed(int exit);
+		void emit_exits(NES_Cpu* cpu);
+
+		// Operand access
+		void emit_cpu_operand(uint8_t reg, int32_t offset);
+		void emit_cpu_indexed(uint8_t reg, uint8_t index, int32_t offset);
+		int add_call(bool write, int exit);
+		void emit_jump_call(int call, uint8_t condition);
+		void emit_calls(NES_Cpu* cpu);
+		void emit_test8(int32_t offset, uint8_t mask);
+		void emit_flag_carry(NES_Cpu* cpu, uint8_t condition);
+		void emit_bus_call(NES_Cpu* cpu, bool write);
+		void emit_target(NES_Cpu* cpu, uint16_t address);
+		int emit_address(NES_Cpu* cpu, uint8_t mode, uint16_t operand, uint16_t address, uint16_t* constant);
+		void emit_page_cross(NES_Cpu* cpu, uint8_t mode, uint16_t operand);
+		void emit_fetch(NES_Cpu* cpu, int access, uint16_t constant);
+		void emit_write(NES_Cpu* cpu, int access, uint16_t constant, int exit);
+
+		// Instructions
+		bool emit_native(NES_Cpu* cpu, const decoded_entry* entry, uint16_t address);
+		bool emit_memory(NES_Cpu* cpu, const decoded_entry* entry, uint16_t address);
+		void emit_branch(NES_Cpu* cpu, const decoded_entry* entry, uint16_t address);
+		void emit_chain(uint16_t address, int exit);
+		void emit_chain_pc(NES_Cpu* cpu, int exit);
+
+		// Block boundaries
+		static bool ends_block(const NES_Cpu::instruction_desc* desc);
+		static bool writes_memory(const NES_Cpu::instruction_desc* desc);
 };
\ No newline at end of file
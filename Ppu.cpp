@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "NES.h"
+
+
+// Byte i of a row is pixel i from the left, these replicate a value into all 8 of them
+#define ROW_BYTES	0x0101010101010101ULL
+#define ROW_LOW		0x7F7F7F7F7F7F7F7FULL
+
+// 0xFF in every byte of a row whose pixel (the low 2 bits) isn't transparent
+static inline uint64_t opaque_mask(uint64_t row) {
+	return ((row | row >> 1) & ROW_BYTES) * 0xFF;
+}
+
+// Bit 7 - i of a byte to byte i, no carries since the shifted copies of the byte don't overlap
+static inline uint64_t spread_bits(uint8_t bits) {
+	return ((bits * 0x8040201008040201ULL) & 0x8080808080808080ULL) >> 7;
+}
+
+// A row of zeros for every tile, behind the pattern tables while there is no cartridge
+static const uint64_t blank_page[0x0400 / 2] = { 0 };
+
+
+NES_Ppu::NES_Ppu(NES_Cpu* cpu) {
+	this->cpu = cpu;
+
+	memset(chr_ram_dirty, 0, sizeof(chr_ram_dirty));
+	chr_ram_changed = false;
+
+	for (int i = 0; i < 8; i++) {
+		pattern_pages[i] = blank_page;
+	}
+}
+
+void NES_Ppu::decode_tiles(const uint8_t* chr, uint32_t size, uint64_t* decoded) {
+	for (uint32_t tile = 0; tile < size / 16; tile++) {
+		for (int row = 0; row < 8; row++) {
+			decoded[tile * 8 + row] = spread_bits(chr[tile * 16 + row]) | spread_bits(chr[tile * 16 + 8 + row]) << 1;
+		}
+	}
+}
+
+void NES_Ppu::invalidate_chr() {
+	memset(chr_ram_dirty, 0xFF, sizeof(chr_ram_dirty));
+	chr_ram_changed = true;
+}
+
+// Most instances never show a picture, they only run the lines for the sprite 0 hits and overflows the CPU sees
+void NES_Ppu::draw() {
+	framebuffer.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+}
+
+const uint8_t* NES_Ppu::frame() {
+	return framebuffer.empty() ? NULL : framebuffer.data();
+}
+
+
+/*
+	Registers
+
+	$2000 PPUCTRL, $2001 PPUMASK, $2002 PPUSTATUS, $2003 OAMADDR, $2004 OAMDATA, $2005 PPUSCROLL, $2006 PPUADDR and
+	$2007 PPUDATA. Reads of the write only registers return what was last written to them.
+*/
+uint8_t NES_Ppu::read_register(uint16_t address) {
+	uint8_t* registers = cpu->ppu_registers;
+
+	switch (address & 0x0007) {
+		case 2: {
+			uint8_t status = registers[2];
+			registers[2] &= ~PPUSTATUS_VBLANK;
+			cpu->ppu_w = 0;
+			return status;
+		}
+
+		case 4:
+			return cpu->oam[registers[3]];
+
+		case 7: {
+			uint16_t vram_address = cpu->ppu_v & 0x3FFF;
+			uint8_t data;
+
+			// Palette reads aren't buffered, the buffer gets the nametable byte underneath instead
+			if (vram_address >= 0x3F00) {
+				data = read_vram(vram_address);
+				cpu->ppu_buffer = read_vram(vram_address - 0x1000);
+			}
+			else {
+				data = cpu->ppu_buffer;
+				cpu->ppu_buffer = read_vram(vram_address);
+			}
+
+			cpu->ppu_v += (registers[0] & PPUCTRL_INCREMENT) ? 32 : 1;
+			return data;
+		}
+	}
+
+	return registers[address & 0x0007];
+}
+
+void NES_Ppu::write_register(uint16_t address, uint8_t data) {
+	uint8_t* registers = cpu->ppu_registers;
+
+	switch (address & 0x0007) {
+		case 0:
+			// Turning NMIs on during vertical blank fires one straight away
+			if (!(registers[0] & PPUCTRL_NMI) && (data & PPUCTRL_NMI) && (registers[2] & PPUSTATUS_VBLANK)) {
+				cpu->ppu_nmi_pending = 1;
+			}
+
+			registers[0] = data;
+			cpu->ppu_t = (cpu->ppu_t & 0xF3FF) | (data & 0x03) << 10;
+			break;
+
+		case 2:
+			break;
+
+		case 4:
+			cpu->oam[registers[3]++] = data;
+			registers[4] = data;
+			break;
+
+		case 5:
+			if (cpu->ppu_w == 0) {
+				cpu->ppu_t = (cpu->ppu_t & 0xFFE0) | data >> 3;
+				cpu->ppu_x = data & 0x07;
+			}
+			else {
+				cpu->ppu_t = (cpu->ppu_t & 0x8C1F) | (data & 0x07) << 12 | (data & 0xF8) << 2;
+			}
+
+			cpu->ppu_w ^= 1;
+			registers[5] = data;
+			break;
+
+		case 6:
+			if (cpu->ppu_w == 0) {
+				cpu->ppu_t = (cpu->ppu_t & 0x00FF) | (data & 0x3F) << 8;
+			}
+			else {
+				cpu->ppu_t = (cpu->ppu_t & 0xFF00) | data;
+				cpu->ppu_v = cpu->ppu_t;
+			}
+
+			cpu->ppu_w ^= 1;
+			registers[6] = data;
+			break;
+
+		case 7:
+			write_vram(cpu->ppu_v & 0x3FFF, data);
+			cpu->ppu_v += (registers[0] & PPUCTRL_INCREMENT) ? 32 : 1;
+			registers[7] = data;
+			break;
+
+		default:
+			registers[address & 0x0007] = data;
+			break;
+	}
+}
+
+
+/*
+	PPU bus
+
+	$0000 - $1FFF pattern tables through chr_pages, $2000 - $3EFF the nametables through nametable_pages and
+	$3F00 - $3FFF palette RAM. Only CHR RAM can be written, and each write marks its tile to be decoded again.
+*/
+static inline int palette_index(uint16_t address) {
+	int index = address & 0x001F;
+
+	// The backdrop entries of the sprite palettes are the background ones
+	return (index & 0x13) == 0x10 ? index & 0x0F : index;
+}
+
+uint8_t NES_Ppu::read_vram(uint16_t address) {
+	if (address >= 0x3F00) {
+		return cpu->palette[palette_index(address)];
+	}
+
+	if (address >= 0x2000) {
+		return cpu->nametable_pages[(address >> 10) & 0x03][address & 0x03FF];
+	}
+
+	if (cpu->cartridge == NULL) {
+		return 0;
+	}
+
+	return cpu->chr_pages[address >> 10][address & 0x03FF];
+}
+
+void NES_Ppu::write_vram(uint16_t address, uint8_t data) {
+	if (address >= 0x3F00) {
+		cpu->palette[palette_index(address)] = data & 0x3F;
+	}
+	else if (address >= 0x2000) {
+		cpu->nametable_pages[(address >> 10) & 0x03][address & 0x03FF] = data;
+	}
+	else if (cpu->cartridge != NULL && cpu->cartridge->chr_ram) {
+		uint8_t* byte = &cpu->chr_pages[address >> 10][address & 0x03FF];
+		*byte = data;
+
+		int tile = (byte - cpu->chr_ram.data()) >> 4;
+		chr_ram_dirty[tile / 64] |= 1ULL << (tile % 64);
+		chr_ram_changed = true;
+	}
+}
+
+
+/*
+	Scanlines
+
+	Visible lines are drawn whole when they start, then fine Y is stepped and the horizontal scroll reloaded from t
+	the way the PPU does at the end of a rendered line. Vertical blank starts with line 241, and the pre-render line
+	clears the flags and reloads the whole of v from t before the first line of the next frame.
+*/
+void NES_Ppu::scanline() {
+	int line = cpu->ppu_scanline;
+	uint8_t* registers = cpu->ppu_registers;
+	bool rendering = (registers[1] & (PPUMASK_BACKGROUND | PPUMASK_SPRITES)) != 0;
+
+	if (cpu->ppu_nmi_pending) {
+		cpu->ppu_nmi_pending = 0;
+		cpu->nmi();
+	}
+
+	if (line < SCREEN_HEIGHT) {
+		render_line(line);
+
+		if (rendering) {
+			// Fine Y, carrying into coarse Y, which wraps into the next nametable after row 29
+			uint16_t v = cpu->ppu_v;
+			if ((v & 0x7000) != 0x7000) {
+				v += 0x1000;
+			}
+			else {
+				v &= ~0x7000;
+				int coarse_y = (v & 0x03E0) >> 5;
+
+				if (coarse_y == 29) {
+					coarse_y = 0;
+					v ^= 0x0800;
+				}
+				else if (coarse_y == 31) {
+					coarse_y = 0;
+				}
+				else {
+					coarse_y++;
+				}
+
+				v = (v & ~0x03E0) | coarse_y << 5;
+			}
+
+			cpu->ppu_v = (v & ~0x041F) | (cpu->ppu_t & 0x041F);
+
+			if (cpu->cartridge != NULL) {
+				cpu->cartridge->mapper->scanline(cpu);
+			}
+		}
+	}
+	else if (line == PPU_VBLANK_SCANLINE) {
+		registers[2] |= PPUSTATUS_VBLANK;
+		cpu->ppu_frame++;
+
+		if (registers[0] & PPUCTRL_NMI) {
+			cpu->nmi();
+		}
+	}
+	else if (line == PPU_PRERENDER_SCANLINE) {
+		registers[2] &= ~(PPUSTATUS_VBLANK | PPUSTATUS_SPRITE_ZERO | PPUSTATUS_OVERFLOW);
+
+		if (rendering) {
+			cpu->ppu_v = cpu->ppu_t;
+
+			if (cpu->cartridge != NULL) {
+				cpu->cartridge->mapper->scanline(cpu);
+			}
+		}
+	}
+
+	cpu->ppu_scanline = (line + 1) % PPU_SCANLINES;
+	cpu->ppu_line_dot += PPU_DOTS_PER_SCANLINE;
+	cpu->ppu_deadline = (cpu->ppu_line_dot + 2) / 3;
+}
+
+
+/*
+	Catching up
+
+	Every line left to run draws and does the same whether it runs at its own start or later on, as long as it runs
+	before anything it depends on changes. sync() makes sure of that and runs from inside instructions, so it stops
+	short of the next event: the line there calls back into the CPU and only ever runs from run(), between instructions.
+*/
+void NES_Ppu::sync() {
+	while (cpu->cycle_count >= cpu->ppu_deadline && cpu->ppu_deadline < cpu->events.next()) {
+		scanline();
+	}
+}
+
+void NES_Ppu::catch_up() {
+	while (cpu->cycle_count >= cpu->ppu_deadline) {
+		scanline();
+	}
+
+	schedule();
+}
+
+/*
+	Posts the next line starts where the PPU does something to the CPU: vertical blank every frame, or the next
+	line for an NMI enabled during vertical blank, and the line whose scanline() call has the mapper raise its IRQ,
+	counting the lines the mapper is clocked on while rendering.
+*/
+void NES_Ppu::schedule() {
+	cpu->post_event(EVENT_PPU, cpu->ppu_nmi_pending ? cpu->ppu_deadline : line_start(PPU_VBLANK_SCANLINE));
+
+	bool rendering = (cpu->ppu_registers[1] & (PPUMASK_BACKGROUND | PPUMASK_SPRITES)) != 0;
+	int clocks = rendering && cpu->cartridge != NULL ? cpu->cartridge->mapper->scanlines_to_irq(cpu) : 0;
+
+	for (int i = 0; clocks > 0 && i < PPU_SCANLINES; i++) {
+		int line = (cpu->ppu_scanline + i) % PPU_SCANLINES;
+		if (line >= SCREEN_HEIGHT && line != PPU_PRERENDER_SCANLINE) {
+			continue;
+		}
+
+		if (--clocks == 0) {
+			cpu->post_event(EVENT_MAPPER_IRQ, line_start(line));
+			return;
+		}
+	}
+
+	cpu->events.cancel(EVENT_MAPPER_IRQ);
+}
+
+uint64_t NES_Ppu::line_start(int line) {
+	int lines = (line - cpu->ppu_scanline + PPU_SCANLINES) % PPU_SCANLINES;
+
+	return (cpu->ppu_line_dot + (uint64_t) lines * PPU_DOTS_PER_SCANLINE + 2) / 3;
+}
+
+// Point pattern_pages at the decoded rows of whatever chr_pages has in, decoding the CHR RAM tiles written to
+void NES_Ppu::update_patterns() {
+	const NES_Cartridge* cartridge = cpu->cartridge;
+
+	if (cartridge == NULL) {
+		for (int i = 0; i < 8; i++) {
+			pattern_pages[i] = blank_page;
+		}
+		return;
+	}
+
+	if (!cartridge->chr_ram) {
+		for (int i = 0; i < 8; i++) {
+			pattern_pages[i] = cartridge->chr_decoded.data() + (cpu->chr_pages[i] - cartridge->chr_rom) / 2;
+		}
+		return;
+	}
+
+	if (chr_ram_changed) {
+		if (chr_ram_decoded.empty()) {
+			chr_ram_decoded.resize(cpu->chr_ram.size() / 2);
+		}
+
+		for (int word = 0; word < (int) (sizeof(chr_ram_dirty) / sizeof(chr_ram_dirty[0])); word++) {
+			while (chr_ram_dirty[word] != 0) {
+				int tile = word * 64 + __builtin_ctzll(chr_ram_dirty[word]);
+				chr_ram_dirty[word] &= chr_ram_dirty[word] - 1;
+
+				decode_tiles(&cpu->chr_ram[tile * 16], 16, &chr_ram_decoded[tile * 8]);
+			}
+		}
+
+		chr_ram_changed = false;
+	}
+
+	for (int i = 0; i < 8; i++) {
+		pattern_pages[i] = chr_ram_decoded.data() + (cpu->chr_pages[i] - cpu->chr_ram.data()) / 2;
+	}
+}
+
+inline uint64_t NES_Ppu::pattern_row(uint16_t address, int row) {
+	return pattern_pages[address >> 10][(address & 0x03F0) >> 1 | row];
+}
+
+void NES_Ppu::render_line(int line) {
+	uint8_t* registers = cpu->ppu_registers;
+	uint8_t* out = framebuffer.empty() ? NULL : &framebuffer[line * SCREEN_WIDTH];
+	uint8_t color_mask = (registers[1] & PPUMASK_GRAYSCALE) ? 0x30 : 0x3F;
+
+	if (!(registers[1] & (PPUMASK_BACKGROUND | PPUMASK_SPRITES))) {
+		if (out != NULL) {
+			memset(out, cpu->palette[0] & color_mask, SCREEN_WIDTH);
+		}
+		return;
+	}
+
+	update_patterns();
+
+	// Palette indexes, 0 where the pixel is transparent, with 8 pixels on the end for fine X and sprites at X 248+
+	uint8_t background[SCREEN_WIDTH + 16];
+	uint8_t sprites[SCREEN_WIDTH + 8];
+
+	memset(sprites, 0, sizeof(sprites));
+	bool zero_on_line = false;
+	if (registers[1] & PPUMASK_SPRITES) {
+		zero_on_line = render_sprites(line, sprites);
+	}
+
+	// Without a picture, the background only matters for a sprite 0 hit the line can still make
+	bool hit = (registers[2] & PPUSTATUS_SPRITE_ZERO) != 0;
+	if (out == NULL && (hit || !zero_on_line)) {
+		return;
+	}
+
+	if (registers[1] & PPUMASK_BACKGROUND) {
+		render_background(background);
+	}
+	else {
+		memset(background, 0, sizeof(background));
+	}
+
+	uint8_t* shown = &background[cpu->ppu_x];
+
+	if (!(registers[1] & PPUMASK_BACKGROUND_LEFT)) {
+		memset(shown, 0, 8);
+	}
+	if (!(registers[1] & PPUMASK_SPRITES_LEFT)) {
+		memset(sprites, 0, 8);
+	}
+
+	/*
+		Sprite pixels are 0x10 | palette << 2 | color, with bit 6 set for sprite 0 and bit 7 for sprites behind the
+		background. A sprite pixel shows unless it is behind an opaque background pixel.
+	*/
+	for (int x = 0; x < SCREEN_WIDTH; x += 8) {
+		uint64_t back;
+		uint64_t front;
+		memcpy(&back, &shown[x], 8);
+		memcpy(&front, &sprites[x], 8);
+
+		uint64_t back_opaque = opaque_mask(back);
+		uint64_t front_opaque = opaque_mask(front);
+		uint64_t behind = ((front >> 7) & ROW_BYTES) * 0xFF;
+		uint64_t zero = ((front >> 6) & ROW_BYTES) * 0xFF;
+
+		// Sprite 0 hits anywhere it overlaps the background but at X 255
+		uint64_t overlap = front_opaque & back_opaque & zero;
+		if (x == SCREEN_WIDTH - 8) {
+			overlap &= 0x00FFFFFFFFFFFFFFULL;
+		}
+		hit |= overlap != 0;
+
+		if (out == NULL) {
+			continue;
+		}
+
+		uint64_t show_front = front_opaque & ~(behind & back_opaque);
+		uint64_t pixels = (back & ~show_front) | (front & show_front & (ROW_BYTES * 0x1F));
+
+		for (int i = 0; i < 8; i++) {
+			out[x + i] = cpu->palette[(pixels >> (i * 8)) & 0x1F] & color_mask;
+		}
+	}
+
+	if (hit) {
+		registers[2] |= PPUSTATUS_SPRITE_ZERO;
+	}
+}
+
+// 33 tiles from v, so the line can start anywhere in the first one for fine X
+void NES_Ppu::render_background(uint8_t* pixels) {
+	uint16_t v = cpu->ppu_v;
+	uint16_t table = (cpu->ppu_registers[0] & PPUCTRL_BACKGROUND_TABLE) ? 0x1000 : 0x0000;
+	int fine_y = v >> 12;
+
+	for (int tile = 0; tile < 33; tile++) {
+		const uint8_t* nametable = cpu->nametable_pages[(v >> 10) & 0x03];
+		uint8_t index = nametable[v & 0x03FF];
+		uint8_t attribute = nametable[0x03C0 | ((v >> 4) & 0x38) | ((v >> 2) & 0x07)];
+		uint64_t palette = (attribute >> (((v >> 4) & 0x04) | (v & 0x02))) & 0x03;
+
+		uint64_t row = pattern_row(table | index << 4, fine_y);
+		row |= (opaque_mask(row) & ROW_BYTES) * (palette << 2);
+		memcpy(&pixels[tile * 8], &row, 8);
+
+		// Coarse X, wrapping into the next nametable
+		if ((v & 0x001F) == 31) {
+			v = (v & ~0x001F) ^ 0x0400;
+		}
+		else {
+			v++;
+		}
+	}
+}
+
+// The first 8 sprites on the line, lower OAM indexes in front. Returns true when sprite 0 is one of them.
+bool NES_Ppu::render_sprites(int line, uint8_t* pixels) {
+	uint8_t* registers = cpu->ppu_registers;
+	int height = (registers[0] & PPUCTRL_SPRITE_SIZE) ? 16 : 8;
+	int found = 0;
+	bool zero = false;
+
+	for (int i = 0; i < 64; i++) {
+		const uint8_t* sprite = &cpu->oam[i * 4];
+
+		// Sprites show one line below their Y
+		int row = line - sprite[0] - 1;
+		if (row < 0 || row >= height) {
+			continue;
+		}
+
+		if (found == 8) {
+			registers[2] |= PPUSTATUS_OVERFLOW;
+			return zero;
+		}
+		found++;
+		zero |= i == 0;
+
+		uint8_t attributes = sprite[2];
+		if (attributes & 0x80) {
+			row = height - 1 - row;
+		}
+
+		uint16_t address;
+		if (height == 16) {
+			address = (sprite[1] & 0x01) << 12 | (sprite[1] & 0xFE) << 4 | (row & 0x08) << 1;
+		}
+		else {
+			address = ((registers[0] & PPUCTRL_SPRITE_TABLE) ? 0x1000 : 0x0000) | sprite[1] << 4;
+		}
+
+		// Pixels are bytes, so a horizontal flip is a byte swap
+		uint64_t row_pixels = pattern_row(address, row & 0x07);
+		if (attributes & 0x40) {
+			row_pixels = __builtin_bswap64(row_pixels);
+		}
+
+		uint8_t flags = 0x10 | (attributes & 0x03) << 2 | ((attributes & 0x20) ? 0x80 : 0) | (i == 0 ? 0x40 : 0);
+		uint64_t opaque = opaque_mask(row_pixels);
+		uint64_t colored = (row_pixels | ROW_BYTES * flags) & opaque;
+
+		// Only where no sprite in front of this one drew
+		uint64_t existing;
+		memcpy(&existing, &pixels[sprite[3]], 8);
+		existing |= colored & ~opaque_mask(existing);
+		memcpy(&pixels[sprite[3]], &existing, 8);
+	}
+
+	return zero;
+}
+
+
+// 2C02 colors
+const uint8_t NES_Ppu::colors[64][3] = {
+	{  84,  84,  84 }, {   0,  30, 116 }, {   8,  16, 144 }, {  48,   0, 136 }, {  68,   0, 100 }, {  92,   0,  48 },
+	{  84,   4,   0 }, {  60,  24,   0 }, {  32,  42,   0 }, {   8,  58,   0 }, {   0,  64,   0 }, {   0,  60,   0 },
+	{   0,  50,  60 }, {   0,   0,   0 }, {   0,   0,   0 }, {   0,   0,   0 },
+	{ 152, 150, 152 }, {   8,  76, 196 }, {  48,  50, 236 }, {  92,  30, 228 }, { 136,  20, 176 }, { 160,  20, 100 },
+	{ 152,  34,  32 }, { 120,  60,   0 }, {  84,  90,   0 }, {  40, 114,   0 }, {   8, 124,   0 }, {   0, 118,  40 },
+	{   0, 102, 120 }, {   0,   0,   0 }, {   0,   0,   0 }, {   0,   0,   0 },
+	{ 236, 238, 236 }, {  76, 154, 236 }, { 120, 124, 236 }, { 176,  98, 236 }, { 228,  84, 236 }, { 236,  88, 180 },
+	{ 236, 106, 100 }, { 212, 136,  32 }, { 160, 170,   0 }, { 116, 196,   0 }, {  76, 208,  32 }, {  56, 204, 108 },
+	{  56, 180, 204 }, {  60,  60,  60 }, {   0,   0,   0 }, {   0,   0,   0 },
+	{ 236, 238, 236 }, { 168, 204, 236 }, { 188, 188, 236 }, { 212, 178, 236 }, { 236, 174, 236 }, { 236, 174, 212 },
+	{ 236, 180, 176 }, { 228, 196, 144 }, { 204, 210, 120 }, { 180, 222, 120 }, { 168, 226, 144 }, { 152, 226, 180 },
+	{ 160, 214, 228 }, { 160, 162, 160 }, {   0,   0,   0 }, {   0,   0,   0 }
+};
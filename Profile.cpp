@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include "NES.h"
+
+
+NES_Profile::NES_Profile() : pc_counters(0x10000), symbol_index(0x10000, -1) {
+	begin(0x0000, 0);
+}
+
+// Clear the counters and start the call tree at pc
+void NES_Profile::begin(uint16_t pc, uint64_t cycle) {
+	memset(&pc_counters[0], 0, pc_counters.size() * sizeof(profile_counter));
+
+	nodes.clear();
+	nodes.reserve(PROFILE_MAX_NODES);
+
+	profile_node root;
+	root.parent = 0;
+	root.first_child = 0;
+	root.next_sibling = 0;
+	root.function = pc;
+	root.depth = 0;
+	root.instructions = 0;
+	root.cycles = 0;
+	nodes.push_back(root);
+
+	node = 0;
+	overflow = 0;
+
+	// A NOP before the first instruction, so nothing is charged and the tree doesn't move
+	last_pc = pc;
+	last_opcode = 0xEA;
+	last_node = 0;
+	last_cycle = cycle;
+}
+
+// Called address becomes a child of the current node, children are few so they are searched in a list
+void NES_Profile::enter(uint16_t function) {
+	if (overflow > 0 || nodes[node].depth >= PROFILE_MAX_DEPTH) {
+		overflow++;
+		return;
+	}
+
+	for (uint32_t child = nodes[node].first_child; child != 0; child = nodes[child].next_sibling) {
+		if (nodes[child].function == function) {
+			node = child;
+			return;
+		}
+	}
+
+	if (nodes.size() >= PROFILE_MAX_NODES) {
+		overflow++;
+		return;
+	}
+
+	profile_node callee;
+	callee.parent = node;
+	callee.first_child = 0;
+	callee.next_sibling = nodes[node].first_child;
+	callee.function = function;
+	callee.depth = nodes[node].depth + 1;
+	callee.instructions = 0;
+	callee.cycles = 0;
+
+	nodes[node].first_child = nodes.size();
+	nodes.push_back(callee);
+	node = nodes.size() - 1;
+}
+
+// Returns without a matching call (RTS used as a jump) stay in the root
+void NES_Profile::leave() {
+	if (overflow > 0) {
+		overflow--;
+	}
+	else if (node != 0) {
+		node = nodes[node].parent;
+	}
+}
+
+void NES_Profile::interrupt(uint16_t from, uint16_t handler) {
+	// The instruction before the interrupt has run, so whatever it does to the stack comes first
+	if (last_opcode == 0x20 || last_opcode == 0x00) {
+		enter(from);
+	}
+	else if (last_opcode == 0x60 || last_opcode == 0x40) {
+		leave();
+	}
+
+	enter(handler);
+	last_opcode = 0xEA;
+}
+
+/*
+	Symbols
+
+	ld65 label files have one "al 00C000 .name" line per label. cc65 debug info files have "sym" lines with
+	name="name" and val=0xC000 among their fields. The first name given to an address is kept.
+*/
+int NES_Profile::load_symbols(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		printf("Failed to open symbol file %s\n", path);
+		return 1;
+	}
+
+	char line[1024];
+	int loaded = 0;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		unsigned int address;
+		char label[256];
+		std::string name;
+
+		if (sscanf(line, "al %x .%255s", &address, label) == 2) {
+			name = label;
+		}
+		else if (strncmp(line, "sym", 3) == 0 && (line[3] == '\t' || line[3] == ' ')) {
+			const char* name_field = strstr(line, "name=\"");
+			const char* value_field = strstr(line, "val=0x");
+
+			if (name_field == NULL || value_field == NULL) {
+				continue;
+			}
+
+			name_field += 6;
+			const char* name_end = strchr(name_field, '"');
+			if (name_end == NULL) {
+				continue;
+			}
+
+			name.assign(name_field, name_end - name_field);
+			address = strtoul(value_field + 6, NULL, 16);
+		}
+		else {
+			continue;
+		}
+
+		// Only the CPU address of banked code
+		address &= 0xFFFF;
+
+		if (symbol_index[address] < 0) {
+			symbol_index[address] = symbol_names.size();
+			symbol_names.push_back(name);
+			loaded++;
+		}
+	}
+
+	fclose(file);
+
+	printf("Loaded %d symbols from %s\n", loaded, path);
+
+	return 0;
+}
+
+std::string NES_Profile::name(uint16_t address) {
+	if (symbol_index[address] >= 0) {
+		return symbol_names[symbol_index[address]];
+	}
+
+	char hex[8];
+	snprintf(hex, sizeof(hex), "$%04X", address);
+
+	return hex;
+}
+
+uint64_t NES_Profile::instructions() {
+	uint64_t total = 0;
+	for (size_t i = 0; i < pc_counters.size(); i++) {
+		total += pc_counters[i].instructions;
+	}
+
+	return total;
+}
+
+uint64_t NES_Profile::cycles() {
+	uint64_t total = 0;
+	for (size_t i = 0; i < pc_counters.size(); i++) {
+		total += pc_counters[i].cycles;
+	}
+
+	return total;
+}
+
+void NES_Profile::report(int count) {
+	std::vector<uint16_t> addresses;
+	for (uint32_t i = 0; i < 0x10000; i++) {
+		if (pc_counters[i].instructions > 0) {
+			addresses.push_back(i);
+		}
+	}
+
+	count = (int) std::min((size_t) count, addresses.size());
+	std::partial_sort(addresses.begin(), addresses.begin() + count, addresses.end(), [this](uint16_t a, uint16_t b) {
+		return pc_counters[a].cycles > pc_counters[b].cycles;
+	});
+
+	uint64_t total = cycles();
+
+	printf("address  instructions        cycles       %%  symbol\n");
+	for (int i = 0; i < count; i++) {
+		uint16_t address = addresses[i];
+
+		// Nearest label at or before the address
+		std::string label;
+		for (uint32_t back = 0; back < 0x1000 && back <= address; back++) {
+			if (symbol_index[address - back] >= 0) {
+				char offset[8];
+				snprintf(offset, sizeof(offset), "+%u", back);
+				label = symbol_names[symbol_index[address - back]] + (back ? offset : "");
+				break;
+			}
+		}
+
+		printf("$%04X  %14llu  %12llu  %5.2f%%  %s\n", address, (unsigned long long) pc_counters[address].instructions,
+			(unsigned long long) pc_counters[address].cycles,
+			total ? 100.0 * pc_counters[address].cycles / total : 0.0, label.c_str());
+	}
+
+	printf("%llu instructions, %llu cycles, %zu call stacks\n", (unsigned long long) instructions(),
+		(unsigned long long) total, nodes.size());
+}
+
+int NES_Profile::save_collapsed(const char* path, bool cycles) {
+	FILE* out = fopen(path, "w");
+	if (out == NULL) {
+		printf("Failed to write collapsed stacks to %s\n", path);
+		return 1;
+	}
+
+	for (size_t i = 0; i < nodes.size(); i++) {
+		uint64_t weight = cycles ? nodes[i].cycles : nodes[i].instructions;
+		if (weight == 0) {
+			continue;
+		}
+
+		// Walk up to the root, then write the frames outermost first
+		std::vector<uint32_t> stack;
+		for (uint32_t frame = i; ; frame = nodes[frame].parent) {
+			stack.push_back(frame);
+			if (frame == 0) {
+				break;
+			}
+		}
+
+		for (size_t j = stack.size(); j-- > 0; ) {
+			fprintf(out, "%s%s", name(nodes[stack[j]].function).c_str(), j ? ";" : "");
+		}
+		fprintf(out, " %llu\n", (unsigned long long) weight);
+	}
+
+	fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "NES.h"
+
+
+/*
+	Run-length encoding
+
+	Each run starts with a control byte. 0x80 | (length - 1) is a run of up to 128 zero bytes, length - 1 on its own
+	is followed by that many literal bytes. The data is XORed with the reference first (none for keyframes), so
+	whatever didn't change since the keyframe turns into zero runs.
+*/
+static inline uint8_t difference(const uint8_t* data, const uint8_t* reference, size_t i) {
+	return reference != NULL ? data[i] ^ reference[i] : data[i];
+}
+
+static size_t encode_runs(const uint8_t* data, const uint8_t* reference, size_t size, uint8_t* out) {
+	size_t length = 0;
+	size_t i = 0;
+
+	while (i < size) {
+		size_t run = 0;
+		while (i + run < size && run < 128 && difference(data, reference, i + run) == 0) {
+			run++;
+		}
+
+		if (run > 0) {
+			out[length++] = 0x80 | (run - 1);
+			i += run;
+			continue;
+		}
+
+		// Literals until two zero bytes in a row, a lone one is cheaper kept in the literal run
+		size_t start = i;
+		while (i < size && i - start < 128) {
+			if (difference(data, reference, i) == 0 && (i + 1 >= size || difference(data, reference, i + 1) == 0)) {
+				break;
+			}
+			i++;
+		}
+
+		out[length++] = i - start - 1;
+		for (size_t j = start; j < i; j++) {
+			out[length++] = difference(data, reference, j);
+		}
+	}
+
+	return length;
+}
+
+// Returns the decoded size, 0 when it doesn't fit in capacity
+static size_t decode_runs(const uint8_t* in, size_t size, const uint8_t* reference, uint8_t* out, size_t capacity) {
+	size_t length = 0;
+	size_t i = 0;
+
+	while (i < size) {
+		uint8_t control = in[i++];
+		size_t run = (control & 0x7F) + 1;
+
+		if (length + run > capacity || (!(control & 0x80) && i + run > size)) {
+			return 0;
+		}
+
+		// A zero run is the reference's bytes as they are, which is most of a delta
+		if ((control & 0x80) && reference != NULL) {
+			memcpy(&out[length], &reference[length], run);
+		}
+		else if (control & 0x80) {
+			memset(&out[length], 0, run);
+		}
+		else if (reference != NULL) {
+			for (size_t j = 0; j < run; j++) {
+				out[length + j] = in[i + j] ^ reference[length + j];
+			}
+			i += run;
+		}
+		else {
+			memcpy(&out[length], &in[i], run);
+			i += run;
+		}
+		length += run;
+	}
+
+	return length;
+}
+
+
+NES_Rewind::NES_Rewind(size_t buffer_size) : buffer(buffer_size), reference(STATE_MAX_SIZE), state(STATE_MAX_SIZE),
+	packed(STATE_MAX_SIZE + STATE_MAX_SIZE / 128 + 1) {
+	write_offset = 0;
+	used = 0;
+	reference_size = 0;
+	reference_serial = 0;
+	reference_valid = false;
+}
+
+size_t NES_Rewind::frames() {
+	return entries.size();
+}
+
+size_t NES_Rewind::bytes() {
+	return used;
+}
+
+bool NES_Rewind::push(NES_Cpu* cpu) {
+	size_t size = cpu->save_state(state.data(), state.size());
+	if (size == 0) {
+		return false;
+	}
+
+	for (;;) {
+		uint64_t serial = entries.empty() ? 0 : entries.back().serial + 1;
+
+		// A delta of the newest entry's keyframe while that one is recent enough
+		bool delta = !entries.empty() && serial - entries.back().keyframe < REWIND_KEYFRAME &&
+			load_reference(entries.back().keyframe) && reference_size == size;
+		uint64_t keyframe = delta ? reference_serial : serial;
+
+		size_t packed_size = encode_runs(state.data(), delta ? reference.data() : NULL, size, packed.data());
+
+		size_t offset = reserve(packed_size);
+		if (offset == SIZE_MAX) {
+			return false;
+		}
+
+		// Making room dropped the keyframe itself, and every delta of it with it
+		if (delta && (entries.empty() || entries.front().serial > keyframe)) {
+			continue;
+		}
+
+		memcpy(&buffer[offset], packed.data(), packed_size);
+
+		rewind_entry entry;
+		entry.offset = offset;
+		entry.size = packed_size;
+		entry.serial = serial;
+		entry.keyframe = keyframe;
+		entries.push_back(entry);
+
+		write_offset = offset + packed_size;
+		used += packed_size;
+
+		if (!delta) {
+			memcpy(reference.data(), state.data(), size);
+			reference_size = size;
+			reference_serial = serial;
+			reference_valid = true;
+		}
+
+		return true;
+	}
+}
+
+bool NES_Rewind::pop(NES_Cpu* cpu) {
+	if (entries.empty()) {
+		return false;
+	}
+
+	rewind_entry entry = entries.back();
+	bool delta = entry.keyframe != entry.serial;
+
+	if (delta && !load_reference(entry.keyframe)) {
+		return false;
+	}
+
+	size_t size = decode_runs(&buffer[entry.offset], entry.size, delta ? reference.data() : NULL, state.data(), state.size());
+
+	// The newest entry was the last one written, its space is free again
+	entries.pop_back();
+	used -= entry.size;
+	write_offset = entry.offset;
+
+	// The serial is handed out again by the next push
+	if (!delta && reference_serial == entry.serial) {
+		reference_valid = false;
+	}
+
+	return size != 0 && cpu->load_state(state.data(), size) == 0;
+}
+
+/*
+	The entries sit in the buffer in the order they were written, so the one after the newest is always the oldest.
+	An entry that doesn't fit before the end of the buffer starts over at the beginning, leaving the tail unused.
+*/
+size_t NES_Rewind::reserve(size_t size) {
+	if (size > buffer.size()) {
+		return SIZE_MAX;
+	}
+
+	size_t start = write_offset;
+
+	if (start + size > buffer.size()) {
+		// Whatever is still past the write offset is older than everything at the start
+		while (!entries.empty() && entries.front().offset >= start) {
+			drop_oldest();
+		}
+		start = 0;
+	}
+
+	while (!entries.empty() && entries.front().offset < start + size && entries.front().offset + entries.front().size > start) {
+		drop_oldest();
+	}
+
+	return start;
+}
+
+// Drops the oldest entry, then the deltas that depended on it if it was a keyframe
+void NES_Rewind::drop_oldest() {
+	do {
+		if (entries.front().serial == reference_serial) {
+			reference_valid = false;
+		}
+
+		used -= entries.front().size;
+		entries.pop_front();
+	} while (!entries.empty() && entries.front().keyframe != entries.front().serial);
+}
+
+bool NES_Rewind::load_reference(uint64_t keyframe) {
+	if (reference_valid && reference_serial == keyframe) {
+		return true;
+	}
+
+	if (entries.empty() || keyframe < entries.front().serial) {
+		return false;
+	}
+
+	const rewind_entry* entry = &entries[keyframe - entries.front().serial];
+	reference_size = decode_runs(&buffer[entry->offset], entry->size, NULL, reference.data(), reference.size());
+	reference_serial = keyframe;
+	reference_valid = reference_size != 0;
+
+	return reference_valid;
+}
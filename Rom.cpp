@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <map>
+#include <mutex>
+#include "NES.h"
+#include "util.h"
+
+
+NES_Cartridge::NES_Cartridge() {
+	hash = 0;
+	size = 0;
+	mapper_number = MAPPER_NROM;
+	mapper = NULL;
+	mirroring = MIRROR_HORIZONTAL;
+	prg_rom = NULL;
+	prg_size = 0;
+	chr_rom = NULL;
+	chr_size = 0;
+	chr_ram = false;
+	has_trainer = false;
+	file = NULL;
+	references = 0;
+
+	memset(trainer, 0, sizeof(trainer));
+}
+
+NES_Cartridge::~NES_Cartridge() {
+	delete file;
+}
+
+
+/*
+	Shared images
+
+	Every image in use is in one map keyed by its hash. Instances load, clone and let go of cartridges from the
+	batch threads, so the map and the reference counts are only touched under the lock. Neither is ever destroyed,
+	global instances let go of their cartridge after the static destructors ran.
+*/
+static std::mutex& image_lock = *new std::mutex();
+static std::multimap<uint64_t, NES_Cartridge*>& images = *new std::multimap<uint64_t, NES_Cartridge*>();
+
+const NES_Cartridge* NES_Cartridge::acquire(uint64_t hash, uint32_t size) {
+	std::lock_guard<std::mutex> guard(image_lock);
+
+	auto range = images.equal_range(hash);
+	for (auto image = range.first; image != range.second; image++) {
+		if (image->second->size == size) {
+			image->second->references++;
+			return image->second;
+		}
+	}
+
+	return NULL;
+}
+
+// Another instance may have built the same image since acquire() came back empty, the first one built is kept
+const NES_Cartridge* NES_Cartridge::share(NES_Cartridge* image) {
+	const NES_Cartridge* shared = acquire(image->hash, image->size);
+	if (shared != NULL) {
+		delete image;
+		return shared;
+	}
+
+	std::lock_guard<std::mutex> guard(image_lock);
+	image->references = 1;
+	images.insert(std::make_pair(image->hash, image));
+
+	return image;
+}
+
+void NES_Cartridge::retain(const NES_Cartridge* image) {
+	if (image == NULL) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(image_lock);
+	image->references++;
+}
+
+void NES_Cartridge::release(const NES_Cartridge* image) {
+	if (image == NULL) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> guard(image_lock);
+	if (--image->references > 0) {
+		return;
+	}
+
+	auto range = images.equal_range(image->hash);
+	for (auto entry = range.first; entry != range.second; entry++) {
+		if (entry->second == image) {
+			images.erase(entry);
+			break;
+		}
+	}
+	guard.unlock();
+
+	delete image;
+}
+
+// The first instance to run the predecoded core or the recompiler on the image decodes it, the others wait for it
+const decoded_entry* NES_Cartridge::decoded_prg() const {
+	std::lock_guard<std::mutex> guard(image_lock);
+
+	if (prg_decoded.empty() && prg_size > 0) {
+		prg_decoded.resize(prg_size);
+		NES_Cpu::decode_prg(prg_rom, prg_size, prg_decoded.data());
+	}
+
+	return prg_decoded.data();
+}
+
+
+NES_Rom_File::NES_Rom_File() {
+	mapping = NULL;
+	length = 0;
+	memset(&header, 0, sizeof(header));
+}
+
+NES_Rom_File::~NES_Rom_File() {
+	close();
+}
+
+int NES_Rom_File::open(const char* path) {
+	close();
+
+	int descriptor = ::open(path, O_RDONLY);
+	if (descriptor < 0) {
+		printf("Failed to open game file\n");
+		return 1;
+	}
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0 || status.st_size < 16) {
+		printf("Game file is too small to be a ROM\n");
+		::close(descriptor);
+		return 1;
+	}
+
+	// The mapping stays valid once the descriptor is closed
+	void* address = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	::close(descriptor);
+
+	if (address == MAP_FAILED) {
+		printf("Failed to map game file\n");
+		return 1;
+	}
+
+	mapping = (uint8_t*) address;
+	length = status.st_size;
+
+	// The index is keyed by the full path, so the same file reached another way is still found
+	char full_path[PATH_MAX];
+	if (realpath(path, full_path) == NULL) {
+		snprintf(full_path, sizeof(full_path), "%s", path);
+	}
+
+	header.size = length;
+	header.modified = (int64_t) status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+
+	if (!find_index(full_path, &header)) {
+		header.hash = fnv1a(mapping, length);
+		add_index(full_path, &header);
+	}
+
+	return 0;
+}
+
+void NES_Rom_File::close() {
+	if (mapping != NULL) {
+		munmap(mapping, length);
+	}
+
+	mapping = NULL;
+	length = 0;
+}
+
+uint8_t* NES_Rom_File::data() {
+	return mapping;
+}
+
+int NES_Rom_File::size() {
+	return (int) length;
+}
+
+const rom_info* NES_Rom_File::info() {
+	return &header;
+}
+
+
+// Where the index lives, the directories leading to it are made when create is set
+bool NES_Rom_File::index_path(char* path, size_t size, bool create) {
+	const char* cache = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	char cache_dir[PATH_MAX];
+
+	if (cache != NULL && cache[0] != '\0') {
+		snprintf(cache_dir, sizeof(cache_dir), "%s", cache);
+	}
+	else if (home != NULL && home[0] != '\0') {
+		snprintf(cache_dir, sizeof(cache_dir), "%s/.cache", home);
+	}
+	else {
+		return false;
+	}
+
+	int length = snprintf(path, size, "%s/%s/%s", cache_dir, ROM_INDEX_DIR, ROM_INDEX_FILE);
+	if (length <= 0 || length >= (int) size) {
+		return false;
+	}
+
+	// The directory is the path without the file name, which fit already
+	if (create) {
+		char dir[PATH_MAX];
+		size_t dir_length = length - strlen(ROM_INDEX_FILE) - 1;
+		memcpy(dir, path, dir_length);
+		dir[dir_length] = '\0';
+
+		mkdir(cache_dir, 0755);
+		mkdir(dir, 0755);
+	}
+
+	return true;
+}
+
+/*
+	ROM index
+
+	One line per file, "hash size modified path", with the path running to the end of the line. An entry only counts
+	when the size and modification time still match the file.
+*/
+static bool parse_index_line(char* line, rom_info* info, const char** path) {
+	unsigned long long hash;
+	unsigned long long size;
+	long long modified;
+	int path_start = 0;
+
+	if (sscanf(line, "%llx %llu %lld %n", &hash, &size, &modified, &path_start) < 3 || path_start == 0) {
+		return false;
+	}
+
+	line[strcspn(line, "\r\n")] = '\0';
+	info->hash = hash;
+	info->size = size;
+	info->modified = modified;
+	*path = &line[path_start];
+
+	return true;
+}
+
+bool NES_Rom_File::find_index(const char* path, rom_info* info) {
+	char index_file[PATH_MAX];
+	if (!index_path(index_file, sizeof(index_file), false)) {
+		return false;
+	}
+
+	FILE* index = fopen(index_file, "r");
+	if (index == NULL) {
+		return false;
+	}
+
+	char line[PATH_MAX + 64];
+	bool found = false;
+
+	while (!found && fgets(line, sizeof(line), index) != NULL) {
+		rom_info entry;
+		const char* entry_path;
+
+		if (!parse_index_line(line, &entry, &entry_path) || strcmp(entry_path, path) != 0 ||
+			entry.size != info->size || entry.modified != info->modified) {
+			continue;
+		}
+
+		info->hash = entry.hash;
+		found = true;
+	}
+
+	fclose(index);
+
+	return found;
+}
+
+/*
+	Rewrites the index with the new entry and the ones for other files that are still there unchanged, so stale lines
+	and files that are gone don't pile up. The new index is written to a file of its own next to the old one and
+	renamed over it, so a reader never sees a half written index. Batch threads add under one lock and keep each
+	other's entries, another process adding a file at the same time can only lose its own entry.
+*/
+static std::mutex& index_lock = *new std::mutex();
+
+void NES_Rom_File::add_index(const char* path, const rom_info* info) {
+	char index_file[PATH_MAX];
+	char new_file[PATH_MAX + 32];
+	if (!index_path(index_file, sizeof(index_file), true)) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(index_lock);
+
+	snprintf(new_file, sizeof(new_file), "%s.XXXXXX", index_file);
+	int descriptor = mkstemp(new_file);
+	if (descriptor < 0) {
+		return;
+	}
+
+	FILE* out = fdopen(descriptor, "w");
+	if (out == NULL) {
+		::close(descriptor);
+		unlink(new_file);
+		return;
+	}
+
+	FILE* index = fopen(index_file, "r");
+	if (index != NULL) {
+		char line[PATH_MAX + 64];
+
+		while (fgets(line, sizeof(line), index) != NULL) {
+			rom_info entry;
+			const char* entry_path;
+			struct stat status;
+
+			if (!parse_index_line(line, &entry, &entry_path) || strcmp(entry_path, path) == 0 ||
+				stat(entry_path, &status) != 0 || (uint64_t) status.st_size != entry.size ||
+				(int64_t) status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec != entry.modified) {
+				continue;
+			}
+
+			fprintf(out, "%016llx %llu %lld %s\n", (unsigned long long) entry.hash, (unsigned long long) entry.size,
+				(long long) entry.modified, entry_path);
+		}
+
+		fclose(index);
+	}
+
+	fprintf(out, "%016llx %llu %lld %s\n", (unsigned long long) info->hash, (unsigned long long) info->size,
+		(long long) info->modified, path);
+
+	if (fclose(out) != 0 || rename(new_file, index_file) != 0) {
+		printf("Failed to add %s to the ROM index\n", path);
+		unlink(new_file);
+	}
+}
@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include "NES.h"
+
+
+void NES_Scheduler::clear() {
+	for (int source = 0; source < EVENT_SOURCES; source++) {
+		deadlines[source] = EVENT_NONE;
+	}
+
+	count = 0;
+}
+
+/*
+	A source already in the heap keeps its slot and moves up or down from there, so every source is in it at most
+	once and the heap never holds more than EVENT_SOURCES entries.
+*/
+void NES_Scheduler::post(int source, uint64_t cycle) {
+	if (deadlines[source] == EVENT_NONE) {
+		slots[source] = count;
+		heap[count++] = (uint8_t) source;
+	}
+
+	uint64_t previous = deadlines[source];
+	deadlines[source] = cycle;
+
+	if (previous == EVENT_NONE || cycle < previous) {
+		sift_up(slots[source]);
+	} else {
+		sift_down(slots[source]);
+	}
+}
+
+void NES_Scheduler::cancel(int source) {
+	if (deadlines[source] == EVENT_NONE) {
+		return;
+	}
+
+	// The last entry takes the cancelled one's place and is sifted whichever way it belongs
+	int index = slots[source];
+	deadlines[source] = EVENT_NONE;
+	count--;
+
+	if (index != count) {
+		int moved = heap[count];
+		heap[index] = (uint8_t) moved;
+		slots[moved] = index;
+		sift_up(index);
+		sift_down(slots[moved]);
+	}
+}
+
+uint64_t NES_Scheduler::next() {
+	return count > 0 ? deadlines[heap[0]] : EVENT_NONE;
+}
+
+uint64_t NES_Scheduler::deadline(int source) {
+	return deadlines[source];
+}
+
+int NES_Scheduler::due(uint64_t cycle) {
+	if (count == 0 || deadlines[heap[0]] > cycle) {
+		return -1;
+	}
+
+	int source = heap[0];
+	cancel(source);
+
+	return source;
+}
+
+
+/*
+	Heap
+
+	Entries are sources ordered by their deadline, heap[0] is the earliest and slots follows every move.
+*/
+void NES_Scheduler::swap(int a, int b) {
+	uint8_t source = heap[a];
+	heap[a] = heap[b];
+	heap[b] = source;
+
+	slots[heap[a]] = a;
+	slots[heap[b]] = b;
+}
+
+void NES_Scheduler::sift_up(int index) {
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (deadlines[heap[parent]] <= deadlines[heap[index]]) {
+			break;
+		}
+
+		swap(index, parent);
+		index = parent;
+	}
+}
+
+void NES_Scheduler::sift_down(int index) {
+	for (;;) {
+		int smallest = index;
+		int left = 2 * index + 1;
+		int right = left + 1;
+
+		if (left < count && deadlines[heap[left]] < deadlines[heap[smallest]]) {
+			smallest = left;
+		}
+
+		if (right < count && deadlines[heap[right]] < deadlines[heap[smallest]]) {
+			smallest = right;
+		}
+
+		if (smallest == index) {
+			break;
+		}
+
+		swap(index, smallest);
+		index = smallest;
+	}
+}
@@ -4,6 +4,9 @@
 #include <iomanip>
 #include "NES.h"
 
+// Debug tracing flag, checked by the loader
+int trace = 0;
+
 // Debugging functions
 int print_hex(uint8_t* data, int size) {
 
@@ -30,4 +33,88 @@ int print_hex(uint8_t* data, int size) {
     
 	return 0;
 	
-}
\ No newline at end of file
+}
+
+// Read a whole file into a malloc'd buffer, NULL when it can't be read
+uint8_t* read_file(const char* path, int* size) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	uint8_t* buffer = (uint8_t*) malloc(*size > 0 ? *size : 1);
+	int bytes_read = fread(buffer, 1, *size, file);
+	fclose(file);
+
+	if (bytes_read != *size) {
+		free(buffer);
+		return NULL;
+	}
+
+	return buffer;
+}
+
+// Buttons as (pad1 << 8) | pad0, returns 1 when the script can't be read
+int read_input_script(const char* path, std::vector<uint64_t>* frames, std::vector<uint16_t>* buttons) {
+	FILE* script = fopen(path, "r");
+	if (script == NULL) {
+		return 1;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), script) != NULL) {
+		unsigned long long frame;
+		unsigned int pad0 = 0;
+		unsigned int pad1 = 0;
+
+		if (line[0] != '#' && sscanf(line, "%llu %x %x", &frame, &pad0, &pad1) >= 2) {
+			frames->push_back(frame);
+			buttons->push_back((pad1 & 0xFF) << 8 | (pad0 & 0xFF));
+		}
+	}
+
+	fclose(script);
+
+	return 0;
+}
+
+uint8_t* put16(uint8_t* out, uint16_t value) {
+	out[0] = value & 0x00FF;
+	out[1] = value >> 8;
+	return out + 2;
+}
+
+uint8_t* put32(uint8_t* out, uint32_t value) {
+	out = put16(out, value & 0xFFFF);
+	return put16(out, value >> 16);
+}
+
+uint8_t* put64(uint8_t* out, uint64_t value) {
+	out = put32(out, value & 0xFFFFFFFF);
+	return put32(out, value >> 32);
+}
+
+uint16_t get16(const uint8_t* in) {
+	return in[0] | in[1] << 8;
+}
+
+uint32_t get32(const uint8_t* in) {
+	return get16(in) | (uint32_t) get16(in + 2) << 16;
+}
+
+uint64_t get64(const uint8_t* in) {
+	return get32(in) | (uint64_t) get32(in + 4) << 32;
+}
+
+uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash) {
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001B3;
+	}
+
+	return hash;
+}
@@ -4,4 +4,19 @@
 #include <iomanip>
 #include "NES.h"
 
-int print_hex(uint8_t* data, int size);
\ No newline at end of file
+int print_hex(uint8_t* data, int size);
+uint8_t* read_file(const char* path, int* size);
+
+// Input scripts, one "frame pad0 [pad1]" line per change of buttons
+int read_input_script(const char* path, std::vector<uint64_t>* frames, std::vector<uint16_t>* buttons);
+
+// Little endian fields, the put functions return the position after the field
+uint8_t* put16(uint8_t* out, uint16_t value);
+uint8_t* put32(uint8_t* out, uint32_t value);
+uint8_t* put64(uint8_t* out, uint64_t value);
+uint16_t get16(const uint8_t* in);
+uint32_t get32(const uint8_t* in);
+uint64_t get64(const uint8_t* in);
+
+// FNV-1a, continuing from hash
+uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash = 0xCBF29CE484222325);